@@ -3,24 +3,177 @@
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <errno.h>
 
-#define MAX_USERS 1000
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <malloc.h>
+#define fsync _commit
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#endif
+
+#ifdef __linux__
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE 0
+#endif
+#endif
+
+#define USER_CHUNK_SHIFT 12
+#define USER_CHUNK_SIZE (1 << USER_CHUNK_SHIFT)
 #define MAX_CANDIDATES 10
+#define MAX_RACES 4096
+#define ALL_RACES -1
+#define NO_RACE -2
+#define BALLOT_WITHDRAWN -1     // User.votedFor of a ballot whose candidate was removed
+#define RECOUNT_MAX_LINES 20
 #define MAX_NAME_LENGTH 50
+#define MAX_VOTER_NAME_LENGTH 256       // voter names live in the string arena; only input is bounded
+#define ARENA_BLOCK_SIZE (1 << 20)
 #define MAX_PASSWORD_LENGTH 30
+#define PASSWORD_HASH_LENGTH 128
 #define NID_LENGTH 20
 #define ADMIN_PASSWORD "admin123"
 #define SESSION_TIMEOUT 300
+#define JOURNAL_FILE "election.journal"
+#define JOURNAL_MAX_RECORD 1024
+#define JOURNAL_BUFFER_SIZE (64 * 1024)
+#define JOURNAL_CHECKPOINT_MIN_BYTES (4 * 1024 * 1024)
+#define JOURNAL_CHECKPOINT_VOTER_BYTES 16   // journal allowed per voter on the roll before a checkpoint
+#define JOURNAL_CHECKPOINT_SECONDS 300      // longest a non-empty journal waits for a checkpoint
+#define JOURNAL_RETRY_SECONDS 10        // between checkpoints that try to replace a failed journal
+#define SNAPSHOT_FILE "election.snap"
+#define SNAPSHOT_MAGIC "ELECSNAP"
+#define SNAPSHOT_VERSION 6
+#define SNAPSHOT_ALIGN 4096
+#define TEXT_MANIFEST_FILE "checkpoint_manifest.txt"
+#define TEXT_MANIFEST_PREVIOUS "checkpoint_manifest.prev"
+#define TEXT_BUFFER_SIZE (1024 * 1024)
+#define TEXT_RECORD_MAX 4096            // longest single record written to a text file
+#define PARSE_BLOCK_SIZE (64 * 1024 * 1024)
+#define PARSE_MAX_ERRORS 20
+#define IMPORT_BLOCK_SIZE (16 * 1024 * 1024)
+#define IMPORT_LINE_MAX 1024
+#define IMPORT_REJECTS_FILE "import_rejects.csv"
+#define VOTE_SHARDS 64
+#define CACHE_LINE_SIZE 64
+#define SERVER_DEFAULT_PORT 9090
+#define SERVER_LINE_MAX 1024
+#define SERVER_MAX_EVENTS 64
+#define SEARCH_FIELDS 4
+#define SEARCH_MAX_TERMS 8
+#define SEARCH_MAX_RESULTS 50
+#define SEARCH_TERM_MATCH 100
+#define LOG_FILE "activity_log.txt"
+#define LOG_RING_SIZE 8192              // must be a power of two
+#define LOG_MESSAGE_LENGTH 192
+#define LOG_IDLE_WAIT_MS 20
+#define KDF_COST_LOG2 11                // scrypt N = 2^11, 2 MB per hash with r = 8
+#define KDF_BLOCK_SIZE 8
+#define KDF_PARALLELISM 1
+#define KDF_MAX_COST_LOG2 (KDF_COST_LOG2 + 2)   // stored hashes may cost at most 4x the default
+#define KDF_MAX_BLOCK_SIZE (KDF_BLOCK_SIZE * 2)
+#define KDF_MAX_PARALLELISM 4
+#define KDF_SALT_LENGTH 16
+#define KDF_KEY_LENGTH 32
+#define KDF_QUEUE_PER_WORKER 16
+#define KDF_BATCH 8
+#define BATCH_KDF_WINDOW 64             // consecutive batch REGISTERs hashed together
+#define LATENCY_BUCKETS 160
+#define METRIC_SHARDS 64
+#define METRICS_FILE "election_metrics.prom"
+#define METRICS_INTERVAL 15             // seconds between rewrites of METRICS_FILE
+#define TURNOUT_DAY_MINUTES 1440
+#define TURNOUT_SLOTS (MAX_CANDIDATES + 1)      // one per candidate, then withdrawn or unknown ballots
+#define TURNOUT_ALL MAX_RACES                   // table of the whole election
+#define TURNOUT_TABLES (MAX_RACES + 1)
+#define TURNOUT_MAX_DAYS 3660                   // widest span of voting days one table holds
+#define TURNOUT_GROW_DAYS 7
+#define TURNOUT_VIEW_ROWS 48
+#define TURNOUT_FILE "turnout.csv"
+#define SESSION_TOKEN_LENGTH 25         // 16 hex digits of secret, 8 of slot
+#define SESSION_WHEEL_BITS 6
+#define SESSION_WHEEL_SLOTS (1 << SESSION_WHEEL_BITS)
+#define SESSION_WHEEL_LEVELS 3
+#define USER_CHUNK_WORDS (USER_CHUNK_SIZE / 64)
+#define BACKUP_PREFIX "backup"          // files are backup_000001.bak, ... and backup_catalog.txt
+#define BACKUP_STATE_FILE "backup_state.bin"
+#define BACKUP_MAGIC "ELECBKUP"
+#define BACKUP_STATE_MAGIC "ELECBKST"
+#define BACKUP_VERSION 5
+#define BACKUP_SECTION_USERS 0
+#define BACKUP_SECTION_RACES 1
+#define BACKUP_MAX_DELTAS 16            // a chain with this many deltas is compacted into a new base
+#define BACKUP_KEEP_CHAINS 2            // chains older than this are deleted after a compaction
+#define ARCHIVE_MAGIC "ELECARCH"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_BLOCK_SIZE (64 * 1024)  // raw bytes per block; a block holds whole records
+#define ARCHIVE_BATCH_BLOCKS 8          // blocks each worker packs or unpacks per batch
+#define RESULTS_CHUNK 4096              // most report text in one results archive record
+#define LZ_HASH_BITS 13
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// Offset of a string in the string arena: an unsigned int length, the
+// text and its NUL, padded to 4 bytes
+typedef unsigned long long StringRef;
+
+// Voter strings, appended to fixed-size blocks and never moved. Offsets
+// run on across blocks, and no entry crosses a block boundary, so the
+// used blocks laid end to end are the arena as one contiguous range.
+typedef struct {
+    _Atomic(char**) blocks;     // a grown table replaces the old one, which is never freed
+    int blockCount;
+    int blockCapacity;
+    unsigned long long used;    // next free offset
+    unsigned long long mapped;  // bytes read from a snapshot, whose blocks are never written
+} StringArena;
 
-// Structure for User
+// Structure for User: the NID the index is keyed on, and references to
+// the voter's strings. The fields that voting and counting touch live in
+// VoterColumns.
 typedef struct {
-    char fullName[MAX_NAME_LENGTH];
     char nidNumber[NID_LENGTH];
-    char password[MAX_PASSWORD_LENGTH];
-    int hasVoted;
-    time_t voteTime;
+    StringRef fullName;
+    StringRef password;         // scrypt hash, or a legacy H%d hash until next login
 } User;
 
+// Voting state of one chunk of the roll, one dense column per field, so
+// turnout reads a bit and a constituency number per voter
+typedef struct {
+    atomic_ullong voted[USER_CHUNK_WORDS];  // hasVoted bitmap, claimed with fetch-or when voting
+    unsigned short races[USER_CHUNK_SIZE];  // index of the constituency the voter belongs to
+    signed char ballots[USER_CHUNK_SIZE];   // candidate id the ballot went to, 0 for none
+    time_t voteTimes[USER_CHUNK_SIZE];
+} VoterColumns;
+
+// One whole voter, as the text, backup and restore paths carry it
+typedef struct {
+    char fullName[MAX_VOTER_NAME_LENGTH];
+    char nidNumber[NID_LENGTH];
+    char password[PASSWORD_HASH_LENGTH];
+    int race;
+    int hasVoted;
+    int votedFor;
+    long long voteTime;
+} VoterRecord;
+
 // Structure for Candidate
 typedef struct {
     int id;
@@ -30,60 +183,1061 @@ typedef struct {
     int age;
     char manifesto[200];
     int votes;
+    int race;               // index of the constituency the candidate stands in
 } Candidate;
 
+// Per-thread vote counters. Each shard sits on its own cache lines so
+// threads casting votes never write to the same line.
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_int counts[MAX_CANDIDATES];
+} VoteShard;
+
+// Candidates ranked by votes, highest first, as of the last read. Votes
+// only touch their own shard; each read folds the shards into the ranking.
+typedef struct {
+    int order[MAX_CANDIDATES];      // candidate indices by rank
+    int votes[MAX_CANDIDATES];
+    int count;
+    int totalVotes;
+} Leaderboard;
+
+// One constituency. Every race has its own candidates, election period,
+// vote shards and leaderboard, so votes in different races never write
+// to the same counters or wait on the same lock.
+typedef struct {
+    int id;
+    char name[MAX_NAME_LENGTH];
+    Candidate candidates[MAX_CANDIDATES];
+    int candidateCount;
+    time_t electionStartTime;
+    time_t electionEndTime;
+    VoteShard voteShards[VOTE_SHARDS];
+    Leaderboard leaderboard;
+    pthread_mutex_t leaderboardLock;
+} Race;
+
+// Stored form of a constituency in constituencies.txt and the snapshot
+typedef struct {
+    int id;
+    char name[MAX_NAME_LENGTH];
+    long long electionStartTime;
+    long long electionEndTime;
+} RaceRecord;
+
+// Figures for one constituency gathered by summarizeRaces()
+typedef struct {
+    int registered;
+    int voted;
+    int totalVotes;
+    int count;                      // candidates ranked
+    int leaders;                    // candidates sharing the lead; 0 before any vote
+    int order[MAX_CANDIDATES];      // candidate indices by rank
+    int votes[MAX_CANDIDATES];
+} RaceSummary;
+
+// Results of the thread-safe voting core
+enum {
+    VOTE_OK = 0,
+    VOTE_NOT_STARTED,
+    VOTE_ENDED,
+    VOTE_INVALID_CANDIDATE,
+    VOTE_ALREADY_CAST,
+    VOTE_NOT_SAVED
+};
+
+enum {
+    REGISTER_OK = 0,
+    REGISTER_DUPLICATE,
+    REGISTER_NO_MEMORY,
+    REGISTER_INVALID_RACE,
+    REGISTER_NOT_SAVED
+};
+
+// Results of the admin changes
+enum {
+    CHANGE_OK = 0,
+    CHANGE_REJECTED,        // unknown constituency or candidate, or a table is full
+    CHANGE_NOT_SAVED
+};
+
+// Protocol state of one client: a socket connection or a batch stream
+typedef struct {
+    int userIndex;                      // -1 until LOGIN succeeds
+    char token[SESSION_TOKEN_LENGTH];   // session table token, empty when logged out
+} ClientSession;
+
+// One logged-in session. Free slots are chained through timerNext.
+typedef struct {
+    unsigned long long secret;      // random part of the token; 0 when free
+    int userIndex;
+    int bucket;                     // timer wheel bucket, -1 when not scheduled
+    int timerNext;
+    int timerPrev;
+    time_t lastActivity;
+} Session;
+
+// Sessions keyed by opaque tokens. A token names its slot and carries a
+// random secret, so lookups are O(1) without a hash table. Expiry runs on
+// a hierarchical timer wheel of one-second ticks with 64 slots per level,
+// reaching 64 s, 68 min and 73 h. Activity only updates lastActivity; a
+// timer that fires for a session still in use is simply rescheduled.
+typedef struct {
+    Session *sessions;
+    int capacity;
+    int freeList;
+    int active;
+    int wheel[SESSION_WHEEL_LEVELS * SESSION_WHEEL_SLOTS];
+    time_t now;                     // last tick processed
+    int initialized;
+    pthread_mutex_t lock;
+    unsigned char tokenKey[32];
+    unsigned long long tokenCounter;
+    unsigned long long expired;
+} SessionTable;
+
+// Growable buffer that protocol responses are written into
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} OutputBuffer;
+
+// Open-addressing hash index over NID numbers
+typedef struct {
+    unsigned int hash;
+    int index;          // -1 marks an empty slot
+} NidSlot;
+
+typedef struct {
+    NidSlot *slots;
+    int capacity;       // always a power of two
+    int count;
+    int ownsSlots;      // 0 while slots point into a mapped snapshot
+    char* (*keyAt)(int index);
+} NidIndex;
+
+// Case-folded copy of the searchable fields of one candidate
+typedef struct {
+    char name[MAX_NAME_LENGTH];
+    char party[MAX_NAME_LENGTH];
+    char education[100];
+    char manifesto[200];
+} SearchDoc;
+
+// Trigram index over the candidates of every constituency. A candidate's
+// document number is race * MAX_CANDIDATES + its index in the race.
+typedef struct {
+    unsigned int trigram;       // 0 marks an empty slot
+    int count;
+    int capacity;
+    int *docs;                  // sorted document numbers
+} TrigramPostings;
+
+typedef struct {
+    TrigramPostings *slots;
+    int capacity;               // always a power of two
+    int used;
+    SearchDoc *docs;
+    int complete;               // 0 after an allocation failure; queries then scan
+} SearchIndex;
+
+typedef struct {
+    int race;
+    int index;
+    int score;
+} SearchHit;
+
+// Binary snapshot layout: header, then page-aligned sections of fixed-width
+// records. The user section is padded to whole chunks so the voter store
+// can point straight into the mapped file.
+enum {
+    SNAPSHOT_USERS,
+    SNAPSHOT_CANDIDATES,
+    SNAPSHOT_NID_INDEX,
+    SNAPSHOT_RACES,
+    SNAPSHOT_VOTERS,            // one VoterColumns per user chunk
+    SNAPSHOT_STRINGS,           // the string arena, one byte per record
+    SNAPSHOT_SECTIONS
+};
+
+typedef struct {
+    unsigned long long offset;
+    unsigned long long count;
+    unsigned int recordSize;
+    unsigned int reserved;
+} SnapshotSection;
+
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int headerChecksum;    // CRC-32 of the header with this field zeroed
+    unsigned long long journalSequence;
+    SnapshotSection sections[SNAPSHOT_SECTIONS];
+} SnapshotHeader;
+
+// Text checkpoint: one generation of the four text files, written under
+// generation-numbered names and committed by renaming a manifest that
+// lists each file with its size and CRC-32. The previous manifest is kept
+// so a damaged checkpoint can fall back to the one before it.
+enum {
+    TEXT_USERS,
+    TEXT_CANDIDATES,
+    TEXT_CONSTITUENCIES,
+    TEXT_CONFIG,
+    TEXT_FILES
+};
+
+typedef struct {
+    char path[64];
+    unsigned long long size;
+    unsigned int checksum;
+} TextFileEntry;
+
+typedef struct {
+    int generation;                 // 0 for the plain files of older versions
+    unsigned long long journalSequence;
+    TextFileEntry files[TEXT_FILES];
+} TextManifest;
+
+// Streams text into a file through one large buffer, checksumming it as
+// it goes out
+typedef struct {
+    FILE *fp;
+    char *buffer;
+    size_t length;
+    unsigned long long size;
+    unsigned int checksum;
+    int failed;
+} TextWriter;
+
+// Block archive: compressed blocks followed by a table describing them.
+// Each block holds whole records, is compressed on its own and carries
+// the CRC-32 of its raw bytes, so one block can be read without the
+// others and blocks are packed and unpacked in parallel.
+typedef struct {
+    unsigned long long offset;
+    unsigned int storedSize;        // equal to rawSize when the block did not compress
+    unsigned int rawSize;
+    unsigned int checksum;          // CRC-32 of the raw bytes
+    int section;
+    int records;
+    int firstKey;                   // keys ascend within a section
+    int lastKey;
+    int reserved;
+} ArchiveBlock;
+
+typedef struct {
+    unsigned long long tableOffset;
+    unsigned int blockCount;
+    unsigned int tableChecksum;
+} ArchiveTable;
+
+// Header of a standalone archive such as an exported results file
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int headerChecksum;    // CRC-32 of the header with this field zeroed
+    char content[8];                // what the records are, e.g. "RESULTS"
+    ArchiveTable body;
+} ArchiveHeader;
+
+// Record in a results archive, followed by length bytes of report text.
+// Key 0 is the preamble, key r the r-th constituency and the last key
+// the summary.
+typedef struct {
+    int key;
+    int length;
+} ResultsRecord;
+
+// One block on its way into or out of an archive
+typedef struct {
+    ArchiveBlock block;
+    unsigned char *raw;
+    unsigned char *stored;
+    int ok;
+} ArchiveTask;
+
+// Packs records into blocks. Full blocks are queued and compressed a
+// batch at a time across the worker threads, then written in order.
+typedef struct {
+    FILE *fp;
+    ArchiveBlock *blocks;
+    int blockCount;
+    int blockCapacity;
+    ArchiveTask *pending;           // the last one is the block being filled
+    int pendingCount;
+    int pendingCapacity;
+    int failed;
+} ArchiveWriter;
+
+typedef struct {
+    FILE *fp;
+    ArchiveBlock *blocks;
+    int blockCount;
+} ArchiveReader;
+
+// Incremental backups form chains: a base holding every record, then
+// deltas holding only the voters and constituencies changed since the
+// previous backup. A backup file is this header followed by an archive
+// body: BackupUser records in index order, then BackupRace records.
+enum {
+    BACKUP_BASE = 1,
+    BACKUP_DELTA
+};
+
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int headerChecksum;    // CRC-32 of the header with this field zeroed
+    unsigned int kind;
+    int number;
+    int parent;                     // previous backup of a delta; 0 for a base
+    long long created;
+    unsigned long long journalSequence;
+    int userCount;                  // voters on the roll at this point
+    int raceCount;
+    int changedUsers;
+    int changedRaces;
+    ArchiveTable body;
+} BackupHeader;
+
+typedef struct {
+    int index;
+    int reserved;
+    VoterRecord voter;
+} BackupUser;
+
+// A constituency with its candidates and their tallies
+typedef struct {
+    int index;
+    int candidateCount;
+    RaceRecord record;
+    Candidate candidates[MAX_CANDIDATES];
+} BackupRace;
+
+// The change bits saved with each checkpoint, so a restart can carry on
+// the chain instead of starting a new base
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int checksum;          // CRC-32 of the header with this field zeroed, then the bits
+    int since;
+    int userCount;
+    int raceCount;
+    int reserved;
+    unsigned long long journalSequence;
+} BackupStateHeader;
+
+// One line of the backup catalog
+typedef struct {
+    int number;
+    int kind;
+    int parent;                     // a compacted base names the backup it reproduces
+    long long created;
+    unsigned long long journalSequence;
+    int changedUsers;
+    int changedRaces;
+} BackupEntry;
+
+// One backup being written. Voter chunks holding changed records stay
+// shared with the live state until the writer, or a voter about to change
+// one of those records, copies the chunk's changed records out. The
+// constituencies are few and are copied when the backup starts.
+typedef struct {
+    BackupHeader header;
+    int chunkCount;
+    User **live;                    // voter chunks as they were at capture
+    VoterColumns **liveColumns;
+    unsigned long long *changed;    // USER_CHUNK_WORDS bits per chunk
+    atomic_int *shared;             // chunk whose changed records are not copied yet
+    VoterRecord **copies;           // changed records of each chunk once copied
+    BackupRace *races;
+    int failed;                     // a copy could not be allocated
+    pthread_mutex_t copyLock;
+} BackupJob;
+
+// Change tracking and the backup catalog. Voters set change bits while
+// holding stateLock shared; a backup takes and clears them while holding
+// it exclusively.
+typedef struct {
+    atomic_ullong *userChanged;     // one bit per voter changed since the last backup
+    atomic_uchar raceChanged[MAX_RACES];
+    int since;                      // backup the bits are relative to; 0 makes the next one a base
+    char *prefix;
+    BackupEntry *entries;           // oldest first
+    int entryCount;
+    int catalogLoaded;
+    _Atomic(BackupJob*) active;
+    int busy;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+} BackupSet;
+
+// A checkpoint's view of the state. As with a backup, voter chunks stay
+// shared with the live state until someone about to change one copies it;
+// the writer reads each chunk under copyLock. The constituencies, the
+// backup change bits and the journal position are copied at capture.
+typedef struct {
+    unsigned long long journalSequence;
+    unsigned long long journalOffset;   // journal bytes holding the records up to journalSequence
+    int userCount;
+    int chunkCount;
+    User **live;                    // voter chunks as they were at capture
+    VoterColumns **liveColumns;
+    atomic_int *shared;             // chunk not copied yet
+    User **copies;                  // chunks copied before they changed
+    VoterColumns **columnCopies;
+    pthread_mutex_t copyLock;
+    char **blocks;                  // string arena up to arenaUsed
+    int blockCount;
+    unsigned long long arenaUsed;
+    unsigned long long arenaMapped;
+    int raceCount;
+    RaceRecord *races;
+    int candidateTotal;
+    Candidate *candidates;          // every constituency's in turn, with their tallies
+    int backupSince;
+    unsigned long long *userChanged;
+    unsigned char *raceChanged;
+    double started;
+} CheckpointJob;
+
+// At most one checkpoint is written at a time
+typedef struct {
+    _Atomic(CheckpointJob*) active;
+    int busy;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+} CheckpointSet;
+
+// State rebuilt from a backup chain
+typedef struct {
+    VoterRecord *users;
+    int userCount;
+    BackupRace *races;
+    int raceCount;
+    unsigned long long journalSequence;
+} BackupImage;
+
+// Describes one legacy text format: PREFIXn_START, key=value lines, PREFIXn_END
+typedef struct {
+    char *prefix;
+    int recordSize;
+    int requiredFields;     // bitmask of fields every record must carry
+    int (*setField)(void* record, char* key, int keyLength, char* value, int valueLength);
+} RecordFormat;
+
+// Work for one parser thread: a slice of the file that starts and ends on
+// record boundaries, and the records and problems found in it
+typedef struct {
+    RecordFormat *format;
+    char *start;
+    char *end;
+    unsigned char *records;
+    int count;
+    int capacity;
+    int malformed;
+    int errorCount;
+    char errors[PARSE_MAX_ERRORS][120];
+    pthread_t thread;
+    int threaded;
+} ParseChunk;
+
+// One line of a CSV voter roll after validation
+typedef struct {
+    char fullName[MAX_VOTER_NAME_LENGTH];
+    char nid[NID_LENGTH];
+    char password[PASSWORD_HASH_LENGTH];    // scrypt hash, given or derived
+    int race;
+    char *reason;               // why the line was rejected, or NULL
+    char *text;                 // the line as read; valid until the next block
+    int textLength;
+} ImportRow;
+
+// Work for one import thread: a slice of whole lines and one row per line
+typedef struct {
+    char *start;
+    char *end;
+    int firstLine;              // the slice starts the file, which may have a header
+    int raceCount;
+    ImportRow *rows;
+    int count;
+    int capacity;
+    pthread_t thread;
+    int threaded;
+} ImportChunk;
+
+// Journal record types
+enum {
+    JOURNAL_REGISTER = 1,
+    JOURNAL_VOTE,
+    JOURNAL_RESET,
+    JOURNAL_ADD_CANDIDATE,
+    JOURNAL_REMOVE_CANDIDATE,
+    JOURNAL_ELECTION_PERIOD,
+    JOURNAL_ADD_RACE,
+    JOURNAL_SET_PASSWORD
+};
+
+// One journal record as it is being built or decoded.
+// On disk each record is: length, CRC-32 of the payload, payload.
+// The payload starts with the sequence number and the record type.
+typedef struct {
+    unsigned char data[JOURNAL_MAX_RECORD];
+    int length;
+    int readPos;
+} JournalRecord;
+
+// Write-ahead journal with group commit
+typedef struct {
+    FILE *fp;
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;
+    unsigned char *buffer;          // records waiting for the next flush
+    unsigned char *flushBuffer;     // records being written by the flush leader
+    size_t buffered;
+    int flushing;
+    int failed;                     // a write or open failed; cleared by the next checkpoint
+    int closed;                     // closed on purpose: checkpoints cover every change
+    time_t retried;                 // last failed checkpoint, or one started for a failed journal
+    time_t checkpointed;            // when the last checkpoint finished
+    unsigned long long size;        // bytes in the file or waiting to be written
+    unsigned long long checkpointBytes;     // size that makes a checkpoint due
+    unsigned long long nextSequence;
+    unsigned long long bufferedSequence;    // last sequence placed in buffer
+    unsigned long long durableSequence;     // last sequence known to be on disk
+    unsigned long long checkpointSequence;  // last sequence covered by the text files
+} Journal;
+
+// One pending activity log entry. A slot is free for the producer that
+// claims position p when sequence == p, and ready for the writer when
+// sequence == p + 1.
+typedef struct {
+    atomic_ulong sequence;
+    time_t time;
+    char text[LOG_MESSAGE_LENGTH];
+} LogSlot;
+
+// Activity log: producers claim ring slots without locking and a
+// background thread appends them to the log file in batches. When the
+// ring is full new entries are dropped and counted rather than stalling
+// voters; the writer records how many were lost.
+typedef struct {
+    LogSlot *slots;
+    _Alignas(CACHE_LINE_SIZE) atomic_ulong head;    // next position producers claim
+    _Alignas(CACHE_LINE_SIZE) atomic_ulong tail;    // next position the writer drains
+    atomic_ulong dropped;
+    atomic_int running;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;            // writer waits here when the ring is empty
+    pthread_cond_t drained;         // flushLog() waits here
+    char *path;
+    FILE *fp;
+    time_t stampSecond;             // second that stamp was formatted for
+    char stamp[32];
+} ActivityLog;
+
+// Log-scale latency histogram: four buckets per power of two microseconds
+typedef struct {
+    unsigned long long buckets[LATENCY_BUCKETS];
+    unsigned long long count;
+    double maxSeconds;
+} LatencyHistogram;
+
+enum {
+    METRIC_REGISTRATIONS,
+    METRIC_LOGINS,
+    METRIC_FAILED_LOGINS,
+    METRIC_VOTES,
+    METRIC_SAVES,
+    METRIC_BACKUPS,
+    METRIC_BYTES_JOURNAL,
+    METRIC_BYTES_CHECKPOINT,
+    METRIC_BYTES_SNAPSHOT,
+    METRIC_BYTES_BACKUP,
+    METRIC_COUNTERS
+};
+
+enum {
+    TIMER_CAST_VOTE,
+    TIMER_LOGIN,
+    TIMER_SAVE,
+    TIMER_LOAD,
+    METRIC_TIMERS
+};
+
+// Latency histogram that many threads record into without a lock; uses
+// the LatencyHistogram buckets
+typedef struct {
+    atomic_ullong buckets[LATENCY_BUCKETS];
+    atomic_ullong totalNs;
+} MetricTimer;
+
+// One thread's counters, on cache lines of their own. Threads past
+// METRIC_SHARDS share shards, which stays correct, only slower.
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_ullong counters[METRIC_COUNTERS];
+    MetricTimer timers[METRIC_TIMERS];
+} MetricShard;
+
+// Background writer of the metrics file
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;            // signalled by stopMetricsWriter()
+    pthread_t thread;
+    int running;
+    char *path;
+} MetricsWriter;
+
+// Votes cast on one day, per minute and ballot slot
+typedef struct {
+    atomic_int counts[TURNOUT_DAY_MINUTES][TURNOUT_SLOTS];
+} TurnoutDay;
+
+// The days of one turnout table from firstDay on. A grown table replaces
+// the old one, which is never freed, the same as the voter chunk table.
+typedef struct {
+    long long firstDay;         // days since the epoch
+    int dayCount;
+    _Atomic(TurnoutDay*) days[];
+} TurnoutTable;
+
+// Turnout over time, one table per constituency plus TURNOUT_ALL. Each
+// vote adds to its minute; loading the roll rebuilds the tables.
+typedef struct {
+    _Atomic(TurnoutTable*) tables[TURNOUT_TABLES];
+    atomic_int untimed[TURNOUT_TABLES];     // votes with no time, or one too far from the others
+    atomic_int registered[MAX_RACES];
+    pthread_mutex_t growLock;
+} TurnoutState;
+
+// Votes in one bucket of a turnout query
+typedef struct {
+    long long start;            // minutes since the epoch
+    int total;
+    int counts[TURNOUT_SLOTS];
+} TurnoutBucket;
+
+// A turnout query: the buckets that have votes, oldest first
+typedef struct {
+    TurnoutBucket *buckets;
+    int count;
+    int capacity;
+    int total;
+    int peakMinute;             // most votes cast in one minute
+    long long peakMinuteStart;
+    int peakBucket;             // index of the bucket with most votes
+    int untimed;
+    int registered;
+} TurnoutSeries;
+
+// One password derivation or verification for the KDF worker pool
+typedef struct KdfJob {
+    int verify;                                 // 1: check password against hash; 0: derive hash
+    char password[MAX_PASSWORD_LENGTH];
+    char hash[PASSWORD_HASH_LENGTH];            // stored hash in, or derived hash out
+    char upgradedHash[PASSWORD_HASH_LENGTH];    // rehash of a matching legacy hash, else empty
+    int matched;                                // verify: password matched; derive: succeeded
+    double submitted;
+    int finished;
+    void (*done)(struct KdfJob* job);           // called by the worker instead of waking a waiter
+    void *context;
+    struct KdfJob *next;
+} KdfJob;
+
+// Bounded queue of password jobs served by one worker per core. Callers
+// that cannot wait (the socket server) are turned away when it is full,
+// which keeps queueing delay, and so login latency, bounded.
+typedef struct {
+    pthread_t *workers;
+    int workerCount;
+    KdfJob **queue;
+    int capacity;
+    int head;
+    int queued;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    pthread_cond_t finished;
+    int peakQueued;
+    unsigned long long completed;
+    unsigned long long rejected;
+    atomic_ullong migrated;                     // legacy hashes replaced at login
+    LatencyHistogram latency;                   // submit to finish
+} KdfPool;
+
+typedef struct {
+    int workers;
+    int capacity;
+    int queued;
+    int peakQueued;
+    unsigned long long completed;
+    unsigned long long rejected;
+    unsigned long long migrated;
+    double p50Us;
+    double p99Us;
+    double maxUs;
+} KdfStats;
+
+// A LOGIN or REGISTER request waiting for its password job
+typedef struct {
+    KdfJob job;
+    int login;                  // LOGIN, otherwise REGISTER
+    char fullName[MAX_VOTER_NAME_LENGTH];
+    char nid[NID_LENGTH];
+    int race;
+    int userIndex;              // LOGIN: the voter, or -1 for an unknown NID
+    double started;
+} PasswordRequest;
+
 // Global variables
-User users[MAX_USERS];
+User **userChunks = NULL;     // voter store, grown one fixed-size chunk at a time
+VoterColumns **voterColumns = NULL;     // voting state, one entry per user chunk
+StringArena stringArena;
+int userChunkCount = 0;
+int userChunkCapacity = 0;
 int userCount = 0;
-Candidate candidates[MAX_CANDIDATES];
-int candidateCount = 0;
-int currentUserIndex = -1;
-time_t lastActivityTime;
-time_t electionStartTime;
-time_t electionEndTime;
+Race **races = NULL;          // constituencies, each allocated once and never moved
+int raceCount = 0;
+int raceCapacity = 0;
+_Thread_local int currentUserIndex = -1;     // voter of the request being handled
+_Thread_local char currentSession[SESSION_TOKEN_LENGTH];     // interactive voter's session token
+SessionTable sessionTable = { .lock = PTHREAD_MUTEX_INITIALIZER };
+NidIndex nidIndex;
+SearchIndex searchIndex;
+// Voters take this shared; registration and admin changes take it
+// exclusively, and so does a checkpoint while it takes its view
+pthread_rwlock_t stateLock = PTHREAD_RWLOCK_INITIALIZER;
+atomic_int nextVoteShard;
+_Thread_local int voteShardIndex = -1;
+MetricShard metricShards[METRIC_SHARDS];
+TurnoutState turnout = { .growLock = PTHREAD_MUTEX_INITIALIZER };
+atomic_int nextMetricShard;
+_Thread_local int metricShardIndex = -1;
+MetricsWriter metricsWriter = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+Journal journal = { .lock = PTHREAD_MUTEX_INITIALIZER, .flushed = PTHREAD_COND_INITIALIZER };
+KdfPool kdfPool = { .lock = PTHREAD_MUTEX_INITIALIZER, .notEmpty = PTHREAD_COND_INITIALIZER,
+                    .notFull = PTHREAD_COND_INITIALIZER, .finished = PTHREAD_COND_INITIALIZER };
+ActivityLog activityLog = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+                            .drained = PTHREAD_COND_INITIALIZER, .path = LOG_FILE };
+BackupSet backups = { .lock = PTHREAD_MUTEX_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER,
+                      .prefix = BACKUP_PREFIX };
+CheckpointSet checkpoints = { .lock = PTHREAD_MUTEX_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER };
 
 // Function prototypes
-void initializeCandidates();
+void initializeCandidates(Race* race);
+void initializeRaces();
+int chooseRace(int allowAll);
+void addConstituency();
 void registerUser();
 int loginUser();
 void mainMenu();
 void adminPanel();
 void castVote();
-void showCandidates();
+void showCandidates(int race);
 void showCandidateDetails();
 void searchCandidate();
 void showResults();
 void showStatistics();
+int summarizeRaces(RaceSummary* summaries);
+int totalCandidateCount();
+char* raceStatusText(Race* race);
 void exportResults();
+int writeResultsFile(char* path);
+int writeResultsArchive(char* path, char* text, size_t* ends, int sections);
 void resetElection();
 void addCandidate();
 void removeCandidate();
 void clearInputBuffer();
 int findUserByNID(char* nid);
+User* userAt(int index);
+int arenaAdd(char* text, StringRef* ref);
+char* arenaText(StringRef ref);
+char* userFullName(int index);
+char* userPasswordHash(int index);
+int readInputLine(char* buffer, int size);
+VoterColumns* voterColumnsAt(int index);
+int userRace(int index);
+int userHasVoted(int index);
+int userVotedFor(int index);
+time_t userVoteTime(int index);
+int claimVote(int index);
+void recordBallot(int index, int candidateId, time_t voteTime);
+void clearVote(int index);
+void readVoter(int index, VoterRecord* out);
+int writeVoter(int index, VoterRecord* voter);
+int ensureUserCapacity(int count);
+int growUserChunkTable(int chunks);
+unsigned int hashNID(char* nid);
+void nidIndexInit(NidIndex* index, char* (*keyAt)(int), int expected);
+void nidIndexFree(NidIndex* index);
+void nidIndexInsert(NidIndex* index, int userIndex);
+int nidIndexFind(NidIndex* index, char* nid);
+void rebuildNIDIndex();
+void rebuildSearchIndex();
+void searchIndexAdd(int race, int index);
+void searchIndexRemove(int race, int index);
+int searchCandidates(char* query, SearchHit* hits, int maxHits);
+void benchmarkSearch();
+char* userNIDAt(int index);
+double currentSeconds();
+void deadlineAfter(struct timespec* deadline, long milliseconds);
+void sleepSeconds(double seconds);
+int applyRegister(char* fullName, char* nid, char* hashedPassword, int race);
+void applyVote(int userIndex, int candidateId, time_t voteTime);
+void applyReset(int race);
+void applyAddCandidate(int race, Candidate* candidate);
+void applyRemoveCandidate(int race, int id);
+void applyElectionPeriod(int race, time_t startTime, time_t endTime);
+int applyAddRace(char* name, time_t startTime, time_t endTime);
+unsigned int crc32(unsigned char* data, size_t length);
+unsigned int crc32Update(unsigned int crc, unsigned char* data, size_t length);
+void openJournal();
+void replayJournal();
+void closeJournal();
+void resetJournal(unsigned long long checkpointSequence, unsigned long long offset, int voters);
+unsigned long long journalAppend(JournalRecord* record);
+int journalCommit(unsigned long long sequence);
+int journalFailed();
+void checkpointIfDue();
+unsigned long long journalRegister(int userIndex);
+unsigned long long journalVote(int userIndex, int candidateId, time_t voteTime);
+unsigned long long journalReset(int race);
+unsigned long long journalAddCandidate(Candidate* candidate);
+unsigned long long journalRemoveCandidate(int race, int id);
+unsigned long long journalElectionPeriod(int race, time_t startTime, time_t endTime);
+unsigned long long journalAddRace(int race);
+int candidateVotes(Race* race, int index);
+void tallyVote(Race* race, int index);
+void untallyVote(Race* race, int index);
+int leaderboardTop(Race* race, int k, int* indices, int* votes, int* totalVotes);
+int countLeaders(int* votes, int count);
+int castVoteFor(int userIndex, int candidateId, time_t voteTime);
+int withdrawVote(int userIndex, int candidateId, time_t voteTime, unsigned long long sequence);
+int registerVoter(char* fullName, char* nid, char* hashedPassword, int race, int* userIndex);
+int authenticateVoter(char* nid, char* password);
+int resetVotes(int race);
+int insertCandidate(int race, Candidate* candidate);
+int deleteCandidate(int race, int id);
+int changeElectionPeriod(int race, time_t startTime, time_t endTime);
+int createRace(char* name, time_t startTime, time_t endTime, int* race);
+void benchmarkVoting();
+void startSystem();
+void outputPrintf(OutputBuffer* out, char* format, ...);
+int handleCommand(ClientSession* session, char* line, OutputBuffer* out);
+int runServer(char* address);
+int handleBatchCommand(ClientSession* session, char* line, OutputBuffer* out);
+int runBatch(char* path, int saveEvery);
+void benchmarkNIDLookup();
 void saveData();
+int runCheckpoint(int background);
+void waitForCheckpoint();
+CheckpointJob* captureCheckpoint();
+void freeCheckpointJob(CheckpointJob* job);
+void checkpointUserChanged(int userIndex);
 void loadData();
+int writeTextData(CheckpointJob* job);
+void loadTextData(TextManifest* manifest);
+void loadTextCheckpoint();
+int cpuCount();
+int parseRecordFile(char* path, RecordFormat* format,
+                    void (*store)(unsigned char* records, int count), int* malformed);
+int setUserField(void* record, char* key, int keyLength, char* value, int valueLength);
+int setCandidateField(void* record, char* key, int keyLength, char* value, int valueLength);
+int setRaceField(void* record, char* key, int keyLength, char* value, int valueLength);
+unsigned long long textCheckpointSequence();
+int writeSnapshot(char* path, CheckpointJob* job);
+int loadSnapshot(char* path, unsigned long long minSequence);
+unsigned int snapshotHeaderChecksum(SnapshotHeader* header);
+int convertTextToSnapshot();
+int convertSnapshotToText();
 void createBackup();
+int startBackup();
+void waitForBackup();
+void backupUserChanged(int userIndex);
+void backupRaceChanged(int race);
+int loadBackupCatalog();
+int loadBackupImage(int number, BackupImage* image);
+void freeBackupImage(BackupImage* image);
+void saveBackupState(CheckpointJob* job);
+void loadBackupState();
+int restoreBackup(int number);
+void listBackups();
+int showBackupVoter(int number, char* nid);
+int extractArchive(char* path, int constituency);
+void benchmarkBackup();
+int benchmarkSuite(int* sizes, int sizeCount);
+int runSelfTest();
+int runLoadTest(int seconds, int clients, int rate, int voters);
 void logActivity(char* activity);
+int startLogger(char* path);
+void flushLog();
+void stopLogger();
+void benchmarkLogging();
 int validateNID(char* nid);
 int validatePassword(char* password);
-void hashPassword(char* password, char* hashedPassword);
+int hashPassword(char* password, char* hashedPassword);
+void legacyPasswordHash(char* password, char* hashedPassword);
+int startKdfPool(int workers);
+int kdfSubmit(KdfJob* job);
+void kdfRun(KdfJob* job);
+void kdfRunAll(KdfJob** jobs, int count);
+void kdfPoolStats(KdfStats* stats);
+void histogramRecord(LatencyHistogram* histogram, double seconds);
+double histogramPercentile(LatencyHistogram* histogram, double percentile);
+void histogramMerge(LatencyHistogram* into, LatencyHistogram* from);
+void metricAdd(int counter, unsigned long long amount);
+void metricTime(int timer, double seconds);
+void writeMetrics(OutputBuffer* out);
+int writeMetricsFile(char* path);
+void startMetricsWriter(char* path);
+void stopMetricsWriter();
+void showMetrics();
+int recountVotes();
+void turnoutAdd(int race, int ballot, time_t voteTime);
+void turnoutChange(int race, int ballot, time_t voteTime, int delta);
+void rebuildTurnout();
+int turnoutSeries(int race, int width, TurnoutSeries* series);
+int writeTurnoutCsv(char* path, int race, int width);
+void showTurnout();
+int importRoll(char* path, char* rejectsPath);
+int preparePasswordRequest(char** fields, int count, PasswordRequest* request, OutputBuffer* out);
+int finishPasswordRequest(ClientSession* session, PasswordRequest* request, OutputBuffer* out);
+void upgradePasswordHash(int userIndex, char* oldHash, char* newHash);
+void applySetPassword(int userIndex, char* hashedPassword);
+unsigned long long journalSetPassword(int userIndex);
+void benchmarkLogin();
 int checkSession();
+int initSessionTable();
+int createSession(int userIndex, char* token);
+int sessionUser(char* token);
+void endSession(char* token);
+void sessionTick(time_t now);
+int activeSessionCount();
+void startSessionReaper();
+void benchmarkSessions();
 void setElectionPeriod();
-int isElectionActive();
+int isElectionActive(Race* race);
 void printHeader(char* title);
 void printSuccess(char* message);
 void printError(char* message);
 void printInfo(char* message);
 
-int main() {
+int main(int argc, char* argv[]) {
     int choice;
     
-    time(&lastActivityTime);
-    time(&electionStartTime);
-    electionEndTime = electionStartTime + (7 * 24 * 60 * 60);
+    if(argc > 1 && strcmp(argv[1], "--bench-nid") == 0) {
+        benchmarkNIDLookup();
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-search") == 0) {
+        benchmarkSearch();
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-log") == 0) {
+        benchmarkLogging();
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-login") == 0) {
+        benchmarkLogin();
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-sessions") == 0) {
+        benchmarkSessions();
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-votes") == 0) {
+        benchmarkVoting();
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-backup") == 0) {
+        benchmarkBackup();
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-suite") == 0) {
+        // Roll sizes may follow; the default covers small to national scale
+        int sizes[16] = { 1000, 100000, 10000000 };
+        int sizeCount = 3;
+        if(argc > 2) {
+            sizeCount = 0;
+            for(int i = 2; i < argc && sizeCount < 16; i++) {
+                if(atoi(argv[i]) > 0) {
+                    sizes[sizeCount++] = atoi(argv[i]);
+                }
+            }
+        }
+        return benchmarkSuite(sizes, sizeCount) ? 0 : 1;
+    }
+    if(argc > 1 && strcmp(argv[1], "--self-test") == 0) {
+        return runSelfTest() ? 0 : 1;
+    }
+    if(argc > 1 && strcmp(argv[1], "--load-test") == 0) {
+        int seconds = 30, clients = 64, rate = 0, voters = 100000;
+        for(int i = 2; i + 1 < argc; i += 2) {
+            if(strcmp(argv[i], "--seconds") == 0) {
+                seconds = atoi(argv[i + 1]);
+            } else if(strcmp(argv[i], "--clients") == 0) {
+                clients = atoi(argv[i + 1]);
+            } else if(strcmp(argv[i], "--rate") == 0) {
+                rate = atoi(argv[i + 1]);
+            } else if(strcmp(argv[i], "--voters") == 0) {
+                voters = atoi(argv[i + 1]);
+            }
+        }
+        return runLoadTest(seconds, clients, rate, voters) ? 0 : 1;
+    }
+    if(argc > 1 && strcmp(argv[1], "--server") == 0) {
+        return runServer(argc > 2 ? argv[2] : NULL);
+    }
+    if(argc > 1 && strcmp(argv[1], "--batch") == 0) {
+        int saveEvery = 0;
+        char *path = NULL;
+        for(int i = 2; i < argc; i++) {
+            if(strcmp(argv[i], "--save-every") == 0 && i + 1 < argc) {
+                saveEvery = atoi(argv[++i]);
+            } else {
+                path = argv[i];
+            }
+        }
+        return runBatch(path, saveEvery);
+    }
+    if(argc > 2 && strcmp(argv[1], "--import-roll") == 0) {
+        startSystem();
+        closeJournal();
+        int ok = importRoll(argv[2], argc > 3 ? argv[3] : IMPORT_REJECTS_FILE);
+        stopLogger();
+        return ok ? 0 : 1;
+    }
+    if(argc > 1 && strcmp(argv[1], "--recount") == 0) {
+        startSystem();
+        closeJournal();
+        int ok = recountVotes();
+        stopLogger();
+        return ok ? 0 : 2;
+    }
+    if(argc > 1 && strcmp(argv[1], "--to-snapshot") == 0) {
+        return convertTextToSnapshot() ? 0 : 1;
+    }
+    if(argc > 1 && strcmp(argv[1], "--to-text") == 0) {
+        return convertSnapshotToText() ? 0 : 1;
+    }
+    if(argc > 1 && strcmp(argv[1], "--list-backups") == 0) {
+        listBackups();
+        return 0;
+    }
+    if(argc > 2 && strcmp(argv[1], "--restore-backup") == 0) {
+        return restoreBackup(atoi(argv[2])) ? 0 : 1;
+    }
+    if(argc > 3 && strcmp(argv[1], "--backup-voter") == 0) {
+        return showBackupVoter(atoi(argv[2]), argv[3]) ? 0 : 1;
+    }
+    if(argc > 2 && strcmp(argv[1], "--extract") == 0) {
+        return extractArchive(argv[2], argc > 3 ? atoi(argv[3]) : 0) ? 0 : 1;
+    }
     
-    initializeCandidates();
-    loadData();
+    startSystem();
     
     printf("\n========================================\n");
     printf("   GENERAL ELECTION VOTING SYSTEM\n");
@@ -114,10 +1268,15 @@ int main() {
                 adminPanel();
                 break;
             case 4:
+                waitForBackup();
                 createBackup();
+                waitForBackup();
                 saveData();
+                closeJournal();
+                stopMetricsWriter();
                 printSuccess("Thank you for using the Voting System!");
                 logActivity("System shutdown");
+                stopLogger();
                 exit(0);
             default:
                 printError("Invalid choice! Please try again.");
@@ -127,48 +1286,110 @@ int main() {
     return 0;
 }
 
-void initializeCandidates() {
-    candidateCount = 5;
-    
-    strcpy(candidates[0].name, "John Smith");
-    strcpy(candidates[0].party, "Democratic Party");
-    strcpy(candidates[0].education, "MBA from Harvard University");
-    candidates[0].age = 52;
-    strcpy(candidates[0].manifesto, "Focus on healthcare reform and education");
-    candidates[0].id = 1;
-    candidates[0].votes = 0;
-    
-    strcpy(candidates[1].name, "Sarah Johnson");
-    strcpy(candidates[1].party, "Republican Party");
-    strcpy(candidates[1].education, "Law Degree from Yale");
-    candidates[1].age = 48;
-    strcpy(candidates[1].manifesto, "Economic growth and tax reforms");
-    candidates[1].id = 2;
-    candidates[1].votes = 0;
-    
-    strcpy(candidates[2].name, "Michael Brown");
-    strcpy(candidates[2].party, "Independent");
-    strcpy(candidates[2].education, "PhD in Economics");
-    candidates[2].age = 45;
-    strcpy(candidates[2].manifesto, "Environmental protection and sustainability");
-    candidates[2].id = 3;
-    candidates[2].votes = 0;
-    
-    strcpy(candidates[3].name, "Emily Davis");
-    strcpy(candidates[3].party, "Green Party");
-    strcpy(candidates[3].education, "MS in Environmental Science");
-    candidates[3].age = 42;
-    strcpy(candidates[3].manifesto, "Climate action and renewable energy");
-    candidates[3].id = 4;
-    candidates[3].votes = 0;
-    
-    strcpy(candidates[4].name, "Robert Wilson");
-    strcpy(candidates[4].party, "Libertarian Party");
-    strcpy(candidates[4].education, "BA in Political Science");
-    candidates[4].age = 55;
-    strcpy(candidates[4].manifesto, "Individual freedom and limited government");
-    candidates[4].id = 5;
-    candidates[4].votes = 0;
+// Loads the last checkpoint and replays the journal on top of it
+void startSystem() {
+    startLogger(LOG_FILE);
+    startKdfPool(cpuCount());
+    startSessionReaper();
+    initializeRaces();
+    loadData();
+    loadBackupState();
+    replayJournal();
+    openJournal();
+    startMetricsWriter(METRICS_FILE);
+}
+
+void initializeCandidates(Race* race) {
+    race->candidateCount = 5;
+    
+    strcpy(race->candidates[0].name, "John Smith");
+    strcpy(race->candidates[0].party, "Democratic Party");
+    strcpy(race->candidates[0].education, "MBA from Harvard University");
+    race->candidates[0].age = 52;
+    strcpy(race->candidates[0].manifesto, "Focus on healthcare reform and education");
+    race->candidates[0].id = 1;
+    race->candidates[0].votes = 0;
+    race->candidates[0].race = race->id - 1;
+    
+    strcpy(race->candidates[1].name, "Sarah Johnson");
+    strcpy(race->candidates[1].party, "Republican Party");
+    strcpy(race->candidates[1].education, "Law Degree from Yale");
+    race->candidates[1].age = 48;
+    strcpy(race->candidates[1].manifesto, "Economic growth and tax reforms");
+    race->candidates[1].id = 2;
+    race->candidates[1].votes = 0;
+    race->candidates[1].race = race->id - 1;
+    
+    strcpy(race->candidates[2].name, "Michael Brown");
+    strcpy(race->candidates[2].party, "Independent");
+    strcpy(race->candidates[2].education, "PhD in Economics");
+    race->candidates[2].age = 45;
+    strcpy(race->candidates[2].manifesto, "Environmental protection and sustainability");
+    race->candidates[2].id = 3;
+    race->candidates[2].votes = 0;
+    race->candidates[2].race = race->id - 1;
+    
+    strcpy(race->candidates[3].name, "Emily Davis");
+    strcpy(race->candidates[3].party, "Green Party");
+    strcpy(race->candidates[3].education, "MS in Environmental Science");
+    race->candidates[3].age = 42;
+    strcpy(race->candidates[3].manifesto, "Climate action and renewable energy");
+    race->candidates[3].id = 4;
+    race->candidates[3].votes = 0;
+    race->candidates[3].race = race->id - 1;
+    
+    strcpy(race->candidates[4].name, "Robert Wilson");
+    strcpy(race->candidates[4].party, "Libertarian Party");
+    strcpy(race->candidates[4].education, "BA in Political Science");
+    race->candidates[4].age = 55;
+    strcpy(race->candidates[4].manifesto, "Individual freedom and limited government");
+    race->candidates[4].id = 5;
+    race->candidates[4].votes = 0;
+    race->candidates[4].race = race->id - 1;
+}
+
+// Starts from a single constituency holding the default candidates
+void initializeRaces() {
+    time_t now;
+    time(&now);
+    raceCount = 0;
+    int race = applyAddRace("General", now, now + (7 * 24 * 60 * 60));
+    if(race == -1) {
+        printError("Could not allocate memory for the constituencies!");
+        exit(1);
+    }
+    initializeCandidates(races[race]);
+}
+
+// Lists the constituencies and asks for one. Returns its index, ALL_RACES
+// when allowAll is set and 0 is entered, or NO_RACE for a bad choice.
+// Nothing is asked while there is only one constituency.
+int chooseRace(int allowAll) {
+    if(raceCount == 1) {
+        return 0;
+    }
+    
+    printf("\n%-4s %-30s %-10s\n", "ID", "Constituency", "Candidates");
+    printf("========================================\n");
+    for(int r = 0; r < raceCount; r++) {
+        printf("%-4d %-30s %-10d\n", races[r]->id, races[r]->name, races[r]->candidateCount);
+    }
+    
+    int id;
+    printf(allowAll ? "\nEnter Constituency ID (0 for all): " : "\nEnter Constituency ID: ");
+    if(scanf("%d", &id) != 1) {
+        id = -1;
+    }
+    clearInputBuffer();
+    
+    if(allowAll && id == 0) {
+        return ALL_RACES;
+    }
+    if(id < 1 || id > raceCount) {
+        printError("Invalid constituency ID!");
+        return NO_RACE;
+    }
+    return id - 1;
 }
 
 int validateNID(char* nid) {
@@ -204,906 +1425,10519 @@ int validatePassword(char* password) {
     return (hasUpper && hasLower && hasDigit);
 }
 
-void hashPassword(char* password, char* hashedPassword) {
-    int hash = 0;
-    for(int i = 0; password[i] != '\0'; i++) {
-        hash = (hash * 31 + password[i]) % 100000;
-    }
-    sprintf(hashedPassword, "H%d", hash);
+// SHA-256, HMAC-SHA-256 and scrypt (RFC 7914) for password hashing
+typedef struct {
+    unsigned int state[8];
+    unsigned long long length;
+    unsigned char block[64];
+    size_t used;
+} Sha256;
+
+static const unsigned int sha256Constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha256Init(Sha256* ctx) {
+    static const unsigned int initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
 }
 
-void registerUser() {
-    if(userCount >= MAX_USERS) {
-        printError("Registration limit reached! Maximum 1000 users allowed.");
-        return;
+static void sha256Transform(Sha256* ctx, const unsigned char* data) {
+    unsigned int w[64];
+    for(int i = 0; i < 16; i++) {
+        w[i] = ((unsigned int)data[i*4] << 24) | ((unsigned int)data[i*4+1] << 16) |
+               ((unsigned int)data[i*4+2] << 8) | data[i*4+3];
     }
-    
-    char fullName[MAX_NAME_LENGTH];
-    char nidNumber[NID_LENGTH];
-    char password[MAX_PASSWORD_LENGTH];
-    char hashedPassword[MAX_PASSWORD_LENGTH];
-    
-    printHeader("USER REGISTRATION");
-    
-    printf("1. Enter your Full Name: ");
-    fgets(fullName, MAX_NAME_LENGTH, stdin);
-    fullName[strcspn(fullName, "\n")] = 0;
-    
-    if(strlen(fullName) == 0) {
-        printError("Full name cannot be empty!");
-        return;
+    for(int i = 16; i < 64; i++) {
+        unsigned int s0 = ROTR32(w[i-15], 7) ^ ROTR32(w[i-15], 18) ^ (w[i-15] >> 3);
+        unsigned int s1 = ROTR32(w[i-2], 17) ^ ROTR32(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
     }
     
-    printf("2. Enter your NID Number (10-17 digits): ");
-    fgets(nidNumber, NID_LENGTH, stdin);
-    nidNumber[strcspn(nidNumber, "\n")] = 0;
-    
-    if(!validateNID(nidNumber)) {
-        printError("Invalid NID! Must be 10-17 digits only.");
-        return;
+    unsigned int a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    unsigned int e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for(int i = 0; i < 64; i++) {
+        unsigned int t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) +
+                          sha256Constants[i] + w[i];
+        unsigned int t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
     }
-    
-    if(findUserByNID(nidNumber) != -1) {
-        printError("This NID is already registered!");
-        return;
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void sha256Update(Sha256* ctx, const unsigned char* data, size_t length) {
+    ctx->length += length;
+    while(length > 0) {
+        size_t take = 64 - ctx->used < length ? 64 - ctx->used : length;
+        memcpy(ctx->block + ctx->used, data, take);
+        ctx->used += take;
+        data += take;
+        length -= take;
+        if(ctx->used == 64) {
+            sha256Transform(ctx, ctx->block);
+            ctx->used = 0;
+        }
     }
-    
-    printf("3. Enter a Password (min 8 chars, 1 uppercase, 1 lowercase, 1 digit): ");
-    fgets(password, MAX_PASSWORD_LENGTH, stdin);
-    password[strcspn(password, "\n")] = 0;
-    
-    if(!validatePassword(password)) {
-        printError("Weak password! Must have 8+ chars, uppercase, lowercase, and digit.");
-        return;
+}
+
+static void sha256Final(Sha256* ctx, unsigned char* digest) {
+    unsigned long long bits = ctx->length * 8;
+    unsigned char pad = 0x80;
+    sha256Update(ctx, &pad, 1);
+    pad = 0;
+    while(ctx->used != 56) {
+        sha256Update(ctx, &pad, 1);
+    }
+    unsigned char lengthBytes[8];
+    for(int i = 0; i < 8; i++) {
+        lengthBytes[i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    sha256Update(ctx, lengthBytes, 8);
+    for(int i = 0; i < 8; i++) {
+        digest[i*4] = (unsigned char)(ctx->state[i] >> 24);
+        digest[i*4+1] = (unsigned char)(ctx->state[i] >> 16);
+        digest[i*4+2] = (unsigned char)(ctx->state[i] >> 8);
+        digest[i*4+3] = (unsigned char)ctx->state[i];
+    }
+}
+
+// PBKDF2-HMAC-SHA-256 with a single iteration, which is all scrypt needs
+static void pbkdf2Sha256(const unsigned char* password, size_t passwordLength,
+                         const unsigned char* salt, size_t saltLength,
+                         unsigned char* out, size_t outLength) {
+    unsigned char key[64], pad[64], digest[32];
+    Sha256 inner, outer, ctx;
+    
+    memset(key, 0, sizeof(key));
+    if(passwordLength > 64) {
+        sha256Init(&ctx);
+        sha256Update(&ctx, password, passwordLength);
+        sha256Final(&ctx, key);
+    } else {
+        memcpy(key, password, passwordLength);
+    }
+    for(int i = 0; i < 64; i++) {
+        pad[i] = key[i] ^ 0x36;
+    }
+    sha256Init(&inner);
+    sha256Update(&inner, pad, 64);
+    sha256Update(&inner, salt, saltLength);
+    for(int i = 0; i < 64; i++) {
+        pad[i] = key[i] ^ 0x5c;
+    }
+    sha256Init(&outer);
+    sha256Update(&outer, pad, 64);
+    
+    for(unsigned int block = 1; outLength > 0; block++) {
+        unsigned char counter[4] = { block >> 24, block >> 16, block >> 8, block };
+        ctx = inner;
+        sha256Update(&ctx, counter, 4);
+        sha256Final(&ctx, digest);
+        ctx = outer;
+        sha256Update(&ctx, digest, 32);
+        sha256Final(&ctx, digest);
+        
+        size_t take = outLength < 32 ? outLength : 32;
+        memcpy(out, digest, take);
+        out += take;
+        outLength -= take;
+    }
+}
+
+static void salsa20_8(unsigned int* b) {
+    unsigned int x[16];
+    memcpy(x, b, sizeof(x));
+    for(int i = 0; i < 8; i += 2) {
+        x[ 4] ^= ROTL32(x[ 0] + x[12],  7);  x[ 8] ^= ROTL32(x[ 4] + x[ 0],  9);
+        x[12] ^= ROTL32(x[ 8] + x[ 4], 13);  x[ 0] ^= ROTL32(x[12] + x[ 8], 18);
+        x[ 9] ^= ROTL32(x[ 5] + x[ 1],  7);  x[13] ^= ROTL32(x[ 9] + x[ 5],  9);
+        x[ 1] ^= ROTL32(x[13] + x[ 9], 13);  x[ 5] ^= ROTL32(x[ 1] + x[13], 18);
+        x[14] ^= ROTL32(x[10] + x[ 6],  7);  x[ 2] ^= ROTL32(x[14] + x[10],  9);
+        x[ 6] ^= ROTL32(x[ 2] + x[14], 13);  x[10] ^= ROTL32(x[ 6] + x[ 2], 18);
+        x[ 3] ^= ROTL32(x[15] + x[11],  7);  x[ 7] ^= ROTL32(x[ 3] + x[15],  9);
+        x[11] ^= ROTL32(x[ 7] + x[ 3], 13);  x[15] ^= ROTL32(x[11] + x[ 7], 18);
+        x[ 1] ^= ROTL32(x[ 0] + x[ 3],  7);  x[ 2] ^= ROTL32(x[ 1] + x[ 0],  9);
+        x[ 3] ^= ROTL32(x[ 2] + x[ 1], 13);  x[ 0] ^= ROTL32(x[ 3] + x[ 2], 18);
+        x[ 6] ^= ROTL32(x[ 5] + x[ 4],  7);  x[ 7] ^= ROTL32(x[ 6] + x[ 5],  9);
+        x[ 4] ^= ROTL32(x[ 7] + x[ 6], 13);  x[ 5] ^= ROTL32(x[ 4] + x[ 7], 18);
+        x[11] ^= ROTL32(x[10] + x[ 9],  7);  x[ 8] ^= ROTL32(x[11] + x[10],  9);
+        x[ 9] ^= ROTL32(x[ 8] + x[11], 13);  x[10] ^= ROTL32(x[ 9] + x[ 8], 18);
+        x[12] ^= ROTL32(x[15] + x[14],  7);  x[13] ^= ROTL32(x[12] + x[15],  9);
+        x[14] ^= ROTL32(x[13] + x[12], 13);  x[15] ^= ROTL32(x[14] + x[13], 18);
+    }
+    for(int i = 0; i < 16; i++) {
+        b[i] += x[i];
+    }
+}
+
+// BlockMix of 2r 64-byte blocks from b into y
+static void scryptBlockMix(unsigned int* b, unsigned int* y, int r) {
+    unsigned int x[16];
+    memcpy(x, &b[(2 * r - 1) * 16], sizeof(x));
+    for(int i = 0; i < 2 * r; i++) {
+        for(int k = 0; k < 16; k++) {
+            x[k] ^= b[i * 16 + k];
+        }
+        salsa20_8(x);
+        // Even blocks go to the first half of the output, odd to the second
+        memcpy(&y[((i & 1) * r + i / 2) * 16], x, sizeof(x));
+    }
+}
+
+// ROMix on one 128r-byte block; v holds n blocks and xy two more
+static void scryptROMix(unsigned char* block, int r, unsigned int n, unsigned int* v, unsigned int* xy) {
+    int words = 32 * r;
+    unsigned int *x = xy, *y = xy + words;
+    
+    for(int k = 0; k < words; k++) {
+        x[k] = (unsigned int)block[k*4] | ((unsigned int)block[k*4+1] << 8) |
+               ((unsigned int)block[k*4+2] << 16) | ((unsigned int)block[k*4+3] << 24);
+    }
+    for(unsigned int i = 0; i < n; i++) {
+        memcpy(&v[(size_t)i * words], x, words * sizeof(unsigned int));
+        scryptBlockMix(x, y, r);
+        memcpy(x, y, words * sizeof(unsigned int));
+    }
+    for(unsigned int i = 0; i < n; i++) {
+        unsigned int j = x[(2 * r - 1) * 16] & (n - 1);
+        for(int k = 0; k < words; k++) {
+            x[k] ^= v[(size_t)j * words + k];
+        }
+        scryptBlockMix(x, y, r);
+        memcpy(x, y, words * sizeof(unsigned int));
+    }
+    for(int k = 0; k < words; k++) {
+        block[k*4] = (unsigned char)x[k];
+        block[k*4+1] = (unsigned char)(x[k] >> 8);
+        block[k*4+2] = (unsigned char)(x[k] >> 16);
+        block[k*4+3] = (unsigned char)(x[k] >> 24);
+    }
+}
+
+// Memory needed by scrypt() for cost 2^log2N and block size r
+static size_t scryptScratchSize(int log2N, int r) {
+    return ((size_t)1 << log2N) * 128 * r + 256 * (size_t)r;
+}
+
+// scrypt with n = 2^log2N. scratch must hold scryptScratchSize() bytes, or
+// be NULL to allocate it here. Returns 0 if memory runs out.
+static int scrypt(const unsigned char* password, size_t passwordLength,
+                  const unsigned char* salt, size_t saltLength,
+                  int log2N, int r, int p, unsigned char* scratch,
+                  unsigned char* out, size_t outLength) {
+    size_t blockSize = 128 * (size_t)r;
+    unsigned char *blocks = malloc(blockSize * p);
+    unsigned char *owned = NULL;
+    if(scratch == NULL) {
+        scratch = owned = malloc(scryptScratchSize(log2N, r));
+    }
+    if(blocks == NULL || scratch == NULL) {
+        free(blocks);
+        free(owned);
+        return 0;
+    }
+    
+    unsigned int *v = (unsigned int*)scratch;
+    unsigned int *xy = v + ((size_t)1 << log2N) * 32 * r;
+    pbkdf2Sha256(password, passwordLength, salt, saltLength, blocks, blockSize * p);
+    for(int i = 0; i < p; i++) {
+        scryptROMix(blocks + i * blockSize, r, 1u << log2N, v, xy);
+    }
+    pbkdf2Sha256(password, passwordLength, blocks, blockSize * p, out, outLength);
+    
+    free(blocks);
+    free(owned);
+    return 1;
+}
+
+static const char base64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Unpadded base64, as used in PHC hash strings
+static void base64Encode(const unsigned char* data, int length, char* out) {
+    int o = 0;
+    for(int i = 0; i < length; i += 3) {
+        unsigned int chunk = (unsigned int)data[i] << 16;
+        if(i + 1 < length) chunk |= (unsigned int)data[i+1] << 8;
+        if(i + 2 < length) chunk |= data[i+2];
+        out[o++] = base64Alphabet[(chunk >> 18) & 63];
+        out[o++] = base64Alphabet[(chunk >> 12) & 63];
+        if(i + 1 < length) out[o++] = base64Alphabet[(chunk >> 6) & 63];
+        if(i + 2 < length) out[o++] = base64Alphabet[chunk & 63];
+    }
+    out[o] = '\0';
+}
+
+// Returns the number of bytes decoded, or -1 for bad input
+static int base64Decode(char* text, int textLength, unsigned char* out, int maxLength) {
+    unsigned int chunk = 0;
+    int bits = 0, length = 0;
+    for(int i = 0; i < textLength; i++) {
+        char *found = strchr(base64Alphabet, text[i]);
+        if(text[i] == '\0' || found == NULL) {
+            return -1;
+        }
+        chunk = (chunk << 6) | (unsigned int)(found - base64Alphabet);
+        bits += 6;
+        if(bits >= 8) {
+            bits -= 8;
+            if(length == maxLength) {
+                return -1;
+            }
+            out[length++] = (unsigned char)(chunk >> bits);
+        }
+    }
+    return length;
+}
+
+static void fillRandom(unsigned char* buffer, int length) {
+    int filled = 0;
+#ifndef _WIN32
+    FILE *fp = fopen("/dev/urandom", "rb");
+    if(fp != NULL) {
+        filled = (int)fread(buffer, 1, length, fp);
+        fclose(fp);
+    }
+#endif
+    if(filled < length) {
+        static unsigned int seed = 0;
+        if(seed == 0) {
+            seed = (unsigned int)time(NULL) ^ (unsigned int)(size_t)buffer;
+        }
+        for(int i = filled; i < length; i++) {
+            seed = seed * 1103515245u + 12345u;
+            buffer[i] = (unsigned char)(seed >> 16);
+        }
+    }
+}
+
+// The 5-digit rolling hash used before scrypt. Voters registered with it
+// are moved to scrypt the next time they log in.
+void legacyPasswordHash(char* password, char* hashedPassword) {
+    int hash = 0;
+    for(int i = 0; password[i] != '\0'; i++) {
+        hash = (hash * 31 + password[i]) % 100000;
+    }
+    sprintf(hashedPassword, "H%d", hash);
+}
+
+static int isLegacyHash(char* hash) {
+    if(hash[0] != 'H' || hash[1] == '\0') {
+        return 0;
+    }
+    for(int i = 1; hash[i]; i++) {
+        if(!isdigit((unsigned char)hash[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Derives a salted scrypt hash in PHC string format:
+//   $scrypt$ln=11,r=8,p=1$<salt>$<key>
+// scratch is a worker's buffer for the default parameters, or NULL.
+static int derivePasswordHash(char* password, unsigned char* scratch, char* hashedPassword) {
+    unsigned char salt[KDF_SALT_LENGTH], key[KDF_KEY_LENGTH];
+    char saltText[KDF_SALT_LENGTH * 2], keyText[KDF_KEY_LENGTH * 2];
+    
+    fillRandom(salt, sizeof(salt));
+    if(!scrypt((unsigned char*)password, strlen(password), salt, sizeof(salt),
+               KDF_COST_LOG2, KDF_BLOCK_SIZE, KDF_PARALLELISM, scratch, key, sizeof(key))) {
+        return 0;
+    }
+    base64Encode(salt, sizeof(salt), saltText);
+    base64Encode(key, sizeof(key), keyText);
+    snprintf(hashedPassword, PASSWORD_HASH_LENGTH, "$scrypt$ln=%d,r=%d,p=%d$%s$%s",
+             KDF_COST_LOG2, KDF_BLOCK_SIZE, KDF_PARALLELISM, saltText, keyText);
+    return 1;
+}
+
+// Checks a password against a stored hash of either format. Unknown or
+// malformed hashes, and ones costlier than KDF_MAX_*, still cost one
+// derivation so that they take as long to reject as a wrong password.
+static int checkPassword(char* password, char* storedHash, unsigned char* scratch) {
+    if(isLegacyHash(storedHash)) {
+        char legacy[PASSWORD_HASH_LENGTH];
+        legacyPasswordHash(password, legacy);
+        return strcmp(legacy, storedHash) == 0;
+    }
+    
+    int log2N, r, p, offset = 0;
+    unsigned char salt[64], key[KDF_KEY_LENGTH], expected[KDF_KEY_LENGTH];
+    int saltLength = -1, keyLength = -1;
+    if(sscanf(storedHash, "$scrypt$ln=%d,r=%d,p=%d$%n", &log2N, &r, &p, &offset) == 3 && offset > 0 &&
+       log2N >= 1 && log2N <= KDF_MAX_COST_LOG2 && r >= 1 && r <= KDF_MAX_BLOCK_SIZE &&
+       p >= 1 && p <= KDF_MAX_PARALLELISM) {
+        char *saltText = storedHash + offset;
+        char *keyText = strchr(saltText, '$');
+        if(keyText != NULL) {
+            saltLength = base64Decode(saltText, keyText - saltText, salt, sizeof(salt));
+            keyLength = base64Decode(keyText + 1, strlen(keyText + 1), expected, sizeof(expected));
+        }
+    }
+    if(saltLength < 0 || keyLength != KDF_KEY_LENGTH) {
+        char discard[PASSWORD_HASH_LENGTH];
+        derivePasswordHash(password, scratch, discard);
+        return 0;
+    }
+    
+    if(log2N != KDF_COST_LOG2 || r != KDF_BLOCK_SIZE) {
+        scratch = NULL;
+    }
+    if(!scrypt((unsigned char*)password, strlen(password), salt, saltLength,
+               log2N, r, p, scratch, key, sizeof(key))) {
+        return 0;
+    }
+    unsigned char difference = 0;
+    for(int i = 0; i < KDF_KEY_LENGTH; i++) {
+        difference |= key[i] ^ expected[i];
+    }
+    return difference == 0;
+}
+
+static void runKdfJob(KdfJob* job, unsigned char* scratch) {
+    job->upgradedHash[0] = '\0';
+    if(!job->verify) {
+        job->matched = derivePasswordHash(job->password, scratch, job->hash);
+    } else {
+        job->matched = checkPassword(job->password, job->hash, scratch);
+        if(job->matched && isLegacyHash(job->hash)) {
+            derivePasswordHash(job->password, scratch, job->upgradedHash);
+        }
+    }
+    memset(job->password, 0, sizeof(job->password));
+}
+
+static int latencyBucket(double seconds) {
+    unsigned long long us = (unsigned long long)(seconds * 1e6);
+    if(us < 8) {
+        return (int)us;
+    }
+    int msb = 3;
+    while((us >> (msb + 1)) != 0) {
+        msb++;
+    }
+    int bucket = msb * 4 + (int)((us >> (msb - 2)) & 3);
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+void histogramRecord(LatencyHistogram* histogram, double seconds) {
+    histogram->buckets[latencyBucket(seconds)]++;
+    histogram->count++;
+    if(seconds > histogram->maxSeconds) {
+        histogram->maxSeconds = seconds;
+    }
+}
+
+void histogramMerge(LatencyHistogram* into, LatencyHistogram* from) {
+    for(int i = 0; i < LATENCY_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    if(from->maxSeconds > into->maxSeconds) {
+        into->maxSeconds = from->maxSeconds;
+    }
+}
+
+// Upper bound in microseconds of the bucket holding the given percentile,
+// capped at the largest value recorded
+double histogramPercentile(LatencyHistogram* histogram, double percentile) {
+    if(histogram->count == 0) {
+        return 0;
+    }
+    unsigned long long rank = (unsigned long long)(histogram->count * percentile / 100.0);
+    unsigned long long seen = 0;
+    double maxUs = histogram->maxSeconds * 1e6;
+    for(int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if(seen > rank) {
+            double bound = i < 8 ? i + 1 : (double)((unsigned long long)(4 + i % 4 + 1) << (i / 4 - 2));
+            return bound < maxUs ? bound : maxUs;
+        }
+    }
+    return maxUs;
+}
+
+static MetricShard* metricShard() {
+    if(metricShardIndex == -1) {
+        metricShardIndex = atomic_fetch_add(&nextMetricShard, 1) % METRIC_SHARDS;
+    }
+    return &metricShards[metricShardIndex];
+}
+
+void metricAdd(int counter, unsigned long long amount) {
+    atomic_fetch_add_explicit(&metricShard()->counters[counter], amount, memory_order_relaxed);
+}
+
+void metricTime(int timer, double seconds) {
+    MetricTimer *into = &metricShard()->timers[timer];
+    atomic_fetch_add_explicit(&into->buckets[latencyBucket(seconds)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&into->totalNs, (unsigned long long)(seconds * 1e9), memory_order_relaxed);
+}
+
+static const struct {
+    char *name;
+    char *labels;
+    char *help;
+} metricCounterInfo[METRIC_COUNTERS] = {
+    { "election_registrations_total", "", "Voters registered." },
+    { "election_logins_total", "", "Successful voter logins." },
+    { "election_failed_logins_total", "", "Logins refused for an unknown NID or a wrong password." },
+    { "election_votes_cast_total", "", "Votes accepted." },
+    { "election_saves_total", "", "Checkpoints written." },
+    { "election_backups_total", "", "Backups written." },
+    { "election_bytes_written_total", "{target=\"journal\"}", "Bytes written to disk." },
+    { "election_bytes_written_total", "{target=\"checkpoint\"}", "Bytes written to disk." },
+    { "election_bytes_written_total", "{target=\"snapshot\"}", "Bytes written to disk." },
+    { "election_bytes_written_total", "{target=\"backup\"}", "Bytes written to disk." }
+};
+
+static const struct {
+    char *name;
+    char *help;
+} metricTimerInfo[METRIC_TIMERS] = {
+    { "election_cast_vote_seconds", "Time to accept a vote, journal commit included." },
+    { "election_login_seconds", "Time to check a voter's password and log them in." },
+    { "election_save_seconds", "Time to write a checkpoint." },
+    { "election_load_seconds", "Time to load the checkpoint at startup." }
+};
+
+// Sums the shards into Prometheus text format. Histogram buckets are the
+// powers of two microseconds from 8 us to about 33 s; the octave edges are
+// also edges of the LatencyHistogram buckets, so the counts are exact.
+void writeMetrics(OutputBuffer* out) {
+    for(int c = 0; c < METRIC_COUNTERS; c++) {
+        unsigned long long total = 0;
+        for(int s = 0; s < METRIC_SHARDS; s++) {
+            total += atomic_load_explicit(&metricShards[s].counters[c], memory_order_relaxed);
+        }
+        if(c == 0 || strcmp(metricCounterInfo[c].name, metricCounterInfo[c - 1].name) != 0) {
+            outputPrintf(out, "# HELP %s %s\n", metricCounterInfo[c].name, metricCounterInfo[c].help);
+            outputPrintf(out, "# TYPE %s counter\n", metricCounterInfo[c].name);
+        }
+        outputPrintf(out, "%s%s %llu\n", metricCounterInfo[c].name, metricCounterInfo[c].labels, total);
+    }
+    
+    for(int t = 0; t < METRIC_TIMERS; t++) {
+        unsigned long long buckets[LATENCY_BUCKETS] = {0};
+        unsigned long long totalNs = 0;
+        for(int s = 0; s < METRIC_SHARDS; s++) {
+            MetricTimer *timer = &metricShards[s].timers[t];
+            for(int i = 0; i < LATENCY_BUCKETS; i++) {
+                buckets[i] += atomic_load_explicit(&timer->buckets[i], memory_order_relaxed);
+            }
+            totalNs += atomic_load_explicit(&timer->totalNs, memory_order_relaxed);
+        }
+        char *name = metricTimerInfo[t].name;
+        outputPrintf(out, "# HELP %s %s\n", name, metricTimerInfo[t].help);
+        outputPrintf(out, "# TYPE %s histogram\n", name);
+        unsigned long long seen = 0;
+        int next = 0;
+        for(int octave = 3; octave <= 25; octave++) {
+            while(next < octave * 4) {
+                seen += buckets[next++];
+            }
+            outputPrintf(out, "%s_bucket{le=\"%.9g\"} %llu\n", name, (double)(1ULL << octave) / 1e6, seen);
+        }
+        while(next < LATENCY_BUCKETS) {
+            seen += buckets[next++];
+        }
+        outputPrintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, seen);
+        outputPrintf(out, "%s_sum %.9f\n", name, totalNs / 1e9);
+        outputPrintf(out, "%s_count %llu\n", name, seen);
+    }
+    
+    pthread_rwlock_rdlock(&stateLock);
+    int voters = userCount;
+    int constituencies = raceCount;
+    pthread_rwlock_unlock(&stateLock);
+    outputPrintf(out, "# HELP election_registered_voters Voters on the roll.\n");
+    outputPrintf(out, "# TYPE election_registered_voters gauge\n");
+    outputPrintf(out, "election_registered_voters %d\n", voters);
+    outputPrintf(out, "# HELP election_constituencies Constituencies.\n");
+    outputPrintf(out, "# TYPE election_constituencies gauge\n");
+    outputPrintf(out, "election_constituencies %d\n", constituencies);
+    outputPrintf(out, "# HELP election_active_sessions Logged-in voter sessions.\n");
+    outputPrintf(out, "# TYPE election_active_sessions gauge\n");
+    outputPrintf(out, "election_active_sessions %d\n", activeSessionCount());
+}
+
+// Replaces the file in one rename, so a scraper never reads half of it
+int writeMetricsFile(char* path) {
+    OutputBuffer out = { NULL, 0, 0 };
+    writeMetrics(&out);
+    char tempPath[260];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    FILE *fp = fopen(tempPath, "w");
+    if(fp == NULL) {
+        free(out.data);
+        return 0;
+    }
+    int ok = out.data != NULL && fwrite(out.data, 1, out.length, fp) == out.length;
+    ok = (fclose(fp) == 0) && ok;
+    free(out.data);
+    if(!ok) {
+        remove(tempPath);
+        return 0;
+    }
+#ifdef _WIN32
+    remove(path);
+#endif
+    return rename(tempPath, path) == 0;
+}
+
+static void* metricsWriterThread(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&metricsWriter.lock);
+    while(metricsWriter.running) {
+        struct timespec deadline;
+        deadlineAfter(&deadline, METRICS_INTERVAL * 1000L);
+        int waited = 0;
+        while(metricsWriter.running && waited != ETIMEDOUT) {
+            waited = pthread_cond_timedwait(&metricsWriter.wake, &metricsWriter.lock, &deadline);
+        }
+        if(metricsWriter.running) {
+            pthread_mutex_unlock(&metricsWriter.lock);
+            writeMetricsFile(metricsWriter.path);
+            pthread_mutex_lock(&metricsWriter.lock);
+        }
+    }
+    pthread_mutex_unlock(&metricsWriter.lock);
+    return NULL;
+}
+
+// Rewrites the metrics file every METRICS_INTERVAL seconds in the
+// background, for the node exporter's textfile collector or any scraper
+// that reads files
+void startMetricsWriter(char* path) {
+    pthread_mutex_lock(&metricsWriter.lock);
+    if(!metricsWriter.running) {
+        metricsWriter.path = path;
+        metricsWriter.running = 1;
+        if(pthread_create(&metricsWriter.thread, NULL, metricsWriterThread, NULL) != 0) {
+            metricsWriter.running = 0;
+        }
+    }
+    pthread_mutex_unlock(&metricsWriter.lock);
+}
+
+// Wakes the writer, waits for it to exit and writes the file one last
+// time. Does nothing if the writer is not running.
+void stopMetricsWriter() {
+    pthread_mutex_lock(&metricsWriter.lock);
+    int running = metricsWriter.running;
+    metricsWriter.running = 0;
+    pthread_cond_signal(&metricsWriter.wake);
+    pthread_mutex_unlock(&metricsWriter.lock);
+    if(running) {
+        pthread_join(metricsWriter.thread, NULL);
+        writeMetricsFile(metricsWriter.path);
+    }
+}
+
+// Each worker takes its share of the queue, up to KDF_BATCH jobs, per
+// lock round trip, and reports them finished together
+static void* kdfWorkerThread(void* arg) {
+    (void)arg;
+    unsigned char *scratch = malloc(scryptScratchSize(KDF_COST_LOG2, KDF_BLOCK_SIZE));
+    KdfJob *batch[KDF_BATCH];
+    void (*callbacks[KDF_BATCH])(KdfJob*);
+    double latencies[KDF_BATCH];
+    
+    while(1) {
+        pthread_mutex_lock(&kdfPool.lock);
+        while(kdfPool.queued == 0) {
+            pthread_cond_wait(&kdfPool.notEmpty, &kdfPool.lock);
+        }
+        int share = (kdfPool.queued + kdfPool.workerCount - 1) / kdfPool.workerCount;
+        int taken = 0;
+        while(taken < share && taken < KDF_BATCH) {
+            batch[taken++] = kdfPool.queue[kdfPool.head];
+            kdfPool.head = (kdfPool.head + 1) % kdfPool.capacity;
+            kdfPool.queued--;
+        }
+        pthread_cond_broadcast(&kdfPool.notFull);
+        pthread_mutex_unlock(&kdfPool.lock);
+        
+        for(int i = 0; i < taken; i++) {
+            runKdfJob(batch[i], scratch);
+            latencies[i] = currentSeconds() - batch[i]->submitted;
+            callbacks[i] = batch[i]->done;
+        }
+        
+        // A waiter may free its job as soon as it sees it finished
+        pthread_mutex_lock(&kdfPool.lock);
+        for(int i = 0; i < taken; i++) {
+            histogramRecord(&kdfPool.latency, latencies[i]);
+            kdfPool.completed++;
+            batch[i]->finished = 1;
+        }
+        pthread_cond_broadcast(&kdfPool.finished);
+        pthread_mutex_unlock(&kdfPool.lock);
+        for(int i = 0; i < taken; i++) {
+            if(callbacks[i] != NULL) {
+                callbacks[i](batch[i]);
+            }
+        }
+    }
+    return NULL;
+}
+
+int startKdfPool(int workers) {
+    pthread_mutex_lock(&kdfPool.lock);
+    if(kdfPool.running) {
+        pthread_mutex_unlock(&kdfPool.lock);
+        return 1;
+    }
+    kdfPool.capacity = workers * KDF_QUEUE_PER_WORKER;
+    kdfPool.queue = malloc(sizeof(KdfJob*) * kdfPool.capacity);
+    kdfPool.workers = malloc(sizeof(pthread_t) * workers);
+    if(kdfPool.queue == NULL || kdfPool.workers == NULL) {
+        free(kdfPool.queue);
+        free(kdfPool.workers);
+        pthread_mutex_unlock(&kdfPool.lock);
+        return 0;
+    }
+    kdfPool.workerCount = 0;
+    for(int i = 0; i < workers; i++) {
+        if(pthread_create(&kdfPool.workers[i], NULL, kdfWorkerThread, NULL) == 0) {
+            kdfPool.workerCount++;
+        }
+    }
+    kdfPool.running = kdfPool.workerCount > 0;
+    pthread_mutex_unlock(&kdfPool.lock);
+    return kdfPool.running;
+}
+
+// Caller holds kdfPool.lock and has checked there is room
+static void kdfEnqueue(KdfJob* job) {
+    job->submitted = currentSeconds();
+    job->finished = 0;
+    kdfPool.queue[(kdfPool.head + kdfPool.queued) % kdfPool.capacity] = job;
+    kdfPool.queued++;
+    if(kdfPool.queued > kdfPool.peakQueued) {
+        kdfPool.peakQueued = kdfPool.queued;
+    }
+    pthread_cond_signal(&kdfPool.notEmpty);
+}
+
+// Queues a job whose done callback runs on a worker thread when it
+// finishes. Returns 0, without queueing, if the queue is full.
+int kdfSubmit(KdfJob* job) {
+    pthread_mutex_lock(&kdfPool.lock);
+    if(!kdfPool.running) {
+        pthread_mutex_unlock(&kdfPool.lock);
+        runKdfJob(job, NULL);
+        job->finished = 1;
+        if(job->done != NULL) {
+            job->done(job);
+        }
+        return 1;
+    }
+    if(kdfPool.queued == kdfPool.capacity) {
+        kdfPool.rejected++;
+        pthread_mutex_unlock(&kdfPool.lock);
+        return 0;
+    }
+    kdfEnqueue(job);
+    pthread_mutex_unlock(&kdfPool.lock);
+    return 1;
+}
+
+// Runs a job on the pool and waits for it, waiting for room if the queue
+// is full. Without a pool the job runs on the calling thread.
+void kdfRun(KdfJob* job) {
+    kdfRunAll(&job, 1);
+}
+
+// Queues every job before waiting, so the workers hash them in parallel
+void kdfRunAll(KdfJob** jobs, int count) {
+    pthread_mutex_lock(&kdfPool.lock);
+    if(!kdfPool.running) {
+        pthread_mutex_unlock(&kdfPool.lock);
+        for(int i = 0; i < count; i++) {
+            jobs[i]->done = NULL;
+            runKdfJob(jobs[i], NULL);
+            jobs[i]->finished = 1;
+        }
+        return;
+    }
+    for(int i = 0; i < count; i++) {
+        jobs[i]->done = NULL;
+        while(kdfPool.queued == kdfPool.capacity) {
+            pthread_cond_wait(&kdfPool.notFull, &kdfPool.lock);
+        }
+        kdfEnqueue(jobs[i]);
+    }
+    for(int i = 0; i < count; i++) {
+        while(!jobs[i]->finished) {
+            pthread_cond_wait(&kdfPool.finished, &kdfPool.lock);
+        }
+    }
+    pthread_mutex_unlock(&kdfPool.lock);
+}
+
+void kdfPoolStats(KdfStats* stats) {
+    pthread_mutex_lock(&kdfPool.lock);
+    stats->workers = kdfPool.workerCount;
+    stats->capacity = kdfPool.capacity;
+    stats->queued = kdfPool.queued;
+    stats->peakQueued = kdfPool.peakQueued;
+    stats->completed = kdfPool.completed;
+    stats->rejected = kdfPool.rejected;
+    stats->migrated = atomic_load(&kdfPool.migrated);
+    stats->p50Us = histogramPercentile(&kdfPool.latency, 50);
+    stats->p99Us = histogramPercentile(&kdfPool.latency, 99);
+    stats->maxUs = kdfPool.latency.maxSeconds * 1e6;
+    pthread_mutex_unlock(&kdfPool.lock);
+}
+
+// Derives a new scrypt hash on the worker pool; returns 0 if memory ran
+// out or the password is MAX_PASSWORD_LENGTH or longer
+int hashPassword(char* password, char* hashedPassword) {
+    KdfJob job;
+    if(strlen(password) >= sizeof(job.password)) {
+        return 0;
+    }
+    memset(&job, 0, sizeof(job));
+    job.verify = 0;
+    snprintf(job.password, sizeof(job.password), "%s", password);
+    kdfRun(&job);
+    if(!job.matched) {
+        return 0;
+    }
+    strcpy(hashedPassword, job.hash);
+    return 1;
+}
+
+void registerUser() {
+    char fullName[MAX_VOTER_NAME_LENGTH];
+    char nidNumber[NID_LENGTH];
+    char password[MAX_PASSWORD_LENGTH];
+    char hashedPassword[PASSWORD_HASH_LENGTH];
+    
+    printHeader("USER REGISTRATION");
+    
+    printf("1. Enter your Full Name: ");
+    if(!readInputLine(fullName, sizeof(fullName))) {
+        printError("Full name is too long!");
+        return;
+    }
+    
+    if(strlen(fullName) == 0) {
+        printError("Full name cannot be empty!");
+        return;
+    }
+    
+    printf("2. Enter your NID Number (10-17 digits): ");
+    fgets(nidNumber, NID_LENGTH, stdin);
+    nidNumber[strcspn(nidNumber, "\n")] = 0;
+    
+    if(!validateNID(nidNumber)) {
+        printError("Invalid NID! Must be 10-17 digits only.");
+        return;
+    }
+    
+    pthread_rwlock_rdlock(&stateLock);
+    int existing = findUserByNID(nidNumber);
+    pthread_rwlock_unlock(&stateLock);
+    if(existing != -1) {
+        printError("This NID is already registered!");
+        return;
+    }
+    
+    printf("3. Enter a Password (min 8 chars, 1 uppercase, 1 lowercase, 1 digit): ");
+    if(!readInputLine(password, sizeof(password))) {
+        printError("Password is too long! Use at most 29 characters.");
+        return;
+    }
+    
+    if(!validatePassword(password)) {
+        printError("Weak password! Must have 8+ chars, uppercase, lowercase, and digit.");
+        return;
+    }
+    
+    int race = 0;
+    if(raceCount > 1) {
+        printf("4. Choose your Constituency:");
+        race = chooseRace(0);
+        if(race == NO_RACE) {
+            return;
+        }
+    }
+    
+    if(!hashPassword(password, hashedPassword)) {
+        printError("Registration failed! Out of memory.");
+        return;
+    }
+    
+    int userIndex;
+    int result = registerVoter(fullName, nidNumber, hashedPassword, race, &userIndex);
+    if(result == REGISTER_DUPLICATE) {
+        printError("This NID is already registered!");
+        return;
+    } else if(result == REGISTER_NO_MEMORY) {
+        printError("Registration failed! Out of memory.");
+        return;
+    } else if(result == REGISTER_INVALID_RACE) {
+        printError("Invalid constituency ID!");
+        return;
+    } else if(result == REGISTER_NOT_SAVED) {
+        printError("Registration could not be confirmed on disk! Please report this to an election official.");
+        checkpointIfDue();
+        return;
     }
     
-    hashPassword(password, hashedPassword);
-    
-    strcpy(users[userCount].fullName, fullName);
-    strcpy(users[userCount].nidNumber, nidNumber);
-    strcpy(users[userCount].password, hashedPassword);
-    users[userCount].hasVoted = 0;
-    users[userCount].voteTime = 0;
-    userCount++;
-    
     printSuccess("Registration successful!");
     printf("Name: %s\n", fullName);
     printf("NID: %s\n", nidNumber);
+    if(raceCount > 1) {
+        printf("Constituency: %s\n", races[race]->name);
+    }
     printInfo("You can now login with your NID number.");
     
     logActivity("User registered");
-    saveData();
+    checkpointIfDue();
+}
+
+int loginUser() {
+    char nidNumber[NID_LENGTH];
+    char password[MAX_PASSWORD_LENGTH];
+    
+    printHeader("USER LOGIN");
+    
+    printf("1. Enter your NID Number: ");
+    fgets(nidNumber, NID_LENGTH, stdin);
+    nidNumber[strcspn(nidNumber, "\n")] = 0;
+    
+    printf("2. Enter your Password: ");
+    if(!readInputLine(password, sizeof(password))) {
+        printError("Password is too long! Passwords have at most 29 characters.");
+        logActivity("Failed login attempt");
+        return 0;
+    }
+    
+    int userIndex = authenticateVoter(nidNumber, password);
+    
+    if(userIndex != -1 && !createSession(userIndex, currentSession)) {
+        printError("Login failed! Out of memory.");
+        return 0;
+    }
+    if(userIndex != -1) {
+        currentUserIndex = userIndex;
+        printSuccess("Login successful!");
+        printf("Welcome, %s!\n", userFullName(userIndex));
+        logActivity("User logged in");
+        return 1;
+    } else {
+        printError("Invalid NID number or password!");
+        logActivity("Failed login attempt");
+        return 0;
+    }
+}
+
+int checkSession() {
+    if(sessionUser(currentSession) == -1) {
+        printError("Session timeout! Please login again.");
+        currentUserIndex = -1;
+        currentSession[0] = '\0';
+        return 0;
+    }
+    return 1;
+}
+int isElectionActive(Race* race) {
+    time_t currentTime;
+    time(&currentTime);
+    
+    if(difftime(currentTime, race->electionStartTime) < 0) {
+        return 0;
+    }
+    if(difftime(currentTime, race->electionEndTime) > 0) {
+        return -1;
+    }
+    return 1;
+}
+
+void mainMenu() {
+    int choice;
+    
+    while(1) {
+        if(!checkSession()) {
+            return;
+        }
+        
+        printHeader("MAIN MENU");
+        printf("Logged in as: %s\n", userFullName(currentUserIndex));
+        printf("========================================\n");
+        printf("1. Cast Vote\n");
+        printf("2. Show All Candidates\n");
+        printf("3. View Candidate Details\n");
+        printf("4. Search Candidate\n");
+        printf("5. Show Results\n");
+        printf("6. View Statistics\n");
+        printf("7. Logout\n");
+        printf("========================================\n");
+        printf("Enter your choice: ");
+        scanf("%d", &choice);
+        clearInputBuffer();
+        
+        switch(choice) {
+            case 1:
+                castVote();
+                break;
+            case 2:
+                showCandidates(userRace(currentUserIndex));
+                break;
+            case 3:
+                showCandidateDetails();
+                break;
+            case 4:
+                searchCandidate();
+                break;
+            case 5:
+                showResults();
+                break;
+            case 6:
+                showStatistics();
+                break;
+            case 7:
+                printSuccess("Logged out successfully!");
+                printf("Goodbye, %s!\n", userFullName(currentUserIndex));
+                logActivity("User logged out");
+                endSession(currentSession);
+                currentSession[0] = '\0';
+                currentUserIndex = -1;
+                return;
+            default:
+                printError("Invalid choice! Please try again.");
+        }
+    }
+}
+
+void adminPanel() {
+    char password[MAX_PASSWORD_LENGTH];
+    int choice;
+    
+    printHeader("ADMIN PANEL");
+    printf("Enter Admin Password: ");
+    if(!readInputLine(password, sizeof(password)) || strcmp(password, ADMIN_PASSWORD) != 0) {
+        printError("Invalid admin password!");
+        logActivity("Failed admin login attempt");
+        return;
+    }
+    
+    printSuccess("Admin access granted!");
+    logActivity("Admin logged in");
+    
+    while(1) {
+        printHeader("ADMIN PANEL");
+        printf("1. View All Statistics\n");
+        printf("2. Export Results\n");
+        printf("3. Reset Election\n");
+        printf("4. Add Candidate\n");
+        printf("5. Remove Candidate\n");
+        printf("6. Create Backup\n");
+        printf("7. Set Election Period\n");
+        printf("8. Add Constituency\n");
+        printf("9. Show Metrics\n");
+        printf("10. Recount Votes\n");
+        printf("11. Turnout Analytics\n");
+        printf("12. Exit Admin Panel\n");
+        printf("========================================\n");
+        printf("Enter your choice: ");
+        scanf("%d", &choice);
+        clearInputBuffer();
+        
+        switch(choice) {
+            case 1:
+                showStatistics();
+                break;
+            case 2:
+                exportResults();
+                break;
+            case 3:
+                resetElection();
+                break;
+            case 4:
+                addCandidate();
+                break;
+            case 5:
+                removeCandidate();
+                break;
+            case 6:
+                createBackup();
+                break;
+            case 7:
+                setElectionPeriod();
+                break;
+            case 8:
+                addConstituency();
+                break;
+            case 9:
+                showMetrics();
+                break;
+            case 10:
+                recountVotes();
+                break;
+            case 11:
+                showTurnout();
+                break;
+            case 12:
+                printInfo("Exiting admin panel...");
+                return;
+            default:
+                printError("Invalid choice!");
+        }
+    }
+}
+
+void castVote() {
+    if(!checkSession()) return;
+    
+    Race *race = races[userRace(currentUserIndex)];
+    int status = isElectionActive(race);
+    if(status == 0) {
+        printError("Election has not started yet!");
+        return;
+    } else if(status == -1) {
+        printError("Election has ended!");
+        return;
+    }
+    
+    if(userHasVoted(currentUserIndex)) {
+        printError("You have already cast your vote!");
+        printf("[!] One person can only vote once.\n");
+        
+        char timeStr[100];
+        time_t voteTime = userVoteTime(currentUserIndex);
+        struct tm *timeInfo = localtime(&voteTime);
+        strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", timeInfo);
+        printf("[INFO] You voted on: %s\n", timeStr);
+        return;
+    }
+    
+    printHeader("CAST YOUR VOTE");
+    showCandidates(userRace(currentUserIndex));
+    
+    int candidateId;
+    printf("\nEnter the ID of the candidate you want to vote for: ");
+    scanf("%d", &candidateId);
+    clearInputBuffer();
+    
+    if(candidateId < 1 || candidateId > race->candidateCount) {
+        printError("Invalid candidate ID!");
+        return;
+    }
+    
+    printf("\n[!] CONFIRMATION REQUIRED\n");
+    printf("You are about to vote for:\n");
+    printf("=> %s (%s)\n", race->candidates[candidateId-1].name, race->candidates[candidateId-1].party);
+    printf("\nAre you sure? (Y/N): ");
+    
+    char confirm;
+    scanf(" %c", &confirm);
+    clearInputBuffer();
+    
+    if(confirm != 'Y' && confirm != 'y') {
+        printInfo("Vote cancelled.");
+        return;
+    }
+    
+    time_t voteTime;
+    time(&voteTime);
+    int result = castVoteFor(currentUserIndex, candidateId, voteTime);
+    if(result == VOTE_ALREADY_CAST) {
+        printError("You have already cast your vote!");
+        return;
+    } else if(result == VOTE_INVALID_CANDIDATE) {
+        printError("Invalid candidate ID!");
+        return;
+    } else if(result == VOTE_NOT_SAVED) {
+        printError("Your vote could not be confirmed on disk! Please report this to an election official.");
+        checkpointIfDue();
+        return;
+    } else if(result != VOTE_OK) {
+        printError("Election is not active!");
+        return;
+    }
+    
+    printSuccess("Vote cast successfully!");
+    printf("\n========================================\n");
+    printf("        VOTING RECEIPT\n");
+    printf("========================================\n");
+    printf(" Voter: %s\n", userFullName(currentUserIndex));
+    printf(" Candidate: %s\n", race->candidates[candidateId-1].name);
+    printf(" Party: %s\n", race->candidates[candidateId-1].party);
+    
+    char timeStr[100];
+    voteTime = userVoteTime(currentUserIndex);
+    struct tm *timeInfo = localtime(&voteTime);
+    strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", timeInfo);
+    printf(" Time: %s\n", timeStr);
+    printf("========================================\n");
+    
+    printf("\nThank you for voting, %s!\n", userFullName(currentUserIndex));
+    
+    logActivity("Vote cast");
+    checkpointIfDue();
+}
+
+void showCandidates(int race) {
+    printHeader("LIST OF CANDIDATES");
+    if(raceCount > 1) {
+        printf("Constituency: %s\n", races[race]->name);
+    }
+    printf("%-4s %-25s %-25s\n", "ID", "Name", "Party");
+    printf("========================================\n");
+    
+    for(int i = 0; i < races[race]->candidateCount; i++) {
+        printf("%-4d %-25s %-25s\n", 
+               races[race]->candidates[i].id,
+               races[race]->candidates[i].name, 
+               races[race]->candidates[i].party);
+    }
+}
+
+void showCandidateDetails() {
+    Race *race = races[userRace(currentUserIndex)];
+    int id;
+    printf("\nEnter Candidate ID to view details: ");
+    scanf("%d", &id);
+    clearInputBuffer();
+    
+    if(id < 1 || id > race->candidateCount) {
+        printError("Invalid candidate ID!");
+        return;
+    }
+    
+    Candidate c = race->candidates[id-1];
+    
+    printf("\n========================================\n");
+    printf("        CANDIDATE PROFILE\n");
+    printf("========================================\n");
+    printf(" Name:      %s\n", c.name);
+    printf(" Party:     %s\n", c.party);
+    printf(" Age:       %d\n", c.age);
+    printf(" Education: %s\n", c.education);
+    printf(" Manifesto: %s\n", c.manifesto);
+    printf("========================================\n");
+}
+
+void searchCandidate() {
+    char searchTerm[MAX_NAME_LENGTH];
+    SearchHit hits[SEARCH_MAX_RESULTS];
+    
+    printf("\nEnter candidate name, party or keywords to search: ");
+    fgets(searchTerm, MAX_NAME_LENGTH, stdin);
+    searchTerm[strcspn(searchTerm, "\n")] = 0;
+    
+    printHeader("SEARCH RESULTS");
+    
+    pthread_rwlock_rdlock(&stateLock);
+    int found = searchCandidates(searchTerm, hits, SEARCH_MAX_RESULTS);
+    int shown = found < SEARCH_MAX_RESULTS ? found : SEARCH_MAX_RESULTS;
+    for(int i = 0; i < shown; i++) {
+        Candidate *c = &races[hits[i].race]->candidates[hits[i].index];
+        if(raceCount > 1) {
+            printf("[+] [%d] %s - %s (%s)\n", c->id, c->name, c->party, races[hits[i].race]->name);
+        } else {
+            printf("[+] [%d] %s - %s\n", c->id, c->name, c->party);
+        }
+    }
+    pthread_rwlock_unlock(&stateLock);
+    
+    if(found == 0) {
+        printError("No candidates found matching your search.");
+    } else if(found > shown) {
+        printf("[INFO] Showing the best %d of %d matches.\n", shown, found);
+    }
+}
+
+char* raceStatusText(Race* race) {
+    int status = isElectionActive(race);
+    return status == 1 ? "ACTIVE" : status == 0 ? "NOT STARTED" : "ENDED";
+}
+
+int totalCandidateCount() {
+    int total = 0;
+    for(int r = 0; r < raceCount; r++) {
+        total += races[r]->candidateCount;
+    }
+    return total;
+}
+
+// Work for one summary thread: a run of voter chunks to count and a run
+// of constituencies to rank
+typedef struct {
+    int firstChunk;
+    int lastChunk;
+    int firstRace;
+    int lastRace;
+    int *registered;        // per constituency, private to this thread
+    int *voted;
+    RaceSummary *summaries;
+    pthread_t thread;
+    int threaded;
+} SummaryWorker;
+
+static int bitCount(unsigned long long bits) {
+#ifdef __GNUC__
+    return __builtin_popcountll(bits);
+#else
+    int count = 0;
+    while(bits != 0) {
+        bits &= bits - 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+static int lowestBit(unsigned long long bits) {
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    int bit = 0;
+    while(!((bits >> bit) & 1)) {
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+static void* summaryThread(void* arg) {
+    SummaryWorker *worker = arg;
+    
+    for(int c = worker->firstChunk; c < worker->lastChunk; c++) {
+        VoterColumns *columns = voterColumns[c];
+        int used = userCount - c * USER_CHUNK_SIZE;
+        if(used > USER_CHUNK_SIZE) {
+            used = USER_CHUNK_SIZE;
+        }
+        int words = (used + 63) / 64;
+        if(raceCount == 1) {
+            worker->registered[0] += used;
+            for(int w = 0; w < words; w++) {
+                worker->voted[0] += bitCount(atomic_load_explicit(&columns->voted[w], memory_order_relaxed));
+            }
+            continue;
+        }
+        for(int i = 0; i < used; i++) {
+            worker->registered[columns->races[i]]++;
+        }
+        // Only the voters who voted are visited
+        for(int w = 0; w < words; w++) {
+            unsigned long long bits = atomic_load_explicit(&columns->voted[w], memory_order_relaxed);
+            while(bits != 0) {
+                worker->voted[columns->races[w * 64 + lowestBit(bits)]]++;
+                bits &= bits - 1;
+            }
+        }
+    }
+    
+    for(int r = worker->firstRace; r < worker->lastRace; r++) {
+        RaceSummary *summary = &worker->summaries[r];
+        summary->count = leaderboardTop(races[r], MAX_CANDIDATES, summary->order,
+                                        summary->votes, &summary->totalVotes);
+        summary->leaders = summary->count > 0 && summary->votes[0] > 0 ?
+                           countLeaders(summary->votes, summary->count) : 0;
+    }
+    return NULL;
+}
+
+// Fills one summary per constituency. The voter roll and the list of
+// constituencies are split across all cores; each thread counts into its
+// own arrays, which are added up at the end. The caller holds stateLock.
+// Returns 0 if memory runs out.
+int summarizeRaces(RaceSummary* summaries) {
+    int chunks = (userCount + USER_CHUNK_SIZE - 1) / USER_CHUNK_SIZE;
+    int threads = cpuCount();
+    if(threads > chunks) {
+        threads = chunks > 0 ? chunks : 1;
+    }
+    
+    SummaryWorker *workers = calloc(threads, sizeof(SummaryWorker));
+    int *counts = calloc((size_t)threads * raceCount * 2, sizeof(int));
+    if(workers == NULL || counts == NULL) {
+        free(workers);
+        free(counts);
+        return 0;
+    }
+    memset(summaries, 0, sizeof(RaceSummary) * raceCount);
+    
+    for(int t = 0; t < threads; t++) {
+        workers[t].firstChunk = (int)((long long)chunks * t / threads);
+        workers[t].lastChunk = (int)((long long)chunks * (t + 1) / threads);
+        workers[t].firstRace = raceCount * t / threads;
+        workers[t].lastRace = raceCount * (t + 1) / threads;
+        workers[t].registered = counts + (size_t)t * raceCount * 2;
+        workers[t].voted = workers[t].registered + raceCount;
+        workers[t].summaries = summaries;
+    }
+    for(int t = 1; t < threads; t++) {
+        workers[t].threaded = pthread_create(&workers[t].thread, NULL, summaryThread, &workers[t]) == 0;
+        if(!workers[t].threaded) {
+            summaryThread(&workers[t]);
+        }
+    }
+    summaryThread(&workers[0]);
+    
+    for(int t = 0; t < threads; t++) {
+        if(workers[t].threaded) {
+            pthread_join(workers[t].thread, NULL);
+        }
+        for(int r = 0; r < raceCount; r++) {
+            summaries[r].registered += workers[t].registered[r];
+            summaries[r].voted += workers[t].voted[r];
+        }
+    }
+    
+    free(workers);
+    free(counts);
+    return 1;
+}
+
+// Short text naming who leads a constituency
+static void describeLead(Race* race, RaceSummary* summary, char* out, size_t size) {
+    if(summary->leaders == 1) {
+        Candidate *leader = &race->candidates[summary->order[0]];
+        snprintf(out, size, "%s (%s)", leader->name, leader->party);
+    } else if(summary->leaders > 1) {
+        snprintf(out, size, "TIE (%d candidates)", summary->leaders);
+    } else {
+        snprintf(out, size, "-");
+    }
+}
+
+typedef struct {
+    char *party;
+    int votes;
+    int leading;
+} PartyTotal;
+
+static int comparePartyTotals(const void* a, const void* b) {
+    const PartyTotal *left = a, *right = b;
+    if(left->votes != right->votes) {
+        return right->votes - left->votes;
+    }
+    return right->leading - left->leading;
+}
+
+// Totals across constituencies: votes per party and the number of
+// constituencies each party leads outright
+static void writePartyTotals(OutputBuffer* out, RaceSummary* summaries) {
+    PartyTotal *parties = calloc((size_t)raceCount * MAX_CANDIDATES, sizeof(PartyTotal));
+    if(parties == NULL) {
+        return;
+    }
+    
+    int partyCount = 0;
+    for(int r = 0; r < raceCount; r++) {
+        for(int k = 0; k < summaries[r].count; k++) {
+            char *party = races[r]->candidates[summaries[r].order[k]].party;
+            int p = 0;
+            while(p < partyCount && strcmp(parties[p].party, party) != 0) {
+                p++;
+            }
+            if(p == partyCount) {
+                parties[partyCount++].party = party;
+            }
+            parties[p].votes += summaries[r].votes[k];
+            if(k == 0 && summaries[r].leaders == 1) {
+                parties[p].leading++;
+            }
+        }
+    }
+    qsort(parties, partyCount, sizeof(PartyTotal), comparePartyTotals);
+    
+    outputPrintf(out, "\n%-25s %-10s %-10s\n", "Party", "Votes", "Leading In");
+    outputPrintf(out, "---------------------------------------------------\n");
+    for(int p = 0; p < partyCount; p++) {
+        outputPrintf(out, "%-25s %-10d %d\n", parties[p].party, parties[p].votes, parties[p].leading);
+    }
+    free(parties);
+}
+
+static void writeRaceWinner(OutputBuffer* out, Race* race, RaceSummary* summary) {
+    int *indices = summary->order;
+    if(summary->leaders == 1) {
+        outputPrintf(out, "\nWINNER: %s (%s) with %d votes\n", 
+                     race->candidates[indices[0]].name,
+                     race->candidates[indices[0]].party,
+                     summary->votes[0]);
+    } else if(summary->leaders > 1) {
+        outputPrintf(out, "\nTIE: %d candidates with %d votes each\n", summary->leaders, summary->votes[0]);
+        for(int r = 0; r < summary->leaders; r++) {
+            outputPrintf(out, "   %s (%s)\n", race->candidates[indices[r]].name, race->candidates[indices[r]].party);
+        }
+    }
+}
+
+void showResults() {
+    if(!checkSession()) return;
+    
+    pthread_rwlock_rdlock(&stateLock);
+    RaceSummary *summaries = calloc(raceCount, sizeof(RaceSummary));
+    if(summaries == NULL || !summarizeRaces(summaries)) {
+        pthread_rwlock_unlock(&stateLock);
+        free(summaries);
+        printError("Could not allocate memory for the results!");
+        return;
+    }
+    
+    Race *race = races[userRace(currentUserIndex)];
+    RaceSummary *summary = &summaries[race->id - 1];
+    int *indices = summary->order, *votes = summary->votes;
+    
+    printHeader("ELECTION RESULTS");
+    if(raceCount > 1) {
+        printf("Constituency: %s\n", race->name);
+    }
+    printf("%-25s %-25s %-10s %-12s\n", "Candidate", "Party", "Votes", "Percentage");
+    printf("========================================================================\n");
+    
+    for(int r = 0; r < summary->count; r++) {
+        float percentage = (summary->totalVotes > 0) ? (votes[r] * 100.0 / summary->totalVotes) : 0;
+        printf("%-25s %-25s %-10d %.2f%%\n", 
+               race->candidates[indices[r]].name, 
+               race->candidates[indices[r]].party,
+               votes[r],
+               percentage);
+    }
+    
+    printf("========================================================================\n");
+    printf("Total Votes Cast: %d\n", summary->totalVotes);
+    
+    if(summary->leaders == 1) {
+        printf("\n[CURRENT LEADER]\n");
+        printf("   %s (%s) with %d votes\n",
+               race->candidates[indices[0]].name,
+               race->candidates[indices[0]].party,
+               votes[0]);
+    } else if(summary->leaders > 1) {
+        printf("\n[TIED FOR THE LEAD] %d candidates with %d votes each\n", summary->leaders, votes[0]);
+        for(int r = 0; r < summary->leaders; r++) {
+            printf("   %s (%s)\n", race->candidates[indices[r]].name, race->candidates[indices[r]].party);
+        }
+    } else {
+        printInfo("No votes cast yet.");
+    }
+    
+    if(raceCount > 1) {
+        printHeader("ALL CONSTITUENCIES");
+        printf("%-25s %-10s %-35s\n", "Constituency", "Votes", "Leading");
+        printf("========================================================================\n");
+        for(int r = 0; r < raceCount; r++) {
+            char lead[120];
+            describeLead(races[r], &summaries[r], lead, sizeof(lead));
+            printf("%-25s %-10d %-35s\n", races[r]->name, summaries[r].totalVotes, lead);
+        }
+        OutputBuffer out = { NULL, 0, 0 };
+        writePartyTotals(&out, summaries);
+        if(out.data != NULL) {
+            fwrite(out.data, 1, out.length, stdout);
+        }
+        free(out.data);
+    }
+    pthread_rwlock_unlock(&stateLock);
+    free(summaries);
+}
+
+void showStatistics() {
+    int totalVotes = 0;
+    int votedUsers = 0;
+    
+    pthread_rwlock_rdlock(&stateLock);
+    RaceSummary *summaries = calloc(raceCount, sizeof(RaceSummary));
+    if(summaries == NULL || !summarizeRaces(summaries)) {
+        pthread_rwlock_unlock(&stateLock);
+        free(summaries);
+        printError("Could not allocate memory for the statistics!");
+        return;
+    }
+    
+    for(int r = 0; r < raceCount; r++) {
+        totalVotes += summaries[r].totalVotes;
+        votedUsers += summaries[r].voted;
+    }
+    
+    int registeredUsers = userCount;
+    int totalCandidates = totalCandidateCount();
+    
+    float turnout = (registeredUsers > 0) ? (votedUsers * 100.0 / registeredUsers) : 0;
+    
+    printHeader("ELECTION STATISTICS");
+    printf("Total Registered Users:  %d\n", registeredUsers);
+    printf("Users Who Voted:         %d\n", votedUsers);
+    printf("Users Who Haven't Voted: %d\n", registeredUsers - votedUsers);
+    printf("Voter Turnout:           %.2f%%\n", turnout);
+    printf("Total Votes Cast:        %d\n", totalVotes);
+    printf("Total Candidates:        %d\n", totalCandidates);
+    
+    if(raceCount == 1) {
+        char startStr[100], endStr[100];
+        struct tm *timeInfo;
+        
+        timeInfo = localtime(&races[0]->electionStartTime);
+        strftime(startStr, sizeof(startStr), "%Y-%m-%d %H:%M", timeInfo);
+        
+        timeInfo = localtime(&races[0]->electionEndTime);
+        strftime(endStr, sizeof(endStr), "%Y-%m-%d %H:%M", timeInfo);
+        
+        printf("\nElection Period:\n");
+        printf("   Start: %s\n", startStr);
+        printf("   End:   %s\n", endStr);
+        printf("   Status: %s\n", raceStatusText(races[0]));
+    } else {
+        printf("Constituencies:          %d\n", raceCount);
+        printf("\n%-25s %-11s %-10s %-10s %-12s\n", "Constituency", "Registered", "Voted", "Turnout", "Status");
+        printf("========================================================================\n");
+        for(int r = 0; r < raceCount; r++) {
+            char raceTurnout[20];
+            snprintf(raceTurnout, sizeof(raceTurnout), "%.2f%%", summaries[r].registered > 0 ?
+                     summaries[r].voted * 100.0 / summaries[r].registered : 0.0);
+            printf("%-25s %-11d %-10d %-10s %-12s\n", races[r]->name, summaries[r].registered,
+                   summaries[r].voted, raceTurnout, raceStatusText(races[r]));
+        }
+    }
+    pthread_rwlock_unlock(&stateLock);
+    free(summaries);
+}
+
+void showMetrics() {
+    OutputBuffer out = { NULL, 0, 0 };
+    printHeader("METRICS");
+    writeMetrics(&out);
+    if(out.data != NULL) {
+        fwrite(out.data, 1, out.length, stdout);
+    }
+    free(out.data);
+    printf("\n");
+    printInfo("The same is written to " METRICS_FILE " every few seconds.");
+}
+
+// One recount thread's share of the roll and what it found there
+typedef struct {
+    int firstChunk;
+    int lastChunk;
+    int *ballots;               // per constituency and candidate slot
+    int *voted;                 // voters marked voted, per constituency
+    int *withdrawn;             // ballots for removed candidates, per constituency
+    long long noBallot;         // marked voted, but no ballot on record
+    long long strayBallots;     // a ballot on record, but not marked voted
+    long long badBallots;       // a ballot for a candidate id that does not exist
+    pthread_t thread;
+    int threaded;
+} RecountWorker;
+
+static void* recountThread(void* arg) {
+    RecountWorker *worker = arg;
+    for(int c = worker->firstChunk; c < worker->lastChunk; c++) {
+        VoterColumns *columns = voterColumns[c];
+        int used = userCount - c * USER_CHUNK_SIZE;
+        if(used > USER_CHUNK_SIZE) {
+            used = USER_CHUNK_SIZE;
+        }
+        unsigned long long voted = 0;
+        for(int i = 0; i < used; i++) {
+            if((i & 63) == 0) {
+                voted = atomic_load_explicit(&columns->voted[i >> 6], memory_order_relaxed);
+            }
+            int race = columns->races[i];
+            int ballot = columns->ballots[i];
+            if((voted >> (i & 63)) & 1) {
+                worker->voted[race]++;
+                if(ballot == 0) {
+                    worker->noBallot++;
+                    continue;
+                }
+            } else if(ballot != 0) {
+                worker->strayBallots++;
+                continue;
+            }
+            if(ballot == BALLOT_WITHDRAWN) {
+                worker->withdrawn[race]++;
+            } else if(ballot > 0 && ballot <= races[race]->candidateCount) {
+                worker->ballots[race * MAX_CANDIDATES + ballot - 1]++;
+            } else if(ballot != 0) {
+                worker->badBallots++;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Tallies every constituency again from the voters' ballot records, on
+// all cores, and compares the result with the candidates' vote counts
+// and with the number of voters marked as voted. Returns 1 if all agree.
+int recountVotes() {
+    int threads = cpuCount();
+    RecountWorker *workers = calloc(threads, sizeof(RecountWorker));
+    if(workers == NULL) {
+        printError("Not enough memory for a recount!");
+        return 0;
+    }
+    
+    // Exclusive, so no vote is half-recorded while the roll is read
+    pthread_rwlock_wrlock(&stateLock);
+    double start = currentSeconds();
+    int ok = 1;
+    int chunks = (userCount + USER_CHUNK_SIZE - 1) / USER_CHUNK_SIZE;
+    for(int t = 0; t < threads; t++) {
+        workers[t].firstChunk = (int)((long long)chunks * t / threads);
+        workers[t].lastChunk = (int)((long long)chunks * (t + 1) / threads);
+        workers[t].ballots = calloc((size_t)raceCount * MAX_CANDIDATES, sizeof(int));
+        workers[t].voted = calloc(raceCount, sizeof(int));
+        workers[t].withdrawn = calloc(raceCount, sizeof(int));
+        ok = ok && workers[t].ballots != NULL && workers[t].voted != NULL && workers[t].withdrawn != NULL;
+    }
+    if(ok) {
+        for(int t = 1; t < threads; t++) {
+            workers[t].threaded = pthread_create(&workers[t].thread, NULL, recountThread, &workers[t]) == 0;
+            if(!workers[t].threaded) {
+                recountThread(&workers[t]);
+            }
+        }
+        recountThread(&workers[0]);
+        for(int t = 1; t < threads; t++) {
+            if(workers[t].threaded) {
+                pthread_join(workers[t].thread, NULL);
+            }
+        }
+        // Sums land in the first worker
+        for(int t = 1; t < threads; t++) {
+            for(int k = 0; k < raceCount * MAX_CANDIDATES; k++) {
+                workers[0].ballots[k] += workers[t].ballots[k];
+            }
+            for(int r = 0; r < raceCount; r++) {
+                workers[0].voted[r] += workers[t].voted[r];
+                workers[0].withdrawn[r] += workers[t].withdrawn[r];
+            }
+            workers[0].noBallot += workers[t].noBallot;
+            workers[0].strayBallots += workers[t].strayBallots;
+            workers[0].badBallots += workers[t].badBallots;
+        }
+    }
+    double elapsed = currentSeconds() - start;
+    
+    int discrepancies = 0;
+    long long ballots = 0;
+    if(ok) {
+        RecountWorker *total = &workers[0];
+        printHeader("RECOUNT");
+        printf("%-25s %-20s %-10s %-10s\n", "Constituency", "Candidate", "Tally", "Recount");
+        for(int r = 0; r < raceCount; r++) {
+            long long tallied = 0;
+            for(int c = 0; c < races[r]->candidateCount; c++) {
+                int recounted = total->ballots[r * MAX_CANDIDATES + c];
+                int votes = candidateVotes(races[r], c);
+                ballots += recounted;
+                tallied += votes;
+                if(recounted != votes && discrepancies++ < RECOUNT_MAX_LINES) {
+                    printf("%-25s %-20s %-10d %-10d\n", races[r]->name, races[r]->candidates[c].name,
+                           votes, recounted);
+                }
+            }
+            if(total->voted[r] != tallied + total->withdrawn[r] && discrepancies++ < RECOUNT_MAX_LINES) {
+                printf("%-25s %-20s %-10lld %-10d\n", races[r]->name, "(marked voted)",
+                       tallied + total->withdrawn[r], total->voted[r]);
+            }
+        }
+        if(discrepancies > RECOUNT_MAX_LINES) {
+            printf("... and %d more\n", discrepancies - RECOUNT_MAX_LINES);
+        }
+        printf("\nBallots recounted: %lld in %d constituency(ies), %.2fs\n", ballots, raceCount, elapsed);
+        printf("Voted without a ballot on record: %lld\n", total->noBallot);
+        printf("Ballot on record but not marked voted: %lld\n", total->strayBallots);
+        printf("Ballot for a candidate that does not exist: %lld\n", total->badBallots);
+        discrepancies += total->noBallot > 0 ? 1 : 0;
+        discrepancies += total->strayBallots > 0 ? 1 : 0;
+        discrepancies += total->badBallots > 0 ? 1 : 0;
+    }
+    pthread_rwlock_unlock(&stateLock);
+    
+    for(int t = 0; t < threads; t++) {
+        free(workers[t].ballots);
+        free(workers[t].voted);
+        free(workers[t].withdrawn);
+    }
+    free(workers);
+    
+    if(!ok) {
+        printError("Not enough memory for a recount!");
+        return 0;
+    }
+    char message[120];
+    if(discrepancies == 0) {
+        printSuccess("The recount matches the tallies.");
+        snprintf(message, sizeof(message), "Recount matched: %lld ballot(s)", ballots);
+    } else {
+        printError("The recount does not match the tallies!");
+        snprintf(message, sizeof(message), "Recount found %d discrepancy(ies)", discrepancies);
+    }
+    logActivity(message);
+    return discrepancies == 0;
+}
+
+// Folds one turnout table into buckets of width minutes. Reads only the
+// turnout tables, never the roll. The caller holds stateLock.
+// Returns 0 if memory runs out.
+int turnoutSeries(int race, int width, TurnoutSeries* series) {
+    int table = race == ALL_RACES ? TURNOUT_ALL : race;
+    memset(series, 0, sizeof(TurnoutSeries));
+    series->untimed = atomic_load(&turnout.untimed[table]);
+    series->registered = race == ALL_RACES ? userCount : atomic_load(&turnout.registered[race]);
+    TurnoutTable *current = atomic_load_explicit(&turnout.tables[table], memory_order_acquire);
+    
+    for(int d = 0; current != NULL && d < current->dayCount; d++) {
+        TurnoutDay *day = atomic_load_explicit(&current->days[d], memory_order_acquire);
+        for(int m = 0; day != NULL && m < TURNOUT_DAY_MINUTES; m++) {
+            int counts[TURNOUT_SLOTS];
+            int total = 0;
+            for(int s = 0; s < TURNOUT_SLOTS; s++) {
+                counts[s] = atomic_load_explicit(&day->counts[m][s], memory_order_relaxed);
+                total += counts[s];
+            }
+            if(total == 0) {
+                continue;
+            }
+            long long minute = (current->firstDay + d) * TURNOUT_DAY_MINUTES + m;
+            if(total > series->peakMinute) {
+                series->peakMinute = total;
+                series->peakMinuteStart = minute;
+            }
+            series->total += total;
+            
+            long long start = minute - minute % width;
+            if(series->count == 0 || series->buckets[series->count - 1].start != start) {
+                if(series->count == series->capacity) {
+                    int capacity = series->capacity > 0 ? series->capacity * 2 : 256;
+                    TurnoutBucket *grown = realloc(series->buckets, sizeof(TurnoutBucket) * capacity);
+                    if(grown == NULL) {
+                        free(series->buckets);
+                        series->buckets = NULL;
+                        return 0;
+                    }
+                    series->buckets = grown;
+                    series->capacity = capacity;
+                }
+                memset(&series->buckets[series->count], 0, sizeof(TurnoutBucket));
+                series->buckets[series->count++].start = start;
+            }
+            TurnoutBucket *bucket = &series->buckets[series->count - 1];
+            bucket->total += total;
+            for(int s = 0; s < TURNOUT_SLOTS; s++) {
+                bucket->counts[s] += counts[s];
+            }
+            if(bucket->total > series->buckets[series->peakBucket].total) {
+                series->peakBucket = series->count - 1;
+            }
+        }
+    }
+    return 1;
+}
+
+static void formatMinute(long long minute, char* text, size_t size) {
+    time_t at = (time_t)(minute * 60);
+    struct tm *timeInfo = localtime(&at);
+    strftime(text, size, "%Y-%m-%d %H:%M", timeInfo);
+}
+
+static void writeCsvText(FILE* fp, char* text) {
+    fputc('"', fp);
+    for(; *text != '\0'; text++) {
+        if(*text == '"') {
+            fputc('"', fp);
+        }
+        fputc(*text, fp);
+    }
+    fputc('"', fp);
+}
+
+// Writes every bucket of a turnout query as CSV, with a column per
+// candidate when one constituency is chosen
+int writeTurnoutCsv(char* path, int race, int width) {
+    char tempPath[260];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    FILE *fp = fopen(tempPath, "w");
+    if(fp == NULL) {
+        return 0;
+    }
+    
+    pthread_rwlock_rdlock(&stateLock);
+    TurnoutSeries series;
+    int ok = turnoutSeries(race, width, &series);
+    int candidates = race == ALL_RACES ? 0 : races[race]->candidateCount;
+    if(ok) {
+        fprintf(fp, "start_epoch,start_local,votes,cumulative,turnout_percent");
+        for(int c = 0; c < candidates; c++) {
+            fputc(',', fp);
+            writeCsvText(fp, races[race]->candidates[c].name);
+        }
+        fprintf(fp, candidates > 0 ? ",other\n" : "\n");
+        
+        int cumulative = 0;
+        char timeStr[40];
+        for(int i = 0; i < series.count; i++) {
+            TurnoutBucket *bucket = &series.buckets[i];
+            cumulative += bucket->total;
+            formatMinute(bucket->start, timeStr, sizeof(timeStr));
+            fprintf(fp, "%lld,%s,%d,%d,%.2f", bucket->start * 60, timeStr, bucket->total, cumulative,
+                    series.registered > 0 ? 100.0 * cumulative / series.registered : 0.0);
+            for(int c = 0; c < candidates; c++) {
+                fprintf(fp, ",%d", bucket->counts[c]);
+            }
+            if(candidates > 0) {
+                fprintf(fp, ",%d", bucket->counts[MAX_CANDIDATES]);
+            }
+            fputc('\n', fp);
+        }
+    }
+    pthread_rwlock_unlock(&stateLock);
+    free(series.buckets);
+    
+    ok = (fclose(fp) == 0) && ok;
+    if(!ok) {
+        remove(tempPath);
+        return 0;
+    }
+#ifdef _WIN32
+    remove(path);
+#endif
+    return rename(tempPath, path) == 0;
+}
+
+// Votes per minute or hour for one constituency or all of them, from the
+// turnout tables, with an optional CSV export
+void showTurnout() {
+    int race = chooseRace(1);
+    if(race == NO_RACE) {
+        return;
+    }
+    int choice;
+    printf("\n1. Votes per minute\n");
+    printf("2. Votes per hour\n");
+    printf("Enter your choice: ");
+    if(scanf("%d", &choice) != 1) {
+        choice = 0;
+    }
+    clearInputBuffer();
+    if(choice != 1 && choice != 2) {
+        printError("Invalid choice!");
+        return;
+    }
+    int width = choice == 1 ? 1 : 60;
+    
+    pthread_rwlock_rdlock(&stateLock);
+    TurnoutSeries series;
+    if(!turnoutSeries(race, width, &series)) {
+        pthread_rwlock_unlock(&stateLock);
+        printError("Not enough memory for the turnout view!");
+        return;
+    }
+    Race *target = race == ALL_RACES ? NULL : races[race];
+    int candidates = target != NULL ? target->candidateCount : 0;
+    
+    printHeader("TURNOUT");
+    printf("Constituency: %s\n", target != NULL ? target->name : "All");
+    if(series.count == 0) {
+        printInfo("No votes with a recorded time yet.");
+    } else {
+        // The most recent buckets; the export has all of them
+        int first = series.count > TURNOUT_VIEW_ROWS ? series.count - TURNOUT_VIEW_ROWS : 0;
+        int cumulative = 0;
+        for(int i = 0; i < first; i++) {
+            cumulative += series.buckets[i].total;
+        }
+        printf("\n%-17s %7s %10s %8s", "Time", "Votes", "Cumulative", "Turnout");
+        char label[12];
+        for(int c = 0; c < candidates; c++) {
+            snprintf(label, sizeof(label), "C%d", c + 1);
+            printf(" %6s", label);
+        }
+        printf(candidates > 0 ? " %6s\n" : "%s\n", candidates > 0 ? "Other" : "");
+        
+        char timeStr[40];
+        for(int i = first; i < series.count; i++) {
+            TurnoutBucket *bucket = &series.buckets[i];
+            cumulative += bucket->total;
+            formatMinute(bucket->start, timeStr, sizeof(timeStr));
+            printf("%-17s %7d %10d %7.2f%%", timeStr, bucket->total, cumulative,
+                   series.registered > 0 ? 100.0 * cumulative / series.registered : 0.0);
+            for(int c = 0; c < candidates; c++) {
+                printf(" %6d", bucket->counts[c]);
+            }
+            if(candidates > 0) {
+                printf(" %6d", bucket->counts[MAX_CANDIDATES]);
+            }
+            printf("\n");
+        }
+        if(first > 0) {
+            printf("(%d earlier %s with votes not shown)\n", first, width == 1 ? "minutes" : "hours");
+        }
+        for(int c = 0; c < candidates; c++) {
+            printf("C%d = %s (%s)\n", c + 1, target->candidates[c].name, target->candidates[c].party);
+        }
+        
+        formatMinute(series.peakMinuteStart, timeStr, sizeof(timeStr));
+        printf("\nPeak rate: %d vote(s) in the minute from %s\n", series.peakMinute, timeStr);
+        if(width > 1) {
+            formatMinute(series.buckets[series.peakBucket].start, timeStr, sizeof(timeStr));
+            printf("Busiest hour: %d vote(s) from %s\n", series.buckets[series.peakBucket].total, timeStr);
+        }
+        printf("Votes with a time: %d of %d registered voter(s)\n", series.total, series.registered);
+    }
+    if(series.untimed > 0) {
+        printf("Votes without a usable time: %d\n", series.untimed);
+    }
+    pthread_rwlock_unlock(&stateLock);
+    free(series.buckets);
+    
+    char answer[10];
+    printf("\nExport to " TURNOUT_FILE "? (y/n): ");
+    if(fgets(answer, sizeof(answer), stdin) == NULL || (answer[0] != 'y' && answer[0] != 'Y')) {
+        return;
+    }
+    if(!writeTurnoutCsv(TURNOUT_FILE, race, width)) {
+        printError("Failed to export turnout!");
+        return;
+    }
+    printSuccess("Turnout exported to '" TURNOUT_FILE "'");
+    logActivity("Turnout exported");
+}
+
+void exportResults() {
+    int choice;
+    printf("\nExport format:\n");
+    printf("1. Text (election_results.txt)\n");
+    printf("2. Compressed archive (election_results.arc)\n");
+    printf("Enter your choice: ");
+    if(scanf("%d", &choice) != 1) {
+        choice = 0;
+    }
+    clearInputBuffer();
+    if(choice != 1 && choice != 2) {
+        printError("Invalid choice!");
+        return;
+    }
+    
+    char *path = choice == 1 ? "election_results.txt" : "election_results.arc";
+    if(!writeResultsFile(path)) {
+        printError("Failed to export results!");
+        return;
+    }
+    char message[100];
+    snprintf(message, sizeof(message), "Results exported to '%s'", path);
+    printSuccess(message);
+    logActivity("Results exported");
+}
+
+// Writes the results report. A path ending in ".arc" gets a compressed
+// archive keyed by constituency instead of plain text.
+int writeResultsFile(char* path) {
+    pthread_rwlock_rdlock(&stateLock);
+    RaceSummary *summaries = calloc(raceCount, sizeof(RaceSummary));
+    size_t *ends = calloc(raceCount + 2, sizeof(size_t));
+    if(summaries == NULL || ends == NULL || !summarizeRaces(summaries)) {
+        pthread_rwlock_unlock(&stateLock);
+        free(summaries);
+        free(ends);
+        return 0;
+    }
+    
+    // ends[] marks where the preamble, each constituency and the summary
+    // finish, which become the archive keys
+    OutputBuffer out = { NULL, 0, 0 };
+    outputPrintf(&out, "===================================================\n");
+    outputPrintf(&out, "          GENERAL ELECTION RESULTS\n");
+    outputPrintf(&out, "===================================================\n\n");
+    
+    time_t now;
+    time(&now);
+    outputPrintf(&out, "Report Generated: %s\n", ctime(&now));
+    ends[0] = out.length;
+    
+    int totalVotes = 0;
+    for(int race = 0; race < raceCount; race++) {
+        RaceSummary *summary = &summaries[race];
+        totalVotes += summary->totalVotes;
+        
+        if(raceCount > 1) {
+            outputPrintf(&out, "\nConstituency: %s\n", races[race]->name);
+        } else {
+            outputPrintf(&out, "\nCandidate Results:\n");
+        }
+        outputPrintf(&out, "---------------------------------------------------\n");
+        
+        for(int r = 0; r < summary->count; r++) {
+            Candidate *c = &races[race]->candidates[summary->order[r]];
+            float percentage = (summary->totalVotes > 0) ? (summary->votes[r] * 100.0 / summary->totalVotes) : 0;
+            outputPrintf(&out, "%d. %-25s (%-20s) : %d votes (%.2f%%)\n", 
+                         r+1, c->name, c->party, 
+                         summary->votes[r], percentage);
+        }
+        
+        if(raceCount > 1) {
+            outputPrintf(&out, "Votes Cast: %d\n", summary->totalVotes);
+            writeRaceWinner(&out, races[race], summary);
+        }
+        ends[race + 1] = out.length;
+    }
+    
+    outputPrintf(&out, "\n---------------------------------------------------\n");
+    outputPrintf(&out, "Total Votes Cast: %d\n", totalVotes);
+    outputPrintf(&out, "Total Registered Users: %d\n", userCount);
+    
+    if(raceCount == 1) {
+        writeRaceWinner(&out, races[0], &summaries[0]);
+    } else {
+        writePartyTotals(&out, summaries);
+    }
+    
+    outputPrintf(&out, "\n===================================================\n");
+    int sections = raceCount + 2;
+    ends[sections - 1] = out.length;
+    pthread_rwlock_unlock(&stateLock);
+    free(summaries);
+    
+    size_t length = strlen(path);
+    int ok = out.data != NULL;
+    if(ok && length > 4 && strcmp(path + length - 4, ".arc") == 0) {
+        ok = writeResultsArchive(path, out.data, ends, sections);
+    } else if(ok) {
+        FILE *fp = fopen(path, "w");
+        ok = fp != NULL && fwrite(out.data, 1, out.length, fp) == out.length;
+        ok = (fp != NULL && fclose(fp) == 0) && ok;
+    }
+    free(out.data);
+    free(ends);
+    return ok;
+}
+
+void resetElection() {
+    char confirm[10];
+    
+    int race = chooseRace(1);
+    if(race == NO_RACE) {
+        return;
+    }
+    
+    if(race == ALL_RACES || raceCount == 1) {
+        printf("\n[WARNING] This will reset all votes and voting status!\n");
+    } else {
+        printf("\n[WARNING] This will reset all votes and voting status in %s!\n", races[race]->name);
+    }
+    printf("Type 'RESET' to confirm: ");
+    fgets(confirm, 10, stdin);
+    confirm[strcspn(confirm, "\n")] = 0;
+    
+    if(strcmp(confirm, "RESET") != 0) {
+        printInfo("Reset cancelled.");
+        return;
+    }
+    
+    if(resetVotes(race) == CHANGE_NOT_SAVED) {
+        printError("The reset could not be confirmed on disk!");
+        return;
+    }
+    
+    printSuccess("Election reset successfully!");
+    logActivity("Election reset by admin");
+    checkpointIfDue();
+}
+
+void addCandidate() {
+    int race = chooseRace(0);
+    if(race == NO_RACE) {
+        return;
+    }
+    if(races[race]->candidateCount >= MAX_CANDIDATES) {
+        printError("Maximum candidate limit reached!");
+        return;
+    }
+    
+    printHeader("ADD NEW CANDIDATE");
+    
+    Candidate newCandidate;
+    newCandidate.id = races[race]->candidateCount + 1;
+    newCandidate.votes = 0;
+    
+    printf("Enter Candidate Name: ");
+    int fits = readInputLine(newCandidate.name, sizeof(newCandidate.name));
+    
+    printf("Enter Party Name: ");
+    fits = readInputLine(newCandidate.party, sizeof(newCandidate.party)) && fits;
+    
+    printf("Enter Age: ");
+    scanf("%d", &newCandidate.age);
+    clearInputBuffer();
+    
+    printf("Enter Education: ");
+    fits = readInputLine(newCandidate.education, sizeof(newCandidate.education)) && fits;
+    
+    printf("Enter Manifesto: ");
+    fits = readInputLine(newCandidate.manifesto, sizeof(newCandidate.manifesto)) && fits;
+    
+    if(!fits) {
+        char message[120];
+        snprintf(message, sizeof(message), "Too long! Names and parties take up to %d characters, "
+                 "education %d and the manifesto %d.", (int)sizeof(newCandidate.name) - 1,
+                 (int)sizeof(newCandidate.education) - 1, (int)sizeof(newCandidate.manifesto) - 1);
+        printError(message);
+        return;
+    }
+    
+    int result = insertCandidate(race, &newCandidate);
+    if(result == CHANGE_REJECTED) {
+        printError("Maximum candidate limit reached!");
+        return;
+    } else if(result == CHANGE_NOT_SAVED) {
+        printError("The new candidate could not be confirmed on disk!");
+        return;
+    }
+    
+    printSuccess("Candidate added successfully!");
+    logActivity("Candidate added by admin");
+    checkpointIfDue();
+}
+
+void removeCandidate() {
+    int id;
+    
+    int race = chooseRace(0);
+    if(race == NO_RACE) {
+        return;
+    }
+    showCandidates(race);
+    printf("\nEnter Candidate ID to remove: ");
+    scanf("%d", &id);
+    clearInputBuffer();
+    
+    if(id < 1 || id > races[race]->candidateCount) {
+        printError("Invalid candidate ID!");
+        return;
+    }
+    
+    printf("\n[!] Remove %s? (Y/N): ", races[race]->candidates[id-1].name);
+    char confirm;
+    scanf(" %c", &confirm);
+    clearInputBuffer();
+    
+    if(confirm != 'Y' && confirm != 'y') {
+        printInfo("Removal cancelled.");
+        return;
+    }
+    
+    int result = deleteCandidate(race, id);
+    if(result == CHANGE_REJECTED) {
+        printError("Invalid candidate ID!");
+        return;
+    } else if(result == CHANGE_NOT_SAVED) {
+        printError("The removal could not be confirmed on disk!");
+        return;
+    }
+    
+    printSuccess("Candidate removed successfully!");
+    logActivity("Candidate removed by admin");
+    checkpointIfDue();
+}
+
+// Starts an incremental backup; it is written in the background
+void createBackup() {
+    int number = startBackup();
+    if(number == 0) {
+        printInfo("The previous backup is still being written. Try again shortly.");
+        return;
+    }
+    if(number < 0) {
+        printError("Failed to start the backup!");
+        return;
+    }
+    
+    printSuccess("Backup started!");
+    printf("Backup %d is being written to %s_%06d.bak in the background.\n",
+           number, backups.prefix, number);
+}
+
+void setElectionPeriod() {
+    int days;
+    
+    printHeader("SET ELECTION PERIOD");
+    int race = chooseRace(1);
+    if(race == NO_RACE) {
+        return;
+    }
+    
+    printf("Enter election duration in days: ");
+    scanf("%d", &days);
+    clearInputBuffer();
+    
+    if(days < 1 || days > 365) {
+        printError("Invalid duration! Must be 1-365 days.");
+        return;
+    }
+    
+    time_t startTime;
+    time(&startTime);
+    if(changeElectionPeriod(race, startTime, startTime + (days * 24 * 60 * 60)) == CHANGE_NOT_SAVED) {
+        printError("The new election period could not be confirmed on disk!");
+        return;
+    }
+    
+    Race *changed = races[race == ALL_RACES ? 0 : race];
+    char startStr[100], endStr[100];
+    struct tm *timeInfo;
+    
+    timeInfo = localtime(&changed->electionStartTime);
+    strftime(startStr, sizeof(startStr), "%Y-%m-%d %H:%M:%S", timeInfo);
+    
+    timeInfo = localtime(&changed->electionEndTime);
+    strftime(endStr, sizeof(endStr), "%Y-%m-%d %H:%M:%S", timeInfo);
+    
+    printSuccess("Election period set successfully!");
+    printf("Start: %s\n", startStr);
+    printf("End:   %s\n", endStr);
+    
+    logActivity("Election period updated");
+    checkpointIfDue();
+}
+
+void addConstituency() {
+    char name[MAX_NAME_LENGTH];
+    int days;
+    
+    printHeader("ADD CONSTITUENCY");
+    printf("Enter Constituency Name: ");
+    fgets(name, MAX_NAME_LENGTH, stdin);
+    name[strcspn(name, "\n")] = 0;
+    
+    if(strlen(name) == 0) {
+        printError("Constituency name cannot be empty!");
+        return;
+    }
+    
+    printf("Enter election duration in days: ");
+    scanf("%d", &days);
+    clearInputBuffer();
+    
+    if(days < 1 || days > 365) {
+        printError("Invalid duration! Must be 1-365 days.");
+        return;
+    }
+    
+    time_t startTime;
+    time(&startTime);
+    int race;
+    int result = createRace(name, startTime, startTime + (days * 24 * 60 * 60), &race);
+    if(result == CHANGE_REJECTED) {
+        printError("Maximum constituency limit reached!");
+        return;
+    } else if(result == CHANGE_NOT_SAVED) {
+        printError("The new constituency could not be confirmed on disk!");
+        return;
+    }
+    
+    printSuccess("Constituency added successfully!");
+    printf("ID: %d\n", race + 1);
+    printInfo("Add its candidates with 'Add Candidate'.");
+    
+    logActivity("Constituency added by admin");
+    checkpointIfDue();
+}
+
+// State mutations shared by the interactive handlers and journal replay.
+// None of these print or persist anything.
+void applySetPassword(int userIndex, char* hashedPassword) {
+    StringRef password;
+    // The old hash stays in the arena; with no memory the voter keeps it
+    if(arenaAdd(hashedPassword, &password)) {
+        backupUserChanged(userIndex);
+        userAt(userIndex)->password = password;
+    }
+}
+
+int applyRegister(char* fullName, char* nid, char* hashedPassword, int race) {
+    StringRef name, password;
+    if(!ensureUserCapacity(userCount + 1) || !arenaAdd(fullName, &name) ||
+       !arenaAdd(hashedPassword, &password)) {
+        return -1;
+    }
+    
+    int userIndex = userCount;
+    backupUserChanged(userIndex);
+    User *user = userAt(userIndex);
+    user->fullName = name;
+    strncpy(user->nidNumber, nid, NID_LENGTH - 1);
+    user->nidNumber[NID_LENGTH - 1] = '\0';
+    user->password = password;
+    voterColumnsAt(userIndex)->races[userIndex & (USER_CHUNK_SIZE - 1)] = (unsigned short)race;
+    clearVote(userIndex);
+    atomic_fetch_add_explicit(&turnout.registered[race], 1, memory_order_relaxed);
+    nidIndexInsert(&nidIndex, userIndex);
+    userCount++;
+    return userIndex;
+}
+
+void applyVote(int userIndex, int candidateId, time_t voteTime) {
+    backupUserChanged(userIndex);
+    claimVote(userIndex);
+    recordBallot(userIndex, candidateId, voteTime);
+    tallyVote(races[userRace(userIndex)], candidateId - 1);
+    turnoutAdd(userRace(userIndex), candidateId, voteTime);
+}
+
+// Clears the tallies and voting status of one constituency, or of every
+// constituency for ALL_RACES
+void applyReset(int race) {
+    for(int r = 0; r < raceCount; r++) {
+        if(race != ALL_RACES && r != race) {
+            continue;
+        }
+        backupRaceChanged(r);
+        for(int i = 0; i < races[r]->candidateCount; i++) {
+            races[r]->candidates[i].votes = 0;
+            for(int s = 0; s < VOTE_SHARDS; s++) {
+                atomic_store(&races[r]->voteShards[s].counts[i], 0);
+            }
+        }
+    }
+    
+    for(int i = 0; i < userCount; i++) {
+        if((race == ALL_RACES || userRace(i) == race) &&
+           (userHasVoted(i) || userVotedFor(i) != 0 || userVoteTime(i) != 0)) {
+            backupUserChanged(i);
+            clearVote(i);
+        }
+    }
+    rebuildTurnout();
+}
+
+void applyAddCandidate(int race, Candidate* candidate) {
+    Race *target = races[race];
+    backupRaceChanged(race);
+    target->candidates[target->candidateCount] = *candidate;
+    target->candidates[target->candidateCount].race = race;
+    for(int s = 0; s < VOTE_SHARDS; s++) {
+        atomic_store(&target->voteShards[s].counts[target->candidateCount], 0);
+    }
+    target->candidateCount++;
+    searchIndexAdd(race, target->candidateCount - 1);
+}
+
+void applyRemoveCandidate(int race, int id) {
+    Race *target = races[race];
+    backupRaceChanged(race);
+    // Candidates after the removed one move down a slot, so they are
+    // re-indexed under their new document numbers
+    for(int i = id-1; i < target->candidateCount; i++) {
+        searchIndexRemove(race, i);
+    }
+    for(int i = id-1; i < target->candidateCount-1; i++) {
+        target->candidates[i] = target->candidates[i+1];
+        target->candidates[i].id = i + 1;
+        for(int s = 0; s < VOTE_SHARDS; s++) {
+            atomic_store(&target->voteShards[s].counts[i],
+                         atomic_load(&target->voteShards[s].counts[i+1]));
+        }
+    }
+    target->candidateCount--;
+    for(int i = id-1; i < target->candidateCount; i++) {
+        searchIndexAdd(race, i);
+    }
+    
+    // The removed candidate's votes are gone from the tally; their
+    // ballots stay on record as withdrawn and later ones follow the ids
+    for(int i = 0; i < userCount; i++) {
+        int ballot = userVotedFor(i);
+        if(ballot >= id && userRace(i) == race) {
+            backupUserChanged(i);
+            recordBallot(i, ballot == id ? BALLOT_WITHDRAWN : ballot - 1, userVoteTime(i));
+        }
+    }
+    rebuildTurnout();
+}
+
+void applyElectionPeriod(int race, time_t startTime, time_t endTime) {
+    for(int r = 0; r < raceCount; r++) {
+        if(race == ALL_RACES || r == race) {
+            backupRaceChanged(r);
+            races[r]->electionStartTime = startTime;
+            races[r]->electionEndTime = endTime;
+        }
+    }
+}
+
+// Doubles the constituency table. As with the voter chunk table, the old
+// table is never freed, since threads reading it without the state lock
+// may still hold it, and the races themselves never move.
+static int growRaceTable() {
+    int capacity = raceCapacity > 0 ? raceCapacity * 2 : 16;
+    Race **grown = calloc(capacity, sizeof(Race*));
+    if(grown == NULL) {
+        return 0;
+    }
+    if(raceCapacity > 0) {
+        memcpy(grown, races, sizeof(Race*) * raceCapacity);
+    }
+    races = grown;
+    raceCapacity = capacity;
+    return 1;
+}
+
+// Returns the index of the new constituency, or -1 when the table is full
+// or memory runs out. A race dropped by a reload is reused.
+int applyAddRace(char* name, time_t startTime, time_t endTime) {
+    if(raceCount >= MAX_RACES || (raceCount == raceCapacity && !growRaceTable())) {
+        return -1;
+    }
+    if(races[raceCount] == NULL) {
+        // Aligned for the vote shards, which sit on cache lines of their own
+#ifdef _WIN32
+        races[raceCount] = _aligned_malloc(sizeof(Race), CACHE_LINE_SIZE);
+#else
+        races[raceCount] = aligned_alloc(CACHE_LINE_SIZE, sizeof(Race));
+#endif
+        if(races[raceCount] == NULL) {
+            return -1;
+        }
+    }
+    
+    Race *race = races[raceCount];
+    memset(race, 0, sizeof(Race));
+    pthread_mutex_init(&race->leaderboardLock, NULL);
+    race->id = raceCount + 1;
+    strncpy(race->name, name, MAX_NAME_LENGTH - 1);
+    race->electionStartTime = startTime;
+    race->electionEndTime = endTime;
+    backupRaceChanged(raceCount);
+    return raceCount++;
+}
+
+// A candidate's tally is the count loaded from disk plus every shard
+int candidateVotes(Race* race, int index) {
+    int total = race->candidates[index].votes;
+    for(int s = 0; s < VOTE_SHARDS; s++) {
+        total += atomic_load_explicit(&race->voteShards[s].counts[index], memory_order_relaxed);
+    }
+    return total;
+}
+
+void tallyVote(Race* race, int index) {
+    if(voteShardIndex == -1) {
+        voteShardIndex = atomic_fetch_add(&nextVoteShard, 1) % VOTE_SHARDS;
+    }
+    atomic_fetch_add_explicit(&race->voteShards[voteShardIndex].counts[index], 1, memory_order_relaxed);
+    backupRaceChanged(race->id - 1);
+}
+
+// Takes back a vote counted by tallyVote. Only the sum of the shards
+// matters, so any shard will do.
+void untallyVote(Race* race, int index) {
+    atomic_fetch_sub_explicit(&race->voteShards[0].counts[index], 1, memory_order_relaxed);
+    backupRaceChanged(race->id - 1);
+}
+
+// Finds the buckets of a day in one turnout table, adding them if missing.
+// Returns NULL when the day is too far from the days the table holds.
+static TurnoutDay* turnoutDay(int table, long long day) {
+    TurnoutTable *current = atomic_load_explicit(&turnout.tables[table], memory_order_acquire);
+    if(current != NULL && day >= current->firstDay && day < current->firstDay + current->dayCount) {
+        TurnoutDay *found = atomic_load_explicit(&current->days[day - current->firstDay], memory_order_acquire);
+        if(found != NULL) {
+            return found;
+        }
+    }
+    
+    pthread_mutex_lock(&turnout.growLock);
+    current = atomic_load_explicit(&turnout.tables[table], memory_order_relaxed);
+    long long first = day;
+    long long end = day + 1;
+    if(current != NULL) {
+        first = current->firstDay < first ? current->firstDay : first;
+        end = current->firstDay + current->dayCount > end ? current->firstDay + current->dayCount : end;
+    }
+    TurnoutDay *found = NULL;
+    if(end - first <= TURNOUT_MAX_DAYS) {
+        if(current == NULL || first < current->firstDay || end > current->firstDay + current->dayCount) {
+            // Room for the days after this one too, so a running election
+            // seldom grows the table
+            if(current == NULL || end > current->firstDay + current->dayCount) {
+                end = end - first + TURNOUT_GROW_DAYS <= TURNOUT_MAX_DAYS ? end + TURNOUT_GROW_DAYS :
+                      first + TURNOUT_MAX_DAYS;
+            }
+            int count = (int)(end - first);
+            TurnoutTable *grown = malloc(sizeof(TurnoutTable) + sizeof(_Atomic(TurnoutDay*)) * count);
+            if(grown != NULL) {
+                grown->firstDay = first;
+                grown->dayCount = count;
+                for(int d = 0; d < count; d++) {
+                    long long old = current != NULL ? first + d - current->firstDay : -1;
+                    atomic_init(&grown->days[d], old >= 0 && old < current->dayCount ?
+                                atomic_load_explicit(&current->days[old], memory_order_relaxed) : NULL);
+                }
+                atomic_store_explicit(&turnout.tables[table], grown, memory_order_release);
+            }
+            current = grown;
+        }
+        if(current != NULL) {
+            found = atomic_load_explicit(&current->days[day - current->firstDay], memory_order_relaxed);
+            if(found == NULL) {
+                found = calloc(1, sizeof(TurnoutDay));
+                if(found != NULL) {
+                    atomic_store_explicit(&current->days[day - current->firstDay], found, memory_order_release);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&turnout.growLock);
+    return found;
+}
+
+// Counts one vote in the minute it was cast, in its constituency and in
+// the whole election
+void turnoutAdd(int race, int ballot, time_t voteTime) {
+    turnoutChange(race, ballot, voteTime, 1);
+}
+
+void turnoutChange(int race, int ballot, time_t voteTime, int delta) {
+    int slot = ballot > 0 && ballot <= MAX_CANDIDATES ? ballot - 1 : MAX_CANDIDATES;
+    long long minute = (long long)voteTime / 60;
+    int tables[2] = { race, TURNOUT_ALL };
+    for(int t = 0; t < 2; t++) {
+        TurnoutDay *day = voteTime > 0 ? turnoutDay(tables[t], minute / TURNOUT_DAY_MINUTES) : NULL;
+        if(day == NULL) {
+            atomic_fetch_add_explicit(&turnout.untimed[tables[t]], delta, memory_order_relaxed);
+        } else {
+            atomic_fetch_add_explicit(&day->counts[minute % TURNOUT_DAY_MINUTES][slot], delta,
+                                      memory_order_relaxed);
+        }
+    }
+}
+
+// One turnout rebuild thread's run of voter chunks
+typedef struct {
+    int firstChunk;
+    int lastChunk;
+    int *registered;        // per constituency, private to this thread
+    pthread_t thread;
+    int threaded;
+} TurnoutWorker;
+
+static void* turnoutThread(void* arg) {
+    TurnoutWorker *worker = arg;
+    for(int c = worker->firstChunk; c < worker->lastChunk; c++) {
+        VoterColumns *columns = voterColumns[c];
+        int used = userCount - c * USER_CHUNK_SIZE;
+        if(used > USER_CHUNK_SIZE) {
+            used = USER_CHUNK_SIZE;
+        }
+        for(int i = 0; i < used; i++) {
+            worker->registered[columns->races[i]]++;
+        }
+        for(int w = 0; w < (used + 63) / 64; w++) {
+            unsigned long long bits = atomic_load_explicit(&columns->voted[w], memory_order_relaxed);
+            while(bits != 0) {
+                int slot = w * 64 + lowestBit(bits);
+                turnoutAdd(columns->races[slot], columns->ballots[slot], columns->voteTimes[slot]);
+                bits &= bits - 1;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Rebuilds the turnout tables from the vote times on the roll, split
+// across all cores. The caller holds stateLock exclusively, or runs
+// before any other thread starts.
+void rebuildTurnout() {
+    for(int t = 0; t < TURNOUT_TABLES; t++) {
+        TurnoutTable *table = atomic_load(&turnout.tables[t]);
+        if(table != NULL) {
+            for(int d = 0; d < table->dayCount; d++) {
+                free(atomic_load(&table->days[d]));
+            }
+            free(table);
+            atomic_store(&turnout.tables[t], NULL);
+        }
+        atomic_store(&turnout.untimed[t], 0);
+    }
+    for(int r = 0; r < MAX_RACES; r++) {
+        atomic_store(&turnout.registered[r], 0);
+    }
+    
+    int chunks = (userCount + USER_CHUNK_SIZE - 1) / USER_CHUNK_SIZE;
+    int threads = cpuCount();
+    if(threads > chunks) {
+        threads = chunks > 0 ? chunks : 1;
+    }
+    TurnoutWorker *workers = calloc(threads, sizeof(TurnoutWorker));
+    int *counts = calloc((size_t)threads * raceCount, sizeof(int));
+    if(workers == NULL || counts == NULL) {
+        free(workers);
+        free(counts);
+        printError("Could not allocate memory for the turnout tables!");
+        return;
+    }
+    for(int t = 0; t < threads; t++) {
+        workers[t].firstChunk = (int)((long long)chunks * t / threads);
+        workers[t].lastChunk = (int)((long long)chunks * (t + 1) / threads);
+        workers[t].registered = counts + (size_t)t * raceCount;
+        workers[t].threaded = t > 0 &&
+            pthread_create(&workers[t].thread, NULL, turnoutThread, &workers[t]) == 0;
+    }
+    for(int t = 0; t < threads; t++) {
+        if(!workers[t].threaded) {
+            turnoutThread(&workers[t]);
+        }
+    }
+    for(int t = 0; t < threads; t++) {
+        if(workers[t].threaded) {
+            pthread_join(workers[t].thread, NULL);
+        }
+        for(int r = 0; r < raceCount; r++) {
+            atomic_fetch_add(&turnout.registered[r], workers[t].registered[r]);
+        }
+    }
+    free(workers);
+    free(counts);
+}
+
+// Re-sorts from the authoritative tallies. Runs on every read rather than
+// every vote, so voters never contend on the leaderboard lock; folding
+// VOTE_SHARDS cache lines is cheap next to a lock taken per vote.
+// The caller holds race->leaderboardLock.
+static void foldLeaderboard(Race* race) {
+    Leaderboard *board = &race->leaderboard;
+    
+    board->count = race->candidateCount;
+    board->totalVotes = 0;
+    for(int i = 0; i < race->candidateCount; i++) {
+        board->votes[i] = candidateVotes(race, i);
+        board->totalVotes += board->votes[i];
+        
+        // Insertion sort: most votes first, lower index first on a tie
+        int r = i;
+        while(r > 0 && board->votes[board->order[r - 1]] < board->votes[i]) {
+            board->order[r] = board->order[r - 1];
+            r--;
+        }
+        board->order[r] = i;
+    }
+}
+
+// Copies the first k ranks; returns how many were copied. The caller
+// holds stateLock, so the candidate list cannot change underneath.
+int leaderboardTop(Race* race, int k, int* indices, int* votes, int* totalVotes) {
+    Leaderboard *board = &race->leaderboard;
+    
+    pthread_mutex_lock(&race->leaderboardLock);
+    foldLeaderboard(race);
+    if(k > board->count) {
+        k = board->count;
+    }
+    for(int r = 0; r < k; r++) {
+        indices[r] = board->order[r];
+        votes[r] = board->votes[board->order[r]];
+    }
+    *totalVotes = board->totalVotes;
+    pthread_mutex_unlock(&race->leaderboardLock);
+    return k;
+}
+
+// Number of entries at the head of a ranked list that share the top score
+int countLeaders(int* votes, int count) {
+    int leaders = 0;
+    while(leaders < count && votes[leaders] == votes[0]) {
+        leaders++;
+    }
+    return leaders;
+}
+
+// Thread-safe operations used by every front end. Each one changes state
+// under stateLock, queues its journal record before releasing the lock and
+// waits for the record to be durable afterwards, so concurrent callers
+// share journal flushes.
+int castVoteFor(int userIndex, int candidateId, time_t voteTime) {
+    double started = currentSeconds();
+    pthread_rwlock_rdlock(&stateLock);
+    
+    Race *race = races[userRace(userIndex)];
+    int status = isElectionActive(race);
+    if(status != 1) {
+        pthread_rwlock_unlock(&stateLock);
+        return status == 0 ? VOTE_NOT_STARTED : VOTE_ENDED;
+    }
+    if(candidateId < 1 || candidateId > race->candidateCount) {
+        pthread_rwlock_unlock(&stateLock);
+        return VOTE_INVALID_CANDIDATE;
+    }
+    
+    if(journalFailed()) {
+        pthread_rwlock_unlock(&stateLock);
+        return VOTE_NOT_SAVED;
+    }
+    backupUserChanged(userIndex);
+    if(!claimVote(userIndex)) {
+        pthread_rwlock_unlock(&stateLock);
+        return VOTE_ALREADY_CAST;
+    }
+    recordBallot(userIndex, candidateId, voteTime);
+    tallyVote(race, candidateId - 1);
+    turnoutAdd(race->id - 1, candidateId, voteTime);
+    unsigned long long sequence = journalVote(userIndex, candidateId, voteTime);
+    
+    pthread_rwlock_unlock(&stateLock);
+    if(!journalCommit(sequence) && withdrawVote(userIndex, candidateId, voteTime, sequence)) {
+        return VOTE_NOT_SAVED;
+    }
+    metricAdd(METRIC_VOTES, 1);
+    metricTime(TIMER_CAST_VOTE, currentSeconds() - started);
+    return VOTE_OK;
+}
+
+// Undoes a vote whose journal record never reached disk, so it is not
+// counted and the voter can cast it again. A reset or a removed candidate
+// may have dropped or moved the ballot since, and then it is left alone.
+// Returns 0 if a checkpoint saved the vote after all.
+int withdrawVote(int userIndex, int candidateId, time_t voteTime, unsigned long long sequence) {
+    // A checkpoint whose view holds the vote writes it anyway, so see how
+    // that one ends first
+    for(;;) {
+        pthread_rwlock_wrlock(&stateLock);
+        CheckpointJob *job = atomic_load(&checkpoints.active);
+        if(job == NULL || job->journalSequence < sequence) {
+            break;
+        }
+        pthread_rwlock_unlock(&stateLock);
+        waitForCheckpoint();
+    }
+    pthread_mutex_lock(&journal.lock);
+    int saved = journal.checkpointSequence >= sequence;
+    pthread_mutex_unlock(&journal.lock);
+    if(!saved && userIndex < userCount && userHasVoted(userIndex) &&
+       userVotedFor(userIndex) == candidateId && userVoteTime(userIndex) == voteTime) {
+        int race = userRace(userIndex);
+        backupUserChanged(userIndex);
+        clearVote(userIndex);
+        untallyVote(races[race], candidateId - 1);
+        turnoutChange(race, candidateId, voteTime, -1);
+    }
+    pthread_rwlock_unlock(&stateLock);
+    return !saved;
+}
+
+int registerVoter(char* fullName, char* nid, char* hashedPassword, int race, int* userIndex) {
+    pthread_rwlock_wrlock(&stateLock);
+    
+    if(race < 0 || race >= raceCount) {
+        pthread_rwlock_unlock(&stateLock);
+        return REGISTER_INVALID_RACE;
+    }
+    if(findUserByNID(nid) != -1) {
+        pthread_rwlock_unlock(&stateLock);
+        return REGISTER_DUPLICATE;
+    }
+    if(journalFailed()) {
+        pthread_rwlock_unlock(&stateLock);
+        return REGISTER_NOT_SAVED;
+    }
+    *userIndex = applyRegister(fullName, nid, hashedPassword, race);
+    if(*userIndex == -1) {
+        pthread_rwlock_unlock(&stateLock);
+        return REGISTER_NO_MEMORY;
+    }
+    unsigned long long sequence = journalRegister(*userIndex);
+    
+    pthread_rwlock_unlock(&stateLock);
+    if(!journalCommit(sequence)) {
+        return REGISTER_NOT_SAVED;
+    }
+    metricAdd(METRIC_REGISTRATIONS, 1);
+    return REGISTER_OK;
+}
+
+static void wheelUnlink(int index) {
+    Session *session = &sessionTable.sessions[index];
+    if(session->bucket == -1) {
+        return;
+    }
+    if(session->timerPrev != -1) {
+        sessionTable.sessions[session->timerPrev].timerNext = session->timerNext;
+    } else {
+        sessionTable.wheel[session->bucket] = session->timerNext;
+    }
+    if(session->timerNext != -1) {
+        sessionTable.sessions[session->timerNext].timerPrev = session->timerPrev;
+    }
+    session->bucket = -1;
+}
+
+// Files a session under the level whose span covers its expiry
+static void wheelLink(int index, time_t expires) {
+    Session *session = &sessionTable.sessions[index];
+    if(expires <= sessionTable.now) {
+        expires = sessionTable.now + 1;
+    }
+    unsigned long long delta = expires - sessionTable.now;
+    unsigned long long reach = 1ULL << (SESSION_WHEEL_BITS * SESSION_WHEEL_LEVELS);
+    if(delta >= reach) {
+        // Park in the furthest slot; it is filed again when it cascades
+        expires = sessionTable.now + reach - 1;
+        delta = reach - 1;
+    }
+    int level = 0;
+    while(delta >= 1ULL << (SESSION_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    int slot = (int)(((unsigned long long)expires >> (SESSION_WHEEL_BITS * level)) & (SESSION_WHEEL_SLOTS - 1));
+    int bucket = level * SESSION_WHEEL_SLOTS + slot;
+    
+    session->bucket = bucket;
+    session->timerPrev = -1;
+    session->timerNext = sessionTable.wheel[bucket];
+    if(session->timerNext != -1) {
+        sessionTable.sessions[session->timerNext].timerPrev = index;
+    }
+    sessionTable.wheel[bucket] = index;
+}
+
+static void releaseSession(int index) {
+    Session *session = &sessionTable.sessions[index];
+    wheelUnlink(index);
+    session->secret = 0;
+    session->userIndex = -1;
+    session->timerNext = sessionTable.freeList;
+    sessionTable.freeList = index;
+    sessionTable.active--;
+}
+
+// Caller holds the session lock
+int initSessionTable() {
+    if(sessionTable.initialized) {
+        return 1;
+    }
+    for(int i = 0; i < SESSION_WHEEL_LEVELS * SESSION_WHEEL_SLOTS; i++) {
+        sessionTable.wheel[i] = -1;
+    }
+    sessionTable.freeList = -1;
+    sessionTable.now = time(NULL);
+    fillRandom(sessionTable.tokenKey, sizeof(sessionTable.tokenKey));
+    sessionTable.initialized = 1;
+    return 1;
+}
+
+static int parseSessionToken(char* token, unsigned long long* secret, int* index) {
+    unsigned long long value = 0;
+    unsigned int slot = 0;
+    for(int i = 0; i < SESSION_TOKEN_LENGTH - 1; i++) {
+        char c = token[i];
+        int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if(digit < 0) {
+            return 0;
+        }
+        if(i < 16) {
+            value = (value << 4) | digit;
+        } else {
+            slot = (slot << 4) | digit;
+        }
+    }
+    if(token[SESSION_TOKEN_LENGTH - 1] != '\0' || value == 0 || slot >= (unsigned int)sessionTable.capacity) {
+        return 0;
+    }
+    *secret = value;
+    *index = (int)slot;
+    return 1;
+}
+// Starts a session for a voter and writes its token; returns 0 if memory
+// runs out
+int createSession(int userIndex, char* token) {
+    pthread_mutex_lock(&sessionTable.lock);
+    initSessionTable();
+    if(sessionTable.freeList == -1) {
+        int capacity = sessionTable.capacity > 0 ? sessionTable.capacity * 2 : 1024;
+        Session *grown = realloc(sessionTable.sessions, sizeof(Session) * capacity);
+        if(grown == NULL) {
+            pthread_mutex_unlock(&sessionTable.lock);
+            return 0;
+        }
+        sessionTable.sessions = grown;
+        for(int i = capacity - 1; i >= sessionTable.capacity; i--) {
+            grown[i].secret = 0;
+            grown[i].bucket = -1;
+            grown[i].timerNext = sessionTable.freeList;
+            sessionTable.freeList = i;
+        }
+        sessionTable.capacity = capacity;
+    }
+    
+    int index = sessionTable.freeList;
+    Session *session = &sessionTable.sessions[index];
+    sessionTable.freeList = session->timerNext;
+    
+    // The secret is SHA-256 of a random per-process key and a counter
+    Sha256 ctx;
+    unsigned char digest[32];
+    sha256Init(&ctx);
+    sha256Update(&ctx, sessionTable.tokenKey, sizeof(sessionTable.tokenKey));
+    sha256Update(&ctx, (unsigned char*)&sessionTable.tokenCounter, sizeof(sessionTable.tokenCounter));
+    sha256Final(&ctx, digest);
+    sessionTable.tokenCounter++;
+    memcpy(&session->secret, digest, sizeof(session->secret));
+    if(session->secret == 0) {
+        session->secret = 1;
+    }
+    
+    session->userIndex = userIndex;
+    session->lastActivity = sessionTable.now;
+    session->bucket = -1;
+    wheelLink(index, session->lastActivity + SESSION_TIMEOUT + 1);
+    sessionTable.active++;
+    static const char hexDigits[] = "0123456789abcdef";
+    for(int i = 0; i < 16; i++) {
+        token[i] = hexDigits[(session->secret >> (60 - 4 * i)) & 15];
+    }
+    for(int i = 0; i < 8; i++) {
+        token[16 + i] = hexDigits[((unsigned int)index >> (28 - 4 * i)) & 15];
+    }
+    token[SESSION_TOKEN_LENGTH - 1] = '\0';
+    pthread_mutex_unlock(&sessionTable.lock);
+    return 1;
+}
+
+// Returns the voter of a live session and marks it active, or -1 for an
+// unknown, ended or expired token
+int sessionUser(char* token) {
+    unsigned long long secret;
+    int index, userIndex = -1;
+    pthread_mutex_lock(&sessionTable.lock);
+    if(parseSessionToken(token, &secret, &index) && sessionTable.sessions[index].secret == secret) {
+        Session *session = &sessionTable.sessions[index];
+        userIndex = session->userIndex;
+        session->lastActivity = sessionTable.now;
+    }
+    pthread_mutex_unlock(&sessionTable.lock);
+    return userIndex;
+}
+
+void endSession(char* token) {
+    unsigned long long secret;
+    int index;
+    pthread_mutex_lock(&sessionTable.lock);
+    if(parseSessionToken(token, &secret, &index) && sessionTable.sessions[index].secret == secret) {
+        releaseSession(index);
+    }
+    pthread_mutex_unlock(&sessionTable.lock);
+}
+
+int activeSessionCount() {
+    pthread_mutex_lock(&sessionTable.lock);
+    int active = sessionTable.active;
+    pthread_mutex_unlock(&sessionTable.lock);
+    return active;
+}
+
+// Refiles every session of one bucket; they land on lower levels
+static void cascadeBucket(int bucket) {
+    int index = sessionTable.wheel[bucket];
+    sessionTable.wheel[bucket] = -1;
+    while(index != -1) {
+        Session *session = &sessionTable.sessions[index];
+        int next = session->timerNext;
+        session->bucket = -1;
+        wheelLink(index, session->lastActivity + SESSION_TIMEOUT + 1);
+        index = next;
+    }
+}
+
+// Advances the wheel one second at a time up to now. Each tick touches only
+// the sessions filed under that second, plus a cascade every 64 ticks.
+void sessionTick(time_t now) {
+    pthread_mutex_lock(&sessionTable.lock);
+    initSessionTable();
+    while(sessionTable.now < now) {
+        sessionTable.now++;
+        unsigned long long tick = (unsigned long long)sessionTable.now;
+        // Cascade from the highest level that wrapped down to level 1
+        int wrapped = 0;
+        while(wrapped + 1 < SESSION_WHEEL_LEVELS &&
+              (tick & ((1ULL << (SESSION_WHEEL_BITS * (wrapped + 1))) - 1)) == 0) {
+            wrapped++;
+        }
+        for(int level = wrapped; level >= 1; level--) {
+            int slot = (int)((tick >> (SESSION_WHEEL_BITS * level)) & (SESSION_WHEEL_SLOTS - 1));
+            cascadeBucket(level * SESSION_WHEEL_SLOTS + slot);
+        }
+        
+        int bucket = (int)(tick & (SESSION_WHEEL_SLOTS - 1));
+        int index = sessionTable.wheel[bucket];
+        sessionTable.wheel[bucket] = -1;
+        while(index != -1) {
+            Session *session = &sessionTable.sessions[index];
+            int next = session->timerNext;
+            session->bucket = -1;
+            if(difftime(sessionTable.now, session->lastActivity) > SESSION_TIMEOUT) {
+                releaseSession(index);
+                sessionTable.expired++;
+            } else {
+                wheelLink(index, session->lastActivity + SESSION_TIMEOUT + 1);
+            }
+            index = next;
+        }
+    }
+    pthread_mutex_unlock(&sessionTable.lock);
+}
+
+static void* sessionReaperThread(void* arg) {
+    (void)arg;
+    while(1) {
+        sessionTick(time(NULL));
+        sleepSeconds(1);
+    }
+    return NULL;
+}
+
+// Ticks the session wheel once a second in the background
+void startSessionReaper() {
+    static int started = 0;
+    pthread_t reaper;
+    if(started) {
+        return;
+    }
+    sessionTick(time(NULL));
+    if(pthread_create(&reaper, NULL, sessionReaperThread, NULL) == 0) {
+        pthread_detach(reaper);
+        started = 1;
+    }
+}
+
+// Returns the user index, or -1 for an unknown NID, wrong password or
+// one too long to have been registered. The password is checked on the
+// KDF pool outside the state lock.
+int authenticateVoter(char* nid, char* password) {
+    double started = currentSeconds();
+    KdfJob job;
+    if(strlen(password) >= sizeof(job.password)) {
+        metricAdd(METRIC_FAILED_LOGINS, 1);
+        return -1;
+    }
+    memset(&job, 0, sizeof(job));
+    job.verify = 1;
+    strcpy(job.password, password);
+    
+    pthread_rwlock_rdlock(&stateLock);
+    int userIndex = findUserByNID(nid);
+    if(userIndex != -1) {
+        strcpy(job.hash, userPasswordHash(userIndex));
+    }
+    pthread_rwlock_unlock(&stateLock);
+    
+    kdfRun(&job);
+    if(userIndex == -1 || !job.matched) {
+        metricAdd(METRIC_FAILED_LOGINS, 1);
+        return -1;
+    }
+    if(job.upgradedHash[0] != '\0') {
+        upgradePasswordHash(userIndex, job.hash, job.upgradedHash);
+    }
+    metricAdd(METRIC_LOGINS, 1);
+    metricTime(TIMER_LOGIN, currentSeconds() - started);
+    return userIndex;
+}
+
+// Replaces a voter's password hash after a login under the old scheme,
+// unless it changed in the meantime. Both hashes check the same password,
+// so the upgrade is skipped while the journal is failed, and one that
+// does not reach the disk is simply made again at a later login.
+void upgradePasswordHash(int userIndex, char* oldHash, char* newHash) {
+    unsigned long long sequence = 0;
+    pthread_rwlock_wrlock(&stateLock);
+    if(!journalFailed() && strcmp(userPasswordHash(userIndex), oldHash) == 0) {
+        applySetPassword(userIndex, newHash);
+        sequence = journalSetPassword(userIndex);
+        atomic_fetch_add(&kdfPool.migrated, 1);
+    }
+    pthread_rwlock_unlock(&stateLock);
+    if(sequence != 0) {
+        journalCommit(sequence);
+    }
+}
+
+int resetVotes(int race) {
+    pthread_rwlock_wrlock(&stateLock);
+    if(journalFailed()) {
+        pthread_rwlock_unlock(&stateLock);
+        return CHANGE_NOT_SAVED;
+    }
+    applyReset(race);
+    unsigned long long sequence = journalReset(race);
+    pthread_rwlock_unlock(&stateLock);
+    return journalCommit(sequence) ? CHANGE_OK : CHANGE_NOT_SAVED;
+}
+
+int insertCandidate(int race, Candidate* candidate) {
+    pthread_rwlock_wrlock(&stateLock);
+    if(race < 0 || race >= raceCount || races[race]->candidateCount >= MAX_CANDIDATES) {
+        pthread_rwlock_unlock(&stateLock);
+        return CHANGE_REJECTED;
+    }
+    if(journalFailed()) {
+        pthread_rwlock_unlock(&stateLock);
+        return CHANGE_NOT_SAVED;
+    }
+    candidate->id = races[race]->candidateCount + 1;
+    candidate->votes = 0;
+    candidate->race = race;
+    applyAddCandidate(race, candidate);
+    unsigned long long sequence = journalAddCandidate(candidate);
+    pthread_rwlock_unlock(&stateLock);
+    return journalCommit(sequence) ? CHANGE_OK : CHANGE_NOT_SAVED;
+}
+
+int deleteCandidate(int race, int id) {
+    pthread_rwlock_wrlock(&stateLock);
+    if(race < 0 || race >= raceCount || id < 1 || id > races[race]->candidateCount) {
+        pthread_rwlock_unlock(&stateLock);
+        return CHANGE_REJECTED;
+    }
+    if(journalFailed()) {
+        pthread_rwlock_unlock(&stateLock);
+        return CHANGE_NOT_SAVED;
+    }
+    applyRemoveCandidate(race, id);
+    unsigned long long sequence = journalRemoveCandidate(race, id);
+    pthread_rwlock_unlock(&stateLock);
+    return journalCommit(sequence) ? CHANGE_OK : CHANGE_NOT_SAVED;
+}
+
+int changeElectionPeriod(int race, time_t startTime, time_t endTime) {
+    pthread_rwlock_wrlock(&stateLock);
+    if(journalFailed()) {
+        pthread_rwlock_unlock(&stateLock);
+        return CHANGE_NOT_SAVED;
+    }
+    applyElectionPeriod(race, startTime, endTime);
+    unsigned long long sequence = journalElectionPeriod(race, startTime, endTime);
+    pthread_rwlock_unlock(&stateLock);
+    return journalCommit(sequence) ? CHANGE_OK : CHANGE_NOT_SAVED;
+}
+
+// Sets *race to the index of the new constituency; CHANGE_REJECTED when
+// the table is full
+int createRace(char* name, time_t startTime, time_t endTime, int* race) {
+    pthread_rwlock_wrlock(&stateLock);
+    if(journalFailed()) {
+        pthread_rwlock_unlock(&stateLock);
+        return CHANGE_NOT_SAVED;
+    }
+    *race = applyAddRace(name, startTime, endTime);
+    if(*race == -1) {
+        pthread_rwlock_unlock(&stateLock);
+        return CHANGE_REJECTED;
+    }
+    unsigned long long sequence = journalAddRace(*race);
+    pthread_rwlock_unlock(&stateLock);
+    return journalCommit(sequence) ? CHANGE_OK : CHANGE_NOT_SAVED;
+}
+
+// Slicing-by-8 tables: crcTable[k][b] is the CRC of byte b followed by
+// k zero bytes, so eight bytes are folded in per step
+static unsigned int crcTable[8][256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+static void buildCrcTable() {
+    for(unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for(int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crcTable[0][i] = c;
+    }
+    for(int k = 1; k < 8; k++) {
+        for(int i = 0; i < 256; i++) {
+            unsigned int c = crcTable[k - 1][i];
+            crcTable[k][i] = (c >> 8) ^ crcTable[0][c & 0xFF];
+        }
+    }
+}
+
+unsigned int crc32(unsigned char* data, size_t length) {
+    return crc32Update(0, data, length);
+}
+
+// Continues a checksum: crc32Update(crc32(a), b) equals crc32 of a then b
+unsigned int crc32Update(unsigned int crc, unsigned char* data, size_t length) {
+    pthread_once(&crcTableOnce, buildCrcTable);
+    crc ^= 0xFFFFFFFFu;
+    while(length >= 8) {
+        unsigned int low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (unsigned int)data[3] << 24);
+        unsigned int high = data[4] | data[5] << 8 | data[6] << 16 | (unsigned int)data[7] << 24;
+        crc = crcTable[7][low & 0xFF] ^ crcTable[6][(low >> 8) & 0xFF] ^
+              crcTable[5][(low >> 16) & 0xFF] ^ crcTable[4][low >> 24] ^
+              crcTable[3][high & 0xFF] ^ crcTable[2][(high >> 8) & 0xFF] ^
+              crcTable[1][(high >> 16) & 0xFF] ^ crcTable[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+    while(length-- > 0) {
+        crc = crcTable[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static void recordPut(JournalRecord* record, void* data, int length) {
+    if(record->length + length > JOURNAL_MAX_RECORD) {
+        length = JOURNAL_MAX_RECORD - record->length;
+    }
+    memcpy(record->data + record->length, data, length);
+    record->length += length;
+}
+
+static void recordPutInt(JournalRecord* record, long long value) {
+    recordPut(record, &value, sizeof(value));
+}
+
+static void recordPutString(JournalRecord* record, char* text) {
+    unsigned short length = (unsigned short)strlen(text);
+    recordPut(record, &length, sizeof(length));
+    recordPut(record, text, length);
+}
+
+static int recordGet(JournalRecord* record, void* out, int length) {
+    if(record->readPos + length > record->length) {
+        return 0;
+    }
+    memcpy(out, record->data + record->readPos, length);
+    record->readPos += length;
+    return 1;
+}
+
+static long long recordGetInt(JournalRecord* record) {
+    long long value = 0;
+    recordGet(record, &value, sizeof(value));
+    return value;
+}
+
+static void recordGetString(JournalRecord* record, char* out, int size) {
+    unsigned short length = 0;
+    out[0] = '\0';
+    if(!recordGet(record, &length, sizeof(length)) ||
+       record->readPos + length > record->length) {
+        return;
+    }
+    int copy = length < size ? length : size - 1;
+    memcpy(out, record->data + record->readPos, copy);
+    out[copy] = '\0';
+    record->readPos += length;
+}
+
+// Starts a record; the sequence number is filled in by journalAppend()
+static void recordBegin(JournalRecord* record, int type) {
+    unsigned char recordType = (unsigned char)type;
+    record->length = 0;
+    record->readPos = 0;
+    recordPutInt(record, 0);
+    recordPut(record, &recordType, 1);
+}
+
+#ifndef _WIN32
+// Makes the renames in the working directory durable
+static void syncDirectory() {
+    int fd = open(".", O_RDONLY);
+    if(fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+#endif
+
+// The journal may grow in proportion to the roll before a checkpoint, so
+// writing one stays a fixed share of the work however large the roll is
+static unsigned long long checkpointBytes(int voters) {
+    unsigned long long bytes = (unsigned long long)voters * JOURNAL_CHECKPOINT_VOTER_BYTES;
+    return bytes > JOURNAL_CHECKPOINT_MIN_BYTES ? bytes : JOURNAL_CHECKPOINT_MIN_BYTES;
+}
+
+void openJournal() {
+    if(journal.buffer == NULL) {
+        journal.buffer = malloc(JOURNAL_BUFFER_SIZE);
+        journal.flushBuffer = malloc(JOURNAL_BUFFER_SIZE);
+    }
+    pthread_mutex_lock(&journal.lock);
+    journal.fp = fopen(JOURNAL_FILE, "ab");
+    journal.closed = 0;
+    journal.failed = journal.fp == NULL || journal.buffer == NULL || journal.flushBuffer == NULL;
+    if(journal.failed) {
+        printError("Could not open the vote journal! Changes are refused until a checkpoint succeeds.");
+        if(journal.fp != NULL) {
+            fclose(journal.fp);
+            journal.fp = NULL;
+        }
+    } else {
+        fseek(journal.fp, 0, SEEK_END);
+        long size = ftell(journal.fp);
+        journal.size = size > 0 ? (unsigned long long)size : 0;
+    }
+    journal.checkpointBytes = checkpointBytes(userCount);
+    journal.checkpointed = time(NULL);
+    pthread_mutex_unlock(&journal.lock);
+}
+
+// For batch runs, which write a checkpoint instead of journal records
+void closeJournal() {
+    pthread_mutex_lock(&journal.lock);
+    if(journal.fp != NULL) {
+        fclose(journal.fp);
+        journal.fp = NULL;
+    }
+    journal.closed = 1;
+    journal.failed = 0;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+// Called once the text files cover everything up to checkpointSequence
+// Moves the records from offset on to a new file that replaces the
+// journal. Called with the journal locked and no flush running. If the
+// copy fails the old file is kept; replay skips what a checkpoint covers.
+static void trimJournal(unsigned long long offset) {
+    char tempPath[] = JOURNAL_FILE ".tmp";
+    unsigned long long end = journal.size - journal.buffered;
+    FILE *in = fopen(JOURNAL_FILE, "rb");
+    FILE *out = in != NULL ? fopen(tempPath, "wb") : NULL;
+    int ok = out != NULL && fseek(in, (long)offset, SEEK_SET) == 0;
+    // With no flush running its buffer is free
+    unsigned char *buffer = journal.flushBuffer;
+    for(unsigned long long left = end - offset; ok && left > 0; ) {
+        size_t n = left < JOURNAL_BUFFER_SIZE ? (size_t)left : JOURNAL_BUFFER_SIZE;
+        ok = fread(buffer, 1, n, in) == n && fwrite(buffer, 1, n, out) == n;
+        left -= n;
+    }
+    ok = ok && fflush(out) == 0 && fsync(fileno(out)) == 0;
+    if(in != NULL) {
+        fclose(in);
+    }
+    if(out != NULL) {
+        ok = (fclose(out) == 0) && ok;
+    }
+    if(!ok) {
+        remove(tempPath);
+        return;
+    }
+    
+    fclose(journal.fp);
+#ifdef _WIN32
+    remove(JOURNAL_FILE);
+#endif
+    if(rename(tempPath, JOURNAL_FILE) == 0) {
+        journal.size -= offset;
+    }
+#ifndef _WIN32
+    syncDirectory();
+#endif
+    journal.fp = fopen(JOURNAL_FILE, "ab");
+    if(journal.fp == NULL) {
+        journal.buffered = 0;
+        journal.failed = 1;
+        printError("Could not reopen the vote journal! Changes are refused until a checkpoint succeeds.");
+    }
+}
+
+// Called once a checkpoint covers every record up to checkpointSequence,
+// which the first offset bytes of the journal hold
+void resetJournal(unsigned long long checkpointSequence, unsigned long long offset, int voters) {
+    pthread_mutex_lock(&journal.lock);
+    while(journal.flushing) {
+        pthread_cond_wait(&journal.flushed, &journal.lock);
+    }
+    journal.checkpointSequence = checkpointSequence;
+    journal.checkpointed = time(NULL);
+    journal.checkpointBytes = checkpointBytes(voters);
+    
+    if((journal.fp != NULL || journal.failed) && journal.bufferedSequence <= checkpointSequence) {
+        // Nothing newer than the checkpoint: start an empty journal
+        if(journal.fp != NULL) {
+            fclose(journal.fp);
+        }
+        journal.fp = fopen(JOURNAL_FILE, "wb");
+        journal.buffered = 0;
+        journal.size = 0;
+        journal.durableSequence = journal.bufferedSequence;
+        journal.failed = journal.fp == NULL;
+        if(journal.failed) {
+            printError("Could not reopen the vote journal! Changes are refused until a checkpoint succeeds.");
+        }
+    } else if(journal.fp != NULL) {
+        // Changes made while the checkpoint was written stay
+        trimJournal(offset);
+    } else if(journal.closed) {
+        // Journal is closed (batch mode): the checkpoint covers all of it
+        FILE *fp = fopen(JOURNAL_FILE, "wb");
+        if(fp != NULL) {
+            fclose(fp);
+        }
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+// Queues a record and returns its sequence number. The record is durable
+// once journalCommit() returns for that sequence.
+unsigned long long journalAppend(JournalRecord* record) {
+    unsigned int header[2];
+    size_t needed = sizeof(header) + record->length;
+    pthread_mutex_lock(&journal.lock);
+    while(journal.fp != NULL && journal.buffered + needed > JOURNAL_BUFFER_SIZE) {
+        // Buffer full: wait for the current leader, or flush it ourselves
+        unsigned long long full = journal.bufferedSequence;
+        pthread_mutex_unlock(&journal.lock);
+        journalCommit(full);
+        pthread_mutex_lock(&journal.lock);
+    }
+    
+    // Numbered only once there is room, so the file stays in sequence order
+    unsigned long long sequence = ++journal.nextSequence;
+    memcpy(record->data, &sequence, sizeof(sequence));
+    header[0] = (unsigned int)record->length;
+    header[1] = crc32(record->data, record->length);
+    if(journal.fp != NULL) {
+        memcpy(journal.buffer + journal.buffered, header, sizeof(header));
+        memcpy(journal.buffer + journal.buffered + sizeof(header), record->data, record->length);
+        journal.buffered += needed;
+        journal.size += needed;
+    }
+    journal.bufferedSequence = sequence;
+    
+    pthread_mutex_unlock(&journal.lock);
+    return sequence;
+}
+
+// Group commit: the first caller to find unflushed records becomes the
+// leader and writes and fsyncs everything buffered so far; callers whose
+// records were included in that batch just wait for it to finish.
+// Returns 0 if a write failed before the record reached the disk.
+int journalCommit(unsigned long long sequence) {
+    pthread_mutex_lock(&journal.lock);
+    
+    while(journal.durableSequence < sequence && journal.fp != NULL) {
+        if(journal.flushing) {
+            pthread_cond_wait(&journal.flushed, &journal.lock);
+            continue;
+        }
+        
+        unsigned char *batch = journal.buffer;
+        size_t batchSize = journal.buffered;
+        unsigned long long batchSequence = journal.bufferedSequence;
+        journal.buffer = journal.flushBuffer;
+        journal.flushBuffer = batch;
+        journal.buffered = 0;
+        journal.flushing = 1;
+        FILE *fp = journal.fp;
+        pthread_mutex_unlock(&journal.lock);
+        
+        int ok = fwrite(batch, 1, batchSize, fp) == batchSize;
+        ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+        metricAdd(METRIC_BYTES_JOURNAL, batchSize);
+        
+        pthread_mutex_lock(&journal.lock);
+        journal.flushing = 0;
+        if(ok) {
+            journal.durableSequence = batchSequence;
+        } else {
+            // The file may end in a torn record; nothing more is appended
+            // after it until a checkpoint starts a new journal
+            printError("Could not write the vote journal! Changes are refused until a checkpoint succeeds.");
+            fclose(fp);
+            journal.fp = NULL;
+            journal.buffered = 0;
+            journal.failed = 1;
+        }
+        pthread_cond_broadcast(&journal.flushed);
+    }
+    
+    // A closed journal leaves every change to the next checkpoint
+    int durable = journal.durableSequence >= sequence || (journal.fp == NULL && journal.closed);
+    pthread_mutex_unlock(&journal.lock);
+    return durable;
+}
+
+int journalFailed() {
+    pthread_mutex_lock(&journal.lock);
+    int failed = journal.failed;
+    pthread_mutex_unlock(&journal.lock);
+    return failed;
+}
+
+unsigned long long journalRegister(int userIndex) {
+    JournalRecord record;
+    recordBegin(&record, JOURNAL_REGISTER);
+    recordPutString(&record, userFullName(userIndex));
+    recordPutString(&record, userAt(userIndex)->nidNumber);
+    recordPutString(&record, userPasswordHash(userIndex));
+    recordPutInt(&record, userRace(userIndex));
+    return journalAppend(&record);
+}
+
+unsigned long long journalVote(int userIndex, int candidateId, time_t voteTime) {
+    JournalRecord record;
+    recordBegin(&record, JOURNAL_VOTE);
+    recordPutInt(&record, userIndex);
+    recordPutInt(&record, candidateId);
+    recordPutInt(&record, (long long)voteTime);
+    return journalAppend(&record);
+}
+
+unsigned long long journalReset(int race) {
+    JournalRecord record;
+    recordBegin(&record, JOURNAL_RESET);
+    recordPutInt(&record, race + 1);
+    return journalAppend(&record);
+}
+
+unsigned long long journalAddCandidate(Candidate* candidate) {
+    JournalRecord record;
+    recordBegin(&record, JOURNAL_ADD_CANDIDATE);
+    recordPutInt(&record, candidate->id);
+    recordPutString(&record, candidate->name);
+    recordPutString(&record, candidate->party);
+    recordPutString(&record, candidate->education);
+    recordPutInt(&record, candidate->age);
+    recordPutString(&record, candidate->manifesto);
+    recordPutInt(&record, candidate->race);
+    return journalAppend(&record);
+}
+
+unsigned long long journalRemoveCandidate(int race, int id) {
+    JournalRecord record;
+    recordBegin(&record, JOURNAL_REMOVE_CANDIDATE);
+    recordPutInt(&record, id);
+    recordPutInt(&record, race);
+    return journalAppend(&record);
+}
+
+unsigned long long journalElectionPeriod(int race, time_t startTime, time_t endTime) {
+    JournalRecord record;
+    recordBegin(&record, JOURNAL_ELECTION_PERIOD);
+    recordPutInt(&record, (long long)startTime);
+    recordPutInt(&record, (long long)endTime);
+    recordPutInt(&record, race + 1);
+    return journalAppend(&record);
+}
+
+unsigned long long journalSetPassword(int userIndex) {
+    JournalRecord record;
+    recordBegin(&record, JOURNAL_SET_PASSWORD);
+    recordPutInt(&record, userIndex);
+    recordPutString(&record, userPasswordHash(userIndex));
+    return journalAppend(&record);
+}
+
+unsigned long long journalAddRace(int race) {
+    JournalRecord record;
+    recordBegin(&record, JOURNAL_ADD_RACE);
+    recordPutString(&record, races[race]->name);
+    recordPutInt(&record, (long long)races[race]->electionStartTime);
+    recordPutInt(&record, (long long)races[race]->electionEndTime);
+    return journalAppend(&record);
+}
+
+// The constituency is the last field of each record; journals written
+// before constituencies existed read it as 0, which is the first one, or
+// as "all" for resets and election periods.
+static void replayRecord(JournalRecord* record) {
+    unsigned char type = 0;
+    recordGet(record, &type, 1);
+    
+    if(type == JOURNAL_REGISTER) {
+        char fullName[MAX_VOTER_NAME_LENGTH], nid[NID_LENGTH], password[PASSWORD_HASH_LENGTH];
+        recordGetString(record, fullName, sizeof(fullName));
+        recordGetString(record, nid, sizeof(nid));
+        recordGetString(record, password, sizeof(password));
+        int race = (int)recordGetInt(record);
+        if(findUserByNID(nid) == -1) {
+            applyRegister(fullName, nid, password, race >= 0 && race < raceCount ? race : 0);
+        }
+    } else if(type == JOURNAL_VOTE) {
+        int userIndex = (int)recordGetInt(record);
+        int candidateId = (int)recordGetInt(record);
+        time_t voteTime = (time_t)recordGetInt(record);
+        if(userIndex >= 0 && userIndex < userCount && !userHasVoted(userIndex) &&
+           candidateId >= 1 && candidateId <= races[userRace(userIndex)]->candidateCount) {
+            applyVote(userIndex, candidateId, voteTime);
+        }
+    } else if(type == JOURNAL_RESET) {
+        int race = (int)recordGetInt(record) - 1;
+        if(race >= ALL_RACES && race < raceCount) {
+            applyReset(race);
+        }
+    } else if(type == JOURNAL_ADD_CANDIDATE) {
+        Candidate candidate;
+        candidate.id = (int)recordGetInt(record);
+        recordGetString(record, candidate.name, sizeof(candidate.name));
+        recordGetString(record, candidate.party, sizeof(candidate.party));
+        recordGetString(record, candidate.education, sizeof(candidate.education));
+        candidate.age = (int)recordGetInt(record);
+        recordGetString(record, candidate.manifesto, sizeof(candidate.manifesto));
+        candidate.votes = 0;
+        int race = (int)recordGetInt(record);
+        if(race >= 0 && race < raceCount && races[race]->candidateCount < MAX_CANDIDATES) {
+            applyAddCandidate(race, &candidate);
+        }
+    } else if(type == JOURNAL_REMOVE_CANDIDATE) {
+        int id = (int)recordGetInt(record);
+        int race = (int)recordGetInt(record);
+        if(race >= 0 && race < raceCount && id >= 1 && id <= races[race]->candidateCount) {
+            applyRemoveCandidate(race, id);
+        }
+    } else if(type == JOURNAL_ELECTION_PERIOD) {
+        time_t startTime = (time_t)recordGetInt(record);
+        time_t endTime = (time_t)recordGetInt(record);
+        int race = (int)recordGetInt(record) - 1;
+        if(race >= ALL_RACES && race < raceCount) {
+            applyElectionPeriod(race, startTime, endTime);
+        }
+    } else if(type == JOURNAL_ADD_RACE) {
+        char name[MAX_NAME_LENGTH];
+        recordGetString(record, name, sizeof(name));
+        time_t startTime = (time_t)recordGetInt(record);
+        time_t endTime = (time_t)recordGetInt(record);
+        applyAddRace(name, startTime, endTime);
+    } else if(type == JOURNAL_SET_PASSWORD) {
+        int userIndex = (int)recordGetInt(record);
+        char password[PASSWORD_HASH_LENGTH];
+        recordGetString(record, password, sizeof(password));
+        if(userIndex >= 0 && userIndex < userCount) {
+            applySetPassword(userIndex, password);
+        }
+    }
+}
+
+// Re-applies journal records newer than the last checkpoint. Replay stops
+// at the first torn or corrupt record, which is cut off the end of the file.
+void replayJournal() {
+    FILE *fp = fopen(JOURNAL_FILE, "rb");
+    if(fp == NULL) {
+        journal.nextSequence = journal.checkpointSequence;
+        journal.bufferedSequence = journal.durableSequence = journal.nextSequence;
+        return;
+    }
+    
+    JournalRecord record;
+    unsigned int header[2];
+    unsigned long long lastSequence = journal.checkpointSequence;
+    long validEnd = 0;
+    int replayed = 0;
+    
+    while(fread(header, sizeof(header), 1, fp) == 1) {
+        if(header[0] < sizeof(unsigned long long) + 1 || header[0] > JOURNAL_MAX_RECORD) {
+            break;
+        }
+        if(fread(record.data, 1, header[0], fp) != header[0]) {
+            break;
+        }
+        if(crc32(record.data, header[0]) != header[1]) {
+            break;
+        }
+        record.length = (int)header[0];
+        record.readPos = 0;
+        
+        unsigned long long sequence = 0;
+        recordGet(&record, &sequence, sizeof(sequence));
+        if(sequence > lastSequence) {
+            replayRecord(&record);
+            lastSequence = sequence;
+            replayed++;
+        }
+        validEnd = ftell(fp);
+    }
+    
+    fseek(fp, 0, SEEK_END);
+    long fileEnd = ftell(fp);
+    fclose(fp);
+    
+    if(validEnd < fileEnd) {
+        // Drop the damaged tail so new records are not appended after it
+        FILE *in = fopen(JOURNAL_FILE, "rb");
+        unsigned char *valid = malloc(validEnd > 0 ? validEnd : 1);
+        if(in != NULL && valid != NULL && fread(valid, 1, validEnd, in) == (size_t)validEnd) {
+            fclose(in);
+            in = NULL;
+            FILE *out = fopen(JOURNAL_FILE, "wb");
+            if(out != NULL) {
+                fwrite(valid, 1, validEnd, out);
+                fclose(out);
+            }
+        }
+        if(in != NULL) {
+            fclose(in);
+        }
+        free(valid);
+        printInfo("Discarded a damaged record at the end of the vote journal.");
+    }
+    
+    journal.nextSequence = lastSequence;
+    journal.bufferedSequence = journal.durableSequence = lastSequence;
+    
+    if(replayed > 0) {
+        printf("[INFO] Recovered %d change(s) from the vote journal.\n", replayed);
+    }
+}
+
+// Starts a background checkpoint once the journal has grown in proportion
+// to the roll, or has held changes for JOURNAL_CHECKPOINT_SECONDS. A
+// failed journal is replaced by a checkpoint too. After a failure the next
+// try waits JOURNAL_RETRY_SECONDS.
+void checkpointIfDue() {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&journal.lock);
+    int due = journal.fp != NULL && now - journal.retried >= JOURNAL_RETRY_SECONDS &&
+              (journal.size >= journal.checkpointBytes ||
+               (journal.size > 0 && now - journal.checkpointed >= JOURNAL_CHECKPOINT_SECONDS));
+    if(journal.failed && now - journal.retried >= JOURNAL_RETRY_SECONDS) {
+        journal.retried = now;
+        due = 1;
+    }
+    pthread_mutex_unlock(&journal.lock);
+    if(due) {
+        runCheckpoint(1);
+    }
+}
+
+typedef struct {
+    int firstUser;
+    int userStep;
+    int votes;
+    int accepted;
+} VoteBenchWorker;
+
+static void* voteBenchThread(void* arg) {
+    VoteBenchWorker *worker = arg;
+    time_t now = time(NULL);
+    for(int i = 0; i < worker->votes; i++) {
+        int userIndex = worker->firstUser + i * worker->userStep;
+        if(castVoteFor(userIndex, 1 + userIndex % races[0]->candidateCount, now) == VOTE_OK) {
+            worker->accepted++;
+        }
+    }
+    return NULL;
+}
+
+// Casts one vote for every synthetic voter with 1, 2, 4... threads and
+// checks that tallies match, then lets two threads race for the same voters
+// to show that no one can vote twice. The journal is closed, so this
+// measures the in-memory voting path only.
+void benchmarkVoting() {
+    int voters = 1000000;
+    int maxThreads = cpuCount() * 2;
+    char name[MAX_NAME_LENGTH], nid[NID_LENGTH];
+    
+    closeJournal();
+    initializeRaces();
+    nidIndexInit(&nidIndex, userNIDAt, voters);
+    for(int i = 0; i < voters; i++) {
+        sprintf(name, "Voter %d", i);
+        sprintf(nid, "%013d", 1000000 + i);
+        applyRegister(name, nid, "H0", 0);
+    }
+    
+    printHeader("VOTE CASTING BENCHMARK");
+    printf("%-10s %-14s %-14s %-10s\n", "Threads", "Votes/sec", "Elapsed (ms)", "Tally OK");
+    
+    for(int threads = 1; threads <= maxThreads; threads *= 2) {
+        applyReset(ALL_RACES);
+        VoteBenchWorker workers[64];
+        pthread_t ids[64];
+        
+        double start = currentSeconds();
+        for(int t = 0; t < threads; t++) {
+            workers[t].firstUser = t;
+            workers[t].userStep = threads;
+            workers[t].votes = (voters - t + threads - 1) / threads;
+            workers[t].accepted = 0;
+            pthread_create(&ids[t], NULL, voteBenchThread, &workers[t]);
+        }
+        for(int t = 0; t < threads; t++) {
+            pthread_join(ids[t], NULL);
+        }
+        double elapsed = currentSeconds() - start;
+        
+        int tallied = 0;
+        for(int i = 0; i < races[0]->candidateCount; i++) {
+            tallied += candidateVotes(races[0], i);
+        }
+        printf("%-10d %-14.0f %-14.1f %-10s\n", threads, voters / elapsed,
+               elapsed * 1000.0, tallied == voters ? "yes" : "NO");
+        if(threads == 64) {
+            break;
+        }
+    }
+    
+    // Contention check: two threads try to vote for the same voters
+    applyReset(ALL_RACES);
+    VoteBenchWorker racers[2];
+    pthread_t ids[2];
+    for(int t = 0; t < 2; t++) {
+        racers[t].firstUser = 0;
+        racers[t].userStep = 1;
+        racers[t].votes = voters;
+        racers[t].accepted = 0;
+        pthread_create(&ids[t], NULL, voteBenchThread, &racers[t]);
+    }
+    pthread_join(ids[0], NULL);
+    pthread_join(ids[1], NULL);
+    printf("\nDouble-vote race: %d accepted out of %d attempts for %d voters (%s)\n",
+           racers[0].accepted + racers[1].accepted, 2 * voters, voters,
+           racers[0].accepted + racers[1].accepted == voters ? "OK" : "FAILED");
+}
+
+void outputPrintf(OutputBuffer* out, char* format, ...) {
+    va_list args;
+    
+    while(1) {
+        size_t room = out->capacity - out->length;
+        va_start(args, format);
+        int written = vsnprintf(out->data + out->length, room, format, args);
+        va_end(args);
+        
+        if(written < 0) {
+            return;
+        }
+        if((size_t)written < room) {
+            out->length += written;
+            return;
+        }
+        
+        size_t capacity = out->capacity > 0 ? out->capacity * 2 : 1024;
+        while(capacity - out->length <= (size_t)written) {
+            capacity *= 2;
+        }
+        char *grown = realloc(out->data, capacity);
+        if(grown == NULL) {
+            return;
+        }
+        out->data = grown;
+        out->capacity = capacity;
+    }
+}
+
+// Splits a request line on tabs in place; returns the number of fields
+static int splitFields(char* line, char** fields, int maxFields) {
+    int count = 0;
+    char *p = line;
+    while(count < maxFields) {
+        fields[count++] = p;
+        char *tab = strchr(p, '\t');
+        if(tab == NULL) {
+            break;
+        }
+        *tab = '\0';
+        p = tab + 1;
+    }
+    return count;
+}
+
+static int sessionActive(ClientSession* session) {
+    if(session->token[0] == '\0') {
+        return 0;
+    }
+    session->userIndex = sessionUser(session->token);
+    if(session->userIndex == -1) {
+        session->token[0] = '\0';
+        return 0;
+    }
+    return 1;
+}
+// First half of REGISTER and LOGIN: checks the request and fills in its
+// password job. Returns 0 after answering a request that needs no hashing.
+int preparePasswordRequest(char** fields, int count, PasswordRequest* request, OutputBuffer* out) {
+    memset(request, 0, sizeof(PasswordRequest));
+    request->login = strcmp(fields[0], "LOGIN") == 0;
+    request->started = currentSeconds();
+    
+    if(request->login) {
+        if(count != 3) {
+            outputPrintf(out, "ERR usage: LOGIN<TAB>nid<TAB>password\n");
+            return 0;
+        }
+        if(strlen(fields[2]) >= MAX_PASSWORD_LENGTH) {
+            metricAdd(METRIC_FAILED_LOGINS, 1);
+            outputPrintf(out, "ERR password too long\n");
+            return 0;
+        }
+        request->job.verify = 1;
+        strcpy(request->job.password, fields[2]);
+        pthread_rwlock_rdlock(&stateLock);
+        request->userIndex = findUserByNID(fields[1]);
+        if(request->userIndex != -1) {
+            strcpy(request->job.hash, userPasswordHash(request->userIndex));
+        }
+        pthread_rwlock_unlock(&stateLock);
+        return 1;
+    }
+    
+    if(count != 4 && count != 5) {
+        outputPrintf(out, "ERR usage: REGISTER<TAB>name<TAB>nid<TAB>password[<TAB>constituency id]\n");
+        return 0;
+    }
+    if(strlen(fields[1]) == 0 || strlen(fields[1]) >= MAX_VOTER_NAME_LENGTH) {
+        outputPrintf(out, "ERR invalid name\n");
+        return 0;
+    }
+    if(strlen(fields[2]) >= NID_LENGTH || !validateNID(fields[2])) {
+        outputPrintf(out, "ERR invalid NID\n");
+        return 0;
+    }
+    if(strlen(fields[3]) >= MAX_PASSWORD_LENGTH) {
+        outputPrintf(out, "ERR password too long\n");
+        return 0;
+    }
+    if(!validatePassword(fields[3])) {
+        outputPrintf(out, "ERR weak password\n");
+        return 0;
+    }
+    request->race = count == 5 ? atoi(fields[4]) - 1 : 0;
+    if(request->race < 0 || request->race >= raceCount) {
+        outputPrintf(out, "ERR unknown constituency\n");
+        return 0;
+    }
+    // Spare the hashing for a NID that is already taken
+    pthread_rwlock_rdlock(&stateLock);
+    int existing = findUserByNID(fields[2]);
+    pthread_rwlock_unlock(&stateLock);
+    if(existing != -1) {
+        outputPrintf(out, "ERR NID already registered\n");
+        return 0;
+    }
+    strcpy(request->fullName, fields[1]);
+    strcpy(request->nid, fields[2]);
+    strcpy(request->job.password, fields[3]);
+    return 1;
+}
+
+// Second half, once the password job has run. Returns 1 if a voter was
+// registered.
+int finishPasswordRequest(ClientSession* session, PasswordRequest* request, OutputBuffer* out) {
+    KdfJob *job = &request->job;
+    
+    if(request->login) {
+        if(request->userIndex == -1 || !job->matched) {
+            metricAdd(METRIC_FAILED_LOGINS, 1);
+            logActivity("Failed login attempt");
+            outputPrintf(out, "ERR invalid NID number or password\n");
+            return 0;
+        }
+        if(job->upgradedHash[0] != '\0') {
+            upgradePasswordHash(request->userIndex, job->hash, job->upgradedHash);
+        }
+        endSession(session->token);
+        session->userIndex = -1;
+        if(!createSession(request->userIndex, session->token)) {
+            outputPrintf(out, "ERR out of memory\n");
+            return 0;
+        }
+        session->userIndex = request->userIndex;
+        currentUserIndex = request->userIndex;
+        metricAdd(METRIC_LOGINS, 1);
+        metricTime(TIMER_LOGIN, currentSeconds() - request->started);
+        logActivity("User logged in");
+        outputPrintf(out, "OK\t%s\t%s\n", userFullName(request->userIndex), session->token);
+        return 0;
+    }
+    
+    if(!job->matched) {
+        outputPrintf(out, "ERR out of memory\n");
+        return 0;
+    }
+    int userIndex;
+    int result = registerVoter(request->fullName, request->nid, job->hash, request->race, &userIndex);
+    if(result == REGISTER_DUPLICATE) {
+        outputPrintf(out, "ERR NID already registered\n");
+        return 0;
+    } else if(result == REGISTER_NO_MEMORY) {
+        outputPrintf(out, "ERR out of memory\n");
+        return 0;
+    } else if(result == REGISTER_INVALID_RACE) {
+        outputPrintf(out, "ERR unknown constituency\n");
+        return 0;
+    } else if(result == REGISTER_NOT_SAVED) {
+        // Reported as a change so the caller tries the checkpoint that
+        // starts a new journal
+        outputPrintf(out, "ERR could not be saved\n");
+        return 1;
+    }
+    logActivity("User registered");
+    outputPrintf(out, "OK\n");
+    return 1;
+}
+
+// Request/response protocol shared by the socket server and batch mode.
+// One request per line, fields separated by tabs:
+//   REGISTER <name> <nid> <password> [constituency id]
+//   LOGIN <nid> <password>             LOGOUT
+//   RESUME <session token>
+//   VOTE <candidate id>                STATS
+//   RESULTS [k] [constituency id]      RACES
+//   SEARCH <terms>                     KDFSTATS
+// Every response starts with OK or ERR on its own line. LOGIN answers OK,
+// the voter's name and a session token; RESUME attaches that session to
+// another connection until it is logged out or idle for SESSION_TIMEOUT
+// seconds. STATS answers OK, voters, voted, votes, candidates, election
+// status, constituencies and active sessions. RESULTS answers
+// OK, count, total votes and the number tied for the lead, then one line
+// per candidate in rank order: id, name, party, votes. It defaults to the
+// logged-in voter's constituency, or the first one. RACES answers OK and
+// the constituency count, then per constituency: id, name, candidates,
+// registered, voted, votes, leading candidate id (0 for none or a tie).
+// SEARCH answers OK, the number of matches and the number listed, then
+// per match: constituency id, candidate id, name, party, score.
+// KDFSTATS answers OK, password workers, queued jobs, peak queue depth,
+// jobs completed, jobs turned away, legacy hashes upgraded, and p50 and
+// p99 job latency in microseconds. The server may answer REGISTER and
+// LOGIN with "ERR server busy" when the password queue is full.
+// Returns 1 if the request changed election state.
+int handleCommand(ClientSession* session, char* line, OutputBuffer* out) {
+    char *fields[5];
+    line[strcspn(line, "\r\n")] = 0;
+    int count = splitFields(line, fields, 5);
+    char *command = fields[0];
+    
+    if(strcmp(command, "REGISTER") == 0 || strcmp(command, "LOGIN") == 0) {
+        PasswordRequest request;
+        if(!preparePasswordRequest(fields, count, &request, out)) {
+            return 0;
+        }
+        kdfRun(&request.job);
+        return finishPasswordRequest(session, &request, out);
+    }
+    
+    if(strcmp(command, "KDFSTATS") == 0) {
+        KdfStats stats;
+        kdfPoolStats(&stats);
+        outputPrintf(out, "OK\t%d\t%d\t%d\t%llu\t%llu\t%llu\t%.0f\t%.0f\n", stats.workers, stats.queued,
+                     stats.peakQueued, stats.completed, stats.rejected, stats.migrated,
+                     stats.p50Us, stats.p99Us);
+        return 0;
+    }
+    
+    if(strcmp(command, "LOGOUT") == 0) {
+        if(sessionActive(session)) {
+            logActivity("User logged out");
+        }
+        endSession(session->token);
+        session->token[0] = '\0';
+        session->userIndex = -1;
+        currentUserIndex = -1;
+        outputPrintf(out, "OK\n");
+        return 0;
+    }
+    
+    if(strcmp(command, "RESUME") == 0) {
+        if(count != 2 || strlen(fields[1]) >= SESSION_TOKEN_LENGTH) {
+            outputPrintf(out, "ERR usage: RESUME<TAB>session token\n");
+            return 0;
+        }
+        int userIndex = sessionUser(fields[1]);
+        if(userIndex == -1) {
+            outputPrintf(out, "ERR session expired or unknown\n");
+            return 0;
+        }
+        strcpy(session->token, fields[1]);
+        session->userIndex = userIndex;
+        currentUserIndex = userIndex;
+        outputPrintf(out, "OK\t%s\n", userFullName(userIndex));
+        return 0;
+    }
+    
+    if(strcmp(command, "VOTE") == 0) {
+        if(!sessionActive(session)) {
+            outputPrintf(out, "ERR not logged in\n");
+            return 0;
+        }
+        if(count != 2) {
+            outputPrintf(out, "ERR usage: VOTE<TAB>candidate id\n");
+            return 0;
+        }
+        int result = castVoteFor(session->userIndex, atoi(fields[1]), time(NULL));
+        if(result == VOTE_OK) {
+            logActivity("Vote cast");
+            outputPrintf(out, "OK\n");
+            return 1;
+        }
+        outputPrintf(out, "ERR %s\n",
+                     result == VOTE_NOT_STARTED ? "election has not started yet" :
+                     result == VOTE_ENDED ? "election has ended" :
+                     result == VOTE_INVALID_CANDIDATE ? "invalid candidate ID" :
+                     result == VOTE_NOT_SAVED ? "could not be saved" :
+                     "already voted");
+        return result == VOTE_NOT_SAVED;
+    }
+    
+    if(strcmp(command, "RESULTS") == 0) {
+        int indices[MAX_CANDIDATES], votes[MAX_CANDIDATES], totalVotes;
+        int k = count > 1 ? atoi(fields[1]) : MAX_CANDIDATES;
+        
+        pthread_rwlock_rdlock(&stateLock);
+        int race = count > 2 ? atoi(fields[2]) - 1 :
+                   sessionActive(session) ? userRace(session->userIndex) : 0;
+        if(race < 0 || race >= raceCount) {
+            pthread_rwlock_unlock(&stateLock);
+            outputPrintf(out, "ERR unknown constituency\n");
+            return 0;
+        }
+        Candidate *list = races[race]->candidates;
+        int ranked = leaderboardTop(races[race], k > 0 ? k : MAX_CANDIDATES, indices, votes, &totalVotes);
+        int leaders = ranked > 0 && votes[0] > 0 ? countLeaders(votes, ranked) : 0;
+        outputPrintf(out, "OK\t%d\t%d\t%d\n", ranked, totalVotes, leaders);
+        for(int r = 0; r < ranked; r++) {
+            outputPrintf(out, "%d\t%s\t%s\t%d\n", list[indices[r]].id,
+                         list[indices[r]].name, list[indices[r]].party, votes[r]);
+        }
+        pthread_rwlock_unlock(&stateLock);
+        return 0;
+    }
+    
+    if(strcmp(command, "SEARCH") == 0) {
+        if(count != 2) {
+            outputPrintf(out, "ERR usage: SEARCH<TAB>terms\n");
+            return 0;
+        }
+        SearchHit hits[SEARCH_MAX_RESULTS];
+        pthread_rwlock_rdlock(&stateLock);
+        int found = searchCandidates(fields[1], hits, SEARCH_MAX_RESULTS);
+        int shown = found < SEARCH_MAX_RESULTS ? found : SEARCH_MAX_RESULTS;
+        outputPrintf(out, "OK\t%d\t%d\n", found, shown);
+        for(int i = 0; i < shown; i++) {
+            Candidate *c = &races[hits[i].race]->candidates[hits[i].index];
+            outputPrintf(out, "%d\t%d\t%s\t%s\t%d\n", hits[i].race + 1, c->id,
+                         c->name, c->party, hits[i].score);
+        }
+        pthread_rwlock_unlock(&stateLock);
+        return 0;
+    }
+    
+    if(strcmp(command, "STATS") == 0 || strcmp(command, "RACES") == 0) {
+        pthread_rwlock_rdlock(&stateLock);
+        RaceSummary *summaries = calloc(raceCount, sizeof(RaceSummary));
+        if(summaries == NULL || !summarizeRaces(summaries)) {
+            pthread_rwlock_unlock(&stateLock);
+            free(summaries);
+            outputPrintf(out, "ERR out of memory\n");
+            return 0;
+        }
+        
+        if(strcmp(command, "RACES") == 0) {
+            outputPrintf(out, "OK\t%d\n", raceCount);
+            for(int r = 0; r < raceCount; r++) {
+                RaceSummary *summary = &summaries[r];
+                outputPrintf(out, "%d\t%s\t%d\t%d\t%d\t%d\t%d\n", races[r]->id, races[r]->name,
+                             races[r]->candidateCount, summary->registered, summary->voted,
+                             summary->totalVotes,
+                             summary->leaders == 1 ? races[r]->candidates[summary->order[0]].id : 0);
+            }
+        } else {
+            int votedUsers = 0, totalVotes = 0;
+            for(int r = 0; r < raceCount; r++) {
+                votedUsers += summaries[r].voted;
+                totalVotes += summaries[r].totalVotes;
+            }
+            Race *race = races[sessionActive(session) ? userRace(session->userIndex) : 0];
+            outputPrintf(out, "OK\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", userCount, votedUsers,
+                         totalVotes, totalCandidateCount(), isElectionActive(race), raceCount,
+                         activeSessionCount());
+        }
+        pthread_rwlock_unlock(&stateLock);
+        free(summaries);
+        return 0;
+    }
+    
+    outputPrintf(out, "ERR unknown command\n");
+    return 0;
+}
+
+// Trusted operator commands accepted only in batch mode, in addition to
+// everything handleCommand() understands:
+//   CAST <nid> <candidate id>          vote on behalf of a registered voter
+//   ADD_CANDIDATE <name> <party> <age> <education> <manifesto> [constituency id]
+//   ADD_CONSTITUENCY <name> [days]     answers OK and the new id
+//   RESET [constituency id]            EXPORT [path]
+//   SAVE                               write a checkpoint now
+int handleBatchCommand(ClientSession* session, char* line, OutputBuffer* out) {
+    char *fields[7];
+    char copy[SERVER_LINE_MAX];
+    
+    strncpy(copy, line, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    copy[strcspn(copy, "\r\n")] = 0;
+    int count = splitFields(copy, fields, 7);
+    char *command = fields[0];
+    
+    if(strcmp(command, "CAST") == 0) {
+        if(count != 3) {
+            outputPrintf(out, "ERR usage: CAST<TAB>nid<TAB>candidate id\n");
+            return 0;
+        }
+        pthread_rwlock_rdlock(&stateLock);
+        int userIndex = findUserByNID(fields[1]);
+        pthread_rwlock_unlock(&stateLock);
+        if(userIndex == -1) {
+            outputPrintf(out, "ERR unknown NID\n");
+            return 0;
+        }
+        int result = castVoteFor(userIndex, atoi(fields[2]), time(NULL));
+        if(result != VOTE_OK) {
+            outputPrintf(out, "ERR %s\n",
+                         result == VOTE_NOT_STARTED ? "election has not started yet" :
+                         result == VOTE_ENDED ? "election has ended" :
+                         result == VOTE_INVALID_CANDIDATE ? "invalid candidate ID" :
+                         result == VOTE_NOT_SAVED ? "could not be saved" :
+                         "already voted");
+            return result == VOTE_NOT_SAVED;
+        }
+        outputPrintf(out, "OK\n");
+        return 1;
+    }
+    
+    if(strcmp(command, "ADD_CANDIDATE") == 0) {
+        if(count != 6 && count != 7) {
+            outputPrintf(out, "ERR usage: ADD_CANDIDATE<TAB>name<TAB>party<TAB>age<TAB>education<TAB>manifesto"
+                              "[<TAB>constituency id]\n");
+            return 0;
+        }
+        Candidate candidate;
+        memset(&candidate, 0, sizeof(candidate));
+        strncpy(candidate.name, fields[1], sizeof(candidate.name) - 1);
+        strncpy(candidate.party, fields[2], sizeof(candidate.party) - 1);
+        candidate.age = atoi(fields[3]);
+        strncpy(candidate.education, fields[4], sizeof(candidate.education) - 1);
+        strncpy(candidate.manifesto, fields[5], sizeof(candidate.manifesto) - 1);
+        int result = insertCandidate(count == 7 ? atoi(fields[6]) - 1 : 0, &candidate);
+        if(result != CHANGE_OK) {
+            outputPrintf(out, "ERR %s\n", result == CHANGE_NOT_SAVED ? "could not be saved" :
+                                            "unknown constituency or candidate limit reached");
+            return 0;
+        }
+        logActivity("Candidate added by batch");
+        outputPrintf(out, "OK\t%d\n", candidate.id);
+        return 1;
+    }
+    
+    if(strcmp(command, "ADD_CONSTITUENCY") == 0) {
+        if(count != 2 && count != 3) {
+            outputPrintf(out, "ERR usage: ADD_CONSTITUENCY<TAB>name[<TAB>days]\n");
+            return 0;
+        }
+        int days = count == 3 ? atoi(fields[2]) : 7;
+        if(strlen(fields[1]) == 0 || strlen(fields[1]) >= MAX_NAME_LENGTH || days < 1 || days > 365) {
+            outputPrintf(out, "ERR invalid name or duration\n");
+            return 0;
+        }
+        time_t startTime = time(NULL);
+        int race;
+        int result = createRace(fields[1], startTime, startTime + (days * 24 * 60 * 60), &race);
+        if(result != CHANGE_OK) {
+            outputPrintf(out, "ERR %s\n", result == CHANGE_NOT_SAVED ? "could not be saved" :
+                                            "maximum constituency limit reached");
+            return 0;
+        }
+        logActivity("Constituency added by batch");
+        outputPrintf(out, "OK\t%d\n", race + 1);
+        return 1;
+    }
+    
+    if(strcmp(command, "RESET") == 0) {
+        int race = count > 1 ? atoi(fields[1]) - 1 : ALL_RACES;
+        pthread_rwlock_rdlock(&stateLock);
+        int known = race >= ALL_RACES && race < raceCount;
+        pthread_rwlock_unlock(&stateLock);
+        if(!known) {
+            outputPrintf(out, "ERR unknown constituency\n");
+            return 0;
+        }
+        if(resetVotes(race) == CHANGE_NOT_SAVED) {
+            outputPrintf(out, "ERR could not be saved\n");
+            return 0;
+        }
+        logActivity("Election reset by batch");
+        outputPrintf(out, "OK\n");
+        return 1;
+    }
+    
+    if(strcmp(command, "EXPORT") == 0) {
+        char *path = count > 1 ? fields[1] : "election_results.txt";
+        if(!writeResultsFile(path)) {
+            outputPrintf(out, "ERR failed to export results\n");
+            return 0;
+        }
+        logActivity("Results exported");
+        outputPrintf(out, "OK\t%s\n", path);
+        return 0;
+    }
+    
+    if(strcmp(command, "SAVE") == 0) {
+        saveData();
+        outputPrintf(out, "OK\n");
+        return 0;
+    }
+    
+    if(strcmp(command, "BACKUP") == 0) {
+        waitForBackup();
+        int number = startBackup();
+        if(number <= 0) {
+            outputPrintf(out, "ERR failed to start the backup\n");
+            return 0;
+        }
+        outputPrintf(out, "OK\t%d\n", number);
+        return 0;
+    }
+    
+    return handleCommand(session, line, out);
+}
+
+// Reports one batch response; returns 1 for an error
+static int reportBatchOutput(long lineNumber, char* line, OutputBuffer* out) {
+    if(out->length >= 3 && memcmp(out->data, "ERR", 3) == 0) {
+        fprintf(stderr, "line %ld: %.*s", lineNumber, (int)out->length, out->data);
+        return 1;
+    } else if(out->length > 0 && strncmp(line, "RESULTS", 7) == 0) {
+        fwrite(out->data, 1, out->length, stdout);
+    } else if(out->length > 0 && (strncmp(line, "STATS", 5) == 0 || strncmp(line, "RACES", 5) == 0 ||
+                                  strncmp(line, "SEARCH", 6) == 0 || strncmp(line, "KDFSTATS", 8) == 0)) {
+        fwrite(out->data, 1, out->length, stdout);
+    }
+    return 0;
+}
+
+typedef struct {
+    PasswordRequest requests[BATCH_KDF_WINDOW];
+    long lineNumbers[BATCH_KDF_WINDOW];
+    int count;
+} BatchRegisters;
+
+// Hashes the queued REGISTERs together, then registers them in file order.
+// Returns the number of state changes.
+static int finishBatchRegisters(BatchRegisters* pending, ClientSession* session, OutputBuffer* out,
+                                long* failures) {
+    KdfJob *jobs[BATCH_KDF_WINDOW];
+    int changes = 0;
+    if(pending->count == 0) {
+        return 0;
+    }
+    for(int i = 0; i < pending->count; i++) {
+        jobs[i] = &pending->requests[i].job;
+    }
+    kdfRunAll(jobs, pending->count);
+    for(int i = 0; i < pending->count; i++) {
+        out->length = 0;
+        changes += finishPasswordRequest(session, &pending->requests[i], out);
+        *failures += reportBatchOutput(pending->lineNumbers[i], "REGISTER", out);
+    }
+    pending->count = 0;
+    return changes;
+}
+
+// Applies a command file (or stdin) without any prompts. The journal is
+// closed for the run, so nothing is persisted per operation; instead a
+// checkpoint is written every saveEvery state changes (0 = only at the end).
+// Runs of REGISTER lines are hashed BATCH_KDF_WINDOW at a time on the KDF
+// pool, the way the server overlaps them.
+int runBatch(char* path, int saveEvery) {
+    FILE *in = stdin;
+    if(path != NULL && strcmp(path, "-") != 0) {
+        in = fopen(path, "r");
+        if(in == NULL) {
+            printError("Could not open the batch file!");
+            return 1;
+        }
+    }
+    
+    startSystem();
+    closeJournal();
+    
+    ClientSession session;
+    session.userIndex = -1;
+    session.token[0] = '\0';
+    OutputBuffer out = { NULL, 0, 0 }, registered = { NULL, 0, 0 };
+    BatchRegisters *pending = malloc(sizeof(BatchRegisters));
+    if(pending == NULL) {
+        printError("Not enough memory for the batch run!");
+        return 1;
+    }
+    pending->count = 0;
+    char line[SERVER_LINE_MAX];
+    long lineNumber = 0, operations = 0, failures = 0, changesSinceSave = 0;
+    double start = currentSeconds();
+    
+    while(fgets(line, sizeof(line), in)) {
+        lineNumber++;
+        if(line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        
+        out.length = 0;
+        operations++;
+        int changed = 0;
+        if(strncmp(line, "REGISTER\t", 9) == 0) {
+            char *fields[5];
+            line[strcspn(line, "\r\n")] = 0;
+            int count = splitFields(line, fields, 5);
+            if(preparePasswordRequest(fields, count, &pending->requests[pending->count], &out)) {
+                pending->lineNumbers[pending->count++] = lineNumber;
+                if(pending->count < BATCH_KDF_WINDOW) {
+                    continue;
+                }
+                changed = finishBatchRegisters(pending, &session, &registered, &failures);
+            } else {
+                // Earlier lines answer first
+                changed = finishBatchRegisters(pending, &session, &registered, &failures);
+                failures += reportBatchOutput(lineNumber, line, &out);
+            }
+        } else {
+            changed = finishBatchRegisters(pending, &session, &registered, &failures);
+            currentUserIndex = session.userIndex;
+            changed += handleBatchCommand(&session, line, &out);
+            failures += reportBatchOutput(lineNumber, line, &out);
+        }
+        
+        changesSinceSave += changed;
+        if(changed && saveEvery > 0 && changesSinceSave >= saveEvery) {
+            saveData();
+            changesSinceSave = 0;
+        }
+    }
+    
+    if(in != stdin) {
+        fclose(in);
+    }
+    finishBatchRegisters(pending, &session, &registered, &failures);
+    free(pending);
+    free(registered.data);
+    waitForBackup();
+    saveData();
+    free(out.data);
+    
+    double elapsed = currentSeconds() - start;
+    printf("[INFO] Batch finished: %ld operation(s), %ld failed, %.2fs (%.0f ops/sec)\n",
+           operations, failures, elapsed, elapsed > 0 ? operations / elapsed : 0.0);
+    logActivity("Batch run completed");
+    stopLogger();
+    return failures > 0 ? 2 : 0;
+}
+
+#ifdef __linux__
+typedef struct {
+    int epollFd;
+    int wakeFd;                 // eventfd the KDF workers signal
+    pthread_mutex_t lock;
+    KdfJob *finished;           // password jobs handed back by the workers
+    int inFlight;               // password jobs not yet handed back
+} ServerLoop;
+
+typedef struct {
+    int fd;
+    ServerLoop *loop;
+    ClientSession session;
+    char input[SERVER_LINE_MAX];
+    size_t inputLength;
+    OutputBuffer output;
+    size_t outputSent;
+    unsigned int events;        // epoll events currently requested
+    PasswordRequest *pending;   // LOGIN or REGISTER waiting for a KDF worker
+    int closed;                 // socket closed while a request was pending
+} ServerConnection;
+
+static volatile sig_atomic_t serverStopping = 0;
+
+static void stopServer(int signalNumber) {
+    (void)signalNumber;
+    serverStopping = 1;
+}
+
+// A connection with a pending password job is freed when the job comes back
+static void closeConnection(int epollFd, ServerConnection* conn) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if(conn->pending != NULL) {
+        conn->closed = 1;
+        return;
+    }
+    free(conn->output.data);
+    free(conn);
+}
+
+// Sends as much pending output as the socket takes; returns 0 on error
+static int flushConnection(int epollFd, ServerConnection* conn) {
+    while(conn->outputSent < conn->output.length) {
+        ssize_t sent = send(conn->fd, conn->output.data + conn->outputSent,
+                            conn->output.length - conn->outputSent, MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return 0;
+        }
+        conn->outputSent += sent;
+    }
+    
+    int pending = conn->outputSent < conn->output.length;
+    if(!pending) {
+        conn->output.length = 0;
+        conn->outputSent = 0;
+    }
+    // Stop reading while a request waits for its password job
+    unsigned int wanted = (conn->pending == NULL ? EPOLLIN | EPOLLRDHUP : 0) | (pending ? EPOLLOUT : 0);
+    if(wanted != conn->events) {
+        struct epoll_event event;
+        event.events = wanted;
+        event.data.ptr = conn;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->events = wanted;
+    }
+    return 1;
+}
+
+// Runs on a KDF worker: hands the request back to the connection's loop
+static void serverPasswordDone(KdfJob* job) {
+    ServerConnection *conn = job->context;
+    ServerLoop *loop = conn->loop;
+    pthread_mutex_lock(&loop->lock);
+    job->next = loop->finished;
+    loop->finished = job;
+    pthread_mutex_unlock(&loop->lock);
+    
+    unsigned long long one = 1;
+    if(write(loop->wakeFd, &one, sizeof(one)) < 0) {
+        // The counter is already non-zero, so the loop will wake anyway
+    }
+}
+
+// Queues the password job of a LOGIN or REGISTER line for the KDF pool
+static void startPasswordRequest(ServerConnection* conn, char* line) {
+    char *fields[5];
+    line[strcspn(line, "\r\n")] = 0;
+    int count = splitFields(line, fields, 5);
+    
+    PasswordRequest *request = malloc(sizeof(PasswordRequest));
+    if(request == NULL) {
+        outputPrintf(&conn->output, "ERR out of memory\n");
+        return;
+    }
+    if(!preparePasswordRequest(fields, count, request, &conn->output)) {
+        free(request);
+        return;
+    }
+    request->job.done = serverPasswordDone;
+    request->job.context = conn;
+    if(!kdfSubmit(&request->job)) {
+        outputPrintf(&conn->output, "ERR server busy, try again\n");
+        free(request);
+        return;
+    }
+    conn->pending = request;
+    conn->loop->inFlight++;
+}
+
+static int isPasswordCommand(char* line) {
+    size_t length = strcspn(line, "\t\r\n");
+    return (length == 5 && strncmp(line, "LOGIN", 5) == 0) ||
+           (length == 8 && strncmp(line, "REGISTER", 8) == 0);
+}
+
+// Answers complete request lines in order until one has to wait for a
+// password job; returns 1 if election state changed
+static int processInput(ServerConnection* conn) {
+    char *start = conn->input;
+    char *newline;
+    int changed = 0;
+    while(conn->pending == NULL &&
+          (newline = memchr(start, '\n', conn->input + conn->inputLength - start)) != NULL) {
+        *newline = '\0';
+        currentUserIndex = conn->session.userIndex;
+        if(isPasswordCommand(start)) {
+            startPasswordRequest(conn, start);
+        } else {
+            changed |= handleCommand(&conn->session, start, &conn->output);
+        }
+        start = newline + 1;
+    }
+    conn->inputLength -= start - conn->input;
+    memmove(conn->input, start, conn->inputLength);
+    return changed;
+}
+
+// Reads what is available and answers every complete request line;
+// returns 0 when the connection should be closed
+static int serveConnection(ServerConnection* conn) {
+    while(conn->pending == NULL) {
+        if(conn->inputLength == sizeof(conn->input)) {
+            outputPrintf(&conn->output, "ERR request too long\n");
+            return 0;
+        }
+        ssize_t got = recv(conn->fd, conn->input + conn->inputLength,
+                           sizeof(conn->input) - conn->inputLength, 0);
+        if(got == 0) {
+            return 0;
+        }
+        if(got < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->inputLength += got;
+        
+        if(processInput(conn)) {
+            checkpointIfDue();
+        }
+    }
+    return 1;
+}
+
+// Answers the requests whose password jobs have finished and resumes
+// reading from their connections
+static void finishPasswordRequests(ServerLoop* loop) {
+    unsigned long long count;
+    if(read(loop->wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        return;
+    }
+    pthread_mutex_lock(&loop->lock);
+    KdfJob *job = loop->finished;
+    loop->finished = NULL;
+    pthread_mutex_unlock(&loop->lock);
+    
+    while(job != NULL) {
+        KdfJob *next = job->next;
+        PasswordRequest *request = (PasswordRequest*)job;
+        ServerConnection *conn = job->context;
+        loop->inFlight--;
+        conn->pending = NULL;
+        
+        if(conn->closed) {
+            free(conn->output.data);
+            free(conn);
+        } else {
+            currentUserIndex = conn->session.userIndex;
+            int changed = finishPasswordRequest(&conn->session, request, &conn->output);
+            changed |= processInput(conn);
+            if(changed) {
+                checkpointIfDue();
+            }
+            if(!flushConnection(loop->epollFd, conn)) {
+                closeConnection(loop->epollFd, conn);
+            }
+        }
+        free(request);
+        job = next;
+    }
+}
+
+static void acceptConnections(ServerLoop* loop, int listenFd) {
+    while(1) {
+        int fd = accept(listenFd, NULL, NULL);
+        if(fd < 0) {
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        
+        ServerConnection *conn = calloc(1, sizeof(ServerConnection));
+        if(conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->loop = loop;
+        conn->session.userIndex = -1;
+        conn->events = EPOLLIN | EPOLLRDHUP;
+        
+        struct epoll_event event;
+        event.events = conn->events;
+        event.data.ptr = conn;
+        if(epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            close(fd);
+            free(conn);
+        }
+    }
+}
+
+// One event loop per core. All loops wait on the shared listening socket
+// and each owns the connections it accepted. Password hashing for LOGIN
+// and REGISTER runs on the KDF pool; the loop keeps serving other
+// connections and is woken through its eventfd when a job is done.
+static void* serverLoop(void* arg) {
+    int listenFd = *(int*)arg;
+    ServerLoop loop;
+    memset(&loop, 0, sizeof(loop));
+    pthread_mutex_init(&loop.lock, NULL);
+    loop.epollFd = epoll_create1(0);
+    loop.wakeFd = eventfd(0, EFD_NONBLOCK);
+    if(loop.epollFd < 0 || loop.wakeFd < 0) {
+        return NULL;
+    }
+    
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, listenFd, &event);
+    event.events = EPOLLIN;
+    event.data.ptr = &loop;
+    epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, loop.wakeFd, &event);
+    
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    while(!serverStopping) {
+        int ready = epoll_wait(loop.epollFd, events, SERVER_MAX_EVENTS, 1000);
+        for(int i = 0; i < ready; i++) {
+            if(events[i].data.ptr == NULL) {
+                acceptConnections(&loop, listenFd);
+                continue;
+            }
+            if(events[i].data.ptr == &loop) {
+                finishPasswordRequests(&loop);
+                continue;
+            }
+            ServerConnection *conn = events[i].data.ptr;
+            
+            int keep = !(events[i].events & (EPOLLERR | EPOLLHUP));
+            if(keep && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {
+                keep = serveConnection(conn);
+            }
+            // Answer whatever was produced even if the peer is closing
+            if(!flushConnection(loop.epollFd, conn) || !keep) {
+                closeConnection(loop.epollFd, conn);
+            }
+        }
+    }
+    
+    // Workers still hold jobs that point at this loop
+    while(loop.inFlight > 0) {
+        epoll_wait(loop.epollFd, events, SERVER_MAX_EVENTS, 100);
+        finishPasswordRequests(&loop);
+    }
+    close(loop.wakeFd);
+    close(loop.epollFd);
+    pthread_mutex_destroy(&loop.lock);
+    return NULL;
+}
+
+static int openListener(char* address) {
+    int fd;
+    
+    if(address != NULL && strchr(address, '/') != NULL) {
+        struct sockaddr_un local;
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        strncpy(local.sun_path, address, sizeof(local.sun_path) - 1);
+        unlink(address);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0 || bind(fd, (struct sockaddr*)&local, sizeof(local)) != 0) {
+            return -1;
+        }
+    } else {
+        struct sockaddr_in loopback;
+        int reuse = 1;
+        memset(&loopback, 0, sizeof(loopback));
+        loopback.sin_family = AF_INET;
+        loopback.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        loopback.sin_port = htons(address != NULL ? atoi(address) : SERVER_DEFAULT_PORT);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd < 0) {
+            return -1;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if(bind(fd, (struct sockaddr*)&loopback, sizeof(loopback)) != 0) {
+            return -1;
+        }
+    }
+    
+    if(listen(fd, 128) != 0) {
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+// Serves the protocol on a Unix-domain socket (any address containing '/')
+// or on a loopback TCP port until SIGINT or SIGTERM, then checkpoints.
+int runServer(char* address) {
+    startSystem();
+    
+    int listenFd = openListener(address);
+    if(listenFd < 0) {
+        printError("Could not open the server socket!");
+        return 1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    
+    int threads = cpuCount();
+    pthread_t *loops = malloc(sizeof(pthread_t) * threads);
+    if(loops == NULL) {
+        return 1;
+    }
+    for(int t = 0; t < threads; t++) {
+        pthread_create(&loops[t], NULL, serverLoop, &listenFd);
+    }
+    
+    if(address != NULL) {
+        printf("[INFO] Serving on %s with %d event loop(s). Press Ctrl+C to stop.\n", address, threads);
+    } else {
+        printf("[INFO] Serving on 127.0.0.1:%d with %d event loop(s). Press Ctrl+C to stop.\n",
+               SERVER_DEFAULT_PORT, threads);
+    }
+    fflush(stdout);
+    logActivity("Server started");
+    
+    for(int t = 0; t < threads; t++) {
+        pthread_join(loops[t], NULL);
+    }
+    free(loops);
+    close(listenFd);
+    if(address != NULL && strchr(address, '/') != NULL) {
+        unlink(address);
+    }
+    
+    saveData();
+    closeJournal();
+    stopMetricsWriter();
+    logActivity("Server shutdown");
+    stopLogger();
+    printSuccess("Server stopped.");
+    return 0;
+}
+#else
+int runServer(char* address) {
+    (void)address;
+    printError("Server mode is only available on Linux.");
+    return 1;
+}
+#endif
+
+void clearInputBuffer() {
+    int c;
+    while ((c = getchar()) != '\n' && c != EOF);
+}
+
+// Reads one line without its newline. Returns 0, and drops the rest of
+// the line, when it does not fit.
+int readInputLine(char* buffer, int size) {
+    if(fgets(buffer, size, stdin) == NULL) {
+        buffer[0] = '\0';
+        return 1;
+    }
+    size_t length = strcspn(buffer, "\n");
+    if(buffer[length] != '\n' && !feof(stdin)) {
+        clearInputBuffer();
+        buffer[0] = '\0';
+        return 0;
+    }
+    buffer[length] = '\0';
+    return 1;
+}
+
+User* userAt(int index) {
+    return &userChunks[index >> USER_CHUNK_SHIFT][index & (USER_CHUNK_SIZE - 1)];
+}
+
+// Appends a string to the arena. Returns 0 if memory runs out.
+int arenaAdd(char* text, StringRef* ref) {
+    unsigned int length = (unsigned int)strlen(text);
+    unsigned long long size = (sizeof(length) + length + 1 + 3) & ~3ULL;
+    unsigned long long offset = stringArena.used;
+    char **blocks = atomic_load_explicit(&stringArena.blocks, memory_order_relaxed);
+    if(size > ARENA_BLOCK_SIZE) {
+        return 0;
+    }
+    if(offset % ARENA_BLOCK_SIZE != 0 && offset - offset % ARENA_BLOCK_SIZE < stringArena.mapped) {
+        // The last mapped block may end where the file does
+        offset += ARENA_BLOCK_SIZE - offset % ARENA_BLOCK_SIZE;
+    } else if(offset % ARENA_BLOCK_SIZE + size > ARENA_BLOCK_SIZE) {
+        // Zero the unused tail, since snapshots write whole blocks
+        memset(blocks[offset / ARENA_BLOCK_SIZE] + offset % ARENA_BLOCK_SIZE, 0,
+               ARENA_BLOCK_SIZE - offset % ARENA_BLOCK_SIZE);
+        offset += ARENA_BLOCK_SIZE - offset % ARENA_BLOCK_SIZE;
+    }
+    
+    int block = (int)(offset / ARENA_BLOCK_SIZE);
+    if(block == stringArena.blockCount) {
+        if(block == stringArena.blockCapacity) {
+            int capacity = stringArena.blockCapacity > 0 ? stringArena.blockCapacity * 2 : 64;
+            char **grown = malloc(sizeof(char*) * capacity);
+            if(grown == NULL) {
+                return 0;
+            }
+            if(stringArena.blockCount > 0) {
+                memcpy(grown, blocks, sizeof(char*) * stringArena.blockCount);
+            }
+            // Readers without the state lock may still hold the old table
+            atomic_store_explicit(&stringArena.blocks, grown, memory_order_release);
+            blocks = grown;
+            stringArena.blockCapacity = capacity;
+        }
+        blocks[block] = malloc(ARENA_BLOCK_SIZE);
+        if(blocks[block] == NULL) {
+            return 0;
+        }
+        stringArena.blockCount++;
+    }
+    
+    char *entry = blocks[block] + offset % ARENA_BLOCK_SIZE;
+    memcpy(entry, &length, sizeof(length));
+    memcpy(entry + sizeof(length), text, length + 1);
+    memset(entry + sizeof(length) + length + 1, 0, size - sizeof(length) - length - 1);
+    stringArena.used = offset + size;
+    *ref = offset;
+    return 1;
+}
+
+char* arenaText(StringRef ref) {
+    char **blocks = atomic_load_explicit(&stringArena.blocks, memory_order_acquire);
+    return blocks[ref / ARENA_BLOCK_SIZE] + ref % ARENA_BLOCK_SIZE + sizeof(unsigned int);
+}
+
+// Uses an arena read from a snapshot. Strings added later go to new
+// blocks, so the mapped ones are never written, and only the size bytes
+// of them are ever read.
+static int mapStringArena(char* base, unsigned long long size) {
+    int count = (int)((size + ARENA_BLOCK_SIZE - 1) / ARENA_BLOCK_SIZE);
+    int capacity = count > 64 ? count * 2 : 64;
+    char **blocks = malloc(sizeof(char*) * capacity);
+    if(blocks == NULL) {
+        return 0;
+    }
+    for(int b = 0; b < count; b++) {
+        blocks[b] = base + (unsigned long long)b * ARENA_BLOCK_SIZE;
+    }
+    atomic_store_explicit(&stringArena.blocks, blocks, memory_order_release);
+    stringArena.blockCount = count;
+    stringArena.blockCapacity = capacity;
+    stringArena.used = size;
+    stringArena.mapped = size;
+    return 1;
+}
+
+char* userFullName(int index) {
+    return arenaText(userAt(index)->fullName);
+}
+
+char* userPasswordHash(int index) {
+    return arenaText(userAt(index)->password);
+}
+
+VoterColumns* voterColumnsAt(int index) {
+    return voterColumns[index >> USER_CHUNK_SHIFT];
+}
+
+int userRace(int index) {
+    return voterColumnsAt(index)->races[index & (USER_CHUNK_SIZE - 1)];
+}
+
+int userHasVoted(int index) {
+    atomic_ullong *word = &voterColumnsAt(index)->voted[(index & (USER_CHUNK_SIZE - 1)) >> 6];
+    return (atomic_load_explicit(word, memory_order_relaxed) >> (index & 63)) & 1;
+}
+
+int userVotedFor(int index) {
+    return voterColumnsAt(index)->ballots[index & (USER_CHUNK_SIZE - 1)];
+}
+
+time_t userVoteTime(int index) {
+    return voterColumnsAt(index)->voteTimes[index & (USER_CHUNK_SIZE - 1)];
+}
+
+// Sets the voter's hasVoted bit; returns 0 if it was already set
+int claimVote(int index) {
+    unsigned long long bit = 1ULL << (index & 63);
+    atomic_ullong *word = &voterColumnsAt(index)->voted[(index & (USER_CHUNK_SIZE - 1)) >> 6];
+    return !(atomic_fetch_or(word, bit) & bit);
+}
+
+void recordBallot(int index, int candidateId, time_t voteTime) {
+    VoterColumns *columns = voterColumnsAt(index);
+    columns->ballots[index & (USER_CHUNK_SIZE - 1)] = (signed char)candidateId;
+    columns->voteTimes[index & (USER_CHUNK_SIZE - 1)] = voteTime;
+}
+
+void clearVote(int index) {
+    atomic_ullong *word = &voterColumnsAt(index)->voted[(index & (USER_CHUNK_SIZE - 1)) >> 6];
+    atomic_fetch_and(word, ~(1ULL << (index & 63)));
+    recordBallot(index, 0, 0);
+}
+
+static void voterFrom(User* users, VoterColumns* columns, int slot, VoterRecord* out) {
+    // strncpy zero-fills the rest, which backups compress away
+    strncpy(out->fullName, arenaText(users[slot].fullName), sizeof(out->fullName) - 1);
+    out->fullName[sizeof(out->fullName) - 1] = '\0';
+    memcpy(out->nidNumber, users[slot].nidNumber, NID_LENGTH);
+    strncpy(out->password, arenaText(users[slot].password), sizeof(out->password) - 1);
+    out->password[sizeof(out->password) - 1] = '\0';
+    out->race = columns->races[slot];
+    out->hasVoted = (atomic_load_explicit(&columns->voted[slot >> 6], memory_order_relaxed) >> (slot & 63)) & 1;
+    out->votedFor = columns->ballots[slot];
+    out->voteTime = (long long)columns->voteTimes[slot];
+}
+
+void readVoter(int index, VoterRecord* out) {
+    voterFrom(userChunks[index >> USER_CHUNK_SHIFT], voterColumnsAt(index), index & (USER_CHUNK_SIZE - 1), out);
+}
+
+// Stores a whole record. The caller sees to the NID index and change bits.
+// Returns 0 if memory runs out.
+int writeVoter(int index, VoterRecord* voter) {
+    User *user = userAt(index);
+    if(!arenaAdd(voter->fullName, &user->fullName) || !arenaAdd(voter->password, &user->password)) {
+        return 0;
+    }
+    strcpy(user->nidNumber, voter->nidNumber);
+    voterColumnsAt(index)->races[index & (USER_CHUNK_SIZE - 1)] = (unsigned short)voter->race;
+    if(voter->hasVoted) {
+        claimVote(index);
+    } else {
+        atomic_fetch_and(&voterColumnsAt(index)->voted[(index & (USER_CHUNK_SIZE - 1)) >> 6],
+                         ~(1ULL << (index & 63)));
+    }
+    recordBallot(index, voter->votedFor, (time_t)voter->voteTime);
+    return 1;
+}
+
+int growUserChunkTable(int chunks) {
+    if(chunks <= userChunkCapacity) {
+        return 1;
+    }
+    
+    int newCapacity = userChunkCapacity > 0 ? userChunkCapacity : 16;
+    while(newCapacity < chunks) {
+        newCapacity *= 2;
+    }
+    User **grown = malloc(sizeof(User*) * newCapacity);
+    VoterColumns **grownColumns = malloc(sizeof(VoterColumns*) * newCapacity);
+    if(grown == NULL || grownColumns == NULL) {
+        free(grown);
+        free(grownColumns);
+        return 0;
+    }
+    atomic_ullong *changed = realloc(backups.userChanged,
+                                     sizeof(atomic_ullong) * USER_CHUNK_WORDS * newCapacity);
+    if(changed == NULL) {
+        free(grown);
+        free(grownColumns);
+        return 0;
+    }
+    memset(changed + (size_t)USER_CHUNK_WORDS * userChunkCapacity, 0,
+           sizeof(atomic_ullong) * USER_CHUNK_WORDS * (newCapacity - userChunkCapacity));
+    backups.userChanged = changed;
+    if(userChunkCount > 0) {
+        memcpy(grown, userChunks, sizeof(User*) * userChunkCount);
+        memcpy(grownColumns, voterColumns, sizeof(VoterColumns*) * userChunkCount);
+    }
+    // The old tables are never freed: threads reading userAt() without the
+    // state lock may still hold them, and they stay correct for their indices
+    userChunks = grown;
+    voterColumns = grownColumns;
+    userChunkCapacity = newCapacity;
+    return 1;
+}
+
+// Grows the voter store so it can hold at least count users.
+// Existing chunks never move, so user indices and pointers stay valid.
+int ensureUserCapacity(int count) {
+    int chunksNeeded = (count + USER_CHUNK_SIZE - 1) / USER_CHUNK_SIZE;
+    
+    if(!growUserChunkTable(chunksNeeded)) {
+        return 0;
+    }
+    
+    while(userChunkCount < chunksNeeded) {
+        User *chunk = malloc(sizeof(User) * USER_CHUNK_SIZE);
+        VoterColumns *columns = calloc(1, sizeof(VoterColumns));
+        if(chunk == NULL || columns == NULL) {
+            free(chunk);
+            free(columns);
+            return 0;
+        }
+        userChunks[userChunkCount] = chunk;
+        voterColumns[userChunkCount++] = columns;
+    }
+    return 1;
+}
+
+int findUserByNID(char* nid) {
+    return nidIndexFind(&nidIndex, nid);
+}
+
+// FNV-1a over the NID digits
+unsigned int hashNID(char* nid) {
+    unsigned int hash = 2166136261u;
+    for(int i = 0; nid[i] != '\0'; i++) {
+        hash ^= (unsigned char)nid[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void nidIndexInit(NidIndex* index, char* (*keyAt)(int), int expected) {
+    int capacity = 64;
+    // Keep the load factor at or below one half
+    while(capacity < expected * 2) {
+        capacity *= 2;
+    }
+    
+    index->slots = malloc(sizeof(NidSlot) * capacity);
+    if(index->slots == NULL) {
+        printError("Out of memory while building NID index!");
+        exit(1);
+    }
+    for(int i = 0; i < capacity; i++) {
+        index->slots[i].index = -1;
+    }
+    index->capacity = capacity;
+    index->count = 0;
+    index->ownsSlots = 1;
+    index->keyAt = keyAt;
+}
+
+void nidIndexFree(NidIndex* index) {
+    if(index->ownsSlots) {
+        free(index->slots);
+    }
+    index->slots = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
+
+static void nidIndexPlace(NidIndex* index, unsigned int hash, int userIndex) {
+    unsigned int mask = index->capacity - 1;
+    unsigned int pos = hash & mask;
+    while(index->slots[pos].index != -1) {
+        pos = (pos + 1) & mask;
+    }
+    index->slots[pos].hash = hash;
+    index->slots[pos].index = userIndex;
+}
+
+void nidIndexInsert(NidIndex* index, int userIndex) {
+    if((index->count + 1) * 2 > index->capacity) {
+        NidSlot *old = index->slots;
+        int oldCapacity = index->capacity;
+        
+        index->capacity *= 2;
+        index->slots = malloc(sizeof(NidSlot) * index->capacity);
+        if(index->slots == NULL) {
+            printError("Out of memory while growing NID index!");
+            exit(1);
+        }
+        for(int i = 0; i < index->capacity; i++) {
+            index->slots[i].index = -1;
+        }
+        for(int i = 0; i < oldCapacity; i++) {
+            if(old[i].index != -1) {
+                nidIndexPlace(index, old[i].hash, old[i].index);
+            }
+        }
+        if(index->ownsSlots) {
+            free(old);
+        }
+        index->ownsSlots = 1;
+    }
+    
+    nidIndexPlace(index, hashNID(index->keyAt(userIndex)), userIndex);
+    index->count++;
+}
+
+int nidIndexFind(NidIndex* index, char* nid) {
+    if(index->slots == NULL) {
+        return -1;
+    }
+    
+    unsigned int hash = hashNID(nid);
+    unsigned int mask = index->capacity - 1;
+    unsigned int pos = hash & mask;
+    
+    while(index->slots[pos].index != -1) {
+        if(index->slots[pos].hash == hash &&
+           strcmp(index->keyAt(index->slots[pos].index), nid) == 0) {
+            return index->slots[pos].index;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return -1;
+}
+
+char* userNIDAt(int index) {
+    return userAt(index)->nidNumber;
+}
+
+void rebuildNIDIndex() {
+    nidIndexFree(&nidIndex);
+    nidIndexInit(&nidIndex, userNIDAt, userCount);
+    for(int i = 0; i < userCount; i++) {
+        nidIndexInsert(&nidIndex, i);
+    }
+}
+
+double currentSeconds() {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Absolute wall-clock time for pthread_cond_timedwait
+void deadlineAfter(struct timespec* deadline, long milliseconds) {
+    timespec_get(deadline, TIME_UTC);
+    deadline->tv_sec += milliseconds / 1000;
+    deadline->tv_nsec += (milliseconds % 1000) * 1000000L;
+    if(deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+void sleepSeconds(double seconds) {
+#ifdef _WIN32
+    Sleep((DWORD)(seconds * 1000));
+#else
+    struct timespec pause = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+    nanosleep(&pause, NULL);
+#endif
+}
+
+// Synthetic NID table used only by the lookup benchmark
+static char *benchNIDs = NULL;
+
+static char* benchNIDAt(int index) {
+    return benchNIDs + (size_t)index * NID_LENGTH;
+}
+
+void benchmarkNIDLookup() {
+    int sizes[] = {10000, 1000000, 10000000};
+    int lookups = 1000000;
+    
+    printHeader("NID LOOKUP BENCHMARK");
+    printf("%-10s %-12s %-14s %-14s %-14s\n",
+           "Voters", "Build (ms)", "Hit (ns)", "Miss (ns)", "Linear (ns)");
+    
+    for(int s = 0; s < 3; s++) {
+        int n = sizes[s];
+        benchNIDs = malloc((size_t)n * NID_LENGTH);
+        if(benchNIDs == NULL) {
+            printError("Not enough memory for benchmark size.");
+            return;
+        }
+        for(int i = 0; i < n; i++) {
+            // 13-digit NIDs, scrambled so neighbours do not share prefixes
+            unsigned long long v = (unsigned long long)i * 2654435761ULL % 9000000000000ULL;
+            sprintf(benchNIDAt(i), "%013llu", v + 1000000000000ULL);
+        }
+        
+        NidIndex index;
+        double start = currentSeconds();
+        nidIndexInit(&index, benchNIDAt, n);
+        for(int i = 0; i < n; i++) {
+            nidIndexInsert(&index, i);
+        }
+        double buildMs = (currentSeconds() - start) * 1000.0;
+        
+        unsigned int seed = 12345;
+        int found = 0;
+        start = currentSeconds();
+        for(int i = 0; i < lookups; i++) {
+            seed = seed * 1103515245u + 12345u;
+            found += nidIndexFind(&index, benchNIDAt(seed % n)) != -1;
+        }
+        double hitNs = (currentSeconds() - start) * 1e9 / lookups;
+        
+        char missNID[NID_LENGTH];
+        start = currentSeconds();
+        for(int i = 0; i < lookups; i++) {
+            sprintf(missNID, "%016d", i);
+            found += nidIndexFind(&index, missNID) != -1;
+        }
+        double missNs = (currentSeconds() - start) * 1e9 / lookups;
+        
+        // The old linear scan, sampled with a few lookups only
+        int linearLookups = 20;
+        start = currentSeconds();
+        for(int i = 0; i < linearLookups; i++) {
+            seed = seed * 1103515245u + 12345u;
+            char *target = benchNIDAt(seed % n);
+            for(int j = 0; j < n; j++) {
+                if(strcmp(benchNIDAt(j), target) == 0) {
+                    found++;
+                    break;
+                }
+            }
+        }
+        double linearNs = (currentSeconds() - start) * 1e9 / linearLookups;
+        
+        printf("%-10d %-12.1f %-14.1f %-14.1f %-14.1f\n",
+               n, buildMs, hitNs, missNs, linearNs);
+        
+        if(found < lookups) {
+            printError("Benchmark lookups missed expected entries!");
+        }
+        
+        nidIndexFree(&index);
+        free(benchNIDs);
+        benchNIDs = NULL;
+    }
+}
+
+static void foldText(char* dest, char* src, int size) {
+    int i = 0;
+    for(; src[i] && i < size - 1; i++) {
+        dest[i] = tolower((unsigned char)src[i]);
+    }
+    dest[i] = '\0';
+}
+
+static void foldCandidate(SearchDoc* entry, Candidate* candidate) {
+    foldText(entry->name, candidate->name, sizeof(entry->name));
+    foldText(entry->party, candidate->party, sizeof(entry->party));
+    foldText(entry->education, candidate->education, sizeof(entry->education));
+    foldText(entry->manifesto, candidate->manifesto, sizeof(entry->manifesto));
+}
+
+// Fields in order of importance for ranking
+static char* searchDocField(SearchDoc* entry, int field) {
+    switch(field) {
+        case 0: return entry->name;
+        case 1: return entry->party;
+        case 2: return entry->education;
+        default: return entry->manifesto;
+    }
+}
+
+static int searchFieldWeight[SEARCH_FIELDS] = { 8, 4, 2, 1 };
+
+static unsigned int trigramAt(char* text) {
+    return ((unsigned int)(unsigned char)text[0] << 16) |
+           ((unsigned int)(unsigned char)text[1] << 8) |
+           (unsigned int)(unsigned char)text[2];
+}
+
+static unsigned int hashTrigram(unsigned int trigram) {
+    unsigned int hash = trigram * 2654435761u;
+    return hash ^ (hash >> 15);
+}
+
+static int growSearchTable() {
+    int capacity = searchIndex.capacity > 0 ? searchIndex.capacity * 2 : 4096;
+    TrigramPostings *slots = calloc(capacity, sizeof(TrigramPostings));
+    if(slots == NULL) {
+        return 0;
+    }
+    
+    unsigned int mask = capacity - 1;
+    for(int i = 0; i < searchIndex.capacity; i++) {
+        if(searchIndex.slots[i].trigram != 0) {
+            unsigned int pos = hashTrigram(searchIndex.slots[i].trigram) & mask;
+            while(slots[pos].trigram != 0) {
+                pos = (pos + 1) & mask;
+            }
+            slots[pos] = searchIndex.slots[i];
+        }
+    }
+    free(searchIndex.slots);
+    searchIndex.slots = slots;
+    searchIndex.capacity = capacity;
+    return 1;
+}
+
+// Returns the posting list of a trigram, adding an empty one if create is
+// set; NULL if there is none or memory runs out
+static TrigramPostings* trigramPostings(unsigned int trigram, int create) {
+    if(create && (searchIndex.used + 1) * 2 > searchIndex.capacity && !growSearchTable()) {
+        return NULL;
+    }
+    if(searchIndex.capacity == 0) {
+        return NULL;
+    }
+    
+    unsigned int mask = searchIndex.capacity - 1;
+    unsigned int pos = hashTrigram(trigram) & mask;
+    while(searchIndex.slots[pos].trigram != 0) {
+        if(searchIndex.slots[pos].trigram == trigram) {
+            return &searchIndex.slots[pos];
+        }
+        pos = (pos + 1) & mask;
+    }
+    if(!create) {
+        return NULL;
+    }
+    searchIndex.slots[pos].trigram = trigram;
+    searchIndex.used++;
+    return &searchIndex.slots[pos];
+}
+
+// Position of the first document number >= doc
+static int postingsFind(TrigramPostings* postings, int doc) {
+    int low = 0, high = postings->count;
+    while(low < high) {
+        int mid = (low + high) / 2;
+        if(postings->docs[mid] < doc) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static int postingsInsert(TrigramPostings* postings, int doc) {
+    int pos = postingsFind(postings, doc);
+    if(pos < postings->count && postings->docs[pos] == doc) {
+        return 1;
+    }
+    if(postings->count == postings->capacity) {
+        int capacity = postings->capacity > 0 ? postings->capacity * 2 : 4;
+        int *grown = realloc(postings->docs, capacity * sizeof(int));
+        if(grown == NULL) {
+            return 0;
+        }
+        postings->docs = grown;
+        postings->capacity = capacity;
+    }
+    memmove(postings->docs + pos + 1, postings->docs + pos, (postings->count - pos) * sizeof(int));
+    postings->docs[pos] = doc;
+    postings->count++;
+    return 1;
+}
+
+static void postingsRemove(TrigramPostings* postings, int doc) {
+    int pos = postingsFind(postings, doc);
+    if(pos < postings->count && postings->docs[pos] == doc) {
+        memmove(postings->docs + pos, postings->docs + pos + 1, (postings->count - pos - 1) * sizeof(int));
+        postings->count--;
+    }
+}
+
+void searchIndexAdd(int race, int index) {
+    if(searchIndex.docs == NULL) {
+        return;
+    }
+    int doc = race * MAX_CANDIDATES + index;
+    SearchDoc *entry = &searchIndex.docs[doc];
+    foldCandidate(entry, &races[race]->candidates[index]);
+    
+    for(int f = 0; f < SEARCH_FIELDS; f++) {
+        char *text = searchDocField(entry, f);
+        for(int i = 0; text[i] && text[i+1] && text[i+2]; i++) {
+            TrigramPostings *postings = trigramPostings(trigramAt(text + i), 1);
+            if(postings == NULL || !postingsInsert(postings, doc)) {
+                searchIndex.complete = 0;
+            }
+        }
+    }
+}
+
+void searchIndexRemove(int race, int index) {
+    if(searchIndex.docs == NULL) {
+        return;
+    }
+    int doc = race * MAX_CANDIDATES + index;
+    SearchDoc *entry = &searchIndex.docs[doc];
+    
+    for(int f = 0; f < SEARCH_FIELDS; f++) {
+        char *text = searchDocField(entry, f);
+        for(int i = 0; text[i] && text[i+1] && text[i+2]; i++) {
+            TrigramPostings *postings = trigramPostings(trigramAt(text + i), 0);
+            if(postings != NULL) {
+                postingsRemove(postings, doc);
+            }
+        }
+    }
+    memset(entry, 0, sizeof(SearchDoc));
+}
+
+void rebuildSearchIndex() {
+    for(int i = 0; i < searchIndex.capacity; i++) {
+        free(searchIndex.slots[i].docs);
+    }
+    free(searchIndex.slots);
+    free(searchIndex.docs);
+    memset(&searchIndex, 0, sizeof(searchIndex));
+    
+    // Untouched pages of this table are never faulted in
+    searchIndex.docs = calloc((size_t)MAX_RACES * MAX_CANDIDATES, sizeof(SearchDoc));
+    searchIndex.complete = searchIndex.docs != NULL;
+    for(int r = 0; r < raceCount; r++) {
+        for(int i = 0; i < races[r]->candidateCount; i++) {
+            searchIndexAdd(r, i);
+        }
+    }
+}
+
+// Best field score for one folded term: the field's weight, doubled when
+// the match starts a word. 0 when the term does not occur.
+static int termScore(SearchDoc* entry, char* term) {
+    int best = 0;
+    for(int f = 0; f < SEARCH_FIELDS; f++) {
+        char *text = searchDocField(entry, f);
+        char *hit = strstr(text, term);
+        if(hit != NULL) {
+            int score = searchFieldWeight[f] * ((hit == text || !isalnum((unsigned char)hit[-1])) ? 2 : 1);
+            if(score > best) {
+                best = score;
+            }
+        }
+    }
+    return best;
+}
+
+static void scoreDoc(int* scores, int race, int index, char* term) {
+    SearchDoc folded;
+    SearchDoc *entry = &folded;
+    if(searchIndex.docs != NULL) {
+        entry = &searchIndex.docs[race * MAX_CANDIDATES + index];
+    } else {
+        foldCandidate(&folded, &races[race]->candidates[index]);
+    }
+    int score = termScore(entry, term);
+    if(score > 0) {
+        scores[race * MAX_CANDIDATES + index] += SEARCH_TERM_MATCH + score;
+    }
+}
+
+// Case-insensitive substring search over name, party, education and
+// manifesto of every candidate. Whitespace separates terms; a candidate
+// matches if it contains any term. Candidates matching more terms rank
+// first, then by where the terms were found. Terms of three or more
+// characters are looked up by intersecting their trigram posting lists,
+// and only the survivors are checked with strstr(). Shorter terms scan.
+// Fills up to maxHits best matches and returns the total number of
+// matches. The caller holds stateLock.
+int searchCandidates(char* query, SearchHit* hits, int maxHits) {
+    char folded[200];
+    char *terms[SEARCH_MAX_TERMS];
+    int termCount = 0;
+    
+    foldText(folded, query, sizeof(folded));
+    char *p = folded;
+    while(termCount < SEARCH_MAX_TERMS) {
+        while(*p && isspace((unsigned char)*p)) {
+            p++;
+        }
+        if(*p == '\0') {
+            break;
+        }
+        terms[termCount++] = p;
+        while(*p && !isspace((unsigned char)*p)) {
+            p++;
+        }
+        if(*p) {
+            *p++ = '\0';
+        }
+    }
+    if(termCount == 0) {
+        return 0;
+    }
+    
+    int docCount = raceCount * MAX_CANDIDATES;
+    int *scores = calloc(docCount, sizeof(int));
+    if(scores == NULL) {
+        return 0;
+    }
+    
+    for(int t = 0; t < termCount; t++) {
+        char *term = terms[t];
+        int length = strlen(term);
+        
+        if(length < 3 || !searchIndex.complete) {
+            for(int r = 0; r < raceCount; r++) {
+                for(int i = 0; i < races[r]->candidateCount; i++) {
+                    scoreDoc(scores, r, i, term);
+                }
+            }
+            continue;
+        }
+        
+        TrigramPostings *lists[200];
+        int listCount = 0, shortest = 0;
+        for(int i = 0; i + 3 <= length; i++) {
+            lists[listCount] = trigramPostings(trigramAt(term + i), 0);
+            if(lists[listCount] == NULL) {
+                listCount = 0;
+                break;
+            }
+            if(lists[listCount]->count < lists[shortest]->count) {
+                shortest = listCount;
+            }
+            listCount++;
+        }
+        
+        for(int d = 0; listCount > 0 && d < lists[shortest]->count; d++) {
+            int doc = lists[shortest]->docs[d];
+            int everywhere = 1;
+            for(int l = 0; l < listCount && everywhere; l++) {
+                if(l != shortest) {
+                    int pos = postingsFind(lists[l], doc);
+                    everywhere = pos < lists[l]->count && lists[l]->docs[pos] == doc;
+                }
+            }
+            if(everywhere) {
+                scoreDoc(scores, doc / MAX_CANDIDATES, doc % MAX_CANDIDATES, term);
+            }
+        }
+    }
+    
+    // Keep the best maxHits in order: highest score, then ballot order
+    int found = 0, kept = 0;
+    for(int doc = 0; doc < docCount; doc++) {
+        if(scores[doc] == 0) {
+            continue;
+        }
+        found++;
+        int pos = kept;
+        while(pos > 0 && hits[pos - 1].score < scores[doc]) {
+            pos--;
+        }
+        if(pos >= maxHits) {
+            continue;
+        }
+        if(kept < maxHits) {
+            kept++;
+        }
+        memmove(hits + pos + 1, hits + pos, (kept - 1 - pos) * sizeof(SearchHit));
+        hits[pos].race = doc / MAX_CANDIDATES;
+        hits[pos].index = doc % MAX_CANDIDATES;
+        hits[pos].score = scores[doc];
+    }
+    
+    free(scores);
+    return found;
+}
+
+// Fills every constituency with synthetic candidates and times queries
+// through the trigram index against a scan of every candidate
+void benchmarkSearch() {
+    char *first[] = { "John", "Sarah", "Michael", "Emily", "Robert", "Amina", "Rahim", "Fatima",
+                      "David", "Maria", "Kamal", "Nusrat", "Peter", "Laila", "Omar", "Grace" };
+    char *last[] = { "Smith", "John", "Brown", "Davis", "Wil", "Rah", "Hoss", "Kh",
+                     "Ahm", "Tay", "Chowd", "Isl", "Ev", "Walk", "Haq", "Clar" };
+    char *suffix[] = { "son", "man", "ley", "ford", "ton", "er", "ain", "ed",
+                       "ridge", "wood", "hury", "am", "ans", "ell", "ue", "ke" };
+    char *parties[] = { "Democratic Party", "Republican Party", "Green Party", "Libertarian Party",
+                        "Independent", "Labour Party", "Workers Party", "Civic Alliance" };
+    char *words[] = { "healthcare", "reform", "education", "roads", "water", "jobs", "housing",
+                      "climate", "transport", "safety", "farming", "schools", "taxes", "parks",
+                      "energy", "libraries", "markets", "drainage", "youth", "pensions" };
+    char *degrees[] = { "MBA", "Law Degree", "PhD in Economics", "MS in Environmental Science",
+                        "BA in Political Science", "Diploma in Engineering" };
+    char *queries[] = { "smithson", "emily haqford", "omar", "walkridge drainage", "green party",
+                        "ab", "zzzz", "energy pensions markets" };
+    int queryCount = sizeof(queries) / sizeof(queries[0]);
+    unsigned int seed = 12345;
+    char name[MAX_NAME_LENGTH];
+    
+    raceCount = 0;
+    for(int r = 0; r < MAX_RACES; r++) {
+        sprintf(name, "Ward %d", r + 1);
+        int added = applyAddRace(name, 0, 0);
+        if(added == -1) {
+            printError("Not enough memory for benchmark size.");
+            return;
+        }
+        Race *race = races[added];
+        for(int i = 0; i < MAX_CANDIDATES; i++) {
+            Candidate *c = &race->candidates[race->candidateCount++];
+            memset(c, 0, sizeof(Candidate));
+            c->id = i + 1;
+            c->race = r;
+            seed = seed * 1103515245u + 12345u;
+            sprintf(c->name, "%s %s%s", first[(seed >> 8) % 16], last[(seed >> 16) % 16],
+                    suffix[(seed >> 24) % 16]);
+            strcpy(c->party, parties[(seed >> 4) % 8]);
+            strcpy(c->education, degrees[(seed >> 12) % 6]);
+            for(int w = 0; w < 5; w++) {
+                seed = seed * 1103515245u + 12345u;
+                strcat(c->manifesto, words[(seed >> 16) % 20]);
+                strcat(c->manifesto, w < 4 ? " " : "");
+            }
+        }
+    }
+    
+    double start = currentSeconds();
+    rebuildSearchIndex();
+    double buildMs = (currentSeconds() - start) * 1000.0;
+    
+    printHeader("CANDIDATE SEARCH BENCHMARK");
+    printf("Candidates: %d, distinct trigrams: %d, index build: %.1f ms\n\n",
+           raceCount * MAX_CANDIDATES, searchIndex.used, buildMs);
+    printf("%-26s %-10s %-14s %-14s\n", "Query", "Matches", "Indexed (us)", "Scan (us)");
+    
+    SearchHit hits[SEARCH_MAX_RESULTS];
+    for(int q = 0; q < queryCount; q++) {
+        int runs = 200;
+        int found = 0;
+        start = currentSeconds();
+        for(int i = 0; i < runs; i++) {
+            found = searchCandidates(queries[q], hits, SEARCH_MAX_RESULTS);
+        }
+        double indexedUs = (currentSeconds() - start) * 1e6 / runs;
+        
+        // The same query with the index switched off checks every candidate
+        searchIndex.complete = 0;
+        int scanRuns = 20;
+        int scanned = 0;
+        start = currentSeconds();
+        for(int i = 0; i < scanRuns; i++) {
+            scanned = searchCandidates(queries[q], hits, SEARCH_MAX_RESULTS);
+        }
+        double scanUs = (currentSeconds() - start) * 1e6 / scanRuns;
+        searchIndex.complete = 1;
+        
+        printf("%-26s %-10d %-14.1f %-14.1f%s\n", queries[q], found, indexedUs, scanUs,
+               found == scanned ? "" : "  MISMATCH");
+    }
+}
+
+typedef struct {
+    int firstUser;
+    int userStep;
+    int logins;
+    int accepted;
+    LatencyHistogram latency;
+} LoginBenchWorker;
+
+static void* loginBenchThread(void* arg) {
+    LoginBenchWorker *worker = arg;
+    char nid[NID_LENGTH];
+    for(int i = 0; i < worker->logins; i++) {
+        int userIndex = worker->firstUser + i * worker->userStep;
+        sprintf(nid, "%013d", 1000000 + userIndex);
+        double start = currentSeconds();
+        if(authenticateVoter(nid, "Passw0rdX") == userIndex) {
+            worker->accepted++;
+        }
+        histogramRecord(&worker->latency, currentSeconds() - start);
+    }
+    return NULL;
+}
+
+// Logs every voter in twice from many client threads: the first pass
+// checks the legacy hashes and upgrades them to scrypt, the second checks
+// scrypt hashes. A final burst shows the queue turning work away instead
+// of growing. The journal is not opened.
+void benchmarkLogin() {
+    int voters = 1000;
+    int clients = cpuCount() * 4 < 64 ? cpuCount() * 4 : 64;
+    char name[MAX_NAME_LENGTH], nid[NID_LENGTH], legacy[PASSWORD_HASH_LENGTH];
+    
+    initializeRaces();
+    nidIndexInit(&nidIndex, userNIDAt, voters);
+    legacyPasswordHash("Passw0rdX", legacy);
+    for(int i = 0; i < voters; i++) {
+        sprintf(name, "Voter %d", i);
+        sprintf(nid, "%013d", 1000000 + i);
+        applyRegister(name, nid, legacy, 0);
+    }
+    if(!startKdfPool(cpuCount())) {
+        printError("Could not start the password workers!");
+        return;
+    }
+    
+    printHeader("LOGIN BENCHMARK");
+    printf("scrypt N=2^%d r=%d p=%d, %d worker(s), queue of %d, %d client thread(s)\n\n",
+           KDF_COST_LOG2, KDF_BLOCK_SIZE, KDF_PARALLELISM, kdfPool.workerCount, kdfPool.capacity, clients);
+    printf("%-22s %-12s %-12s %-12s %-10s\n", "Pass", "Logins/sec", "p50 (ms)", "p99 (ms)", "Accepted");
+    
+    char *passes[] = { "legacy -> scrypt", "scrypt" };
+    for(int pass = 0; pass < 2; pass++) {
+        LoginBenchWorker workers[64];
+        pthread_t ids[64];
+        LatencyHistogram all;
+        memset(&all, 0, sizeof(all));
+        
+        double start = currentSeconds();
+        for(int t = 0; t < clients; t++) {
+            memset(&workers[t], 0, sizeof(LoginBenchWorker));
+            workers[t].firstUser = t;
+            workers[t].userStep = clients;
+            workers[t].logins = (voters - t + clients - 1) / clients;
+            pthread_create(&ids[t], NULL, loginBenchThread, &workers[t]);
+        }
+        int accepted = 0;
+        for(int t = 0; t < clients; t++) {
+            pthread_join(ids[t], NULL);
+            accepted += workers[t].accepted;
+            histogramMerge(&all, &workers[t].latency);
+        }
+        double elapsed = currentSeconds() - start;
+        printf("%-22s %-12.0f %-12.2f %-12.2f %d/%d\n", passes[pass], voters / elapsed,
+               histogramPercentile(&all, 50) / 1000.0, histogramPercentile(&all, 99) / 1000.0,
+               accepted, voters);
+    }
+    
+    // Admission control: offer four queues' worth at once without waiting
+    int offered = kdfPool.capacity * 4;
+    KdfJob *jobs = calloc(offered, sizeof(KdfJob));
+    if(jobs == NULL) {
+        return;
+    }
+    int queuedJobs = 0;
+    for(int i = 0; i < offered; i++) {
+        jobs[i].verify = 1;
+        strcpy(jobs[i].password, "Passw0rdX");
+        strcpy(jobs[i].hash, userPasswordHash(i % voters));
+        if(kdfSubmit(&jobs[i])) {
+            queuedJobs++;
+        } else {
+            jobs[i].finished = -1;
+        }
+    }
+    pthread_mutex_lock(&kdfPool.lock);
+    for(int i = 0; i < offered; i++) {
+        while(jobs[i].finished == 0) {
+            pthread_cond_wait(&kdfPool.finished, &kdfPool.lock);
+        }
+    }
+    pthread_mutex_unlock(&kdfPool.lock);
+    free(jobs);
+    
+    KdfStats stats;
+    kdfPoolStats(&stats);
+    printf("\nBurst of %d jobs: %d queued, %d turned away\n", offered, queuedJobs, offered - queuedJobs);
+    printf("Pool: %llu jobs, peak queue %d, %llu hashes upgraded, latency p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           stats.completed, stats.peakQueued, stats.migrated, stats.p50Us / 1000.0,
+           stats.p99Us / 1000.0, stats.maxUs / 1000.0);
+}
+
+// Opens hundreds of thousands of sessions, looks them up, then lets the
+// wheel expire them with half still in use, timing every tick
+void benchmarkSessions() {
+    int count = 500000;
+    char (*tokens)[SESSION_TOKEN_LENGTH] = malloc((size_t)count * SESSION_TOKEN_LENGTH);
+    if(tokens == NULL) {
+        printError("Out of memory!");
+        return;
+    }
+    
+    sessionTick(time(NULL));
+    time_t start = sessionTable.now;
+    
+    printHeader("SESSION TABLE BENCHMARK");
+    double begin = currentSeconds();
+    for(int i = 0; i < count; i++) {
+        createSession(i, tokens[i]);
+    }
+    double createNs = (currentSeconds() - begin) * 1e9 / count;
+    
+    int found = 0;
+    unsigned int seed = 12345;
+    begin = currentSeconds();
+    for(int i = 0; i < count; i++) {
+        seed = seed * 1103515245u + 12345u;
+        int pick = (seed >> 8) % count;
+        found += sessionUser(tokens[pick]) == pick;
+    }
+    double lookupNs = (currentSeconds() - begin) * 1e9 / count;
+    
+    printf("Sessions: %d, %d bytes each (%.1f MB table)\n", count, (int)sizeof(Session),
+           sessionTable.capacity * (double)sizeof(Session) / (1024 * 1024));
+    printf("Create: %.0f ns/session, lookup: %.0f ns (%d/%d found)\n\n", createNs, lookupNs, found, count);
+    
+    // Half the voters stay active 100 seconds in, so they expire later
+    sessionTick(start + 100);
+    for(int i = 0; i < count; i += 2) {
+        sessionUser(tokens[i]);
+    }
+    
+    time_t stops[] = { start + SESSION_TIMEOUT + 2, start + 100 + SESSION_TIMEOUT + 2 };
+    for(int s = 0; s < 2; s++) {
+        unsigned long long expiredBefore = sessionTable.expired;
+        double slowest = 0, total = 0;
+        int ticks = 0;
+        while(sessionTable.now < stops[s]) {
+            begin = currentSeconds();
+            sessionTick(sessionTable.now + 1);
+            double took = currentSeconds() - begin;
+            total += took;
+            slowest = took > slowest ? took : slowest;
+            ticks++;
+        }
+        unsigned long long expired = sessionTable.expired - expiredBefore;
+        printf("Up to t+%-4ld %d ticks, %llu expired, %.1f ms total, slowest tick %.2f ms, %.0f ns per expiry\n",
+               (long)(stops[s] - start), ticks, expired, total * 1000.0, slowest * 1000.0,
+               expired > 0 ? total * 1e9 / expired : 0.0);
+    }
+    printf("Active sessions left: %d\n", activeSessionCount());
+    free(tokens);
+}
+
+// Checkpoint view of one voter chunk, copied into users and columns: the
+// chunk as it was at capture, whether or not it has changed since.
+// Returns 0 if the copy made before a change could not be allocated.
+static int checkpointChunk(CheckpointJob* job, int chunk, User* users, VoterColumns* columns) {
+    pthread_mutex_lock(&job->copyLock);
+    int shared = atomic_load_explicit(&job->shared[chunk], memory_order_relaxed);
+    User *fromUsers = shared ? job->live[chunk] : job->copies[chunk];
+    VoterColumns *fromColumns = shared ? job->liveColumns[chunk] : job->columnCopies[chunk];
+    int ok = fromUsers != NULL && fromColumns != NULL;
+    if(ok) {
+        memcpy(users, fromUsers, sizeof(User) * USER_CHUNK_SIZE);
+        memcpy(columns, fromColumns, sizeof(VoterColumns));
+    }
+    pthread_mutex_unlock(&job->copyLock);
+    return ok;
+}
+
+static void preserveCheckpointChunk(CheckpointJob* job, int chunk) {
+    pthread_mutex_lock(&job->copyLock);
+    if(atomic_load_explicit(&job->shared[chunk], memory_order_relaxed)) {
+        job->copies[chunk] = malloc(sizeof(User) * USER_CHUNK_SIZE);
+        job->columnCopies[chunk] = malloc(sizeof(VoterColumns));
+        if(job->copies[chunk] != NULL && job->columnCopies[chunk] != NULL) {
+            memcpy(job->copies[chunk], job->live[chunk], sizeof(User) * USER_CHUNK_SIZE);
+            memcpy(job->columnCopies[chunk], job->liveColumns[chunk], sizeof(VoterColumns));
+        }
+        atomic_store_explicit(&job->shared[chunk], 0, memory_order_release);
+    }
+    pthread_mutex_unlock(&job->copyLock);
+}
+
+// Called before a voter record changes, and before a voter is added to a
+// chunk, so a running checkpoint still writes the chunk as it was
+void checkpointUserChanged(int userIndex) {
+    int chunk = userIndex >> USER_CHUNK_SHIFT;
+    CheckpointJob *job = atomic_load_explicit(&checkpoints.active, memory_order_acquire);
+    if(job != NULL && chunk < job->chunkCount &&
+       atomic_load_explicit(&job->shared[chunk], memory_order_acquire)) {
+        preserveCheckpointChunk(job, chunk);
+    }
+}
+
+void freeCheckpointJob(CheckpointJob* job) {
+    if(job->copies != NULL) {
+        for(int c = 0; c < job->chunkCount; c++) {
+            free(job->copies[c]);
+            free(job->columnCopies[c]);
+        }
+    }
+    free(job->live);
+    free(job->liveColumns);
+    free(job->shared);
+    free(job->copies);
+    free(job->columnCopies);
+    free(job->races);
+    free(job->candidates);
+    free(job->userChanged);
+    free(job->raceChanged);
+    pthread_mutex_destroy(&job->copyLock);
+    free(job);
+}
+
+// Takes a copy-on-write view of the whole state. Called with stateLock
+// held exclusively, or while no other thread is running. Returns NULL if
+// memory runs out.
+CheckpointJob* captureCheckpoint() {
+    CheckpointJob *job = calloc(1, sizeof(CheckpointJob));
+    if(job == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&job->copyLock, NULL);
+    job->userCount = userCount;
+    job->chunkCount = (userCount + USER_CHUNK_SIZE - 1) / USER_CHUNK_SIZE;
+    job->raceCount = raceCount;
+    job->candidateTotal = totalCandidateCount();
+    int chunks = job->chunkCount > 0 ? job->chunkCount : 1;
+    size_t words = ((size_t)userCount + 63) / 64;
+    job->live = malloc(sizeof(User*) * chunks);
+    job->liveColumns = malloc(sizeof(VoterColumns*) * chunks);
+    job->shared = calloc(chunks, sizeof(atomic_int));
+    job->copies = calloc(chunks, sizeof(User*));
+    job->columnCopies = calloc(chunks, sizeof(VoterColumns*));
+    job->races = malloc(sizeof(RaceRecord) * (raceCount > 0 ? raceCount : 1));
+    job->candidates = malloc(sizeof(Candidate) * (job->candidateTotal > 0 ? job->candidateTotal : 1));
+    job->userChanged = malloc(sizeof(unsigned long long) * (words > 0 ? words : 1));
+    job->raceChanged = malloc(raceCount > 0 ? raceCount : 1);
+    if(job->live == NULL || job->liveColumns == NULL || job->shared == NULL || job->copies == NULL ||
+       job->columnCopies == NULL || job->races == NULL || job->candidates == NULL ||
+       job->userChanged == NULL || job->raceChanged == NULL) {
+        freeCheckpointJob(job);
+        return NULL;
+    }
+    
+    for(int c = 0; c < job->chunkCount; c++) {
+        job->live[c] = userChunks[c];
+        job->liveColumns[c] = voterColumns[c];
+        atomic_init(&job->shared[c], 1);
+    }
+    int n = 0;
+    for(int r = 0; r < raceCount; r++) {
+        RaceRecord *record = &job->races[r];
+        memset(record, 0, sizeof(RaceRecord));
+        record->id = races[r]->id;
+        strcpy(record->name, races[r]->name);
+        record->electionStartTime = (long long)races[r]->electionStartTime;
+        record->electionEndTime = (long long)races[r]->electionEndTime;
+        for(int i = 0; i < races[r]->candidateCount; i++) {
+            job->candidates[n] = races[r]->candidates[i];
+            job->candidates[n].votes = candidateVotes(races[r], i);
+            job->candidates[n++].race = r;
+        }
+        job->raceChanged[r] = atomic_load_explicit(&backups.raceChanged[r], memory_order_relaxed);
+    }
+    for(size_t w = 0; w < words; w++) {
+        job->userChanged[w] = atomic_load_explicit(&backups.userChanged[w], memory_order_relaxed);
+    }
+    pthread_mutex_lock(&backups.lock);
+    job->backupSince = backups.since;
+    pthread_mutex_unlock(&backups.lock);
+    
+    job->blocks = atomic_load(&stringArena.blocks);
+    job->blockCount = stringArena.blockCount;
+    job->arenaUsed = stringArena.used;
+    job->arenaMapped = stringArena.mapped;
+    
+    pthread_mutex_lock(&journal.lock);
+    job->journalSequence = journal.nextSequence;
+    job->journalOffset = journal.size;
+    pthread_mutex_unlock(&journal.lock);
+    return job;
+}
+
+static const char* textFileNames[TEXT_FILES] = {
+    "users.txt", "candidates.txt", "constituencies.txt", "election_config.txt"
+};
+
+// users.txt becomes users_000042.txt in generation 42
+static void textFilePath(int file, int generation, char* path, size_t size) {
+    const char *name = textFileNames[file];
+    if(generation == 0) {
+        snprintf(path, size, "%s", name);
+        return;
+    }
+    snprintf(path, size, "%.*s_%06d.txt", (int)(strlen(name) - 4), name, generation);
+}
+
+static int textWriterOpen(TextWriter* writer, char* path) {
+    memset(writer, 0, sizeof(TextWriter));
+    writer->buffer = malloc(TEXT_BUFFER_SIZE);
+    writer->fp = writer->buffer != NULL ? fopen(path, "wb") : NULL;
+    if(writer->fp == NULL) {
+        free(writer->buffer);
+        return 0;
+    }
+    return 1;
+}
+
+static void textWriterFlush(TextWriter* writer) {
+    if(writer->length > 0 && !writer->failed) {
+        writer->checksum = crc32Update(writer->checksum, (unsigned char*)writer->buffer, writer->length);
+        writer->size += writer->length;
+        writer->failed = fwrite(writer->buffer, 1, writer->length, writer->fp) != writer->length;
+        metricAdd(METRIC_BYTES_CHECKPOINT, writer->length);
+    }
+    writer->length = 0;
+}
+
+// Formats one record straight into the buffer
+static void textPrintf(TextWriter* writer, const char* format, ...) {
+    if(TEXT_BUFFER_SIZE - writer->length < TEXT_RECORD_MAX) {
+        textWriterFlush(writer);
+    }
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(writer->buffer + writer->length, TEXT_RECORD_MAX, format, args);
+    va_end(args);
+    if(written < 0 || written >= TEXT_RECORD_MAX) {
+        writer->failed = 1;
+        return;
+    }
+    writer->length += written;
+}
+
+// Flushes, syncs and closes the file, recording its size and checksum
+static int textWriterClose(TextWriter* writer, TextFileEntry* entry) {
+    textWriterFlush(writer);
+    int ok = !writer->failed && fflush(writer->fp) == 0 && fsync(fileno(writer->fp)) == 0;
+    ok = (fclose(writer->fp) == 0) && ok;
+    free(writer->buffer);
+    entry->size = writer->size;
+    entry->checksum = writer->checksum;
+    return ok;
+}
+
+static void writeTextFile(TextWriter* writer, int file, CheckpointJob* job) {
+    if(file == TEXT_USERS) {
+        textPrintf(writer, "TOTAL_USERS=%d\n\n", job->userCount);
+        User *users = malloc(sizeof(User) * USER_CHUNK_SIZE);
+        VoterColumns *columns = malloc(sizeof(VoterColumns));
+        writer->failed |= users == NULL || columns == NULL;
+        VoterRecord voter;
+        for(int c = 0; !writer->failed && c < job->chunkCount; c++) {
+            if(!checkpointChunk(job, c, users, columns)) {
+                writer->failed = 1;
+                break;
+            }
+            int used = job->userCount - c * USER_CHUNK_SIZE;
+            if(used > USER_CHUNK_SIZE) {
+                used = USER_CHUNK_SIZE;
+            }
+            for(int slot = 0; slot < used; slot++) {
+                int i = c * USER_CHUNK_SIZE + slot;
+                voterFrom(users, columns, slot, &voter);
+                textPrintf(writer, "USER_%d_START\nFullName=%s\nNID=%s\nPassword=%s\nConstituency=%d\n"
+                                   "HasVoted=%d\nVotedFor=%d\nVoteTime=%lld\nUSER_%d_END\n\n",
+                           i+1, voter.fullName, voter.nidNumber, voter.password, voter.race + 1,
+                           voter.hasVoted, voter.votedFor, voter.voteTime, i+1);
+            }
+        }
+        free(users);
+        free(columns);
+    } else if(file == TEXT_CANDIDATES) {
+        textPrintf(writer, "TOTAL_CANDIDATES=%d\n\n", job->candidateTotal);
+        for(int n = 0; n < job->candidateTotal; n++) {
+            Candidate *candidate = &job->candidates[n];
+            textPrintf(writer, "CANDIDATE_%d_START\nID=%d\nConstituency=%d\nName=%s\nParty=%s\n"
+                               "Education=%s\nAge=%d\nManifesto=%s\nVotes=%d\nCANDIDATE_%d_END\n\n",
+                       n+1, candidate->id, candidate->race + 1, candidate->name, candidate->party,
+                       candidate->education, candidate->age, candidate->manifesto, candidate->votes, n+1);
+        }
+    } else if(file == TEXT_CONSTITUENCIES) {
+        // IDs follow file order
+        textPrintf(writer, "TOTAL_CONSTITUENCIES=%d\n\n", job->raceCount);
+        for(int r = 0; r < job->raceCount; r++) {
+            textPrintf(writer, "CONSTITUENCY_%d_START\nID=%d\nName=%s\nElectionStartTime=%ld\n"
+                               "ElectionEndTime=%ld\nCONSTITUENCY_%d_END\n\n",
+                       r+1, job->races[r].id, job->races[r].name, (long)job->races[r].electionStartTime,
+                       (long)job->races[r].electionEndTime, r+1);
+        }
+    } else {
+        // The period is the first constituency's, as read by older versions
+        textPrintf(writer, "ElectionStartTime=%ld\nElectionEndTime=%ld\nJournalSequence=%llu\n",
+                   (long)job->races[0].electionStartTime, (long)job->races[0].electionEndTime,
+                   job->journalSequence);
+    }
+}
+
+// Reads a manifest; returns 1 if it is complete and its checksum matches
+static int readTextManifest(char* path, TextManifest* manifest) {
+    char text[1024];
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL) {
+        return 0;
+    }
+    size_t length = fread(text, 1, sizeof(text) - 1, fp);
+    fclose(fp);
+    text[length] = '\0';
+    
+    char *tail = strstr(text, "Checksum=");
+    unsigned int checksum;
+    if(tail == NULL || sscanf(tail, "Checksum=%x", &checksum) != 1 ||
+       crc32((unsigned char*)text, tail - text) != checksum) {
+        return 0;
+    }
+    memset(manifest, 0, sizeof(TextManifest));
+    char *line = text;
+    int files = 0;
+    int ok = sscanf(line, "Generation=%d", &manifest->generation) == 1 && manifest->generation > 0;
+    while(ok && (line = strchr(line, '\n')) != NULL && ++line < tail) {
+        if(strncmp(line, "JournalSequence=", 16) == 0) {
+            ok = sscanf(line, "JournalSequence=%llu", &manifest->journalSequence) == 1;
+        } else if(strncmp(line, "File=", 5) == 0 && files < TEXT_FILES) {
+            TextFileEntry *entry = &manifest->files[files++];
+            ok = sscanf(line, "File=%63s %llu %x", entry->path, &entry->size, &entry->checksum) == 3;
+        }
+    }
+    return ok && files == TEXT_FILES;
+}
+
+// Checks every file named by a manifest against its size and checksum
+static int verifyTextFiles(TextManifest* manifest) {
+    unsigned char *buffer = malloc(TEXT_BUFFER_SIZE);
+    int ok = buffer != NULL;
+    for(int f = 0; ok && f < TEXT_FILES; f++) {
+        TextFileEntry *entry = &manifest->files[f];
+        FILE *fp = fopen(entry->path, "rb");
+        ok = fp != NULL;
+        unsigned int checksum = 0;
+        unsigned long long size = 0;
+        size_t n;
+        while(ok && (n = fread(buffer, 1, TEXT_BUFFER_SIZE, fp)) > 0) {
+            checksum = crc32Update(checksum, buffer, n);
+            size += n;
+        }
+        if(fp != NULL) {
+            fclose(fp);
+        }
+        ok = ok && size == entry->size && checksum == entry->checksum;
+    }
+    free(buffer);
+    return ok;
+}
+
+// Finds the checkpoint to load: the current manifest, else the previous
+// one. With verify set, a manifest only counts if its files check out.
+// Returns 1 for the current, 2 for the previous, 0 if there is no
+// manifest at all and -1 if none is usable.
+static int findTextCheckpoint(TextManifest* manifest, int verify) {
+    char *paths[] = { TEXT_MANIFEST_FILE, TEXT_MANIFEST_PREVIOUS };
+    int present = 0;
+    for(int m = 0; m < 2; m++) {
+        FILE *fp = fopen(paths[m], "rb");
+        if(fp == NULL) {
+            continue;
+        }
+        fclose(fp);
+        present = 1;
+        if(readTextManifest(paths[m], manifest) && (!verify || verifyTextFiles(manifest))) {
+            return m + 1;
+        }
+    }
+    return present ? -1 : 0;
+}
+
+// Writes the manifest to a temporary file and renames it into place after
+// moving the current one aside. Files only the old previous manifest
+// named are no longer needed and are removed.
+static int commitTextManifest(TextManifest* manifest) {
+    char text[1024];
+    int length = snprintf(text, sizeof(text), "Generation=%d\nJournalSequence=%llu\n",
+                          manifest->generation, manifest->journalSequence);
+    for(int f = 0; f < TEXT_FILES; f++) {
+        TextFileEntry *entry = &manifest->files[f];
+        length += snprintf(text + length, sizeof(text) - length, "File=%s %llu %08x\n",
+                           entry->path, entry->size, entry->checksum);
+    }
+    length += snprintf(text + length, sizeof(text) - length, "Checksum=%08x\n",
+                       crc32((unsigned char*)text, length));
+    
+    char tempPath[] = TEXT_MANIFEST_FILE ".tmp";
+    FILE *fp = fopen(tempPath, "wb");
+    if(fp == NULL) {
+        return 0;
+    }
+    int ok = fwrite(text, 1, length, fp) == (size_t)length && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = (fclose(fp) == 0) && ok;
+    if(!ok) {
+        remove(tempPath);
+        return 0;
+    }
+    
+    TextManifest retired;
+    int retire = readTextManifest(TEXT_MANIFEST_PREVIOUS, &retired);
+    TextManifest current;
+    int hasCurrent = readTextManifest(TEXT_MANIFEST_FILE, &current);
+#ifdef _WIN32
+    remove(TEXT_MANIFEST_PREVIOUS);
+#endif
+    rename(TEXT_MANIFEST_FILE, TEXT_MANIFEST_PREVIOUS);
+    if(rename(tempPath, TEXT_MANIFEST_FILE) != 0) {
+        return 0;
+    }
+#ifndef _WIN32
+    syncDirectory();
+#endif
+    
+    if(retire && retired.generation != manifest->generation &&
+       (!hasCurrent || retired.generation != current.generation)) {
+        for(int f = 0; f < TEXT_FILES; f++) {
+            remove(retired.files[f].path);
+        }
+    }
+    return 1;
+}
+
+// Writes the text files, the snapshot and the backup change bits of a
+// view. Either file covers the journal on its own, so it is only kept if
+// both failed; returns 0 then.
+static int writeCheckpoint(CheckpointJob* job) {
+    int text = writeTextData(job);
+    int saved = writeSnapshot(SNAPSHOT_FILE, job);
+    if(!saved && text) {
+        // The old snapshot would tie with the new text checkpoint and be
+        // loaded in its place. If it cannot be removed, the journal that
+        // brings it up to date is kept instead.
+        printError("Failed to write " SNAPSHOT_FILE "; the text checkpoint replaces it.");
+        saved = remove(SNAPSHOT_FILE) == 0 || errno == ENOENT;
+    }
+    saveBackupState(job);
+    return saved;
+}
+
+// Lets the journal drop what the checkpoint covers and retires the view
+static void finishCheckpoint(CheckpointJob* job, int saved) {
+    if(saved) {
+        resetJournal(job->journalSequence, job->journalOffset, job->userCount);
+    } else {
+        pthread_mutex_lock(&journal.lock);
+        journal.retried = time(NULL);
+        pthread_mutex_unlock(&journal.lock);
+    }
+    
+    // Voters only look at the view while holding stateLock
+    pthread_rwlock_wrlock(&stateLock);
+    atomic_store(&checkpoints.active, NULL);
+    pthread_rwlock_unlock(&stateLock);
+    metricTime(TIMER_SAVE, currentSeconds() - job->started);
+    freeCheckpointJob(job);
+    if(saved) {
+        metricAdd(METRIC_SAVES, 1);
+    } else {
+        printError("Failed to write a checkpoint; changes stay in the vote journal.");
+    }
+    
+    pthread_mutex_lock(&checkpoints.lock);
+    checkpoints.busy = 0;
+    pthread_cond_broadcast(&checkpoints.idle);
+    pthread_mutex_unlock(&checkpoints.lock);
+}
+
+static void* checkpointThread(void* arg) {
+    CheckpointJob *job = arg;
+    finishCheckpoint(job, writeCheckpoint(job));
+    return NULL;
+}
+
+// Checkpoint: writes the state as it is now to the text files and the
+// binary snapshot, then lets the journal start over from there. Changes
+// are held off only while the view is taken. With background set the
+// files are written on another thread, and nothing is done while a
+// checkpoint is running; otherwise this waits for it. Returns 0 if no
+// checkpoint was started.
+int runCheckpoint(int background) {
+    pthread_mutex_lock(&checkpoints.lock);
+    while(checkpoints.busy) {
+        if(background) {
+            pthread_mutex_unlock(&checkpoints.lock);
+            return 0;
+        }
+        pthread_cond_wait(&checkpoints.idle, &checkpoints.lock);
+    }
+    checkpoints.busy = 1;
+    pthread_mutex_unlock(&checkpoints.lock);
+    
+    double started = currentSeconds();
+    pthread_rwlock_wrlock(&stateLock);
+    CheckpointJob *job = captureCheckpoint();
+    if(job != NULL) {
+        job->started = started;
+        atomic_store(&checkpoints.active, job);
+    }
+    pthread_rwlock_unlock(&stateLock);
+    
+    if(job == NULL) {
+        printError("Not enough memory for a checkpoint; changes stay in the vote journal.");
+        pthread_mutex_lock(&checkpoints.lock);
+        checkpoints.busy = 0;
+        pthread_cond_broadcast(&checkpoints.idle);
+        pthread_mutex_unlock(&checkpoints.lock);
+        return 0;
+    }
+    pthread_t writer;
+    if(background && pthread_create(&writer, NULL, checkpointThread, job) == 0) {
+        pthread_detach(writer);
+        return 1;
+    }
+    finishCheckpoint(job, writeCheckpoint(job));
+    return 1;
+}
+
+void saveData() {
+    runCheckpoint(0);
+}
+
+// Waits until no checkpoint is being written
+void waitForCheckpoint() {
+    pthread_mutex_lock(&checkpoints.lock);
+    while(checkpoints.busy) {
+        pthread_cond_wait(&checkpoints.idle, &checkpoints.lock);
+    }
+    pthread_mutex_unlock(&checkpoints.lock);
+}
+
+// Writes a view as a new text checkpoint generation. Nothing the current
+// manifest names is touched until the new manifest has replaced it.
+int writeTextData(CheckpointJob* job) {
+    TextManifest manifest, existing;
+    memset(&manifest, 0, sizeof(manifest));
+    if(readTextManifest(TEXT_MANIFEST_FILE, &existing)) {
+        manifest.generation = existing.generation;
+    }
+    if(readTextManifest(TEXT_MANIFEST_PREVIOUS, &existing) && existing.generation > manifest.generation) {
+        manifest.generation = existing.generation;
+    }
+    manifest.generation++;
+    manifest.journalSequence = job->journalSequence;
+    
+    int ok = 1;
+    for(int f = 0; ok && f < TEXT_FILES; f++) {
+        TextWriter writer;
+        textFilePath(f, manifest.generation, manifest.files[f].path, sizeof(manifest.files[f].path));
+        ok = textWriterOpen(&writer, manifest.files[f].path);
+        if(ok) {
+            writeTextFile(&writer, f, job);
+            ok = textWriterClose(&writer, &manifest.files[f]);
+        }
+    }
+    ok = ok && commitTextManifest(&manifest);
+    if(!ok) {
+        for(int f = 0; f < TEXT_FILES; f++) {
+            char path[64];
+            textFilePath(f, manifest.generation, path, sizeof(path));
+            remove(path);
+        }
+    }
+    return ok;
+}
+
+// Prefers the binary snapshot unless the text checkpoint is newer
+void loadData() {
+    double started = currentSeconds();
+    TextManifest manifest;
+    unsigned long long textSequence = findTextCheckpoint(&manifest, 0) > 0 ?
+                                      manifest.journalSequence : textCheckpointSequence();
+    if(!loadSnapshot(SNAPSHOT_FILE, textSequence)) {
+        loadTextCheckpoint();
+        rebuildNIDIndex();
+    }
+    rebuildSearchIndex();
+    rebuildTurnout();
+    metricTime(TIMER_LOAD, currentSeconds() - started);
+}
+
+// Loads the newest text checkpoint whose files all match their manifest,
+// or the plain files when no manifest has been written yet
+void loadTextCheckpoint() {
+    TextManifest manifest;
+    int found = findTextCheckpoint(&manifest, 1);
+    if(found == 2) {
+        printf("[WARNING] The latest text checkpoint is damaged; loaded the previous one. "
+               "Changes made between the two may be missing.\n");
+    } else if(found == -1) {
+        printf("[WARNING] No intact text checkpoint was found; reading the plain text files.\n");
+    }
+    loadTextData(found > 0 ? &manifest : NULL);
+}
+
+unsigned long long textCheckpointSequence() {
+    unsigned long long sequence = 0;
+    char line[100];
+    FILE *fp = fopen("election_config.txt", "r");
+    if(fp != NULL) {
+        while(fgets(line, sizeof(line), fp)) {
+            sscanf(line, "JournalSequence=%llu", &sequence);
+        }
+        fclose(fp);
+    }
+    return sequence;
+}
+
+// Field bits for the legacy text formats
+enum {
+    USER_FIELD_NAME = 1,
+    USER_FIELD_NID = 2,
+    USER_FIELD_PASSWORD = 4,
+    USER_FIELD_HAS_VOTED = 8,
+    USER_FIELD_VOTE_TIME = 16,
+    USER_FIELD_RACE = 32,
+    USER_FIELD_VOTED_FOR = 64
+};
+
+enum {
+    CANDIDATE_FIELD_ID = 1,
+    CANDIDATE_FIELD_NAME = 2,
+    CANDIDATE_FIELD_PARTY = 4,
+    CANDIDATE_FIELD_EDUCATION = 8,
+    CANDIDATE_FIELD_AGE = 16,
+    CANDIDATE_FIELD_MANIFESTO = 32,
+    CANDIDATE_FIELD_VOTES = 64,
+    CANDIDATE_FIELD_RACE = 128
+};
+
+enum {
+    RACE_FIELD_ID = 1,
+    RACE_FIELD_NAME = 2,
+    RACE_FIELD_START = 4,
+    RACE_FIELD_END = 8
+};
+
+RecordFormat userFormat = {
+    "USER_", sizeof(VoterRecord),
+    USER_FIELD_NAME | USER_FIELD_NID | USER_FIELD_PASSWORD | USER_FIELD_HAS_VOTED,
+    setUserField
+};
+
+RecordFormat candidateFormat = {
+    "CANDIDATE_", sizeof(Candidate),
+    CANDIDATE_FIELD_ID | CANDIDATE_FIELD_NAME | CANDIDATE_FIELD_PARTY | CANDIDATE_FIELD_VOTES,
+    setCandidateField
+};
+
+RecordFormat raceFormat = {
+    "CONSTITUENCY_", sizeof(RaceRecord),
+    RACE_FIELD_ID | RACE_FIELD_NAME | RACE_FIELD_START | RACE_FIELD_END,
+    setRaceField
+};
+
+int cpuCount() {
+#ifdef _WIN32
+    char *env = getenv("NUMBER_OF_PROCESSORS");
+    int count = env != NULL ? atoi(env) : 1;
+#else
+    int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return count > 0 ? count : 1;
+}
+
+static int keyIs(char* key, int keyLength, char* name) {
+    return (int)strlen(name) == keyLength && memcmp(key, name, keyLength) == 0;
+}
+
+static int copyField(char* dest, int size, char* value, int valueLength) {
+    if(valueLength >= size) {
+        return 0;
+    }
+    memcpy(dest, value, valueLength);
+    dest[valueLength] = '\0';
+    return 1;
+}
+
+static int parseNumber(char* value, int valueLength, long long* out) {
+    long long result = 0;
+    int i = 0, negative = 0;
+    
+    if(valueLength > 0 && value[0] == '-') {
+        negative = 1;
+        i = 1;
+    }
+    if(i == valueLength || valueLength - i > 18) {
+        return 0;
+    }
+    for(; i < valueLength; i++) {
+        if(value[i] < '0' || value[i] > '9') {
+            return 0;
+        }
+        result = result * 10 + (value[i] - '0');
+    }
+    *out = negative ? -result : result;
+    return 1;
+}
+
+// Returns the field bit that was set, 0 for an unknown key, -1 for a bad value
+int setUserField(void* record, char* key, int keyLength, char* value, int valueLength) {
+    VoterRecord *voter = record;
+    long long number;
+    
+    if(keyIs(key, keyLength, "FullName")) {
+        return copyField(voter->fullName, MAX_VOTER_NAME_LENGTH, value, valueLength) ? USER_FIELD_NAME : -1;
+    }
+    if(keyIs(key, keyLength, "NID")) {
+        return copyField(voter->nidNumber, NID_LENGTH, value, valueLength) ? USER_FIELD_NID : -1;
+    }
+    if(keyIs(key, keyLength, "Password")) {
+        return copyField(voter->password, PASSWORD_HASH_LENGTH, value, valueLength) ? USER_FIELD_PASSWORD : -1;
+    }
+    if(keyIs(key, keyLength, "HasVoted")) {
+        if(!parseNumber(value, valueLength, &number) || (number != 0 && number != 1)) {
+            return -1;
+        }
+        voter->hasVoted = (int)number;
+        return USER_FIELD_HAS_VOTED;
+    }
+    if(keyIs(key, keyLength, "VotedFor")) {
+        if(!parseNumber(value, valueLength, &number) || number < BALLOT_WITHDRAWN || number > MAX_CANDIDATES) {
+            return -1;
+        }
+        voter->votedFor = (int)number;
+        return USER_FIELD_VOTED_FOR;
+    }
+    if(keyIs(key, keyLength, "VoteTime")) {
+        if(!parseNumber(value, valueLength, &number)) {
+            return -1;
+        }
+        voter->voteTime = number;
+        return USER_FIELD_VOTE_TIME;
+    }
+    if(keyIs(key, keyLength, "Constituency")) {
+        if(!parseNumber(value, valueLength, &number) || number < 1 || number > MAX_RACES) {
+            return -1;
+        }
+        voter->race = (int)number - 1;
+        return USER_FIELD_RACE;
+    }
+    return 0;
+}
+
+int setCandidateField(void* record, char* key, int keyLength, char* value, int valueLength) {
+    Candidate *candidate = record;
+    long long number;
+    
+    if(keyIs(key, keyLength, "Name")) {
+        return copyField(candidate->name, MAX_NAME_LENGTH, value, valueLength) ? CANDIDATE_FIELD_NAME : -1;
+    }
+    if(keyIs(key, keyLength, "Party")) {
+        return copyField(candidate->party, MAX_NAME_LENGTH, value, valueLength) ? CANDIDATE_FIELD_PARTY : -1;
+    }
+    if(keyIs(key, keyLength, "Education")) {
+        return copyField(candidate->education, sizeof(candidate->education), value, valueLength) ?
+               CANDIDATE_FIELD_EDUCATION : -1;
+    }
+    if(keyIs(key, keyLength, "Manifesto")) {
+        return copyField(candidate->manifesto, sizeof(candidate->manifesto), value, valueLength) ?
+               CANDIDATE_FIELD_MANIFESTO : -1;
+    }
+    if(!parseNumber(value, valueLength, &number) || number < 0 || number > 0x7FFFFFFF) {
+        return (keyIs(key, keyLength, "ID") || keyIs(key, keyLength, "Age") ||
+                keyIs(key, keyLength, "Votes") || keyIs(key, keyLength, "Constituency")) ? -1 : 0;
+    }
+    if(keyIs(key, keyLength, "ID")) {
+        candidate->id = (int)number;
+        return CANDIDATE_FIELD_ID;
+    }
+    if(keyIs(key, keyLength, "Age")) {
+        candidate->age = (int)number;
+        return CANDIDATE_FIELD_AGE;
+    }
+    if(keyIs(key, keyLength, "Votes")) {
+        candidate->votes = (int)number;
+        return CANDIDATE_FIELD_VOTES;
+    }
+    if(keyIs(key, keyLength, "Constituency")) {
+        if(number < 1 || number > MAX_RACES) {
+            return -1;
+        }
+        candidate->race = (int)number - 1;
+        return CANDIDATE_FIELD_RACE;
+    }
+    return 0;
+}
+
+int setRaceField(void* record, char* key, int keyLength, char* value, int valueLength) {
+    RaceRecord *race = record;
+    long long number;
+    
+    if(keyIs(key, keyLength, "Name")) {
+        return copyField(race->name, MAX_NAME_LENGTH, value, valueLength) ? RACE_FIELD_NAME : -1;
+    }
+    if(keyIs(key, keyLength, "ID")) {
+        if(!parseNumber(value, valueLength, &number) || number < 1 || number > MAX_RACES) {
+            return -1;
+        }
+        race->id = (int)number;
+        return RACE_FIELD_ID;
+    }
+    if(keyIs(key, keyLength, "ElectionStartTime")) {
+        if(!parseNumber(value, valueLength, &number)) {
+            return -1;
+        }
+        race->electionStartTime = number;
+        return RACE_FIELD_START;
+    }
+    if(keyIs(key, keyLength, "ElectionEndTime")) {
+        if(!parseNumber(value, valueLength, &number)) {
+            return -1;
+        }
+        race->electionEndTime = number;
+        return RACE_FIELD_END;
+    }
+    return 0;
+}
+
+static void parseError(ParseChunk* chunk, char* marker, int markerLength, char* reason) {
+    if(chunk->errorCount < PARSE_MAX_ERRORS) {
+        snprintf(chunk->errors[chunk->errorCount++], sizeof(chunk->errors[0]),
+                 "%.*s: %s", markerLength > 60 ? 60 : markerLength, marker, reason);
+    }
+}
+
+// Matches PREFIXn_START or PREFIXn_END; returns 1 for start, 2 for end
+static int recordMarker(char* line, int length, char* prefix) {
+    int prefixLength = strlen(prefix);
+    if(length <= prefixLength || memcmp(line, prefix, prefixLength) != 0) {
+        return 0;
+    }
+    int i = prefixLength;
+    while(i < length && line[i] >= '0' && line[i] <= '9') {
+        i++;
+    }
+    if(i == prefixLength) {
+        return 0;
+    }
+    if(length - i == 6 && memcmp(line + i, "_START", 6) == 0) {
+        return 1;
+    }
+    if(length - i == 4 && memcmp(line + i, "_END", 4) == 0) {
+        return 2;
+    }
+    return 0;
+}
+
+static unsigned char* nextParsedRecord(ParseChunk* chunk) {
+    if(chunk->count == chunk->capacity) {
+        int capacity = chunk->capacity > 0 ? chunk->capacity * 2 : 1024;
+        unsigned char *grown = realloc(chunk->records, (size_t)capacity * chunk->format->recordSize);
+        if(grown == NULL) {
+            return NULL;
+        }
+        chunk->records = grown;
+        chunk->capacity = capacity;
+    }
+    unsigned char *record = chunk->records + (size_t)chunk->count * chunk->format->recordSize;
+    memset(record, 0, chunk->format->recordSize);
+    return record;
+}
+
+// Scans one slice line by line. Fields may come in any order; a record is
+// kept only if it is closed by its END marker and has every required field.
+static void* parseChunk(void* arg) {
+    ParseChunk *chunk = arg;
+    RecordFormat *format = chunk->format;
+    char *p = chunk->start;
+    unsigned char *record = NULL;
+    char *marker = NULL;
+    int markerLength = 0;
+    int fields = 0;
+    int bad = 0;
+    
+    while(p < chunk->end) {
+        char *lineEnd = memchr(p, '\n', chunk->end - p);
+        if(lineEnd == NULL) {
+            lineEnd = chunk->end;
+        }
+        int length = (int)(lineEnd - p);
+        if(length > 0 && p[length - 1] == '\r') {
+            length--;
+        }
+        
+        int kind = recordMarker(p, length, format->prefix);
+        if(kind == 1) {
+            if(record != NULL) {
+                if(!bad) {
+                    parseError(chunk, marker, markerLength, "missing END marker");
+                }
+                chunk->malformed++;
+            }
+            record = nextParsedRecord(chunk);
+            if(record == NULL) {
+                parseError(chunk, p, length, "out of memory");
+                break;
+            }
+            marker = p;
+            markerLength = length;
+            fields = 0;
+            bad = 0;
+        } else if(kind == 2) {
+            if(record == NULL) {
+                parseError(chunk, p, length, "END marker without START");
+                chunk->malformed++;
+            } else if(bad) {
+                chunk->malformed++;
+            } else if(length - 4 != markerLength - 6 || memcmp(p, marker, length - 4) != 0) {
+                parseError(chunk, marker, markerLength, "END marker does not match START");
+                chunk->malformed++;
+            } else if((fields & format->requiredFields) != format->requiredFields) {
+                parseError(chunk, marker, markerLength, "missing required field");
+                chunk->malformed++;
+            } else {
+                chunk->count++;
+            }
+            record = NULL;
+        } else if(record != NULL && length > 0) {
+            char *equals = memchr(p, '=', length);
+            int result = equals == NULL ? 0 :
+                format->setField(record, p, (int)(equals - p), equals + 1, length - (int)(equals - p) - 1);
+            if(result <= 0 && !bad) {
+                parseError(chunk, marker, markerLength,
+                           result == 0 ? "unknown line inside record" : "invalid or oversized field value");
+                bad = 1;
+            }
+            fields |= result > 0 ? result : 0;
+        } else if(record == NULL && length > 0 && memchr(p, '=', length) == NULL) {
+            // Blank lines and the TOTAL_ header are fine outside records
+            parseError(chunk, p, length, "unexpected line outside a record");
+            chunk->malformed++;
+        }
+        
+        p = lineEnd + 1;
+    }
+    
+    if(record != NULL) {
+        if(!bad) {
+            parseError(chunk, marker, markerLength, "missing END marker");
+        }
+        chunk->malformed++;
+    }
+    return NULL;
+}
+
+// Finds the first START marker line at or after p
+static char* nextRecordStart(char* p, char* end, char* prefix) {
+    while(p < end) {
+        char *lineEnd = memchr(p, '\n', end - p);
+        if(lineEnd == NULL) {
+            lineEnd = end;
+        }
+        int length = (int)(lineEnd - p);
+        if(length > 0 && p[length - 1] == '\r') {
+            length--;
+        }
+        if(recordMarker(p, length, prefix) == 1) {
+            return p;
+        }
+        p = lineEnd + 1;
+    }
+    return end;
+}
+
+// Finds the start of the last START marker line in [begin, end)
+static char* lastRecordStart(char* begin, char* end, char* prefix) {
+    int prefixLength = strlen(prefix);
+    char *p = end;
+    while(p > begin) {
+        char *lineStart = p - 1;
+        while(lineStart > begin && lineStart[-1] != '\n') {
+            lineStart--;
+        }
+        char *lineEnd = memchr(lineStart, '\n', end - lineStart);
+        int length = (int)((lineEnd != NULL ? lineEnd : end) - lineStart);
+        if(length > 0 && lineStart[length - 1] == '\r') {
+            length--;
+        }
+        if(length > prefixLength && recordMarker(lineStart, length, prefix) == 1 && lineEnd != NULL) {
+            return lineStart;
+        }
+        p = lineStart;
+    }
+    return begin;
+}
+
+// Splits [begin, end) on record boundaries and parses the pieces on all cores
+static int parseBlock(char* begin, char* end, RecordFormat* format, int threads,
+                      void (*store)(unsigned char* records, int count), int* malformed) {
+    ParseChunk *chunks = calloc(threads, sizeof(ParseChunk));
+    if(chunks == NULL) {
+        return -1;
+    }
+    
+    char *cursor = begin;
+    for(int t = 0; t < threads; t++) {
+        char *target = t == threads - 1 ? end : begin + (end - begin) * (t + 1) / threads;
+        char *split = t == threads - 1 ? end : nextRecordStart(target > cursor ? target : cursor, end, format->prefix);
+        chunks[t].format = format;
+        chunks[t].start = cursor;
+        chunks[t].end = split;
+        cursor = split;
+    }
+    
+    for(int t = 1; t < threads; t++) {
+        chunks[t].threaded = pthread_create(&chunks[t].thread, NULL, parseChunk, &chunks[t]) == 0;
+        if(!chunks[t].threaded) {
+            parseChunk(&chunks[t]);
+        }
+    }
+    parseChunk(&chunks[0]);
+    
+    int total = 0;
+    for(int t = 0; t < threads; t++) {
+        if(chunks[t].threaded) {
+            pthread_join(chunks[t].thread, NULL);
+        }
+        // Records are handed over in file order so indices match the file
+        store(chunks[t].records, chunks[t].count);
+        total += chunks[t].count;
+        *malformed += chunks[t].malformed;
+        for(int e = 0; e < chunks[t].errorCount; e++) {
+            printf("[WARNING] Malformed record %s\n", chunks[t].errors[e]);
+        }
+        free(chunks[t].records);
+    }
+    
+    free(chunks);
+    return total;
+}
+
+// Streams a legacy text file through a large buffer, handing each block's
+// complete records to the parallel parser. Returns the number of records
+// loaded, or -1 when the file cannot be opened.
+int parseRecordFile(char* path, RecordFormat* format,
+                    void (*store)(unsigned char* records, int count), int* malformed) {
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL) {
+        return -1;
+    }
+    
+    size_t capacity = PARSE_BLOCK_SIZE;
+    char *buffer = malloc(capacity);
+    if(buffer == NULL) {
+        fclose(fp);
+        return -1;
+    }
+    
+    int threads = cpuCount();
+    int total = 0;
+    int startMalformed = *malformed;
+    long long declared = -1;
+    size_t carried = 0;
+    
+    while(1) {
+        size_t got = fread(buffer + carried, 1, capacity - carried, fp);
+        size_t filled = carried + got;
+        int atEnd = got < capacity - carried;
+        
+        if(declared == -1 && filled > 6 && memcmp(buffer, "TOTAL_", 6) == 0) {
+            char *equals = memchr(buffer, '=', filled < 64 ? filled : 64);
+            char *lineEnd = equals != NULL ? memchr(equals, '\n', buffer + filled - equals) : NULL;
+            if(lineEnd != NULL && lineEnd > equals + 1 && lineEnd[-1] == '\r') {
+                lineEnd--;
+            }
+            if(lineEnd == NULL || !parseNumber(equals + 1, (int)(lineEnd - equals - 1), &declared)) {
+                declared = -2;
+            }
+        }
+        
+        char *stop = atEnd ? buffer + filled : lastRecordStart(buffer, buffer + filled, format->prefix);
+        if(stop == buffer && !atEnd) {
+            // One record is larger than the buffer; grow it and read more
+            char *grown = realloc(buffer, capacity * 2);
+            if(grown == NULL) {
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+            carried = filled;
+            continue;
+        }
+        
+        int blockThreads = (stop - buffer) < 1024 * 1024 ? 1 : threads;
+        int parsed = parseBlock(buffer, stop, format, blockThreads, store, malformed);
+        if(parsed > 0) {
+            total += parsed;
+        }
+        
+        if(atEnd) {
+            break;
+        }
+        carried = buffer + filled - stop;
+        memmove(buffer, stop, carried);
+    }
+    
+    free(buffer);
+    fclose(fp);
+    
+    if(declared >= 0 && declared != total + (*malformed - startMalformed)) {
+        printf("[WARNING] %s declares %lld record(s) but contains %d.\n",
+               path, declared, total + (*malformed - startMalformed));
+    }
+    return total;
+}
+
+// Splits a CSV line in place, undoing RFC 4180 quoting. Returns the
+// number of fields, or -1 for bad quoting or more than maxFields fields.
+static int splitCsvLine(char* line, char** fields, int maxFields) {
+    int count = 0;
+    char *p = line;
+    while(1) {
+        if(count == maxFields) {
+            return -1;
+        }
+        char *out = p;
+        fields[count++] = out;
+        if(*p == '"') {
+            p++;
+            while(*p != '"' || p[1] == '"') {
+                if(*p == '\0') {
+                    return -1;
+                }
+                if(*p == '"') {
+                    p++;
+                }
+                *out++ = *p++;
+            }
+            p++;
+            if(*p != ',' && *p != '\0') {
+                return -1;
+            }
+        } else {
+            while(*p != ',' && *p != '\0') {
+                if(*p == '"') {
+                    return -1;
+                }
+                *out++ = *p++;
+            }
+        }
+        char separator = *p;
+        *out = '\0';
+        if(separator == '\0') {
+            return count;
+        }
+        p++;
+    }
+}
+
+// Validates one line: name,NID,password[,constituency id]. The password is
+// either a $scrypt$ hash, taken as is (quoted, as it holds commas), or a
+// plain password, hashed here. Reasons must not contain commas.
+static char* importLine(ImportChunk* chunk, ImportRow* row, char* text, int length, int lineNumber,
+                        unsigned char** scratch) {
+    char line[IMPORT_LINE_MAX];
+    char *fields[4];
+    if(length >= IMPORT_LINE_MAX) {
+        return "line too long";
+    }
+    memcpy(line, text, length);
+    line[length] = '\0';
+    int count = splitCsvLine(line, fields, 4);
+    if(count == -1 || count < 3) {
+        return count == -1 && memchr(text, '"', length) != NULL ? "bad quoting" : "expected 3 or 4 fields";
+    }
+    if(lineNumber == 0 && chunk->firstLine && strspn(fields[1], "0123456789") != strlen(fields[1])) {
+        return NULL;
+    }
+    
+    if(fields[0][0] == '\0' || strlen(fields[0]) >= MAX_VOTER_NAME_LENGTH) {
+        return "empty or oversized name";
+    }
+    if(strlen(fields[1]) >= NID_LENGTH || !validateNID(fields[1])) {
+        return "invalid NID";
+    }
+    row->race = 0;
+    if(count == 4 && fields[3][0] != '\0') {
+        long long id;
+        if(!parseNumber(fields[3], strlen(fields[3]), &id) || id < 1 || id > chunk->raceCount) {
+            return "unknown constituency";
+        }
+        row->race = (int)id - 1;
+    }
+    if(strncmp(fields[2], "$scrypt$", 8) == 0) {
+        if(strlen(fields[2]) >= PASSWORD_HASH_LENGTH) {
+            return "oversized password hash";
+        }
+        strcpy(row->password, fields[2]);
+    } else {
+        if(strlen(fields[2]) >= MAX_PASSWORD_LENGTH) {
+            return "password too long";
+        }
+        if(!validatePassword(fields[2])) {
+            return "weak password";
+        }
+        if(*scratch == NULL) {
+            *scratch = malloc(scryptScratchSize(KDF_COST_LOG2, KDF_BLOCK_SIZE));
+        }
+        if(*scratch == NULL || !derivePasswordHash(fields[2], *scratch, row->password)) {
+            return "out of memory";
+        }
+    }
+    strcpy(row->fullName, fields[0]);
+    strcpy(row->nid, fields[1]);
+    return NULL;
+}
+
+static void* importChunkThread(void* arg) {
+    ImportChunk *chunk = arg;
+    unsigned char *scratch = NULL;
+    char *p = chunk->start;
+    
+    while(p < chunk->end) {
+        char *lineEnd = memchr(p, '\n', chunk->end - p);
+        if(lineEnd == NULL) {
+            lineEnd = chunk->end;
+        }
+        int length = (int)(lineEnd - p);
+        if(length > 0 && p[length - 1] == '\r') {
+            length--;
+        }
+        if(chunk->count == chunk->capacity) {
+            int capacity = chunk->capacity > 0 ? chunk->capacity * 2 : 1024;
+            ImportRow *grown = realloc(chunk->rows, (size_t)capacity * sizeof(ImportRow));
+            if(grown == NULL) {
+                break;
+            }
+            chunk->rows = grown;
+            chunk->capacity = capacity;
+        }
+        ImportRow *row = &chunk->rows[chunk->count];
+        row->text = p;
+        row->textLength = length;
+        row->fullName[0] = '\0';
+        if(length > 0) {
+            row->reason = importLine(chunk, row, p, length, chunk->count, &scratch);
+        }
+        // Blank lines and the header keep their row, so rows stay one per
+        // line, but are neither imported nor rejected
+        if(length == 0 || (row->reason == NULL && row->fullName[0] == '\0')) {
+            row->reason = NULL;
+            row->text = NULL;
+        }
+        chunk->count++;
+        p = lineEnd + 1;
+    }
+    
+    free(scratch);
+    return NULL;
+}
+
+static void writeImportReject(FILE* fp, long long line, ImportRow* row) {
+    fprintf(fp, "%lld,%s,\"", line, row->reason);
+    for(int i = 0; i < row->textLength; i++) {
+        if(row->text[i] == '"') {
+            fputc('"', fp);
+        }
+        fputc(row->text[i], fp);
+    }
+    fputs("\"\n", fp);
+}
+
+// Registers the valid rows of one block in file order. A NID seen before,
+// in the roll or earlier in the file, rejects the row.
+static void mergeImportChunks(ImportChunk* chunks, int threads, int firstImported, long long* line,
+                              FILE* rejects, long long* imported, long long* rejected) {
+    pthread_rwlock_wrlock(&stateLock);
+    for(int t = 0; t < threads; t++) {
+        for(int i = 0; i < chunks[t].count; i++) {
+            ImportRow *row = &chunks[t].rows[i];
+            (*line)++;
+            if(row->text == NULL) {
+                continue;
+            }
+            if(row->reason == NULL) {
+                int existing = findUserByNID(row->nid);
+                if(existing != -1) {
+                    row->reason = existing >= firstImported ? "duplicate NID in file" : "NID already registered";
+                } else if(applyRegister(row->fullName, row->nid, row->password, row->race) == -1) {
+                    row->reason = "out of memory";
+                }
+            }
+            if(row->reason != NULL) {
+                writeImportReject(rejects, *line, row);
+                (*rejected)++;
+            } else {
+                (*imported)++;
+            }
+        }
+        chunks[t].count = 0;
+    }
+    pthread_rwlock_unlock(&stateLock);
+}
+
+// Bulk-registers a CSV voter roll. Lines are validated, and plain
+// passwords hashed, on all cores one block at a time; each block is then
+// added in file order. Rejected lines go to rejectsPath with their line
+// number and reason. Everything is saved once, at the end.
+int importRoll(char* path, char* rejectsPath) {
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL) {
+        printError("Could not open the voter roll!");
+        return 0;
+    }
+    FILE *rejects = fopen(rejectsPath, "w");
+    size_t capacity = IMPORT_BLOCK_SIZE;
+    char *buffer = malloc(capacity);
+    int threads = cpuCount();
+    ImportChunk *chunks = calloc(threads, sizeof(ImportChunk));
+    if(rejects == NULL || buffer == NULL || chunks == NULL) {
+        printError("Could not start the import!");
+        fclose(fp);
+        if(rejects != NULL) {
+            fclose(rejects);
+        }
+        free(buffer);
+        free(chunks);
+        return 0;
+    }
+    fprintf(rejects, "line,reason,record\n");
+    
+    double start = currentSeconds();
+    int firstImported = userCount;
+    long long line = 0, imported = 0, rejected = 0;
+    size_t carried = 0;
+    int firstBlock = 1;
+    
+    while(1) {
+        size_t got = fread(buffer + carried, 1, capacity - carried, fp);
+        size_t filled = carried + got;
+        int atEnd = got < capacity - carried;
+        
+        char *stop = buffer + filled;
+        if(!atEnd) {
+            while(stop > buffer && stop[-1] != '\n') {
+                stop--;
+            }
+            if(stop == buffer) {
+                // No line break in a whole block; importLine rejects it as
+                // too long, but it has to be read to its end first
+                char *grown = realloc(buffer, capacity * 2);
+                if(grown == NULL) {
+                    break;
+                }
+                buffer = grown;
+                capacity *= 2;
+                carried = filled;
+                continue;
+            }
+        }
+        
+        int blockThreads = (stop - buffer) < 1024 * 1024 ? 1 : threads;
+        char *cursor = buffer;
+        for(int t = 0; t < blockThreads; t++) {
+            char *split = stop;
+            if(t < blockThreads - 1) {
+                split = buffer + (stop - buffer) * (t + 1) / blockThreads;
+                split = split > cursor ? split : cursor;
+                char *lineEnd = memchr(split, '\n', stop - split);
+                split = lineEnd != NULL ? lineEnd + 1 : stop;
+            }
+            chunks[t].start = cursor;
+            chunks[t].end = split;
+            chunks[t].firstLine = firstBlock && t == 0;
+            chunks[t].raceCount = raceCount;
+            cursor = split;
+        }
+        for(int t = 1; t < blockThreads; t++) {
+            chunks[t].threaded = pthread_create(&chunks[t].thread, NULL, importChunkThread, &chunks[t]) == 0;
+            if(!chunks[t].threaded) {
+                importChunkThread(&chunks[t]);
+            }
+        }
+        importChunkThread(&chunks[0]);
+        for(int t = 1; t < blockThreads; t++) {
+            if(chunks[t].threaded) {
+                pthread_join(chunks[t].thread, NULL);
+            }
+        }
+        mergeImportChunks(chunks, blockThreads, firstImported, &line, rejects, &imported, &rejected);
+        firstBlock = 0;
+        
+        if(atEnd) {
+            break;
+        }
+        carried = buffer + filled - stop;
+        memmove(buffer, stop, carried);
+    }
+    
+    for(int t = 0; t < threads; t++) {
+        free(chunks[t].rows);
+    }
+    free(chunks);
+    free(buffer);
+    fclose(fp);
+    int ok = fclose(rejects) == 0;
+    
+    if(imported > 0) {
+        metricAdd(METRIC_REGISTRATIONS, imported);
+        saveData();
+    }
+    double elapsed = currentSeconds() - start;
+    printf("[INFO] Imported %lld voter(s), rejected %lld line(s) in %.2fs (%.0f lines/sec).\n",
+           imported, rejected, elapsed, elapsed > 0 ? line / elapsed : 0.0);
+    if(rejected > 0) {
+        printf("[INFO] Rejected lines and reasons are in %s.\n", rejectsPath);
+    }
+    char message[120];
+    snprintf(message, sizeof(message), "Voter roll imported: %lld added, %lld rejected", imported, rejected);
+    logActivity(message);
+    return ok;
+}
+
+// Records that name a constituency that does not exist
+static int unknownRaceRecords = 0;
+
+static void storeParsedUsers(unsigned char* records, int count) {
+    if(count == 0 || !ensureUserCapacity(userCount + count)) {
+        if(count > 0) {
+            printError("Could not allocate memory for the voter roll!");
+        }
+        return;
+    }
+    VoterRecord *parsed = (VoterRecord*)records;
+    for(int i = 0; i < count; i++) {
+        if(parsed[i].race >= raceCount) {
+            // Keep the voter, but in the first constituency
+            parsed[i].race = 0;
+            unknownRaceRecords++;
+        }
+        if(!writeVoter(userCount, &parsed[i])) {
+            printError("Could not allocate memory for the voter roll!");
+            return;
+        }
+        userCount++;
+    }
+}
+
+static void storeParsedCandidates(unsigned char* records, int count) {
+    Candidate *parsed = (Candidate*)records;
+    for(int i = 0; i < count; i++) {
+        if(parsed[i].race >= raceCount) {
+            unknownRaceRecords++;
+            continue;
+        }
+        Race *race = races[parsed[i].race];
+        if(race->candidateCount < MAX_CANDIDATES) {
+            race->candidates[race->candidateCount++] = parsed[i];
+        }
+    }
+}
+
+// Constituencies loaded so far; the default one created at startup is
+// reused for the first record so its candidates survive a missing
+// candidates.txt
+static int storedRaces = 0;
+
+static void storeParsedRaces(unsigned char* records, int count) {
+    RaceRecord *parsed = (RaceRecord*)records;
+    for(int i = 0; i < count; i++) {
+        int race = storedRaces < raceCount ? storedRaces :
+                   applyAddRace(parsed[i].name, 0, 0);
+        if(race == -1) {
+            return;
+        }
+        strcpy(races[race]->name, parsed[i].name);
+        races[race]->electionStartTime = (time_t)parsed[i].electionStartTime;
+        races[race]->electionEndTime = (time_t)parsed[i].electionEndTime;
+        storedRaces++;
+    }
+}
+
+// Reads the files a manifest names, or the plain files without one
+void loadTextData(TextManifest* manifest) {
+    FILE *fp;
+    char line[500];
+    char paths[TEXT_FILES][64];
+    for(int f = 0; f < TEXT_FILES; f++) {
+        strcpy(paths[f], manifest != NULL ? manifest->files[f].path : textFileNames[f]);
+    }
+    
+    int malformed = 0;
+    unknownRaceRecords = 0;
+    
+    // Load election configuration from text file
+    fp = fopen(paths[TEXT_CONFIG], "r");
+    if(fp != NULL) {
+        long startTime, endTime;
+        if(fgets(line, sizeof(line), fp)) {
+            sscanf(line, "ElectionStartTime=%ld", &startTime);
+            races[0]->electionStartTime = (time_t)startTime;
+        }
+        if(fgets(line, sizeof(line), fp)) {
+            sscanf(line, "ElectionEndTime=%ld", &endTime);
+            races[0]->electionEndTime = (time_t)endTime;
+        }
+        if(fgets(line, sizeof(line), fp)) {
+            sscanf(line, "JournalSequence=%llu", &journal.checkpointSequence);
+        }
+        fclose(fp);
+    }
+    
+    // Load constituencies from text file; older data has none and keeps
+    // the single default constituency
+    storedRaces = 0;
+    int records = parseRecordFile(paths[TEXT_CONSTITUENCIES], &raceFormat, storeParsedRaces, &malformed);
+    if(records >= 0 && malformed > 0) {
+        printf("[WARNING] %s: %d malformed record(s) skipped.\n", paths[TEXT_CONSTITUENCIES], malformed);
+    }
+    
+    // Load users from text file
+    malformed = 0;
+    userCount = 0;
+    records = parseRecordFile(paths[TEXT_USERS], &userFormat, storeParsedUsers, &malformed);
+    if(records >= 0 && malformed > 0) {
+        printf("[WARNING] %s: %d malformed record(s) skipped.\n", paths[TEXT_USERS], malformed);
+    }
+    
+    // Load candidates from text file
+    malformed = 0;
+    int loadedCandidates = races[0]->candidateCount;
+    for(int r = 0; r < raceCount; r++) {
+        races[r]->candidateCount = 0;
+    }
+    records = parseRecordFile(paths[TEXT_CANDIDATES], &candidateFormat, storeParsedCandidates, &malformed);
+    if(records < 0) {
+        races[0]->candidateCount = loadedCandidates;
+    } else if(malformed > 0) {
+        printf("[WARNING] %s: %d malformed record(s) skipped.\n", paths[TEXT_CANDIDATES], malformed);
+    }
+    
+    if(unknownRaceRecords > 0) {
+        printf("[WARNING] %d voter or candidate record(s) name an unknown constituency; "
+               "voters were placed in the first one and candidates skipped.\n", unknownRaceRecords);
+    }
+}
+
+unsigned int snapshotHeaderChecksum(SnapshotHeader* header) {
+    SnapshotHeader copy = *header;
+    copy.headerChecksum = 0;
+    return crc32((unsigned char*)&copy, sizeof(copy));
+}
+
+static unsigned long long alignSnapshotOffset(unsigned long long offset) {
+    return (offset + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+static int writeSnapshotPadding(FILE* fp, unsigned long long target) {
+    static char zeros[SNAPSHOT_ALIGN];
+    long long gap = (long long)target - ftell(fp);
+    while(gap > 0) {
+        size_t n = gap > SNAPSHOT_ALIGN ? SNAPSHOT_ALIGN : (size_t)gap;
+        if(fwrite(zeros, 1, n, fp) != n) {
+            return 0;
+        }
+        gap -= n;
+    }
+    return 1;
+}
+
+// Writes the snapshot to a temporary file and renames it into place, so a
+// process that has the previous snapshot mapped keeps a consistent view.
+int writeSnapshot(char* path, CheckpointJob* job) {
+    char tempPath[260];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    
+    // The index is built afresh from the view's NIDs as their chunks go by
+    NidIndex keys;
+    nidIndexInit(&keys, userNIDAt, job->userCount);
+    User *users = malloc(sizeof(User) * USER_CHUNK_SIZE);
+    VoterColumns *columns = malloc(sizeof(VoterColumns));
+    FILE *fp = users != NULL && columns != NULL ? fopen(tempPath, "wb") : NULL;
+    if(fp == NULL) {
+        free(users);
+        free(columns);
+        nidIndexFree(&keys);
+        return 0;
+    }
+    
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.journalSequence = job->journalSequence;
+    
+    int chunks = job->chunkCount;
+    SnapshotSection *sections = header.sections;
+    sections[SNAPSHOT_USERS].offset = alignSnapshotOffset(sizeof(header));
+    sections[SNAPSHOT_USERS].count = job->userCount;
+    sections[SNAPSHOT_USERS].recordSize = sizeof(User);
+    sections[SNAPSHOT_VOTERS].offset = alignSnapshotOffset(
+        sections[SNAPSHOT_USERS].offset + (unsigned long long)chunks * USER_CHUNK_SIZE * sizeof(User));
+    sections[SNAPSHOT_VOTERS].count = chunks;
+    sections[SNAPSHOT_VOTERS].recordSize = sizeof(VoterColumns);
+    sections[SNAPSHOT_STRINGS].offset = alignSnapshotOffset(
+        sections[SNAPSHOT_VOTERS].offset + (unsigned long long)chunks * sizeof(VoterColumns));
+    sections[SNAPSHOT_STRINGS].count = job->arenaUsed;
+    sections[SNAPSHOT_STRINGS].recordSize = 1;
+    sections[SNAPSHOT_CANDIDATES].offset = alignSnapshotOffset(
+        sections[SNAPSHOT_STRINGS].offset + job->arenaUsed);
+    sections[SNAPSHOT_CANDIDATES].count = job->candidateTotal;
+    sections[SNAPSHOT_CANDIDATES].recordSize = sizeof(Candidate);
+    sections[SNAPSHOT_NID_INDEX].offset = alignSnapshotOffset(
+        sections[SNAPSHOT_CANDIDATES].offset + (unsigned long long)job->candidateTotal * sizeof(Candidate));
+    sections[SNAPSHOT_NID_INDEX].count = keys.capacity;
+    sections[SNAPSHOT_NID_INDEX].recordSize = sizeof(NidSlot);
+    sections[SNAPSHOT_RACES].offset = alignSnapshotOffset(
+        sections[SNAPSHOT_NID_INDEX].offset + (unsigned long long)keys.capacity * sizeof(NidSlot));
+    sections[SNAPSHOT_RACES].count = job->raceCount;
+    sections[SNAPSHOT_RACES].recordSize = sizeof(RaceRecord);
+    header.headerChecksum = snapshotHeaderChecksum(&header);
+    
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    
+    ok = ok && writeSnapshotPadding(fp, sections[SNAPSHOT_USERS].offset);
+    for(int c = 0; ok && c < chunks; c++) {
+        // Whole chunks are written; the unused tail of the last one is zeroed
+        int used = job->userCount - c * USER_CHUNK_SIZE;
+        if(used > USER_CHUNK_SIZE) {
+            used = USER_CHUNK_SIZE;
+        }
+        ok = checkpointChunk(job, c, users, columns) &&
+             fwrite(users, sizeof(User), used, fp) == (size_t)used;
+        ok = ok && writeSnapshotPadding(fp, sections[SNAPSHOT_USERS].offset +
+                                        (unsigned long long)(c + 1) * USER_CHUNK_SIZE * sizeof(User));
+        for(int slot = 0; ok && slot < used; slot++) {
+            nidIndexPlace(&keys, hashNID(users[slot].nidNumber), c * USER_CHUNK_SIZE + slot);
+        }
+    }
+    keys.count = job->userCount;
+    
+    ok = ok && writeSnapshotPadding(fp, sections[SNAPSHOT_VOTERS].offset);
+    for(int c = 0; ok && c < chunks; c++) {
+        ok = checkpointChunk(job, c, users, columns) && fwrite(columns, sizeof(VoterColumns), 1, fp) == 1;
+    }
+    
+    // The blocks end to end. Of the last mapped block only the bytes read
+    // from the previous snapshot exist; the rest of it is zeroed.
+    ok = ok && writeSnapshotPadding(fp, sections[SNAPSHOT_STRINGS].offset);
+    for(int b = 0; ok && b < job->blockCount; b++) {
+        unsigned long long start = (unsigned long long)b * ARENA_BLOCK_SIZE;
+        unsigned long long end = start + ARENA_BLOCK_SIZE < job->arenaUsed ? start + ARENA_BLOCK_SIZE :
+                                 job->arenaUsed;
+        size_t length = (size_t)((start < job->arenaMapped && job->arenaMapped < end ?
+                                  job->arenaMapped : end) - start);
+        ok = fwrite(job->blocks[b], 1, length, fp) == length;
+        ok = ok && writeSnapshotPadding(fp, sections[SNAPSHOT_STRINGS].offset + end);
+    }
+    
+    ok = ok && writeSnapshotPadding(fp, sections[SNAPSHOT_CANDIDATES].offset);
+    ok = ok && fwrite(job->candidates, sizeof(Candidate), job->candidateTotal, fp) == (size_t)job->candidateTotal;
+    
+    ok = ok && writeSnapshotPadding(fp, sections[SNAPSHOT_NID_INDEX].offset);
+    ok = ok && fwrite(keys.slots, sizeof(NidSlot), keys.capacity, fp) == (size_t)keys.capacity;
+    
+    ok = ok && writeSnapshotPadding(fp, sections[SNAPSHOT_RACES].offset);
+    ok = ok && fwrite(job->races, sizeof(RaceRecord), job->raceCount, fp) == (size_t)job->raceCount;
+    
+    long size = ftell(fp);
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = (fclose(fp) == 0) && ok;
+    free(users);
+    free(columns);
+    nidIndexFree(&keys);
+    
+    if(!ok) {
+        remove(tempPath);
+        return 0;
+    }
+    metricAdd(METRIC_BYTES_SNAPSHOT, size > 0 ? size : 0);
+#ifdef _WIN32
+    remove(path);
+#endif
+    return rename(tempPath, path) == 0;
+}
+
+// Maps a snapshot file privately: untouched pages are shared with the page
+// cache and only records that change are copied. Nothing is parsed, so
+// startup cost does not depend on the size of the roll.
+int loadSnapshot(char* path, unsigned long long minSequence) {
+    SnapshotHeader header;
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL) {
+        return 0;
+    }
+    
+    int ok = fread(&header, sizeof(header), 1, fp) == 1;
+    fseek(fp, 0, SEEK_END);
+    unsigned long long fileSize = (unsigned long long)ftell(fp);
+    
+    SnapshotSection *sections = header.sections;
+    ok = ok && memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 &&
+         header.version == SNAPSHOT_VERSION &&
+         header.headerChecksum == snapshotHeaderChecksum(&header) &&
+         sections[SNAPSHOT_USERS].recordSize == sizeof(User) &&
+         sections[SNAPSHOT_VOTERS].recordSize == sizeof(VoterColumns) &&
+         sections[SNAPSHOT_STRINGS].recordSize == 1 &&
+         sections[SNAPSHOT_CANDIDATES].recordSize == sizeof(Candidate) &&
+         sections[SNAPSHOT_NID_INDEX].recordSize == sizeof(NidSlot) &&
+         sections[SNAPSHOT_RACES].recordSize == sizeof(RaceRecord) &&
+         sections[SNAPSHOT_RACES].count >= 1 && sections[SNAPSHOT_RACES].count <= MAX_RACES &&
+         sections[SNAPSHOT_CANDIDATES].count <= sections[SNAPSHOT_RACES].count * MAX_CANDIDATES &&
+         sections[SNAPSHOT_USERS].count <= 0x7FFFFFFF;
+    
+    unsigned long long userChunkTotal =
+        (sections[SNAPSHOT_USERS].count + USER_CHUNK_SIZE - 1) / USER_CHUNK_SIZE;
+    unsigned long long indexCapacity = sections[SNAPSHOT_NID_INDEX].count;
+    ok = ok && sections[SNAPSHOT_USERS].offset +
+               userChunkTotal * USER_CHUNK_SIZE * sizeof(User) <= fileSize &&
+         sections[SNAPSHOT_VOTERS].count == userChunkTotal &&
+         sections[SNAPSHOT_VOTERS].offset + userChunkTotal * sizeof(VoterColumns) <= fileSize &&
+         sections[SNAPSHOT_STRINGS].offset + sections[SNAPSHOT_STRINGS].count <= fileSize &&
+         sections[SNAPSHOT_CANDIDATES].offset +
+               sections[SNAPSHOT_CANDIDATES].count * sizeof(Candidate) <= fileSize &&
+         sections[SNAPSHOT_NID_INDEX].offset + indexCapacity * sizeof(NidSlot) <= fileSize &&
+         sections[SNAPSHOT_RACES].offset +
+               sections[SNAPSHOT_RACES].count * sizeof(RaceRecord) <= fileSize &&
+         indexCapacity >= 2 * sections[SNAPSHOT_USERS].count &&
+         (indexCapacity & (indexCapacity - 1)) == 0;
+    
+    if(!ok || header.journalSequence < minSequence) {
+        fclose(fp);
+        return 0;
+    }
+    
+    unsigned char *base;
+#ifdef _WIN32
+    // No mmap here: read the whole file into one buffer instead
+    base = malloc(fileSize);
+    fseek(fp, 0, SEEK_SET);
+    if(base == NULL || fread(base, 1, fileSize, fp) != fileSize) {
+        free(base);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+#else
+    fclose(fp);
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return 0;
+    }
+    base = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        return 0;
+    }
+#endif
+    
+    if(!growUserChunkTable((int)userChunkTotal)) {
+        printError("Could not allocate memory for the voter roll!");
+        exit(1);
+    }
+    for(unsigned long long c = 0; c < userChunkTotal; c++) {
+        userChunks[c] = (User*)(base + sections[SNAPSHOT_USERS].offset +
+                                c * USER_CHUNK_SIZE * sizeof(User));
+        voterColumns[c] = (VoterColumns*)(base + sections[SNAPSHOT_VOTERS].offset +
+                                          c * sizeof(VoterColumns));
+    }
+    userChunkCount = (int)userChunkTotal;
+    userCount = (int)sections[SNAPSHOT_USERS].count;
+    if(!mapStringArena((char*)base + sections[SNAPSHOT_STRINGS].offset, sections[SNAPSHOT_STRINGS].count)) {
+        printError("Could not allocate memory for the voter roll!");
+        exit(1);
+    }
+    
+    RaceRecord *raceRecords = (RaceRecord*)(base + sections[SNAPSHOT_RACES].offset);
+    raceCount = 0;
+    for(unsigned long long r = 0; r < sections[SNAPSHOT_RACES].count; r++) {
+        raceRecords[r].name[MAX_NAME_LENGTH - 1] = '\0';
+        if(applyAddRace(raceRecords[r].name, (time_t)raceRecords[r].electionStartTime,
+                        (time_t)raceRecords[r].electionEndTime) == -1) {
+            printError("Could not allocate memory for the constituencies!");
+            exit(1);
+        }
+    }
+    Candidate *candidateRecords = (Candidate*)(base + sections[SNAPSHOT_CANDIDATES].offset);
+    for(unsigned long long i = 0; i < sections[SNAPSHOT_CANDIDATES].count; i++) {
+        int race = candidateRecords[i].race;
+        if(race >= 0 && race < raceCount && races[race]->candidateCount < MAX_CANDIDATES) {
+            races[race]->candidates[races[race]->candidateCount++] = candidateRecords[i];
+        }
+    }
+    
+    nidIndexFree(&nidIndex);
+    nidIndex.slots = (NidSlot*)(base + sections[SNAPSHOT_NID_INDEX].offset);
+    nidIndex.capacity = (int)indexCapacity;
+    nidIndex.count = userCount;
+    nidIndex.ownsSlots = 0;
+    nidIndex.keyAt = userNIDAt;
+    
+    journal.checkpointSequence = header.journalSequence;
+    return 1;
+}
+
+// Migration helpers for the command line
+int convertTextToSnapshot() {
+    initializeRaces();
+    loadTextCheckpoint();
+    rebuildNIDIndex();
+    journal.nextSequence = journal.checkpointSequence;
+    
+    CheckpointJob *job = captureCheckpoint();
+    int ok = job != NULL && writeSnapshot(SNAPSHOT_FILE, job);
+    if(job != NULL) {
+        freeCheckpointJob(job);
+    }
+    if(!ok) {
+        printError("Failed to write " SNAPSHOT_FILE "!");
+        return 0;
+    }
+    printSuccess("Converted the text checkpoint to " SNAPSHOT_FILE);
+    printf("Users: %d, Constituencies: %d, Candidates: %d\n", userCount, raceCount, totalCandidateCount());
+    return 1;
+}
+
+int convertSnapshotToText() {
+    if(!loadSnapshot(SNAPSHOT_FILE, 0)) {
+        printError("Could not read a valid " SNAPSHOT_FILE "!");
+        return 0;
+    }
+    journal.nextSequence = journal.checkpointSequence;
+    
+    CheckpointJob *job = captureCheckpoint();
+    int ok = job != NULL && writeTextData(job);
+    if(job != NULL) {
+        freeCheckpointJob(job);
+    }
+    if(!ok) {
+        printError("Failed to write the text checkpoint!");
+        return 0;
+    }
+    printSuccess("Converted " SNAPSHOT_FILE " to a text checkpoint (" TEXT_MANIFEST_FILE ")");
+    printf("Users: %d, Constituencies: %d, Candidates: %d\n", userCount, raceCount, totalCandidateCount());
+    return 1;
+}
+
+// Length bytes that follow a nibble of 15: runs of 255, then the rest
+static int lzPutLength(unsigned char* dst, int capacity, int* out, int length) {
+    length -= 15;
+    while(length >= 255) {
+        if(*out >= capacity) {
+            return 0;
+        }
+        dst[(*out)++] = 255;
+        length -= 255;
+    }
+    if(*out >= capacity) {
+        return 0;
+    }
+    dst[(*out)++] = (unsigned char)length;
+    return 1;
+}
+
+// One sequence: a token holding both lengths, the literals, then the
+// offset and the rest of the match length. The last sequence of a block
+// has literals only.
+static int lzPutSequence(unsigned char* dst, int capacity, int* out, unsigned char* literals,
+                         int literalLength, int offset, int matchLength) {
+    int matchCode = matchLength > 0 ? matchLength - LZ_MIN_MATCH : 0;
+    if(*out >= capacity) {
+        return 0;
+    }
+    dst[(*out)++] = (unsigned char)((literalLength < 15 ? literalLength : 15) << 4 |
+                                    (matchCode < 15 ? matchCode : 15));
+    if(literalLength >= 15 && !lzPutLength(dst, capacity, out, literalLength)) {
+        return 0;
+    }
+    if(literalLength > capacity - *out) {
+        return 0;
+    }
+    memcpy(dst + *out, literals, literalLength);
+    *out += literalLength;
+    if(matchLength == 0) {
+        return 1;
+    }
+    if(capacity - *out < 2) {
+        return 0;
+    }
+    dst[(*out)++] = (unsigned char)(offset & 0xFF);
+    dst[(*out)++] = (unsigned char)(offset >> 8);
+    return matchCode < 15 || lzPutLength(dst, capacity, out, matchCode);
+}
+
+// LZ77 over one block with a 64 KB window and a single-entry hash of the
+// next four bytes. Returns the compressed size, or 0 when that would not
+// be smaller than the input.
+static int lzCompress(unsigned char* src, int size, unsigned char* dst) {
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+    int capacity = size - 1;
+    int out = 0, anchor = 0, i = 0;
+    
+    while(i + LZ_MIN_MATCH <= size) {
+        unsigned int sequence, previous;
+        memcpy(&sequence, src + i, sizeof(sequence));
+        unsigned int slot = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int candidate = table[slot];
+        table[slot] = i;
+        if(candidate >= 0 && i - candidate <= LZ_MAX_OFFSET) {
+            memcpy(&previous, src + candidate, sizeof(previous));
+            if(previous == sequence) {
+                int length = LZ_MIN_MATCH;
+                while(i + length < size && src[candidate + length] == src[i + length]) {
+                    length++;
+                }
+                if(!lzPutSequence(dst, capacity, &out, src + anchor, i - anchor, i - candidate, length)) {
+                    return 0;
+                }
+                i += length;
+                anchor = i;
+                continue;
+            }
+        }
+        // Step faster through data that keeps missing
+        i += 1 + ((i - anchor) >> 6);
+    }
+    if(anchor < size && !lzPutSequence(dst, capacity, &out, src + anchor, size - anchor, 0, 0)) {
+        return 0;
+    }
+    return out;
+}
+
+static int lzGetLength(unsigned char* src, int size, int* in, int* length) {
+    int byte;
+    do {
+        if(*in >= size) {
+            return 0;
+        }
+        byte = src[(*in)++];
+        *length += byte;
+    } while(byte == 255);
+    return 1;
+}
+
+// Returns 1 when src unpacks to exactly rawSize bytes
+static int lzDecompress(unsigned char* src, int size, unsigned char* dst, int rawSize) {
+    int in = 0, out = 0;
+    while(in < size) {
+        int token = src[in++];
+        int literals = token >> 4;
+        if(literals == 15 && !lzGetLength(src, size, &in, &literals)) {
+            return 0;
+        }
+        if(literals > size - in || literals > rawSize - out) {
+            return 0;
+        }
+        memcpy(dst + out, src + in, literals);
+        in += literals;
+        out += literals;
+        if(in == size) {
+            break;
+        }
+        
+        if(size - in < 2) {
+            return 0;
+        }
+        int offset = src[in] | src[in + 1] << 8;
+        in += 2;
+        int length = token & 15;
+        if(length == 15 && !lzGetLength(src, size, &in, &length)) {
+            return 0;
+        }
+        length += LZ_MIN_MATCH;
+        if(offset == 0 || offset > out || length > rawSize - out) {
+            return 0;
+        }
+        // Byte by byte: the match may overlap what it copies
+        for(int k = 0; k < length; k++) {
+            dst[out + k] = dst[out - offset + k];
+        }
+        out += length;
+    }
+    return out == rawSize;
+}
+
+static void packArchiveTask(ArchiveTask* task) {
+    ArchiveBlock *block = &task->block;
+    block->checksum = crc32(task->raw, block->rawSize);
+    int size = lzCompress(task->raw, (int)block->rawSize, task->stored);
+    block->storedSize = size > 0 ? (unsigned int)size : block->rawSize;
+    task->ok = 1;
+}
+
+static void unpackArchiveTask(ArchiveTask* task) {
+    ArchiveBlock *block = &task->block;
+    if(task->ok && block->storedSize < block->rawSize) {
+        task->ok = lzDecompress(task->stored, (int)block->storedSize, task->raw, (int)block->rawSize);
+    }
+    task->ok = task->ok && crc32(task->raw, block->rawSize) == block->checksum;
+}
+
+typedef struct {
+    ArchiveTask *tasks;
+    int count;
+    int first;
+    int step;
+    int pack;
+    pthread_t thread;
+    int started;
+} ArchiveWorker;
+
+static void* archiveWorkerThread(void* arg) {
+    ArchiveWorker *worker = arg;
+    for(int i = worker->first; i < worker->count; i += worker->step) {
+        if(worker->pack) {
+            packArchiveTask(&worker->tasks[i]);
+        } else {
+            unpackArchiveTask(&worker->tasks[i]);
+        }
+    }
+    return NULL;
+}
+
+// Packs or unpacks a batch of blocks with one thread per core
+static void runArchiveTasks(ArchiveTask* tasks, int count, int pack) {
+    ArchiveWorker workers[64];
+    int workerCount = cpuCount();
+    if(workerCount > count) {
+        workerCount = count;
+    }
+    if(workerCount > 64) {
+        workerCount = 64;
+    }
+    for(int w = 0; w < workerCount; w++) {
+        workers[w].tasks = tasks;
+        workers[w].count = count;
+        workers[w].first = w;
+        workers[w].step = workerCount;
+        workers[w].pack = pack;
+        workers[w].started = w > 0 &&
+            pthread_create(&workers[w].thread, NULL, archiveWorkerThread, &workers[w]) == 0;
+    }
+    for(int w = 0; w < workerCount; w++) {
+        if(workers[w].started) {
+            pthread_join(workers[w].thread, NULL);
+        } else {
+            archiveWorkerThread(&workers[w]);
+        }
+    }
+}
+
+static ArchiveTask* allocArchiveTasks(int count) {
+    ArchiveTask *tasks = calloc(count, sizeof(ArchiveTask));
+    for(int i = 0; tasks != NULL && i < count; i++) {
+        tasks[i].raw = malloc(ARCHIVE_BLOCK_SIZE);
+        tasks[i].stored = malloc(ARCHIVE_BLOCK_SIZE);
+        if(tasks[i].raw == NULL || tasks[i].stored == NULL) {
+            for(int k = 0; k <= i; k++) {
+                free(tasks[k].raw);
+                free(tasks[k].stored);
+            }
+            free(tasks);
+            tasks = NULL;
+        }
+    }
+    return tasks;
+}
+
+static void freeArchiveTasks(ArchiveTask* tasks, int count) {
+    for(int i = 0; tasks != NULL && i < count; i++) {
+        free(tasks[i].raw);
+        free(tasks[i].stored);
+    }
+    free(tasks);
+}
+
+// Starts an archive body at the current position of fp
+static void archiveWriterInit(ArchiveWriter* writer, FILE* fp) {
+    memset(writer, 0, sizeof(ArchiveWriter));
+    writer->fp = fp;
+    writer->pendingCapacity = cpuCount() * ARCHIVE_BATCH_BLOCKS;
+    writer->pending = allocArchiveTasks(writer->pendingCapacity);
+    writer->failed = writer->pending == NULL;
+}
+
+// Compresses the queued blocks and writes them in order
+static void flushArchiveBlocks(ArchiveWriter* writer) {
+    runArchiveTasks(writer->pending, writer->pendingCount, 1);
+    for(int i = 0; i < writer->pendingCount; i++) {
+        ArchiveTask *task = &writer->pending[i];
+        if(writer->blockCount == writer->blockCapacity) {
+            int capacity = writer->blockCapacity > 0 ? writer->blockCapacity * 2 : 64;
+            ArchiveBlock *grown = realloc(writer->blocks, sizeof(ArchiveBlock) * capacity);
+            if(grown == NULL) {
+                writer->failed = 1;
+                break;
+            }
+            writer->blocks = grown;
+            writer->blockCapacity = capacity;
+        }
+        ArchiveBlock *block = &task->block;
+        unsigned char *data = block->storedSize < block->rawSize ? task->stored : task->raw;
+        block->offset = (unsigned long long)ftell(writer->fp);
+        if(fwrite(data, 1, block->storedSize, writer->fp) != block->storedSize) {
+            writer->failed = 1;
+        }
+        writer->blocks[writer->blockCount++] = *block;
+        memset(block, 0, sizeof(ArchiveBlock));
+    }
+    writer->pendingCount = 0;
+}
+
+// Adds one record. Keys must not decrease within a section, and a section
+// is written whole before the next one starts.
+static void archiveAppend(ArchiveWriter* writer, int section, int key, void* data, int size) {
+    if(writer->failed || size > ARCHIVE_BLOCK_SIZE) {
+        writer->failed = 1;
+        return;
+    }
+    ArchiveTask *task = &writer->pending[writer->pendingCount];
+    if(task->block.records > 0 &&
+       (task->block.section != section || task->block.rawSize + size > ARCHIVE_BLOCK_SIZE)) {
+        if(++writer->pendingCount == writer->pendingCapacity) {
+            flushArchiveBlocks(writer);
+        }
+        task = &writer->pending[writer->pendingCount];
+    }
+    if(task->block.records == 0) {
+        task->block.section = section;
+        task->block.firstKey = key;
+    }
+    memcpy(task->raw + task->block.rawSize, data, size);
+    task->block.rawSize += size;
+    task->block.records++;
+    task->block.lastKey = key;
+}
+
+// Writes the remaining blocks and then the table. Returns 0 if anything
+// failed along the way.
+static int archiveFinish(ArchiveWriter* writer, ArchiveTable* table) {
+    memset(table, 0, sizeof(ArchiveTable));
+    if(!writer->failed) {
+        if(writer->pending[writer->pendingCount].block.records > 0) {
+            writer->pendingCount++;
+        }
+        flushArchiveBlocks(writer);
+    }
+    table->tableOffset = (unsigned long long)ftell(writer->fp);
+    table->blockCount = writer->blockCount;
+    table->tableChecksum = crc32((unsigned char*)writer->blocks, sizeof(ArchiveBlock) * writer->blockCount);
+    if(!writer->failed && writer->blockCount > 0 &&
+       fwrite(writer->blocks, sizeof(ArchiveBlock), writer->blockCount, writer->fp) != (size_t)writer->blockCount) {
+        writer->failed = 1;
+    }
+    freeArchiveTasks(writer->pending, writer->pendingCapacity);
+    free(writer->blocks);
+    writer->pending = NULL;
+    writer->blocks = NULL;
+    return !writer->failed;
+}
+
+// Reads and checks the block table of an archive body
+static int archiveOpen(ArchiveReader* reader, FILE* fp, ArchiveTable* table) {
+    memset(reader, 0, sizeof(ArchiveReader));
+    reader->fp = fp;
+    if(table->blockCount > 0x1000000) {
+        return 0;
+    }
+    reader->blocks = malloc(sizeof(ArchiveBlock) * (table->blockCount > 0 ? table->blockCount : 1));
+    int ok = reader->blocks != NULL &&
+             fseek(fp, (long)table->tableOffset, SEEK_SET) == 0 &&
+             fread(reader->blocks, sizeof(ArchiveBlock), table->blockCount, fp) == table->blockCount &&
+             crc32((unsigned char*)reader->blocks, sizeof(ArchiveBlock) * table->blockCount) == table->tableChecksum;
+    for(unsigned int i = 0; ok && i < table->blockCount; i++) {
+        ArchiveBlock *block = &reader->blocks[i];
+        ok = block->rawSize <= ARCHIVE_BLOCK_SIZE && block->storedSize <= block->rawSize &&
+             block->offset + block->storedSize <= table->tableOffset;
+    }
+    if(!ok) {
+        free(reader->blocks);
+        reader->blocks = NULL;
+        return 0;
+    }
+    reader->blockCount = (int)table->blockCount;
+    return 1;
+}
+
+static void archiveClose(ArchiveReader* reader) {
+    free(reader->blocks);
+    reader->blocks = NULL;
+    reader->blockCount = 0;
+}
+
+// Reads count blocks starting at first into tasks from allocArchiveTasks()
+// and unpacks them in parallel. Returns 1 if every block checked out.
+static int archiveRead(ArchiveReader* reader, int first, int count, ArchiveTask* tasks) {
+    for(int i = 0; i < count; i++) {
+        ArchiveTask *task = &tasks[i];
+        task->block = reader->blocks[first + i];
+        unsigned char *data = task->block.storedSize < task->block.rawSize ? task->stored : task->raw;
+        task->ok = fseek(reader->fp, (long)task->block.offset, SEEK_SET) == 0 &&
+                   fread(data, 1, task->block.storedSize, reader->fp) == task->block.storedSize;
+    }
+    runArchiveTasks(tasks, count, 0);
+    for(int i = 0; i < count; i++) {
+        if(!tasks[i].ok) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Index of the first block of a section that may hold key, or -1
+static int archiveFind(ArchiveReader* reader, int section, int key) {
+    int low = 0, high = reader->blockCount;
+    while(low < high) {
+        int mid = (low + high) / 2;
+        ArchiveBlock *block = &reader->blocks[mid];
+        if(block->section < section || (block->section == section && block->lastKey < key)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if(low < reader->blockCount && reader->blocks[low].section == section &&
+       reader->blocks[low].firstKey <= key) {
+        return low;
+    }
+    return -1;
+}
+
+static unsigned int archiveHeaderChecksum(ArchiveHeader* header) {
+    ArchiveHeader copy = *header;
+    copy.headerChecksum = 0;
+    return crc32((unsigned char*)&copy, sizeof(copy));
+}
+
+// Writes report text as a results archive. Section s of the text ends at
+// ends[s] and is stored under key s, split into records of at most
+// RESULTS_CHUNK bytes.
+int writeResultsArchive(char* path, char* text, size_t* ends, int sections) {
+    FILE *fp = fopen(path, "wb");
+    if(fp == NULL) {
+        return 0;
+    }
+    ArchiveHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+    header.version = ARCHIVE_VERSION;
+    memcpy(header.content, "RESULTS", 7);
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    
+    ArchiveWriter writer;
+    archiveWriterInit(&writer, fp);
+    unsigned char record[sizeof(ResultsRecord) + RESULTS_CHUNK];
+    size_t offset = 0;
+    for(int s = 0; ok && s < sections; s++) {
+        while(offset < ends[s]) {
+            ResultsRecord head;
+            head.key = s;
+            head.length = ends[s] - offset < RESULTS_CHUNK ? (int)(ends[s] - offset) : RESULTS_CHUNK;
+            memcpy(record, &head, sizeof(head));
+            memcpy(record + sizeof(head), text + offset, head.length);
+            archiveAppend(&writer, 0, s, record, sizeof(head) + head.length);
+            offset += head.length;
+        }
+    }
+    ok = archiveFinish(&writer, &header.body) && ok;
+    
+    header.headerChecksum = archiveHeaderChecksum(&header);
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = (fclose(fp) == 0) && ok;
+    if(!ok) {
+        remove(path);
+    }
+    return ok;
+}
+
+// Prints the text of the records in an unpacked block, or only those
+// with the given key when key is not -1. Returns 0 if the block is malformed.
+static int printResultsBlock(ArchiveTask* task, int key) {
+    unsigned int offset = 0;
+    for(int i = 0; i < task->block.records; i++) {
+        ResultsRecord head;
+        if(task->block.rawSize - offset < sizeof(head)) {
+            return 0;
+        }
+        memcpy(&head, task->raw + offset, sizeof(head));
+        offset += sizeof(head);
+        if(head.length < 0 || (unsigned int)head.length > task->block.rawSize - offset) {
+            return 0;
+        }
+        if(key == -1 || head.key == key) {
+            fwrite(task->raw + offset, 1, head.length, stdout);
+        }
+        offset += head.length;
+    }
+    return offset == task->block.rawSize;
+}
+
+// Prints an exported results archive, or only one constituency of it.
+// The whole archive is unpacked in parallel batches; one constituency
+// needs just the blocks holding its key.
+int extractArchive(char* path, int constituency) {
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL) {
+        printError("Could not open the archive!");
+        return 0;
+    }
+    ArchiveHeader header;
+    int ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+             memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)) == 0 &&
+             header.version == ARCHIVE_VERSION &&
+             header.headerChecksum == archiveHeaderChecksum(&header) &&
+             memcmp(header.content, "RESULTS", 8) == 0;
+    ArchiveReader reader;
+    memset(&reader, 0, sizeof(reader));
+    ok = ok && archiveOpen(&reader, fp, &header.body);
+    if(!ok) {
+        fclose(fp);
+        printError("Not a valid results archive!");
+        return 0;
+    }
+    
+    int batch = cpuCount() * ARCHIVE_BATCH_BLOCKS;
+    ArchiveTask *tasks = allocArchiveTasks(batch);
+    ok = tasks != NULL;
+    int missing = 0;
+    if(ok && constituency > 0) {
+        int block = archiveFind(&reader, 0, constituency);
+        if(block == -1) {
+            printError("No such constituency in the archive!");
+            missing = 1;
+            ok = 0;
+        }
+        // A constituency longer than a block continues into the next ones
+        while(ok && block < reader.blockCount && reader.blocks[block].firstKey <= constituency) {
+            ok = archiveRead(&reader, block, 1, tasks) && printResultsBlock(&tasks[0], constituency);
+            block++;
+        }
+    } else {
+        for(int first = 0; ok && first < reader.blockCount; first += batch) {
+            int count = reader.blockCount - first < batch ? reader.blockCount - first : batch;
+            ok = archiveRead(&reader, first, count, tasks);
+            for(int i = 0; ok && i < count; i++) {
+                ok = printResultsBlock(&tasks[i], -1);
+            }
+        }
+    }
+    if(!ok && !missing) {
+        printError("The archive is damaged!");
+    }
+    freeArchiveTasks(tasks, batch);
+    archiveClose(&reader);
+    fclose(fp);
+    return ok;
+}
+
+static void backupPath(int number, char* path, size_t size) {
+    snprintf(path, size, "%s_%06d.bak", backups.prefix, number);
+}
+
+static unsigned int backupHeaderChecksum(BackupHeader* header) {
+    BackupHeader copy = *header;
+    copy.headerChecksum = 0;
+    return crc32((unsigned char*)&copy, sizeof(copy));
+}
+
+static int findBackupEntry(int number) {
+    for(int i = 0; i < backups.entryCount; i++) {
+        if(backups.entries[i].number == number) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static BackupEntry* lastBackupEntry() {
+    return backups.entryCount > 0 ? &backups.entries[backups.entryCount - 1] : NULL;
+}
+
+static int addBackupEntry(BackupHeader* header, int parent) {
+    BackupEntry *grown = realloc(backups.entries, sizeof(BackupEntry) * (backups.entryCount + 1));
+    if(grown == NULL) {
+        return 0;
+    }
+    backups.entries = grown;
+    BackupEntry *entry = &backups.entries[backups.entryCount++];
+    entry->number = header->number;
+    entry->kind = (int)header->kind;
+    entry->parent = parent;
+    entry->created = header->created;
+    entry->journalSequence = header->journalSequence;
+    entry->changedUsers = header->changedUsers;
+    entry->changedRaces = header->changedRaces;
+    return 1;
+}
+
+// Reads <prefix>_catalog.txt once; a missing catalog is an empty one
+int loadBackupCatalog() {
+    if(backups.catalogLoaded) {
+        return 1;
+    }
+    char path[260], line[200], kind[16];
+    snprintf(path, sizeof(path), "%s_catalog.txt", backups.prefix);
+    backups.entryCount = 0;
+    backups.catalogLoaded = 1;
+    
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL) {
+        return 1;
+    }
+    while(fgets(line, sizeof(line), fp)) {
+        BackupHeader header;
+        int parent;
+        memset(&header, 0, sizeof(header));
+        if(line[0] == '#' || sscanf(line, "%d %15s %d %lld %llu %d %d", &header.number, kind, &parent,
+                                    &header.created, &header.journalSequence,
+                                    &header.changedUsers, &header.changedRaces) != 7) {
+            continue;
+        }
+        header.kind = strcmp(kind, "base") == 0 ? BACKUP_BASE : BACKUP_DELTA;
+        if(!addBackupEntry(&header, parent)) {
+            fclose(fp);
+            return 0;
+        }
+    }
+    fclose(fp);
+    return 1;
+}
+
+static int saveBackupCatalog() {
+    char path[260], tempPath[270];
+    snprintf(path, sizeof(path), "%s_catalog.txt", backups.prefix);
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    
+    FILE *fp = fopen(tempPath, "w");
+    if(fp == NULL) {
+        return 0;
+    }
+    fprintf(fp, "# number kind parent created journal_sequence changed_voters changed_constituencies\n");
+    for(int i = 0; i < backups.entryCount; i++) {
+        BackupEntry *entry = &backups.entries[i];
+        fprintf(fp, "%d %s %d %lld %llu %d %d\n", entry->number,
+                entry->kind == BACKUP_BASE ? "base" : "delta", entry->parent, entry->created,
+                entry->journalSequence, entry->changedUsers, entry->changedRaces);
+    }
+    int ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = (fclose(fp) == 0) && ok;
+    if(!ok) {
+        remove(tempPath);
+        return 0;
+    }
+#ifdef _WIN32
+    remove(path);
+#endif
+    return rename(tempPath, path) == 0;
+}
+
+// Opens the temporary file for a backup and reserves room for its header
+static FILE* openBackupFile(BackupHeader* header, char* tempPath, size_t size) {
+    char path[260];
+    backupPath(header->number, path, sizeof(path));
+    snprintf(tempPath, size, "%s.tmp", path);
+    
+    FILE *fp = fopen(tempPath, "wb");
+    if(fp == NULL) {
+        return NULL;
+    }
+    setvbuf(fp, NULL, _IOFBF, 1024 * 1024);
+    if(fwrite(header, sizeof(BackupHeader), 1, fp) != 1) {
+        fclose(fp);
+        remove(tempPath);
+        return NULL;
+    }
+    return fp;
+}
+
+// Fills in the header, syncs the file and renames it into place
+static int closeBackupFile(FILE* fp, BackupHeader* header, char* tempPath, int ok) {
+    char path[260];
+    backupPath(header->number, path, sizeof(path));
+    long size = ftell(fp);
+    
+    header->headerChecksum = backupHeaderChecksum(header);
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(header, sizeof(BackupHeader), 1, fp) == 1;
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = (fclose(fp) == 0) && ok;
+    if(!ok) {
+        remove(tempPath);
+        return 0;
+    }
+    metricAdd(METRIC_BYTES_BACKUP, size > 0 ? size : 0);
+#ifdef _WIN32
+    remove(path);
+#endif
+    return rename(tempPath, path) == 0;
+}
+
+static void fillBackupRace(BackupRace* out, int r) {
+    memset(out, 0, sizeof(BackupRace));
+    out->index = r;
+    out->candidateCount = races[r]->candidateCount;
+    out->record.id = races[r]->id;
+    strcpy(out->record.name, races[r]->name);
+    out->record.electionStartTime = (long long)races[r]->electionStartTime;
+    out->record.electionEndTime = (long long)races[r]->electionEndTime;
+    for(int i = 0; i < races[r]->candidateCount; i++) {
+        out->candidates[i] = races[r]->candidates[i];
+        out->candidates[i].votes = candidateVotes(races[r], i);
+        out->candidates[i].race = r;
+    }
+}
+
+// Copies the changed records of one chunk out of the live state. The
+// writer calls this before serializing a chunk, and so does anyone about
+// to change one of the chunk's changed records while it is still shared.
+static void preserveBackupChunk(BackupJob* job, int chunk) {
+    pthread_mutex_lock(&job->copyLock);
+    if(atomic_load_explicit(&job->shared[chunk], memory_order_relaxed)) {
+        unsigned long long *bits = &job->changed[(size_t)chunk * USER_CHUNK_WORDS];
+        int count = 0;
+        for(int w = 0; w < USER_CHUNK_WORDS; w++) {
+            count += bitCount(bits[w]);
+        }
+        VoterRecord *copy = malloc(sizeof(VoterRecord) * count);
+        if(copy == NULL) {
+            job->failed = 1;
+        } else {
+            int n = 0;
+            for(int w = 0; w < USER_CHUNK_WORDS; w++) {
+                for(int b = 0; b < 64 && bits[w] >> b != 0; b++) {
+                    if((bits[w] >> b) & 1) {
+                        voterFrom(job->live[chunk], job->liveColumns[chunk], w * 64 + b, &copy[n++]);
+                    }
+                }
+            }
+        }
+        job->copies[chunk] = copy;
+        atomic_store_explicit(&job->shared[chunk], 0, memory_order_release);
+    }
+    pthread_mutex_unlock(&job->copyLock);
+}
+
+// Called before a voter record changes: keeps the record as the running
+// backup and checkpoint saw it, and marks it for the next backup
+void backupUserChanged(int userIndex) {
+    checkpointUserChanged(userIndex);
+    int chunk = userIndex >> USER_CHUNK_SHIFT;
+    unsigned long long bit = 1ULL << (userIndex & 63);
+    BackupJob *job = atomic_load_explicit(&backups.active, memory_order_acquire);
+    if(job != NULL && chunk < job->chunkCount && (job->changed[userIndex >> 6] & bit) &&
+       atomic_load_explicit(&job->shared[chunk], memory_order_acquire)) {
+        preserveBackupChunk(job, chunk);
+    }
+    
+    atomic_ullong *word = &backups.userChanged[userIndex >> 6];
+    if(!(atomic_load_explicit(word, memory_order_relaxed) & bit)) {
+        atomic_fetch_or_explicit(word, bit, memory_order_relaxed);
+    }
+}
+
+void backupRaceChanged(int race) {
+    if(!atomic_load_explicit(&backups.raceChanged[race], memory_order_relaxed)) {
+        atomic_store_explicit(&backups.raceChanged[race], 1, memory_order_relaxed);
+    }
+}
+
+static void freeBackupJob(BackupJob* job) {
+    for(int c = 0; c < job->chunkCount; c++) {
+        free(job->copies[c]);
+    }
+    free(job->live);
+    free(job->liveColumns);
+    free(job->changed);
+    free(job->shared);
+    free(job->copies);
+    free(job->races);
+    pthread_mutex_destroy(&job->copyLock);
+    free(job);
+}
+
+static int writeBackupJob(BackupJob* job) {
+    char tempPath[270];
+    FILE *fp = openBackupFile(&job->header, tempPath, sizeof(tempPath));
+    if(fp == NULL) {
+        return 0;
+    }
+    
+    ArchiveWriter writer;
+    archiveWriterInit(&writer, fp);
+    BackupUser record;
+    memset(&record, 0, sizeof(record));
+    for(int c = 0; !writer.failed && c < job->chunkCount; c++) {
+        preserveBackupChunk(job, c);
+        if(job->failed) {
+            writer.failed = 1;
+            break;
+        }
+        if(job->copies[c] == NULL) {
+            continue;
+        }
+        unsigned long long *bits = &job->changed[(size_t)c * USER_CHUNK_WORDS];
+        int n = 0;
+        for(int w = 0; w < USER_CHUNK_WORDS; w++) {
+            for(int b = 0; b < 64 && bits[w] >> b != 0; b++) {
+                if((bits[w] >> b) & 1) {
+                    record.index = c * USER_CHUNK_SIZE + w * 64 + b;
+                    record.voter = job->copies[c][n++];
+                    archiveAppend(&writer, BACKUP_SECTION_USERS, record.index, &record, sizeof(record));
+                }
+            }
+        }
+        free(job->copies[c]);
+        job->copies[c] = NULL;
+    }
+    for(int i = 0; i < job->header.changedRaces; i++) {
+        archiveAppend(&writer, BACKUP_SECTION_RACES, job->races[i].index, &job->races[i], sizeof(BackupRace));
+    }
+    int ok = archiveFinish(&writer, &job->header.body);
+    return closeBackupFile(fp, &job->header, tempPath, ok);
+}
+
+// Opens a backup file and checks its header
+static FILE* openBackupForRead(int number, BackupHeader* header) {
+    char path[260];
+    backupPath(number, path, sizeof(path));
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL) {
+        return NULL;
+    }
+    int ok = fread(header, sizeof(BackupHeader), 1, fp) == 1 &&
+             memcmp(header->magic, BACKUP_MAGIC, sizeof(header->magic)) == 0 &&
+             header->version == BACKUP_VERSION &&
+             header->headerChecksum == backupHeaderChecksum(header) &&
+             header->number == number &&
+             header->userCount >= 0 && header->raceCount >= 1 && header->raceCount <= MAX_RACES &&
+             header->changedUsers >= 0 && header->changedUsers <= header->userCount &&
+             header->changedRaces >= 0 && header->changedRaces <= header->raceCount;
+    if(!ok) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
 }
 
-int loginUser() {
-    char nidNumber[NID_LENGTH];
-    char password[MAX_PASSWORD_LENGTH];
-    char hashedPassword[MAX_PASSWORD_LENGTH];
+static int applyBackupBlock(ArchiveTask* task, BackupImage* image, int* users, int* raceRecords) {
+    ArchiveBlock *block = &task->block;
+    if(block->section == BACKUP_SECTION_USERS) {
+        BackupUser *records = (BackupUser*)task->raw;
+        if(block->rawSize != block->records * sizeof(BackupUser)) {
+            return 0;
+        }
+        for(int i = 0; i < block->records; i++) {
+            if(records[i].index < 0 || records[i].index >= image->userCount) {
+                return 0;
+            }
+            image->users[records[i].index] = records[i].voter;
+        }
+        *users += block->records;
+        return 1;
+    }
+    if(block->section == BACKUP_SECTION_RACES) {
+        BackupRace *records = (BackupRace*)task->raw;
+        if(block->rawSize != block->records * sizeof(BackupRace)) {
+            return 0;
+        }
+        for(int i = 0; i < block->records; i++) {
+            if(records[i].index < 0 || records[i].index >= image->raceCount ||
+               records[i].candidateCount < 0 || records[i].candidateCount > MAX_CANDIDATES) {
+                return 0;
+            }
+            image->races[records[i].index] = records[i];
+        }
+        *raceRecords += block->records;
+        return 1;
+    }
+    return 0;
+}
+
+// Applies one backup file on top of the image built so far, unpacking
+// its blocks a batch at a time in parallel
+static int applyBackupFile(int number, BackupImage* image) {
+    BackupHeader header;
+    FILE *fp = openBackupForRead(number, &header);
+    if(fp == NULL) {
+        return 0;
+    }
+    int ok = header.userCount >= image->userCount && header.raceCount >= image->raceCount;
+    
+    // The roll and the constituency table only grow
+    if(ok && header.userCount > image->userCount) {
+        VoterRecord *users = realloc(image->users, sizeof(VoterRecord) * header.userCount);
+        ok = users != NULL;
+        if(ok) {
+            memset(users + image->userCount, 0, sizeof(VoterRecord) * (header.userCount - image->userCount));
+            image->users = users;
+            image->userCount = header.userCount;
+        }
+    }
+    if(ok && header.raceCount > image->raceCount) {
+        BackupRace *grown = realloc(image->races, sizeof(BackupRace) * header.raceCount);
+        ok = grown != NULL;
+        if(ok) {
+            memset(grown + image->raceCount, 0, sizeof(BackupRace) * (header.raceCount - image->raceCount));
+            image->races = grown;
+            image->raceCount = header.raceCount;
+        }
+    }
     
-    printHeader("USER LOGIN");
+    ArchiveReader reader;
+    memset(&reader, 0, sizeof(reader));
+    ok = ok && archiveOpen(&reader, fp, &header.body);
+    int batch = cpuCount() * ARCHIVE_BATCH_BLOCKS;
+    ArchiveTask *tasks = ok ? allocArchiveTasks(batch) : NULL;
+    ok = ok && tasks != NULL;
+    int users = 0, raceRecords = 0;
+    for(int first = 0; ok && first < reader.blockCount; first += batch) {
+        int count = reader.blockCount - first < batch ? reader.blockCount - first : batch;
+        ok = archiveRead(&reader, first, count, tasks);
+        for(int t = 0; ok && t < count; t++) {
+            ok = applyBackupBlock(&tasks[t], image, &users, &raceRecords);
+        }
+    }
+    freeArchiveTasks(tasks, batch);
+    archiveClose(&reader);
+    fclose(fp);
     
-    printf("1. Enter your NID Number: ");
-    fgets(nidNumber, NID_LENGTH, stdin);
-    nidNumber[strcspn(nidNumber, "\n")] = 0;
+    image->journalSequence = header.journalSequence;
+    return ok && users == header.changedUsers && raceRecords == header.changedRaces;
+}
+
+// Looks for a voter in one backup file, unpacking at most one block.
+// Returns 1 when found, 0 when the file does not hold the voter and -1
+// when it cannot be read. *registered is set from the file's roll size.
+static int findBackupVoter(int number, int userIndex, VoterRecord* out, int* registered) {
+    BackupHeader header;
+    FILE *fp = openBackupForRead(number, &header);
+    if(fp == NULL) {
+        return -1;
+    }
+    *registered = userIndex < header.userCount;
+    
+    ArchiveReader reader;
+    int found = archiveOpen(&reader, fp, &header.body) ? 0 : -1;
+    int block = found == 0 ? archiveFind(&reader, BACKUP_SECTION_USERS, userIndex) : -1;
+    ArchiveTask *task = block != -1 ? allocArchiveTasks(1) : NULL;
+    if(block != -1 && (task == NULL || !archiveRead(&reader, block, 1, task) ||
+                       task->block.rawSize != task->block.records * sizeof(BackupUser))) {
+        found = -1;
+    } else if(block != -1) {
+        // Records are in index order
+        BackupUser *records = (BackupUser*)task->raw;
+        int low = 0, high = task->block.records;
+        while(low < high) {
+            int mid = (low + high) / 2;
+            if(records[mid].index < userIndex) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if(low < task->block.records && records[low].index == userIndex) {
+            *out = records[low].voter;
+            found = 1;
+        }
+    }
+    freeArchiveTasks(task, 1);
+    archiveClose(&reader);
+    fclose(fp);
+    return found;
+}
+
+// Shows a voter's record as it was at a backup. Voter numbers never
+// change, so the current roll maps the NID to one; the chain is then
+// walked back from the backup until a file holds the voter.
+int showBackupVoter(int number, char* nid) {
+    initializeRaces();
+    loadData();
+    replayJournal();
+    int userIndex = findUserByNID(nid);
+    if(userIndex == -1) {
+        printError("No voter with that NID is registered!");
+        return 0;
+    }
+    if(!loadBackupCatalog() || findBackupEntry(number) == -1) {
+        printError("No such backup in the catalog!");
+        return 0;
+    }
     
-    printf("2. Enter your Password: ");
-    fgets(password, MAX_PASSWORD_LENGTH, stdin);
-    password[strcspn(password, "\n")] = 0;
+    VoterRecord voter;
+    int registered = 0;
+    int at = findBackupEntry(number);
+    while(at != -1) {
+        int holder = backups.entries[at].number;
+        int wasRegistered;
+        int found = findBackupVoter(holder, userIndex, &voter, &wasRegistered);
+        if(found < 0) {
+            break;
+        }
+        if(holder == number) {
+            registered = wasRegistered;
+            if(!registered) {
+                printInfo("The voter had not registered yet at that backup.");
+                return 1;
+            }
+        }
+        if(found) {
+            printHeader("VOTER IN BACKUP");
+            printf("Backup: %d (record stored in backup %d)\n", number, holder);
+            printf("Name: %s\n", voter.fullName);
+            printf("NID: %s\n", voter.nidNumber);
+            printf("Constituency: %d\n", voter.race + 1);
+            printf("Voted: %s\n", voter.hasVoted ? "Yes" : "No");
+            if(voter.votedFor > 0) {
+                printf("Ballot: candidate %d\n", voter.votedFor);
+            } else if(voter.votedFor == BALLOT_WITHDRAWN) {
+                printf("Ballot: withdrawn candidate\n");
+            }
+            if(voter.hasVoted) {
+                time_t voteTime = (time_t)voter.voteTime;
+                printf("Vote Time: %s", ctime(&voteTime));
+            }
+            return 1;
+        }
+        if(backups.entries[at].kind == BACKUP_BASE) {
+            break;
+        }
+        at = findBackupEntry(backups.entries[at].parent);
+    }
+    printError("The backup chain is missing or damaged!");
+    return 0;
+}
+
+void freeBackupImage(BackupImage* image) {
+    free(image->users);
+    free(image->races);
+    memset(image, 0, sizeof(BackupImage));
+}
+
+// Rebuilds the state at any backup in the catalog: its base, then each
+// delta up to it in order
+int loadBackupImage(int number, BackupImage* image) {
+    memset(image, 0, sizeof(BackupImage));
+    int *chain = malloc(sizeof(int) * (backups.entryCount + 1));
+    if(chain == NULL) {
+        return 0;
+    }
     
-    hashPassword(password, hashedPassword);
-    int userIndex = findUserByNID(nidNumber);
+    int length = 0;
+    int at = findBackupEntry(number);
+    while(at != -1 && length <= backups.entryCount) {
+        chain[length++] = at;
+        if(backups.entries[at].kind == BACKUP_BASE) {
+            break;
+        }
+        at = findBackupEntry(backups.entries[at].parent);
+    }
     
-    if(userIndex != -1 && strcmp(users[userIndex].password, hashedPassword) == 0) {
-        currentUserIndex = userIndex;
-        time(&lastActivityTime);
-        printSuccess("Login successful!");
-        printf("Welcome, %s!\n", users[userIndex].fullName);
-        logActivity("User logged in");
-        return 1;
-    } else {
-        printError("Invalid NID number or password!");
-        logActivity("Failed login attempt");
-        return 0;
+    int ok = at != -1 && length > 0 && backups.entries[at].kind == BACKUP_BASE;
+    for(int i = length - 1; ok && i >= 0; i--) {
+        ok = applyBackupFile(backups.entries[chain[i]].number, image);
     }
+    free(chain);
+    if(!ok) {
+        freeBackupImage(image);
+    }
+    return ok;
 }
 
-int checkSession() {
-    time_t currentTime;
-    time(&currentTime);
+// Folds a chain that has grown to BACKUP_MAX_DELTAS deltas into a new
+// base holding the same state as its newest backup, then deletes every
+// chain older than the last BACKUP_KEEP_CHAINS bases
+static void compactBackups() {
+    BackupEntry *tip = lastBackupEntry();
+    int deltas = 0;
+    for(int i = backups.entryCount - 1; i >= 0 && backups.entries[i].kind == BACKUP_DELTA; i--) {
+        deltas++;
+    }
+    if(tip == NULL || deltas < BACKUP_MAX_DELTAS) {
+        return;
+    }
     
-    if(difftime(currentTime, lastActivityTime) > SESSION_TIMEOUT) {
-        printError("Session timeout! Please login again.");
-        currentUserIndex = -1;
-        return 0;
+    int source = tip->number;
+    BackupImage image;
+    if(!loadBackupImage(source, &image)) {
+        logActivity("Backup compaction failed: the chain could not be read");
+        return;
     }
     
-    time(&lastActivityTime);
-    return 1;
+    BackupHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BACKUP_MAGIC, sizeof(header.magic));
+    header.version = BACKUP_VERSION;
+    header.kind = BACKUP_BASE;
+    header.number = source + 1;
+    header.created = (long long)time(NULL);
+    header.journalSequence = image.journalSequence;
+    header.userCount = header.changedUsers = image.userCount;
+    header.raceCount = header.changedRaces = image.raceCount;
+    
+    char tempPath[270];
+    FILE *fp = openBackupFile(&header, tempPath, sizeof(tempPath));
+    int ok = fp != NULL;
+    if(ok) {
+        ArchiveWriter writer;
+        archiveWriterInit(&writer, fp);
+        BackupUser record;
+        memset(&record, 0, sizeof(record));
+        for(int i = 0; i < image.userCount; i++) {
+            record.index = i;
+            record.voter = image.users[i];
+            archiveAppend(&writer, BACKUP_SECTION_USERS, i, &record, sizeof(record));
+        }
+        for(int r = 0; r < image.raceCount; r++) {
+            archiveAppend(&writer, BACKUP_SECTION_RACES, r, &image.races[r], sizeof(BackupRace));
+        }
+        ok = archiveFinish(&writer, &header.body);
+        ok = closeBackupFile(fp, &header, tempPath, ok);
+    }
+    freeBackupImage(&image);
+    if(!ok) {
+        logActivity("Backup compaction failed: the new base could not be written");
+        return;
+    }
+    
+    pthread_mutex_lock(&backups.lock);
+    addBackupEntry(&header, source);
+    if(backups.since == source) {
+        backups.since = header.number;
+    }
+    
+    // Retention: keep the newest BACKUP_KEEP_CHAINS bases and what follows them
+    int keepFrom = backups.entryCount;
+    for(int bases = 0; keepFrom > 0 && bases < BACKUP_KEEP_CHAINS; ) {
+        keepFrom--;
+        if(backups.entries[keepFrom].kind == BACKUP_BASE) {
+            bases++;
+        }
+    }
+    char path[260];
+    for(int i = 0; i < keepFrom; i++) {
+        backupPath(backups.entries[i].number, path, sizeof(path));
+        remove(path);
+    }
+    memmove(backups.entries, backups.entries + keepFrom,
+            sizeof(BackupEntry) * (backups.entryCount - keepFrom));
+    backups.entryCount -= keepFrom;
+    pthread_mutex_unlock(&backups.lock);
+    saveBackupCatalog();
+    
+    char message[120];
+    snprintf(message, sizeof(message), "Backups %d-%d compacted into base %d, %d old backup(s) deleted",
+             source - deltas, source, header.number, keepFrom);
+    logActivity(message);
 }
 
-int isElectionActive() {
-    time_t currentTime;
-    time(&currentTime);
+static void* backupWriterThread(void* arg) {
+    BackupJob *job = arg;
+    int ok = writeBackupJob(job);
+    
+    // Voters only look at the job while holding stateLock
+    pthread_rwlock_wrlock(&stateLock);
+    atomic_store(&backups.active, NULL);
+    pthread_rwlock_unlock(&stateLock);
+    
+    pthread_mutex_lock(&backups.lock);
+    if(ok) {
+        ok = addBackupEntry(&job->header, job->header.parent);
+    }
+    if(!ok && backups.since == job->header.number) {
+        // The changes it took are not in any backup; start over with a base
+        backups.since = 0;
+    }
+    pthread_mutex_unlock(&backups.lock);
+    
+    char message[120];
+    if(ok) {
+        metricAdd(METRIC_BACKUPS, 1);
+        saveBackupCatalog();
+        snprintf(message, sizeof(message), "Backup %d written (%s, %d voter(s), %d constituency(ies))",
+                 job->header.number, job->header.kind == BACKUP_BASE ? "base" : "delta",
+                 job->header.changedUsers, job->header.changedRaces);
+        logActivity(message);
+        compactBackups();
+    } else {
+        snprintf(message, sizeof(message), "Backup %d failed", job->header.number);
+        logActivity(message);
+    }
+    freeBackupJob(job);
     
-    if(difftime(currentTime, electionStartTime) < 0) {
+    pthread_mutex_lock(&backups.lock);
+    backups.busy = 0;
+    pthread_cond_broadcast(&backups.idle);
+    pthread_mutex_unlock(&backups.lock);
+    return NULL;
+}
+
+// Takes a copy-on-write view of everything changed since the previous
+// backup and writes it on a background thread. Voting is held off only
+// while the change bits and the constituencies are copied. Returns the
+// backup's number, 0 while another backup is being written, or -1.
+int startBackup() {
+    pthread_mutex_lock(&backups.lock);
+    if(backups.busy) {
+        pthread_mutex_unlock(&backups.lock);
         return 0;
     }
-    if(difftime(currentTime, electionEndTime) > 0) {
+    backups.busy = 1;
+    pthread_mutex_unlock(&backups.lock);
+    
+    BackupJob *job = calloc(1, sizeof(BackupJob));
+    if(job == NULL || !loadBackupCatalog()) {
+        free(job);
+        pthread_mutex_lock(&backups.lock);
+        backups.busy = 0;
+        pthread_cond_broadcast(&backups.idle);
+        pthread_mutex_unlock(&backups.lock);
         return -1;
     }
-    return 1;
-}
-
-void mainMenu() {
-    int choice;
-    
-    while(1) {
-        if(!checkSession()) {
-            return;
+    pthread_mutex_init(&job->copyLock, NULL);
+    
+    pthread_rwlock_wrlock(&stateLock);
+    pthread_mutex_lock(&backups.lock);
+    BackupEntry *tip = lastBackupEntry();
+    int delta = tip != NULL && backups.since == tip->number;
+    
+    BackupHeader *header = &job->header;
+    memcpy(header->magic, BACKUP_MAGIC, sizeof(header->magic));
+    header->version = BACKUP_VERSION;
+    header->kind = delta ? BACKUP_DELTA : BACKUP_BASE;
+    header->number = tip != NULL ? tip->number + 1 : 1;
+    header->parent = delta ? tip->number : 0;
+    header->created = (long long)time(NULL);
+    header->journalSequence = journal.nextSequence;
+    header->userCount = userCount;
+    header->raceCount = raceCount;
+    
+    job->chunkCount = (userCount + USER_CHUNK_SIZE - 1) / USER_CHUNK_SIZE;
+    int chunks = job->chunkCount > 0 ? job->chunkCount : 1;
+    job->live = malloc(sizeof(User*) * chunks);
+    job->liveColumns = malloc(sizeof(VoterColumns*) * chunks);
+    job->changed = calloc((size_t)chunks * USER_CHUNK_WORDS, sizeof(unsigned long long));
+    job->shared = calloc(chunks, sizeof(atomic_int));
+    job->copies = calloc(chunks, sizeof(VoterRecord*));
+    job->races = malloc(sizeof(BackupRace) * raceCount);
+    int ok = job->live != NULL && job->liveColumns != NULL && job->changed != NULL && job->shared != NULL &&
+             job->copies != NULL && job->races != NULL;
+    
+    if(ok) {
+        for(int c = 0; c < job->chunkCount; c++) {
+            job->live[c] = userChunks[c];
+            job->liveColumns[c] = voterColumns[c];
+            int any = 0;
+            for(int w = 0; w < USER_CHUNK_WORDS; w++) {
+                size_t word = (size_t)c * USER_CHUNK_WORDS + w;
+                unsigned long long bits = atomic_load_explicit(&backups.userChanged[word], memory_order_relaxed);
+                if(!delta) {
+                    // A base takes every voter on the roll
+                    int first = c * USER_CHUNK_SIZE + w * 64;
+                    int valid = userCount - first;
+                    bits = valid >= 64 ? ~0ULL : valid > 0 ? (1ULL << valid) - 1 : 0;
+                }
+                atomic_store_explicit(&backups.userChanged[word], 0, memory_order_relaxed);
+                job->changed[word] = bits;
+                header->changedUsers += bitCount(bits);
+                any |= bits != 0;
+            }
+            atomic_init(&job->shared[c], any);
         }
+        for(int r = 0; r < raceCount; r++) {
+            if(!delta || atomic_load_explicit(&backups.raceChanged[r], memory_order_relaxed)) {
+                fillBackupRace(&job->races[header->changedRaces++], r);
+            }
+            atomic_store_explicit(&backups.raceChanged[r], 0, memory_order_relaxed);
+        }
+        backups.since = header->number;
+        atomic_store(&backups.active, job);
         
-        printHeader("MAIN MENU");
-        printf("Logged in as: %s\n", users[currentUserIndex].fullName);
-        printf("========================================\n");
-        printf("1. Cast Vote\n");
-        printf("2. Show All Candidates\n");
-        printf("3. View Candidate Details\n");
-        printf("4. Search Candidate\n");
-        printf("5. Show Results\n");
-        printf("6. View Statistics\n");
-        printf("7. Logout\n");
-        printf("========================================\n");
-        printf("Enter your choice: ");
-        scanf("%d", &choice);
-        clearInputBuffer();
-        
-        switch(choice) {
-            case 1:
-                castVote();
-                break;
-            case 2:
-                showCandidates();
-                break;
-            case 3:
-                showCandidateDetails();
-                break;
-            case 4:
-                searchCandidate();
-                break;
-            case 5:
-                showResults();
-                break;
-            case 6:
-                showStatistics();
-                break;
-            case 7:
-                printSuccess("Logged out successfully!");
-                printf("Goodbye, %s!\n", users[currentUserIndex].fullName);
-                logActivity("User logged out");
-                currentUserIndex = -1;
-                return;
-            default:
-                printError("Invalid choice! Please try again.");
+        pthread_t writer;
+        ok = pthread_create(&writer, NULL, backupWriterThread, job) == 0;
+        if(ok) {
+            pthread_detach(writer);
+        } else {
+            atomic_store(&backups.active, NULL);
+            backups.since = 0;
         }
     }
+    pthread_mutex_unlock(&backups.lock);
+    pthread_rwlock_unlock(&stateLock);
+    
+    if(!ok) {
+        freeBackupJob(job);
+        pthread_mutex_lock(&backups.lock);
+        backups.busy = 0;
+        pthread_cond_broadcast(&backups.idle);
+        pthread_mutex_unlock(&backups.lock);
+        return -1;
+    }
+    return header->number;
 }
 
-void adminPanel() {
-    char password[MAX_PASSWORD_LENGTH];
-    int choice;
+// Waits until no backup is being written
+void waitForBackup() {
+    pthread_mutex_lock(&backups.lock);
+    while(backups.busy) {
+        pthread_cond_wait(&backups.idle, &backups.lock);
+    }
+    pthread_mutex_unlock(&backups.lock);
+}
+
+// Saves the change bits taken with a checkpoint's view
+void saveBackupState(CheckpointJob* job) {
+    char tempPath[] = BACKUP_STATE_FILE ".tmp";
+    BackupStateHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BACKUP_STATE_MAGIC, sizeof(header.magic));
+    header.version = BACKUP_VERSION;
+    header.since = job->backupSince;
+    header.userCount = job->userCount;
+    header.raceCount = job->raceCount;
+    header.journalSequence = job->journalSequence;
+    
+    size_t words = ((size_t)job->userCount + 63) / 64;
+    unsigned int checksum = crc32((unsigned char*)&header, sizeof(header));
+    checksum = crc32Update(checksum, (unsigned char*)job->userChanged, words * sizeof(unsigned long long));
+    checksum = crc32Update(checksum, job->raceChanged, job->raceCount);
+    header.checksum = checksum;
+    
+    FILE *fp = fopen(tempPath, "wb");
+    if(fp == NULL) {
+        return;
+    }
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             (words == 0 || fwrite(job->userChanged, sizeof(unsigned long long), words, fp) == words) &&
+             fwrite(job->raceChanged, 1, job->raceCount, fp) == (size_t)job->raceCount;
+    ok = (fclose(fp) == 0) && ok;
+    if(!ok) {
+        remove(tempPath);
+        return;
+    }
+#ifdef _WIN32
+    remove(BACKUP_STATE_FILE);
+#endif
+    rename(tempPath, BACKUP_STATE_FILE);
+}
+
+// Restores the change bits saved with the checkpoint just loaded, so the
+// next backup can be a delta. They only count if they belong to this
+// checkpoint and to the newest backup (or the base compacted from it);
+// otherwise the next backup is a base. The journal replay that follows
+// marks the changes made after the checkpoint.
+void loadBackupState() {
+    backups.since = 0;
+    memset(backups.raceChanged, 0, sizeof(backups.raceChanged));
+    if(userChunkCapacity > 0) {
+        memset(backups.userChanged, 0, sizeof(atomic_ullong) * USER_CHUNK_WORDS * userChunkCapacity);
+    }
     
-    printHeader("ADMIN PANEL");
-    printf("Enter Admin Password: ");
-    fgets(password, MAX_PASSWORD_LENGTH, stdin);
-    password[strcspn(password, "\n")] = 0;
+    BackupStateHeader header;
+    FILE *fp = fopen(BACKUP_STATE_FILE, "rb");
+    if(fp == NULL || !loadBackupCatalog()) {
+        if(fp != NULL) {
+            fclose(fp);
+        }
+        return;
+    }
+    BackupEntry *tip = lastBackupEntry();
+    size_t words = ((size_t)userCount + 63) / 64;
+    int ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+             memcmp(header.magic, BACKUP_STATE_MAGIC, sizeof(header.magic)) == 0 &&
+             header.version == BACKUP_VERSION &&
+             header.journalSequence == journal.checkpointSequence &&
+             header.userCount == userCount && header.raceCount == raceCount &&
+             tip != NULL && header.since > 0 &&
+             (tip->number == header.since || (tip->kind == BACKUP_BASE && tip->parent == header.since)) &&
+             (words == 0 || fread(backups.userChanged, sizeof(atomic_ullong), words, fp) == words) &&
+             fread(backups.raceChanged, 1, raceCount, fp) == (size_t)raceCount;
+    fclose(fp);
     
-    if(strcmp(password, ADMIN_PASSWORD) != 0) {
-        printError("Invalid admin password!");
-        logActivity("Failed admin login attempt");
+    if(ok) {
+        unsigned int stored = header.checksum;
+        header.checksum = 0;
+        unsigned int checksum = crc32((unsigned char*)&header, sizeof(header));
+        checksum = crc32Update(checksum, (unsigned char*)backups.userChanged, words * sizeof(atomic_ullong));
+        checksum = crc32Update(checksum, (unsigned char*)backups.raceChanged, raceCount);
+        ok = checksum == stored;
+    }
+    if(ok) {
+        backups.since = tip->number;
+    } else {
+        memset(backups.raceChanged, 0, sizeof(backups.raceChanged));
+        if(userChunkCapacity > 0) {
+            memset(backups.userChanged, 0, sizeof(atomic_ullong) * USER_CHUNK_WORDS * userChunkCapacity);
+        }
+    }
+}
+
+void listBackups() {
+    if(!loadBackupCatalog()) {
+        printError("Could not read the backup catalog!");
+        return;
+    }
+    if(backups.entryCount == 0) {
+        printInfo("No backups yet.");
         return;
     }
     
-    printSuccess("Admin access granted!");
-    logActivity("Admin logged in");
+    printHeader("BACKUPS");
+    printf("%-8s %-6s %-8s %-20s %-10s %-10s\n", "Number", "Kind", "Parent", "Created", "Voters", "Races");
+    for(int i = 0; i < backups.entryCount; i++) {
+        BackupEntry *entry = &backups.entries[i];
+        char created[32];
+        time_t when = (time_t)entry->created;
+        strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime(&when));
+        printf("%-8d %-6s %-8d %-20s %-10d %-10d\n", entry->number,
+               entry->kind == BACKUP_BASE ? "base" : "delta", entry->parent, created,
+               entry->changedUsers, entry->changedRaces);
+    }
+}
+
+// Makes the state at any backup in the catalog the current data. Run it
+// while the system is stopped: the journal is discarded, since its records
+// belong to the state being replaced, and the next backup is a base.
+int restoreBackup(int number) {
+    BackupImage image;
+    if(!loadBackupCatalog() || findBackupEntry(number) == -1) {
+        printError("No such backup in the catalog!");
+        return 0;
+    }
+    if(!loadBackupImage(number, &image)) {
+        printError("The backup chain is missing or damaged!");
+        return 0;
+    }
     
-    while(1) {
-        printHeader("ADMIN PANEL");
-        printf("1. View All Statistics\n");
-        printf("2. Export Results\n");
-        printf("3. Reset Election\n");
-        printf("4. Add Candidate\n");
-        printf("5. Remove Candidate\n");
-        printf("6. Create Backup\n");
-        printf("7. Set Election Period\n");
-        printf("8. Exit Admin Panel\n");
-        printf("========================================\n");
-        printf("Enter your choice: ");
-        scanf("%d", &choice);
-        clearInputBuffer();
-        
-        switch(choice) {
-            case 1:
-                showStatistics();
-                break;
-            case 2:
-                exportResults();
-                break;
-            case 3:
-                resetElection();
-                break;
-            case 4:
-                addCandidate();
-                break;
-            case 5:
-                removeCandidate();
-                break;
-            case 6:
-                createBackup();
-                break;
-            case 7:
-                setElectionPeriod();
-                break;
-            case 8:
-                printInfo("Exiting admin panel...");
-                return;
-            default:
-                printError("Invalid choice!");
+    raceCount = 0;
+    for(int r = 0; r < image.raceCount; r++) {
+        BackupRace *stored = &image.races[r];
+        stored->record.name[MAX_NAME_LENGTH - 1] = '\0';
+        int race = applyAddRace(stored->record.name, (time_t)stored->record.electionStartTime,
+                                (time_t)stored->record.electionEndTime);
+        if(race == -1) {
+            printError("Could not allocate memory for the constituencies!");
+            freeBackupImage(&image);
+            return 0;
+        }
+        for(int i = 0; i < stored->candidateCount; i++) {
+            races[race]->candidates[i] = stored->candidates[i];
+        }
+        races[race]->candidateCount = stored->candidateCount;
+    }
+    if(!ensureUserCapacity(image.userCount)) {
+        printError("Could not allocate memory for the voter roll!");
+        freeBackupImage(&image);
+        return 0;
+    }
+    for(int i = 0; i < image.userCount; i++) {
+        if(!writeVoter(i, &image.users[i])) {
+            printError("Could not allocate memory for the voter roll!");
+            freeBackupImage(&image);
+            return 0;
+        }
+    }
+    userCount = image.userCount;
+    rebuildNIDIndex();
+    journal.nextSequence = image.journalSequence;
+    freeBackupImage(&image);
+    
+    CheckpointJob *job = captureCheckpoint();
+    int ok = job != NULL;
+    if(ok) {
+        writeTextData(job);
+        ok = writeSnapshot(SNAPSHOT_FILE, job);
+        freeCheckpointJob(job);
+    }
+    if(!ok) {
+        printError("Failed to write " SNAPSHOT_FILE "!");
+        return 0;
+    }
+    remove(JOURNAL_FILE);
+    remove(BACKUP_STATE_FILE);
+    
+    printSuccess("Backup restored.");
+    printf("Backup: %d, Users: %d, Constituencies: %d, Candidates: %d\n",
+           number, userCount, raceCount, totalCandidateCount());
+    return 1;
+}
+
+typedef struct {
+    int firstUser;
+    int userStep;
+    int votes;
+    atomic_int *stop;
+} BackupBenchWorker;
+
+static void* backupBenchThread(void* arg) {
+    BackupBenchWorker *worker = arg;
+    int user = worker->firstUser;
+    worker->votes = 0;
+    while(!atomic_load_explicit(worker->stop, memory_order_relaxed)) {
+        pthread_rwlock_rdlock(&stateLock);
+        backupUserChanged(user);
+        recordBallot(user, userVotedFor(user), userVoteTime(user) + 1);
+        tallyVote(races[userRace(user)], 0);
+        pthread_rwlock_unlock(&stateLock);
+        worker->votes++;
+        user += worker->userStep;
+        if(user >= userCount) {
+            user = worker->firstUser;
         }
     }
+    return NULL;
 }
 
-void castVote() {
-    if(!checkSession()) return;
-    
-    int status = isElectionActive();
-    if(status == 0) {
-        printError("Election has not started yet!");
-        return;
-    } else if(status == -1) {
-        printError("Election has ended!");
-        return;
+// Vote throughput while a backup of a large roll is written, and how
+// long the capture holds voting off, for a base and for small deltas
+void benchmarkBackup() {
+    int voters = 1000000;
+    int threads = cpuCount() > 4 ? 4 : cpuCount();
+    char name[MAX_NAME_LENGTH], nid[NID_LENGTH];
+    
+    backups.prefix = "bench_backup";
+    backups.catalogLoaded = 1;
+    initializeRaces();
+    nidIndexInit(&nidIndex, userNIDAt, voters);
+    for(int i = 0; i < voters; i++) {
+        sprintf(name, "Voter %d", i);
+        sprintf(nid, "%013d", 1000000 + i);
+        applyRegister(name, nid, "H0", 0);
     }
     
-    if(users[currentUserIndex].hasVoted) {
-        printError("You have already cast your vote!");
-        printf("[!] One person can only vote once.\n");
+    printHeader("INCREMENTAL BACKUP BENCHMARK");
+    printf("%d voters, %d voting thread(s)\n\n", voters, threads);
+    printf("%-8s %-10s %-12s %-14s %-14s %-14s\n",
+           "Backup", "Voters", "Size (MB)", "Capture (ms)", "Write (ms)", "Votes/sec");
+    
+    for(int round = -1; round < 4; round++) {
+        if(round > 0) {
+            // Change a different share of the roll before each delta
+            int step = round == 1 ? 1000 : round == 2 ? 100 : 10;
+            for(int i = 0; i < voters; i += step) {
+                backupUserChanged(i);
+                recordBallot(i, userVotedFor(i), time(NULL));
+            }
+        }
         
-        char timeStr[100];
-        struct tm *timeInfo = localtime(&users[currentUserIndex].voteTime);
-        strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", timeInfo);
-        printf("[INFO] You voted on: %s\n", timeStr);
-        return;
+        atomic_int stop;
+        atomic_init(&stop, 0);
+        BackupBenchWorker workers[4];
+        pthread_t ids[4];
+        for(int t = 0; t < threads; t++) {
+            workers[t].firstUser = t;
+            workers[t].userStep = threads * 7919;
+            workers[t].stop = &stop;
+            pthread_create(&ids[t], NULL, backupBenchThread, &workers[t]);
+        }
+        
+        double start = currentSeconds();
+        if(round == -1) {
+            // Voting alone, for comparison
+            sleepSeconds(0.5);
+        }
+        int number = round == -1 ? 0 : startBackup();
+        double captured = currentSeconds();
+        waitForBackup();
+        double written = currentSeconds();
+        atomic_store(&stop, 1);
+        int votes = 0;
+        for(int t = 0; t < threads; t++) {
+            pthread_join(ids[t], NULL);
+            votes += workers[t].votes;
+        }
+        double elapsed = currentSeconds() - start;
+        
+        if(round == -1) {
+            printf("%-8s %-10s %-12s %-14s %-14s %-14.0f\n", "none", "-", "-", "-", "-", votes / elapsed);
+            continue;
+        }
+        char path[260];
+        backupPath(number, path, sizeof(path));
+        FILE *fp = fopen(path, "rb");
+        double size = 0;
+        if(fp != NULL) {
+            fseek(fp, 0, SEEK_END);
+            size = ftell(fp) / (1024.0 * 1024.0);
+            fclose(fp);
+        }
+        BackupEntry *entry = lastBackupEntry();
+        printf("%-8s %-10d %-12.1f %-14.3f %-14.1f %-14.0f\n",
+               round == 0 ? "base" : "delta", entry != NULL ? entry->changedUsers : 0, size,
+               (captured - start) * 1000.0, (written - captured) * 1000.0, votes / elapsed);
     }
     
-    printHeader("CAST YOUR VOTE");
-    showCandidates();
+    // One more delta with voting stopped; the chain must then rebuild the
+    // live roll exactly, including votes cast while earlier backups ran
+    startBackup();
+    waitForBackup();
+    BackupImage image;
+    int match = loadBackupImage(lastBackupEntry()->number, &image) && image.userCount == userCount;
+    for(int i = 0; match && i < image.userCount; i++) {
+        match = strcmp(image.users[i].nidNumber, userAt(i)->nidNumber) == 0 &&
+                image.users[i].voteTime == (long long)userVoteTime(i);
+    }
+    printf("\nChain rebuilds the roll: %s\n", match ? "yes" : "NO");
+    freeBackupImage(&image);
     
-    int candidateId;
-    printf("\nEnter the ID of the candidate you want to vote for: ");
-    scanf("%d", &candidateId);
-    clearInputBuffer();
+    char path[260];
+    for(int i = 0; i < backups.entryCount; i++) {
+        backupPath(backups.entries[i].number, path, sizeof(path));
+        remove(path);
+    }
+    remove("bench_backup_catalog.txt");
+}
+
+#ifndef _WIN32
+// Synthetic voter i: a unique 13-digit NID, a name and a password that
+// passes validatePassword()
+static void suiteVoter(long long i, char* name, char* nid, char* password) {
+    static char *given[] = { "Amina", "Bilal", "Chen", "Dara", "Elif", "Farid", "Grace", "Hugo" };
+    static char *family[] = { "Rahman", "Okafor", "Silva", "Novak", "Haddad", "Kim", "Murphy", "Sato" };
+    snprintf(name, MAX_NAME_LENGTH, "%s %s %lld", given[i % 8], family[(i / 8) % 8], i);
+    unsigned long long v = (unsigned long long)i * 2654435761ULL % 9000000000000ULL;
+    snprintf(nid, NID_LENGTH, "%013llu", v + 1000000000000ULL);
+    snprintf(password, MAX_PASSWORD_LENGTH, "Ballot%lldx", i);
+}
+
+// Adds constituencies of five candidates, open for voting now, until
+// there are count of them
+static void addSuiteConstituencies(int count, time_t now) {
+    char name[MAX_NAME_LENGTH];
+    for(int r = raceCount; r < count; r++) {
+        snprintf(name, sizeof(name), "District %d", r + 1);
+        if(applyAddRace(name, now - 3600, now + 7 * 24 * 60 * 60) == -1) {
+            return;
+        }
+        for(int k = 0; k < 5; k++) {
+            Candidate candidate;
+            memset(&candidate, 0, sizeof(candidate));
+            candidate.id = k + 1;
+            snprintf(candidate.name, sizeof(candidate.name), "Candidate %d-%d", r + 1, k + 1);
+            snprintf(candidate.party, sizeof(candidate.party), "Party %c", 'A' + k);
+            strcpy(candidate.education, "Graduate");
+            candidate.age = 35 + k;
+            strcpy(candidate.manifesto, "Synthetic benchmark candidate");
+            applyAddCandidate(r, &candidate);
+        }
+    }
+}
+
+// One result row: voters, operation, iterations, total ms, ns per operation
+static void suiteReport(int voters, char* operation, long long iterations, double seconds) {
+    printf("%d\t%s\t%lld\t%.3f\t%.1f\n", voters, operation, iterations, seconds * 1000.0,
+           iterations > 0 ? seconds * 1e9 / iterations : 0.0);
+    fflush(stdout);
+}
+
+static void suiteStatistics() {
+    showStatistics();
+}
+
+static void suiteExportText() {
+    writeResultsFile("bench_results.txt");
+}
+
+static void suiteExportArchive() {
+    writeResultsFile("bench_results.arc");
+}
+
+// Repeats a whole-roll operation until 200 ms have passed or maxRuns is
+// reached. Quiet operations have their console output discarded.
+static void suiteRepeat(int voters, char* operation, void (*run)(), int maxRuns, int quiet) {
+    int saved = -1;
+    if(quiet) {
+        fflush(stdout);
+        saved = dup(STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+    int runs = 0;
+    double start = currentSeconds();
+    do {
+        run();
+        runs++;
+    } while(runs < maxRuns && currentSeconds() - start < 0.2);
+    double elapsed = currentSeconds() - start;
+    if(quiet) {
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+    suiteReport(voters, operation, runs, elapsed);
+}
+
+// Runs every measurement for one roll size. Called in a child process
+// whose working directory is a scratch directory.
+static void runSuiteSize(int voters) {
+    char name[MAX_NAME_LENGTH], nid[NID_LENGTH], password[MAX_PASSWORD_LENGTH];
+    char hash[PASSWORD_HASH_LENGTH];
+    int samples = voters < 1000000 ? voters : 1000000;
+    int constituencies = 1 + voters / 50000;
+    if(constituencies > MAX_RACES) {
+        constituencies = MAX_RACES;
+    }
     
-    if(candidateId < 1 || candidateId > candidateCount) {
-        printError("Invalid candidate ID!");
-        return;
+    // Every change is left to the checkpoints, as in a batch run
+    time_t now = time(NULL);
+    closeJournal();
+    initializeRaces();
+    addSuiteConstituencies(constituencies, now);
+    
+    // One real scrypt hash stands in for every password; hashing each
+    // would take hours at the larger sizes
+    suiteVoter(0, name, nid, password);
+    double start = currentSeconds();
+    int hashes = 3;
+    for(int i = 0; i < hashes; i++) {
+        hashPassword(password, hash);
+    }
+    suiteReport(voters, "hashPassword", hashes, currentSeconds() - start);
+    
+    nidIndexInit(&nidIndex, userNIDAt, voters);
+    start = currentSeconds();
+    for(int i = 0; i < voters; i++) {
+        suiteVoter(i, name, nid, password);
+        if(applyRegister(name, nid, hash, i % constituencies) == -1) {
+            fprintf(stderr, "Out of memory at %d voters\n", i);
+            exit(1);
+        }
+    }
+    suiteReport(voters, "generateRoll", voters, currentSeconds() - start);
+    rebuildSearchIndex();
+    
+    // Inputs are generated up front so only the call itself is timed
+    char (*nids)[NID_LENGTH] = malloc((size_t)samples * NID_LENGTH);
+    char (*passwords)[MAX_PASSWORD_LENGTH] = malloc((size_t)samples * MAX_PASSWORD_LENGTH);
+    if(nids == NULL || passwords == NULL) {
+        fprintf(stderr, "Out of memory for %d samples\n", samples);
+        exit(1);
+    }
+    unsigned int seed = 12345;
+    for(int i = 0; i < samples; i++) {
+        seed = seed * 1103515245u + 12345u;
+        suiteVoter(seed % voters, name, nids[i], passwords[i]);
     }
     
-    printf("\n[!] CONFIRMATION REQUIRED\n");
-    printf("You are about to vote for:\n");
-    printf("=> %s (%s)\n", candidates[candidateId-1].name, candidates[candidateId-1].party);
-    printf("\nAre you sure? (Y/N): ");
+    int found = 0;
+    start = currentSeconds();
+    for(int i = 0; i < samples; i++) {
+        found += findUserByNID(nids[i]) != -1;
+    }
+    suiteReport(voters, "findUserByNID", samples, currentSeconds() - start);
+    start = currentSeconds();
+    for(int i = 0; i < samples; i++) {
+        nids[i][0] = '0';
+        found += findUserByNID(nids[i]) != -1;
+    }
+    suiteReport(voters, "findUserByNID_miss", samples, currentSeconds() - start);
+    if(found != samples) {
+        fprintf(stderr, "findUserByNID: %d of %d lookups found\n", found, samples);
+    }
     
-    char confirm;
-    scanf(" %c", &confirm);
-    clearInputBuffer();
+    int valid = 0;
+    start = currentSeconds();
+    for(int i = 0; i < samples; i++) {
+        valid += validateNID(nids[i]);
+    }
+    suiteReport(voters, "validateNID", samples, currentSeconds() - start);
+    start = currentSeconds();
+    for(int i = 0; i < samples; i++) {
+        valid += validatePassword(passwords[i]);
+    }
+    suiteReport(voters, "validatePassword", samples, currentSeconds() - start);
+    if(valid != 2 * samples) {
+        fprintf(stderr, "Validation rejected %d synthetic inputs\n", 2 * samples - valid);
+    }
+    free(nids);
+    free(passwords);
+    
+    // New registrations through the full path: duplicate check, store, journal record
+    int registrations = samples / 10 > 0 ? samples / 10 : 1;
+    start = currentSeconds();
+    for(int i = 0; i < registrations; i++) {
+        int userIndex;
+        suiteVoter((long long)voters + i, name, nid, password);
+        registerVoter(name, nid, hash, i % constituencies, &userIndex);
+    }
+    suiteReport(voters, "registerVoter", registrations, currentSeconds() - start);
     
-    if(confirm != 'Y' && confirm != 'y') {
-        printInfo("Vote cancelled.");
-        return;
+    int accepted = 0;
+    start = currentSeconds();
+    for(int i = 0; i < userCount; i++) {
+        accepted += castVoteFor(i, i % 5 + 1, now) == VOTE_OK;
+    }
+    suiteReport(voters, "castVoteFor", userCount, currentSeconds() - start);
+    if(accepted != userCount) {
+        fprintf(stderr, "castVoteFor accepted %d of %d votes\n", accepted, userCount);
     }
     
-    candidates[candidateId - 1].votes++;
-    users[currentUserIndex].hasVoted = 1;
-    time(&users[currentUserIndex].voteTime);
+    suiteRepeat(voters, "showStatistics", suiteStatistics, 1000, 1);
+    suiteRepeat(voters, "exportResults_text", suiteExportText, 1000, 0);
+    suiteRepeat(voters, "exportResults_archive", suiteExportArchive, 1000, 0);
     
-    printSuccess("Vote cast successfully!");
-    printf("\n========================================\n");
-    printf("        VOTING RECEIPT\n");
-    printf("========================================\n");
-    printf(" Voter: %s\n", users[currentUserIndex].fullName);
-    printf(" Candidate: %s\n", candidates[candidateId-1].name);
-    printf(" Party: %s\n", candidates[candidateId-1].party);
+    start = currentSeconds();
+    saveData();
+    suiteReport(voters, "saveData", 1, currentSeconds() - start);
     
-    char timeStr[100];
-    struct tm *timeInfo = localtime(&users[currentUserIndex].voteTime);
-    strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", timeInfo);
-    printf(" Time: %s\n", timeStr);
-    printf("========================================\n");
+    start = currentSeconds();
+    startBackup();
+    double captured = currentSeconds();
+    waitForBackup();
+    suiteReport(voters, "createBackup_capture", 1, captured - start);
+    suiteReport(voters, "createBackup", 1, currentSeconds() - start);
     
-    printf("\nThank you for voting, %s!\n", users[currentUserIndex].fullName);
+    int expected = userCount;
+    start = currentSeconds();
+    loadData();
+    suiteReport(voters, "loadData", 1, currentSeconds() - start);
+    if(userCount != expected) {
+        fprintf(stderr, "loadData restored %d of %d voters\n", userCount, expected);
+    }
     
-    logActivity("Vote cast");
+    // Voters registered on top of a loaded snapshot start a new string
+    // block; a second save and load must keep both the old and new ones
+    int added = 1000;
+    for(int i = 0; i < added; i++) {
+        int userIndex;
+        suiteVoter((long long)voters + registrations + i, name, nid, password);
+        registerVoter(name, nid, hash, i % constituencies, &userIndex);
+    }
+    expected = userCount;
+    unsigned long long strings = stringArena.used;
     saveData();
+    loadData();
+    int restored = findUserByNID(nid);
+    if(userCount != expected || restored == -1 || strcmp(userFullName(restored), name) != 0) {
+        fprintf(stderr, "A second save and load restored %d of %d voters\n", userCount, expected);
+    }
+    if(stringArena.used != strings) {
+        fprintf(stderr, "A second save and load grew the strings from %llu to %llu bytes\n",
+                strings, stringArena.used);
+    }
+    suiteVoter(0, name, nid, password);
+    restored = findUserByNID(nid);
+    if(restored == -1 || strcmp(userFullName(restored), name) != 0) {
+        fprintf(stderr, "A second save and load lost the first voter\n");
+    }
+    
+    start = currentSeconds();
+    loadTextCheckpoint();
+    rebuildNIDIndex();
+    rebuildSearchIndex();
+    suiteReport(voters, "loadData_text", 1, currentSeconds() - start);
+    if(userCount != expected) {
+        fprintf(stderr, "loadData restored %d of %d voters\n", userCount, expected);
+    }
 }
 
-void showCandidates() {
-    printHeader("LIST OF CANDIDATES");
-    printf("%-4s %-25s %-25s\n", "ID", "Name", "Party");
-    printf("========================================\n");
-    
-    for(int i = 0; i < candidateCount; i++) {
-        printf("%-4d %-25s %-25s\n", 
-               candidates[i].id,
-               candidates[i].name, 
-               candidates[i].party);
+// Deletes the scratch directory of one run and everything in it
+static void removeSuiteDirectory(char* path) {
+    DIR *dir = opendir(path);
+    if(dir != NULL) {
+        struct dirent *entry;
+        char file[512];
+        while((entry = readdir(dir)) != NULL) {
+            if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+                remove(file);
+            }
+        }
+        closedir(dir);
     }
+    rmdir(path);
 }
+#endif
 
-void showCandidateDetails() {
-    int id;
-    printf("\nEnter Candidate ID to view details: ");
-    scanf("%d", &id);
-    clearInputBuffer();
-    
-    if(id < 1 || id > candidateCount) {
-        printError("Invalid candidate ID!");
-        return;
+// Times the core operations at each roll size and prints tab-separated
+// rows, so runs from different builds can be compared by a script. Each
+// size runs in its own process and scratch directory.
+int benchmarkSuite(int* sizes, int sizeCount) {
+#ifdef _WIN32
+    (void)sizes;
+    (void)sizeCount;
+    printError("The benchmark suite needs a POSIX system.");
+    return 0;
+#else
+    printf("# suite=core version=1 cpus=%d time=%ld\n", cpuCount(), (long)time(NULL));
+    printf("voters\toperation\titerations\ttotal_ms\tns_per_op\n");
+    fflush(stdout);
+    
+    int ok = 1;
+    for(int s = 0; s < sizeCount; s++) {
+        char path[] = "bench_suite_XXXXXX";
+        if(mkdtemp(path) == NULL) {
+            fprintf(stderr, "Could not create a scratch directory\n");
+            return 0;
+        }
+        pid_t child = fork();
+        if(child == 0) {
+            if(chdir(path) != 0) {
+                _exit(1);
+            }
+            runSuiteSize(sizes[s]);
+            fflush(stdout);
+            _exit(0);
+        }
+        int status = 0;
+        if(child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Benchmark at %d voters did not finish\n", sizes[s]);
+            ok = 0;
+        }
+        removeSuiteDirectory(path);
     }
-    
-    Candidate c = candidates[id-1];
-    
-    printf("\n========================================\n");
-    printf("        CANDIDATE PROFILE\n");
-    printf("========================================\n");
-    printf(" Name:      %s\n", c.name);
-    printf(" Party:     %s\n", c.party);
-    printf(" Age:       %d\n", c.age);
-    printf(" Education: %s\n", c.education);
-    printf(" Manifesto: %s\n", c.manifesto);
-    printf("========================================\n");
+    return ok;
+#endif
 }
 
-void searchCandidate() {
-    char searchTerm[MAX_NAME_LENGTH];
-    int found = 0;
-    
-    printf("\nEnter candidate name or party to search: ");
-    fgets(searchTerm, MAX_NAME_LENGTH, stdin);
-    searchTerm[strcspn(searchTerm, "\n")] = 0;
-    
-    for(int i = 0; searchTerm[i]; i++) {
-        searchTerm[i] = tolower(searchTerm[i]);
+#ifndef _WIN32
+#define SELF_TEST_VOTERS 200
+
+// One step of a self-test scenario, run as its own process
+typedef struct {
+    char *title;
+    void (*run)();
+} SelfTestStep;
+
+// Failed checks in the current step
+static int selfTestFailures = 0;
+
+static void selfTestExpect(int passed, char* what) {
+    if(!passed) {
+        fprintf(stderr, "  check failed: %s\n", what);
+        selfTestFailures++;
     }
-    
-    printHeader("SEARCH RESULTS");
-    
-    for(int i = 0; i < candidateCount; i++) {
-        char name[MAX_NAME_LENGTH], party[MAX_NAME_LENGTH];
-        strcpy(name, candidates[i].name);
-        strcpy(party, candidates[i].party);
-        
-        for(int j = 0; name[j]; j++) name[j] = tolower(name[j]);
-        for(int j = 0; party[j]; j++) party[j] = tolower(party[j]);
-        
-        if(strstr(name, searchTerm) || strstr(party, searchTerm)) {
-            printf("[+] [%d] %s - %s\n", 
-                   candidates[i].id, 
-                   candidates[i].name, 
-                   candidates[i].party);
-            found = 1;
+}
+
+// Candidate id self-test voter i picks, or 0 for one who abstains
+static int selfTestChoice(int i) {
+    return i % 3 == 0 ? 0 : 1 + i % 5;
+}
+
+// Registers the synthetic voters, all with the first one's password
+static void selfTestRegister(int voters) {
+    char name[MAX_NAME_LENGTH], nid[NID_LENGTH], password[MAX_PASSWORD_LENGTH];
+    char hash[PASSWORD_HASH_LENGTH];
+    int userIndex;
+    suiteVoter(0, name, nid, password);
+    selfTestExpect(hashPassword(password, hash), "hash a password");
+    for(int i = 0; i < voters; i++) {
+        suiteVoter(i, name, nid, password);
+        if(registerVoter(name, nid, hash, 0, &userIndex) != REGISTER_OK) {
+            selfTestExpect(0, "register a voter");
+            return;
         }
     }
-    
-    if(!found) {
-        printError("No candidates found matching your search.");
+}
+
+static void selfTestVote(int first, int last) {
+    for(int i = first; i < last; i++) {
+        if(selfTestChoice(i) != 0 && castVoteFor(i, selfTestChoice(i), time(NULL)) != VOTE_OK) {
+            selfTestExpect(0, "cast a vote");
+            return;
+        }
     }
 }
 
-void showResults() {
-    if(!checkSession()) return;
-    
-    int totalVotes = 0;
-    for(int i = 0; i < candidateCount; i++) {
-        totalVotes += candidates[i].votes;
+// Compares the loaded election with the synthetic roll, of which the
+// first `voted` voters have cast their votes
+static void selfTestCheckRoll(int voters, int voted) {
+    char name[MAX_NAME_LENGTH], nid[NID_LENGTH], password[MAX_PASSWORD_LENGTH], what[100];
+    int expected[MAX_CANDIDATES] = { 0 };
+    
+    selfTestExpect(userCount == voters, "every registered voter is on the roll");
+    for(int i = 0; i < voters && i < userCount; i++) {
+        suiteVoter(i, name, nid, password);
+        int choice = i < voted ? selfTestChoice(i) : 0;
+        if(choice != 0) {
+            expected[choice - 1]++;
+        }
+        if(findUserByNID(nid) != i || strcmp(userFullName(i), name) != 0 ||
+           userHasVoted(i) != (choice != 0) || (choice != 0 && userVotedFor(i) != choice)) {
+            snprintf(what, sizeof(what), "voter %d is restored as registered and voted", i);
+            selfTestExpect(0, what);
+            break;
+        }
     }
-    
-    printHeader("ELECTION RESULTS");
-    printf("%-25s %-25s %-10s %-12s\n", "Candidate", "Party", "Votes", "Percentage");
-    printf("========================================================================\n");
-    
-    for(int i = 0; i < candidateCount; i++) {
-        float percentage = (totalVotes > 0) ? (candidates[i].votes * 100.0 / totalVotes) : 0;
-        printf("%-25s %-25s %-10d %.2f%%\n", 
-               candidates[i].name, 
-               candidates[i].party,
-               candidates[i].votes,
-               percentage);
+    for(int c = 0; c < races[0]->candidateCount; c++) {
+        snprintf(what, sizeof(what), "candidate %d keeps %d vote(s)", c + 1, expected[c]);
+        selfTestExpect(candidateVotes(races[0], c) == expected[c], what);
     }
-    
-    printf("========================================================================\n");
-    printf("Total Votes Cast: %d\n", totalVotes);
-    
-    int maxVotes = -1;
-    int winnerIndex = -1;
-    for(int i = 0; i < candidateCount; i++) {
-        if(candidates[i].votes > maxVotes) {
-            maxVotes = candidates[i].votes;
-            winnerIndex = i;
+    suiteVoter(0, name, nid, password);
+    selfTestExpect(authenticateVoter(nid, password) == 0, "the first voter can still log in");
+}
+
+// Half the votes reach only the journal, followed by a record torn off
+// mid-write; the process then dies without a checkpoint
+static void selfTestJournalWrite() {
+    startSystem();
+    selfTestRegister(SELF_TEST_VOTERS);
+    selfTestVote(0, SELF_TEST_VOTERS / 2);
+    
+    unsigned int header[2] = { 64, 0 };
+    FILE *fp = fopen(JOURNAL_FILE, "ab");
+    selfTestExpect(fp != NULL && fwrite(header, sizeof(header), 1, fp) == 1 &&
+                   fwrite("torn", 1, 4, fp) == 4 && fclose(fp) == 0, "append a torn record");
+}
+
+// Replays the journal, then votes again on the repaired journal and dies
+static void selfTestJournalRecover() {
+    startSystem();
+    selfTestCheckRoll(SELF_TEST_VOTERS, SELF_TEST_VOTERS / 2);
+    selfTestVote(SELF_TEST_VOTERS / 2, SELF_TEST_VOTERS);
+}
+
+static void selfTestJournalRecoverAgain() {
+    startSystem();
+    selfTestCheckRoll(SELF_TEST_VOTERS, SELF_TEST_VOTERS);
+}
+
+static SelfTestStep selfTestJournal[] = {
+    { "register and vote, then crash mid-record", selfTestJournalWrite },
+    { "recover from the journal and vote again", selfTestJournalRecover },
+    { "recover the votes cast after recovery", selfTestJournalRecoverAgain },
+    { NULL, NULL }
+};
+
+// Half the votes go into one checkpoint and the rest into a second, so
+// the previous text checkpoint differs from the current one
+static void selfTestSnapshotWrite() {
+    startSystem();
+    selfTestRegister(SELF_TEST_VOTERS);
+    selfTestVote(0, SELF_TEST_VOTERS / 2);
+    saveData();
+    selfTestVote(SELF_TEST_VOTERS / 2, SELF_TEST_VOTERS);
+    saveData();
+}
+
+// The text manifests are moved aside meanwhile, so nothing but the
+// snapshot can supply the roll
+static void selfTestSnapshotLoad() {
+    selfTestExpect(rename(TEXT_MANIFEST_FILE, TEXT_MANIFEST_FILE ".hidden") == 0 &&
+                   rename(TEXT_MANIFEST_PREVIOUS, TEXT_MANIFEST_PREVIOUS ".hidden") == 0,
+                   "move the text manifests aside");
+    startSystem();
+    selfTestCheckRoll(SELF_TEST_VOTERS, SELF_TEST_VOTERS);
+    selfTestExpect(rename(TEXT_MANIFEST_FILE ".hidden", TEXT_MANIFEST_FILE) == 0 &&
+                   rename(TEXT_MANIFEST_PREVIOUS ".hidden", TEXT_MANIFEST_PREVIOUS) == 0,
+                   "restore the text manifests");
+}
+
+static void selfTestTextLoad() {
+    remove(SNAPSHOT_FILE);
+    startSystem();
+    selfTestCheckRoll(SELF_TEST_VOTERS, SELF_TEST_VOTERS);
+}
+
+// A damaged users file must fail its checksum, so the previous text
+// checkpoint, the one with half the votes, is loaded instead
+static void selfTestTextFallback() {
+    TextManifest manifest;
+    selfTestExpect(readTextManifest(TEXT_MANIFEST_FILE, &manifest), "read " TEXT_MANIFEST_FILE);
+    FILE *fp = fopen(manifest.files[TEXT_USERS].path, "r+b");
+    int damaged = fp != NULL && fseek(fp, (long)manifest.files[TEXT_USERS].size / 2, SEEK_SET) == 0;
+    int c = damaged ? fgetc(fp) : EOF;
+    damaged = c != EOF && fseek(fp, -1, SEEK_CUR) == 0 && fputc(c ^ 0x20, fp) != EOF;
+    if(fp != NULL) {
+        fclose(fp);
+    }
+    selfTestExpect(damaged, "damage the users file");
+    startSystem();
+    selfTestCheckRoll(SELF_TEST_VOTERS, SELF_TEST_VOTERS / 2);
+}
+
+static SelfTestStep selfTestSnapshot[] = {
+    { "save a checkpoint, vote, save another", selfTestSnapshotWrite },
+    { "reload from the binary snapshot", selfTestSnapshotLoad },
+    { "reload from the text checkpoint alone", selfTestTextLoad },
+    { "fall back past a damaged text checkpoint", selfTestTextFallback },
+    { NULL, NULL }
+};
+
+#define SELF_TEST_REGISTERED 10    // voters on the roll before the import
+
+// Imports the rest of the synthetic roll with one bad row of each kind
+// after voter 20. The last voter has a plain password for the import to
+// hash; the others carry the first voter's hash. Each rejected line must
+// appear in the rejects file with its reason, in file order.
+static void selfTestImport() {
+    static char *malformed[][2] = {
+        { "Only Two,1234567890", "expected 3 or 4 fields" },
+        { "Bad Nid,12345x7890,Ballot1x", "invalid NID" },
+        { "Weak Password,1234567891,password", "weak password" },
+        { "Long Password,1234567892,Ballot1xxxxxxxxxxxxxxxxxxxxxxxxxx", "password too long" },
+        { "Far Away,1234567893,Ballot1x,99", "unknown constituency" },
+        { "\"Unclosed,1234567894,Ballot1x", "bad quoting" }
+    };
+    int malformedCount = sizeof(malformed) / sizeof(malformed[0]);
+    char name[MAX_NAME_LENGTH], nid[NID_LENGTH], password[MAX_PASSWORD_LENGTH], what[100];
+    char *reasons[16];
+    int lines[16], expected = 0, line = 1;
+    
+    startSystem();
+    closeJournal();
+    selfTestRegister(SELF_TEST_REGISTERED);
+    char *hash = userPasswordHash(0);
+    FILE *fp = fopen("roll.csv", "w");
+    if(fp == NULL) {
+        selfTestExpect(0, "write the roll");
+        return;
+    }
+    fprintf(fp, "name,nid,password,constituency\n");
+    for(int i = SELF_TEST_REGISTERED; i < SELF_TEST_VOTERS; i++) {
+        suiteVoter(i, name, nid, password);
+        if(i < SELF_TEST_VOTERS - 1) {
+            fprintf(fp, "%s,%s,\"%s\",1\n", name, nid, hash);
+        } else {
+            fprintf(fp, "%s,%s,%s\n", name, nid, password);
         }
+        line++;
+        if(i != 20) {
+            continue;
+        }
+        for(int m = 0; m < malformedCount; m++) {
+            fprintf(fp, "%s\n", malformed[m][0]);
+            lines[expected] = ++line;
+            reasons[expected++] = malformed[m][1];
+        }
+        fprintf(fp, "\n%s,%s,Ballot20x\n", name, nid);
+        line += 2;
+        lines[expected] = line;
+        reasons[expected++] = "duplicate NID in file";
+        suiteVoter(5, name, nid, password);
+        fprintf(fp, "%s,%s,Ballot5x\n", name, nid);
+        lines[expected] = ++line;
+        reasons[expected++] = "NID already registered";
     }
+    fclose(fp);
     
-    if(winnerIndex != -1 && maxVotes > 0) {
-        printf("\n[CURRENT LEADER]\n");
-        printf("   %s (%s) with %d votes\n",
-               candidates[winnerIndex].name,
-               candidates[winnerIndex].party,
-               maxVotes);
-    } else {
-        printInfo("No votes cast yet.");
+    selfTestExpect(importRoll("roll.csv", IMPORT_REJECTS_FILE), "import the roll");
+    selfTestExpect(userCount == SELF_TEST_VOTERS, "every valid row is imported once");
+    char text[IMPORT_LINE_MAX + 64];
+    int found = 0;
+    fp = fopen(IMPORT_REJECTS_FILE, "r");
+    while(fp != NULL && fgets(text, sizeof(text), fp)) {
+        int rejectLine = 0, offset = 0;
+        if(sscanf(text, "%d,%n", &rejectLine, &offset) != 1) {
+            continue;
+        }
+        int matches = found < expected && rejectLine == lines[found] &&
+                      strncmp(text + offset, reasons[found], strlen(reasons[found])) == 0;
+        snprintf(what, sizeof(what), "line %d is rejected as %s", found < expected ? lines[found] : rejectLine,
+                 found < expected ? reasons[found] : "nothing");
+        selfTestExpect(matches, what);
+        found++;
+    }
+    if(fp != NULL) {
+        fclose(fp);
     }
+    selfTestExpect(found == expected, "the rejects file lists each bad line once");
 }
 
-void showStatistics() {
-    int totalVotes = 0;
-    int votedUsers = 0;
-    
-    for(int i = 0; i < candidateCount; i++) {
-        totalVotes += candidates[i].votes;
+// The import saves once at its end; the roll must survive a reload
+static void selfTestImportReload() {
+    char name[MAX_NAME_LENGTH], nid[NID_LENGTH], password[MAX_PASSWORD_LENGTH];
+    startSystem();
+    selfTestCheckRoll(SELF_TEST_VOTERS, 0);
+    suiteVoter(SELF_TEST_VOTERS - 1, name, nid, password);
+    selfTestExpect(authenticateVoter(nid, password) == SELF_TEST_VOTERS - 1,
+                   "a voter imported with a plain password can log in");
+}
+
+static SelfTestStep selfTestImportRoll[] = {
+    { "import a roll with duplicate and malformed rows", selfTestImport },
+    { "reload the imported roll", selfTestImportReload },
+    { NULL, NULL }
+};
+
+// Runs the steps of one scenario in order in a fresh scratch directory.
+// Each step is a child process, like a restart of the program, and its
+// own messages are kept out of the report. Returns 1 if all passed.
+static int runSelfTestScenario(char* title, SelfTestStep* steps) {
+    char path[] = "self_test_XXXXXX";
+    printf("%s\n", title);
+    if(mkdtemp(path) == NULL) {
+        printf("  could not create a scratch directory\n");
+        return 0;
     }
-    
-    for(int i = 0; i < userCount; i++) {
-        if(users[i].hasVoted) votedUsers++;
+    int ok = 1;
+    for(int s = 0; ok && steps[s].title != NULL; s++) {
+        fflush(stdout);
+        pid_t child = fork();
+        if(child == 0) {
+            if(chdir(path) != 0 || freopen("/dev/null", "w", stdout) == NULL) {
+                _exit(1);
+            }
+            steps[s].run();
+            fflush(stderr);
+            _exit(selfTestFailures > 0 ? 1 : 0);
+        }
+        int status = 0;
+        ok = child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        printf("  %-56s %s\n", steps[s].title, ok ? "ok" : "FAILED");
     }
-    
-    float turnout = (userCount > 0) ? (votedUsers * 100.0 / userCount) : 0;
-    
-    printHeader("ELECTION STATISTICS");
-    printf("Total Registered Users:  %d\n", userCount);
-    printf("Users Who Voted:         %d\n", votedUsers);
-    printf("Users Who Haven't Voted: %d\n", userCount - votedUsers);
-    printf("Voter Turnout:           %.2f%%\n", turnout);
-    printf("Total Votes Cast:        %d\n", totalVotes);
-    printf("Total Candidates:        %d\n", candidateCount);
-    
-    char startStr[100], endStr[100];
-    struct tm *timeInfo;
-    
-    timeInfo = localtime(&electionStartTime);
-    strftime(startStr, sizeof(startStr), "%Y-%m-%d %H:%M", timeInfo);
-    
-    timeInfo = localtime(&electionEndTime);
-    strftime(endStr, sizeof(endStr), "%Y-%m-%d %H:%M", timeInfo);
-    
-    printf("\nElection Period:\n");
-    printf("   Start: %s\n", startStr);
-    printf("   End:   %s\n", endStr);
-    
-    int status = isElectionActive();
-    if(status == 1) {
-        printf("   Status: ACTIVE\n");
-    } else if(status == 0) {
-        printf("   Status: NOT STARTED\n");
-    } else {
-        printf("   Status: ENDED\n");
+    removeSuiteDirectory(path);
+    return ok;
+}
+#endif
+
+// Checks end to end that elections survive a crash and reload intact.
+// Each step exits without saving unless it says so, as a crash would.
+int runSelfTest() {
+#ifdef _WIN32
+    printError("The self-test needs a POSIX system.");
+    return 0;
+#else
+    printHeader("SELF TEST");
+    int failed = 0;
+    failed += !runSelfTestScenario("Journal recovery", selfTestJournal);
+    failed += !runSelfTestScenario("Snapshot and text checkpoint round trip", selfTestSnapshot);
+    failed += !runSelfTestScenario("Voter roll import", selfTestImportRoll);
+    if(failed > 0) {
+        printf("\n%d scenario(s) FAILED\n", failed);
+        return 0;
+    }
+    printf("\nAll scenarios passed\n");
+    return 1;
+#endif
+}
+
+#ifndef _WIN32
+// Requests the load generator times, and the visits that issue them
+enum {
+    LOAD_REGISTER,
+    LOAD_LOGIN,
+    LOAD_LOGIN_FAILED,
+    LOAD_VOTE,
+    LOAD_RESULTS,
+    LOAD_STATS,
+    LOAD_RACES,
+    LOAD_OPERATIONS
+};
+
+enum {
+    VISIT_REGISTER,             // a new voter signs up
+    VISIT_VOTER,                // log in, vote, check the results, log out
+    VISIT_BAD_LOGIN,            // a wrong password, as in a guessing storm
+    VISIT_ADMIN,                // an official polls the totals
+    LOAD_VISITS
+};
+
+static char *loadOperationNames[LOAD_OPERATIONS] = {
+    "REGISTER", "LOGIN", "LOGIN_FAILED", "VOTE", "RESULTS", "STATS", "RACES"
+};
+
+// One stretch of polling day: its share of the run and the relative
+// weight of each kind of visit during it
+typedef struct {
+    char *name;
+    double share;
+    int weights[LOAD_VISITS];
+} LoadPhase;
+
+static LoadPhase loadPhases[] = {
+    { "opening",      0.15, { 40, 50,  5,  5 } },
+    { "morning-peak", 0.25, { 10, 85,  2,  3 } },
+    { "login-storm",  0.10, {  5, 30, 60,  5 } },
+    { "midday",       0.20, { 15, 70,  5, 10 } },
+    { "evening-rush", 0.20, {  5, 90,  2,  3 } },
+    { "close",        0.10, {  0, 20,  0, 80 } },
+};
+#define LOAD_PHASES (int)(sizeof(loadPhases) / sizeof(loadPhases[0]))
+
+static struct {
+    double start;
+    double end;
+    double interval;            // seconds between one client's visits; 0 runs flat out
+    int seconds;
+    int voters;
+    int constituencies;
+    int clients;
+    atomic_int nextVoter;
+    atomic_int nextRegistration;
+} loadRun;
+
+typedef struct {
+    int id;
+    unsigned int seed;
+    OutputBuffer out;
+    LatencyHistogram latency[LOAD_OPERATIONS];
+    unsigned long long errors[LOAD_OPERATIONS];
+    unsigned int (*timeline)[LOAD_OPERATIONS];  // requests finished in each second
+} LoadWorker;
+
+static int loadPhaseAt(double when) {
+    double position = (when - loadRun.start) / (loadRun.end - loadRun.start);
+    double end = 0;
+    for(int p = 0; p < LOAD_PHASES; p++) {
+        end += loadPhases[p].share;
+        if(position < end) {
+            return p;
+        }
     }
+    return LOAD_PHASES - 1;
 }
 
-void exportResults() {
-    FILE *fp = fopen("election_results.txt", "w");
-    if(fp == NULL) {
-        printError("Failed to export results!");
-        return;
+// Sends one request through the protocol layer and records how long it
+// took from ready, the moment it could have been sent. Returns 1 if the
+// answer was OK.
+static int loadRequest(LoadWorker* worker, ClientSession* session, int operation, char* line, double* ready) {
+    worker->out.length = 0;
+    currentUserIndex = session->userIndex;
+    if(handleCommand(session, line, &worker->out)) {
+        checkpointIfDue();
     }
+    double now = currentSeconds();
+    histogramRecord(&worker->latency[operation], now - *ready);
+    *ready = now;
     
-    int totalVotes = 0;
-    for(int i = 0; i < candidateCount; i++) {
-        totalVotes += candidates[i].votes;
+    int ok = worker->out.length >= 2 && memcmp(worker->out.data, "OK", 2) == 0;
+    if(ok == (operation == LOAD_LOGIN_FAILED)) {
+        worker->errors[operation]++;
     }
-    
-    fprintf(fp, "===================================================\n");
-    fprintf(fp, "          GENERAL ELECTION RESULTS\n");
-    fprintf(fp, "===================================================\n\n");
-    
-    time_t now;
-    time(&now);
-    fprintf(fp, "Report Generated: %s\n", ctime(&now));
-    
-    fprintf(fp, "\nCandidate Results:\n");
-    fprintf(fp, "---------------------------------------------------\n");
-    
-    for(int i = 0; i < candidateCount; i++) {
-        float percentage = (totalVotes > 0) ? (candidates[i].votes * 100.0 / totalVotes) : 0;
-        fprintf(fp, "%d. %-25s (%-20s) : %d votes (%.2f%%)\n", 
-                i+1, candidates[i].name, candidates[i].party, 
-                candidates[i].votes, percentage);
+    int second = (int)(now - loadRun.start);
+    if(second >= 0 && second < loadRun.seconds) {
+        worker->timeline[second][operation]++;
     }
-    
-    fprintf(fp, "\n---------------------------------------------------\n");
-    fprintf(fp, "Total Votes Cast: %d\n", totalVotes);
-    fprintf(fp, "Total Registered Users: %d\n", userCount);
-    
-    int maxVotes = -1;
-    int winnerIndex = -1;
-    for(int i = 0; i < candidateCount; i++) {
-        if(candidates[i].votes > maxVotes) {
-            maxVotes = candidates[i].votes;
-            winnerIndex = i;
+    return ok;
+}
+
+static void runLoadVisit(LoadWorker* worker, ClientSession* session, int visit, double ready) {
+    char line[SERVER_LINE_MAX], name[MAX_NAME_LENGTH], nid[NID_LENGTH], password[MAX_PASSWORD_LENGTH];
+    worker->seed = worker->seed * 1103515245u + 12345u;
+    
+    if(visit == VISIT_REGISTER) {
+        int n = atomic_fetch_add(&loadRun.nextRegistration, 1);
+        suiteVoter((long long)loadRun.voters + n, name, nid, password);
+        snprintf(line, sizeof(line), "REGISTER\t%s\t%s\tPolling1Day\t%d", name, nid,
+                 1 + (int)(worker->seed >> 8) % loadRun.constituencies);
+        loadRequest(worker, session, LOAD_REGISTER, line, &ready);
+    } else if(visit == VISIT_VOTER) {
+        // Voters turn up in order, so each votes once until the roll runs out
+        int voter = atomic_fetch_add(&loadRun.nextVoter, 1) % loadRun.voters;
+        suiteVoter(voter, name, nid, password);
+        snprintf(line, sizeof(line), "LOGIN\t%s\tPolling1Day", nid);
+        if(loadRequest(worker, session, LOAD_LOGIN, line, &ready)) {
+            snprintf(line, sizeof(line), "VOTE\t%d", 1 + (int)(worker->seed >> 8) % 5);
+            loadRequest(worker, session, LOAD_VOTE, line, &ready);
+            strcpy(line, "RESULTS");
+            loadRequest(worker, session, LOAD_RESULTS, line, &ready);
+            strcpy(line, "LOGOUT");
+            worker->out.length = 0;
+            handleCommand(session, line, &worker->out);
         }
+    } else if(visit == VISIT_BAD_LOGIN) {
+        suiteVoter((worker->seed >> 8) % loadRun.voters, name, nid, password);
+        snprintf(line, sizeof(line), "LOGIN\t%s\tGuess%u", nid, worker->seed % 10000);
+        loadRequest(worker, session, LOAD_LOGIN_FAILED, line, &ready);
+    } else {
+        strcpy(line, "STATS");
+        loadRequest(worker, session, LOAD_STATS, line, &ready);
+        strcpy(line, "RACES");
+        loadRequest(worker, session, LOAD_RACES, line, &ready);
     }
+}
+
+// One simulated client. With a target rate, each visit has an intended
+// start time and latency is counted from it, so a stalled server shows
+// up in the percentiles instead of just slowing the clients down.
+static void* loadWorkerThread(void* arg) {
+    LoadWorker *worker = arg;
+    ClientSession session;
+    session.userIndex = -1;
+    session.token[0] = '\0';
+    double intended = loadRun.start + loadRun.interval * worker->id / loadRun.clients;
     
-    if(winnerIndex != -1 && maxVotes > 0) {
-        fprintf(fp, "\nWINNER: %s (%s) with %d votes\n", 
-                candidates[winnerIndex].name,
-                candidates[winnerIndex].party,
-                maxVotes);
+    while(1) {
+        double now = currentSeconds();
+        if(loadRun.interval > 0 && intended > now) {
+            sleepSeconds(intended - now);
+            now = currentSeconds();
+        }
+        if(now >= loadRun.end) {
+            break;
+        }
+        double ready = loadRun.interval > 0 ? intended : now;
+        
+        LoadPhase *phase = &loadPhases[loadPhaseAt(ready)];
+        int total = 0;
+        for(int v = 0; v < LOAD_VISITS; v++) {
+            total += phase->weights[v];
+        }
+        worker->seed = worker->seed * 1103515245u + 12345u;
+        int pick = (int)(worker->seed >> 8) % total, visit = 0;
+        while(pick >= phase->weights[visit]) {
+            pick -= phase->weights[visit++];
+        }
+        runLoadVisit(worker, &session, visit, ready);
+        intended += loadRun.interval;
     }
-    
-    fprintf(fp, "\n===================================================\n");
-    
-    fclose(fp);
-    printSuccess("Results exported to 'election_results.txt'");
-    logActivity("Results exported");
+    endSession(session.token);
+    return NULL;
 }
 
-void resetElection() {
-    char confirm[10];
-    
-    printf("\n[WARNING] This will reset all votes and voting status!\n");
-    printf("Type 'RESET' to confirm: ");
-    fgets(confirm, 10, stdin);
-    confirm[strcspn(confirm, "\n")] = 0;
+// Replays a compressed polling day against a fresh election in a scratch
+// directory, with the journal, checkpoints and activity log all live.
+// Prints per-request latency percentiles and a per-second throughput
+// timeline as tab-separated tables.
+int runLoadTest(int seconds, int clients, int rate, int voters) {
+    char path[] = "load_test_XXXXXX";
+    if(seconds < 1 || clients < 1 || voters < 1 || mkdtemp(path) == NULL || chdir(path) != 0) {
+        fprintf(stderr, "Could not set up the load test\n");
+        return 0;
+    }
     
-    if(strcmp(confirm, "RESET") != 0) {
-        printInfo("Reset cancelled.");
-        return;
+    // The roll and constituencies come from the suite generator, all
+    // sharing one password
+    char name[MAX_NAME_LENGTH], nid[NID_LENGTH], password[MAX_PASSWORD_LENGTH], hash[PASSWORD_HASH_LENGTH];
+    time_t now = time(NULL);
+    loadRun.voters = voters;
+    loadRun.constituencies = 1 + voters / 50000 < MAX_RACES ? 1 + voters / 50000 : MAX_RACES;
+    initializeRaces();
+    addSuiteConstituencies(loadRun.constituencies, now);
+    hashPassword("Polling1Day", hash);
+    nidIndexInit(&nidIndex, userNIDAt, voters);
+    for(int i = 0; i < voters; i++) {
+        suiteVoter(i, name, nid, password);
+        applyRegister(name, nid, hash, i % loadRun.constituencies);
     }
+    rebuildSearchIndex();
+    saveData();
+    
+    startLogger(LOG_FILE);
+    startSessionReaper();
+    openJournal();
     
-    for(int i = 0; i < candidateCount; i++) {
-        candidates[i].votes = 0;
+    LoadWorker *workers = calloc(clients, sizeof(LoadWorker));
+    pthread_t *ids = calloc(clients, sizeof(pthread_t));
+    if(workers == NULL || ids == NULL) {
+        fprintf(stderr, "Out of memory for %d clients\n", clients);
+        return 0;
+    }
+    loadRun.seconds = seconds;
+    loadRun.clients = clients;
+    loadRun.interval = rate > 0 ? (double)clients / rate : 0;
+    atomic_init(&loadRun.nextVoter, 0);
+    atomic_init(&loadRun.nextRegistration, 0);
+    loadRun.start = currentSeconds() + 0.1;
+    loadRun.end = loadRun.start + seconds;
+    for(int t = 0; t < clients; t++) {
+        workers[t].id = t;
+        workers[t].seed = 2654435761u * (t + 1);
+        workers[t].timeline = calloc(seconds, sizeof(workers[t].timeline[0]));
+        if(workers[t].timeline == NULL || pthread_create(&ids[t], NULL, loadWorkerThread, &workers[t]) != 0) {
+            fprintf(stderr, "Could not start client %d\n", t);
+            exit(1);
+        }
     }
     
-    for(int i = 0; i < userCount; i++) {
-        users[i].hasVoted = 0;
-        users[i].voteTime = 0;
+    LatencyHistogram latency[LOAD_OPERATIONS];
+    unsigned long long errors[LOAD_OPERATIONS];
+    memset(latency, 0, sizeof(latency));
+    memset(errors, 0, sizeof(errors));
+    for(int t = 0; t < clients; t++) {
+        pthread_join(ids[t], NULL);
+        for(int o = 0; o < LOAD_OPERATIONS; o++) {
+            histogramMerge(&latency[o], &workers[t].latency[o]);
+            errors[o] += workers[t].errors[o];
+        }
+    }
+    double elapsed = currentSeconds() - loadRun.start;
+    
+    printf("# suite=load version=1 cpus=%d time=%ld seconds=%d clients=%d rate=%d voters=%d\n",
+           cpuCount(), (long)now, seconds, clients, rate, voters);
+    printf("operation\tcount\terrors\tper_sec\tp50_us\tp99_us\tp999_us\tmax_us\n");
+    for(int o = 0; o < LOAD_OPERATIONS; o++) {
+        printf("%s\t%llu\t%llu\t%.1f\t%.0f\t%.0f\t%.0f\t%.0f\n", loadOperationNames[o],
+               latency[o].count, errors[o], latency[o].count / elapsed,
+               histogramPercentile(&latency[o], 50), histogramPercentile(&latency[o], 99),
+               histogramPercentile(&latency[o], 99.9), latency[o].maxSeconds * 1e6);
     }
+    printf("\nsecond\tphase\ttotal");
+    for(int o = 0; o < LOAD_OPERATIONS; o++) {
+        printf("\t%s", loadOperationNames[o]);
+    }
+    printf("\n");
+    for(int s = 0; s < seconds; s++) {
+        unsigned int counts[LOAD_OPERATIONS] = { 0 }, total = 0;
+        for(int t = 0; t < clients; t++) {
+            for(int o = 0; o < LOAD_OPERATIONS; o++) {
+                counts[o] += workers[t].timeline[s][o];
+            }
+        }
+        for(int o = 0; o < LOAD_OPERATIONS; o++) {
+            total += counts[o];
+        }
+        printf("%d\t%s\t%u", s, loadPhases[loadPhaseAt(loadRun.start + s + 0.5)].name, total);
+        for(int o = 0; o < LOAD_OPERATIONS; o++) {
+            printf("\t%u", counts[o]);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
     
-    printSuccess("Election reset successfully!");
-    logActivity("Election reset by admin");
+    for(int t = 0; t < clients; t++) {
+        free(workers[t].timeline);
+        free(workers[t].out.data);
+    }
+    free(workers);
+    free(ids);
+    waitForBackup();
     saveData();
+    closeJournal();
+    stopMetricsWriter();
+    stopLogger();
+    if(chdir("..") == 0) {
+        removeSuiteDirectory(path);
+    }
+    return 1;
+}
+#else
+int runLoadTest(int seconds, int clients, int rate, int voters) {
+    (void)seconds;
+    (void)clients;
+    (void)rate;
+    (void)voters;
+    printError("The load test needs a POSIX system.");
+    return 0;
 }
+#endif
 
-void addCandidate() {
-    if(candidateCount >= MAX_CANDIDATES) {
-        printError("Maximum candidate limit reached!");
-        return;
+// Formats the time of an entry, reformatting only when the second changes
+static char* logTimestamp(time_t when) {
+    if(when != activityLog.stampSecond || activityLog.stamp[0] == '\0') {
+        struct tm *timeInfo = localtime(&when);
+        strftime(activityLog.stamp, sizeof(activityLog.stamp), "%Y-%m-%d %H:%M:%S", timeInfo);
+        activityLog.stampSecond = when;
     }
-    
-    printHeader("ADD NEW CANDIDATE");
-    
-    Candidate newCandidate;
-    newCandidate.id = candidateCount + 1;
-    newCandidate.votes = 0;
-    
-    printf("Enter Candidate Name: ");
-    fgets(newCandidate.name, MAX_NAME_LENGTH, stdin);
-    newCandidate.name[strcspn(newCandidate.name, "\n")] = 0;
-    
-    printf("Enter Party Name: ");
-    fgets(newCandidate.party, MAX_NAME_LENGTH, stdin);
-    newCandidate.party[strcspn(newCandidate.party, "\n")] = 0;
-    
-    printf("Enter Age: ");
-    scanf("%d", &newCandidate.age);
-    clearInputBuffer();
-    
-    printf("Enter Education: ");
-    fgets(newCandidate.education, 100, stdin);
-    newCandidate.education[strcspn(newCandidate.education, "\n")] = 0;
-    
-    printf("Enter Manifesto: ");
-    fgets(newCandidate.manifesto, 200, stdin);
-    newCandidate.manifesto[strcspn(newCandidate.manifesto, "\n")] = 0;
-    
-    candidates[candidateCount] = newCandidate;
-    candidateCount++;
-    
-    printSuccess("Candidate added successfully!");
-    logActivity("Candidate added by admin");
-    saveData();
+    return activityLog.stamp;
 }
 
-void removeCandidate() {
-    int id;
+// Writes every published entry; returns how many were written
+static int drainLog() {
+    int written = 0;
+    unsigned long tail = atomic_load_explicit(&activityLog.tail, memory_order_relaxed);
     
-    showCandidates();
-    printf("\nEnter Candidate ID to remove: ");
-    scanf("%d", &id);
-    clearInputBuffer();
-    
-    if(id < 1 || id > candidateCount) {
-        printError("Invalid candidate ID!");
-        return;
+    while(1) {
+        LogSlot *slot = &activityLog.slots[tail & (LOG_RING_SIZE - 1)];
+        if(atomic_load_explicit(&slot->sequence, memory_order_acquire) != tail + 1) {
+            break;
+        }
+        fprintf(activityLog.fp, "[%s] %s\n", logTimestamp(slot->time), slot->text);
+        atomic_store_explicit(&slot->sequence, tail + LOG_RING_SIZE, memory_order_release);
+        tail++;
+        written++;
     }
     
-    printf("\n[!] Remove %s? (Y/N): ", candidates[id-1].name);
-    char confirm;
-    scanf(" %c", &confirm);
-    clearInputBuffer();
-    
-    if(confirm != 'Y' && confirm != 'y') {
-        printInfo("Removal cancelled.");
-        return;
+    unsigned long dropped = atomic_exchange(&activityLog.dropped, 0);
+    if(dropped > 0) {
+        fprintf(activityLog.fp, "[%s] %lu log entries dropped (log buffer full)\n",
+                logTimestamp(time(NULL)), dropped);
     }
-    
-    for(int i = id-1; i < candidateCount-1; i++) {
-        candidates[i] = candidates[i+1];
-        candidates[i].id = i + 1;
+    if(written > 0 || dropped > 0) {
+        fflush(activityLog.fp);
     }
-    candidateCount--;
-    
-    printSuccess("Candidate removed successfully!");
-    logActivity("Candidate removed by admin");
-    saveData();
+    atomic_store_explicit(&activityLog.tail, tail, memory_order_release);
+    return written;
 }
 
-void createBackup() {
-    char backupUsers[50], backupCandidates[50];
-    time_t now;
-    time(&now);
-    struct tm *timeInfo = localtime(&now);
-    
-    sprintf(backupUsers, "backup_users_%04d%02d%02d_%02d%02d%02d.txt",
-            timeInfo->tm_year + 1900, timeInfo->tm_mon + 1, timeInfo->tm_mday,
-            timeInfo->tm_hour, timeInfo->tm_min, timeInfo->tm_sec);
-    
-    sprintf(backupCandidates, "backup_candidates_%04d%02d%02d_%02d%02d%02d.txt",
-            timeInfo->tm_year + 1900, timeInfo->tm_mon + 1, timeInfo->tm_mday,
-            timeInfo->tm_hour, timeInfo->tm_min, timeInfo->tm_sec);
-    
-    FILE *fp;
-    
-    // Backup users
-    fp = fopen(backupUsers, "w");
-    if(fp != NULL) {
-        fprintf(fp, "TOTAL_USERS=%d\n\n", userCount);
-        for(int i = 0; i < userCount; i++) {
-            fprintf(fp, "USER_%d_START\n", i+1);
-            fprintf(fp, "FullName=%s\n", users[i].fullName);
-            fprintf(fp, "NID=%s\n", users[i].nidNumber);
-            fprintf(fp, "Password=%s\n", users[i].password);
-            fprintf(fp, "HasVoted=%d\n", users[i].hasVoted);
-            fprintf(fp, "VoteTime=%ld\n", (long)users[i].voteTime);
-            fprintf(fp, "USER_%d_END\n\n", i+1);
+static void* logWriterThread(void* arg) {
+    (void)arg;
+    while(1) {
+        int written = drainLog();
+        
+        pthread_mutex_lock(&activityLog.lock);
+        pthread_cond_broadcast(&activityLog.drained);
+        if(!atomic_load(&activityLog.running) &&
+           atomic_load(&activityLog.tail) == atomic_load(&activityLog.head)) {
+            pthread_mutex_unlock(&activityLog.lock);
+            break;
         }
-        fclose(fp);
+        if(written == 0) {
+            struct timespec deadline;
+            deadlineAfter(&deadline, LOG_IDLE_WAIT_MS);
+            pthread_cond_timedwait(&activityLog.wake, &activityLog.lock, &deadline);
+        }
+        pthread_mutex_unlock(&activityLog.lock);
     }
-    
-    // Backup candidates
-    fp = fopen(backupCandidates, "w");
-    if(fp != NULL) {
-        fprintf(fp, "TOTAL_CANDIDATES=%d\n\n", candidateCount);
-        for(int i = 0; i < candidateCount; i++) {
-            fprintf(fp, "CANDIDATE_%d_START\n", i+1);
-            fprintf(fp, "ID=%d\n", candidates[i].id);
-            fprintf(fp, "Name=%s\n", candidates[i].name);
-            fprintf(fp, "Party=%s\n", candidates[i].party);
-            fprintf(fp, "Education=%s\n", candidates[i].education);
-            fprintf(fp, "Age=%d\n", candidates[i].age);
-            fprintf(fp, "Manifesto=%s\n", candidates[i].manifesto);
-            fprintf(fp, "Votes=%d\n", candidates[i].votes);
-            fprintf(fp, "CANDIDATE_%d_END\n\n", i+1);
+    return NULL;
+}
+
+// Opens the log file and starts the writer thread. Until this succeeds,
+// and again after stopLogger(), logActivity() writes synchronously.
+int startLogger(char* path) {
+    if(atomic_load(&activityLog.running)) {
+        return 1;
+    }
+    activityLog.path = path;
+    activityLog.slots = calloc(LOG_RING_SIZE, sizeof(LogSlot));
+    activityLog.fp = fopen(path, "a");
+    if(activityLog.slots == NULL || activityLog.fp == NULL) {
+        free(activityLog.slots);
+        activityLog.slots = NULL;
+        if(activityLog.fp != NULL) {
+            fclose(activityLog.fp);
+            activityLog.fp = NULL;
         }
-        fclose(fp);
+        return 0;
     }
-    
-    printSuccess("Backup created successfully!");
-    printf("Files: %s, %s\n", backupUsers, backupCandidates);
-    logActivity("Backup created");
+    setvbuf(activityLog.fp, NULL, _IOFBF, 64 * 1024);
+    for(unsigned long i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&activityLog.slots[i].sequence, i);
+    }
+    atomic_store(&activityLog.head, 0);
+    atomic_store(&activityLog.tail, 0);
+    atomic_store(&activityLog.dropped, 0);
+    activityLog.stamp[0] = '\0';
+    
+    atomic_store(&activityLog.running, 1);
+    if(pthread_create(&activityLog.writer, NULL, logWriterThread, NULL) != 0) {
+        atomic_store(&activityLog.running, 0);
+        fclose(activityLog.fp);
+        activityLog.fp = NULL;
+        free(activityLog.slots);
+        activityLog.slots = NULL;
+        return 0;
+    }
+    static int exitHandlerSet = 0;
+    if(!exitHandlerSet) {
+        atexit(stopLogger);
+        exitHandlerSet = 1;
+    }
+    return 1;
 }
 
-void setElectionPeriod() {
-    int days;
-    
-    printHeader("SET ELECTION PERIOD");
-    printf("Enter election duration in days: ");
-    scanf("%d", &days);
-    clearInputBuffer();
-    
-    if(days < 1 || days > 365) {
-        printError("Invalid duration! Must be 1-365 days.");
+// Waits until everything logged before the call is in the log file
+void flushLog() {
+    if(!atomic_load(&activityLog.running)) {
         return;
     }
-    
-    time(&electionStartTime);
-    electionEndTime = electionStartTime + (days * 24 * 60 * 60);
-    
-    char startStr[100], endStr[100];
-    struct tm *timeInfo;
-    
-    timeInfo = localtime(&electionStartTime);
-    strftime(startStr, sizeof(startStr), "%Y-%m-%d %H:%M:%S", timeInfo);
-    
-    timeInfo = localtime(&electionEndTime);
-    strftime(endStr, sizeof(endStr), "%Y-%m-%d %H:%M:%S", timeInfo);
-    
-    printSuccess("Election period set successfully!");
-    printf("Start: %s\n", startStr);
-    printf("End:   %s\n", endStr);
-    
-    logActivity("Election period updated");
-    saveData();
+    unsigned long target = atomic_load(&activityLog.head);
+    pthread_mutex_lock(&activityLog.lock);
+    while(atomic_load(&activityLog.tail) < target) {
+        pthread_cond_signal(&activityLog.wake);
+        pthread_cond_wait(&activityLog.drained, &activityLog.lock);
+    }
+    pthread_mutex_unlock(&activityLog.lock);
 }
 
-void clearInputBuffer() {
-    int c;
-    while ((c = getchar()) != '\n' && c != EOF);
+// Drains the ring, stops the writer and closes the file. Safe to call
+// more than once; it is also registered with atexit().
+void stopLogger() {
+    if(!atomic_exchange(&activityLog.running, 0)) {
+        return;
+    }
+    pthread_mutex_lock(&activityLog.lock);
+    pthread_cond_signal(&activityLog.wake);
+    pthread_mutex_unlock(&activityLog.lock);
+    pthread_join(activityLog.writer, NULL);
+    
+    fclose(activityLog.fp);
+    activityLog.fp = NULL;
+    free(activityLog.slots);
+    activityLog.slots = NULL;
 }
 
-int findUserByNID(char* nid) {
-    for(int i = 0; i < userCount; i++) {
-        if(strcmp(users[i].nidNumber, nid) == 0) {
-            return i;
+void logActivity(char* activity) {
+    if(!atomic_load_explicit(&activityLog.running, memory_order_acquire)) {
+        FILE *fp = fopen(activityLog.path, "a");
+        if(fp != NULL) {
+            time_t now;
+            time(&now);
+            char timeStr[100];
+            struct tm *timeInfo = localtime(&now);
+            strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", timeInfo);
+            
+            fprintf(fp, "[%s] %s", timeStr, activity);
+            if(currentUserIndex != -1) {
+                fprintf(fp, " - User: %s (NID: %s)", 
+                        userFullName(currentUserIndex),
+                        userAt(currentUserIndex)->nidNumber);
+            }
+            fprintf(fp, "\n");
+            fclose(fp);
         }
+        return;
     }
-    return -1;
-}
-
-void saveData() {
-    FILE *fp;
     
-    // Save users to text file
-    fp = fopen("users.txt", "w");
-    if(fp != NULL) {
-        fprintf(fp, "TOTAL_USERS=%d\n\n", userCount);
-        for(int i = 0; i < userCount; i++) {
-            fprintf(fp, "USER_%d_START\n", i+1);
-            fprintf(fp, "FullName=%s\n", users[i].fullName);
-            fprintf(fp, "NID=%s\n", users[i].nidNumber);
-            fprintf(fp, "Password=%s\n", users[i].password);
-            fprintf(fp, "HasVoted=%d\n", users[i].hasVoted);
-            fprintf(fp, "VoteTime=%ld\n", (long)users[i].voteTime);
-            fprintf(fp, "USER_%d_END\n\n", i+1);
+    // Claim the next slot; give up if the writer has not freed it yet
+    unsigned long pos = atomic_load_explicit(&activityLog.head, memory_order_relaxed);
+    LogSlot *slot;
+    while(1) {
+        slot = &activityLog.slots[pos & (LOG_RING_SIZE - 1)];
+        unsigned long sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        long difference = (long)(sequence - pos);
+        if(difference == 0) {
+            if(atomic_compare_exchange_weak_explicit(&activityLog.head, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if(difference < 0) {
+            atomic_fetch_add_explicit(&activityLog.dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&activityLog.head, memory_order_relaxed);
         }
-        fclose(fp);
     }
     
-    // Save candidates to text file
-    fp = fopen("candidates.txt", "w");
-    if(fp != NULL) {
-        fprintf(fp, "TOTAL_CANDIDATES=%d\n\n", candidateCount);
-        for(int i = 0; i < candidateCount; i++) {
-            fprintf(fp, "CANDIDATE_%d_START\n", i+1);
-            fprintf(fp, "ID=%d\n", candidates[i].id);
-            fprintf(fp, "Name=%s\n", candidates[i].name);
-            fprintf(fp, "Party=%s\n", candidates[i].party);
-            fprintf(fp, "Education=%s\n", candidates[i].education);
-            fprintf(fp, "Age=%d\n", candidates[i].age);
-            fprintf(fp, "Manifesto=%s\n", candidates[i].manifesto);
-            fprintf(fp, "Votes=%d\n", candidates[i].votes);
-            fprintf(fp, "CANDIDATE_%d_END\n\n", i+1);
-        }
-        fclose(fp);
+    slot->time = time(NULL);
+    if(currentUserIndex != -1) {
+        snprintf(slot->text, LOG_MESSAGE_LENGTH, "%s - User: %s (NID: %s)", activity,
+                 userFullName(currentUserIndex), userAt(currentUserIndex)->nidNumber);
+    } else {
+        snprintf(slot->text, LOG_MESSAGE_LENGTH, "%s", activity);
     }
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
     
-    // Save election configuration to text file
-    fp = fopen("election_config.txt", "w");
-    if(fp != NULL) {
-        fprintf(fp, "ElectionStartTime=%ld\n", (long)electionStartTime);
-        fprintf(fp, "ElectionEndTime=%ld\n", (long)electionEndTime);
-        fclose(fp);
+    // Nudge the writer when half the ring has filled since it last woke
+    if((pos & (LOG_RING_SIZE / 2 - 1)) == 0) {
+        pthread_cond_signal(&activityLog.wake);
     }
 }
 
-void loadData() {
-    FILE *fp;
-    char line[500];
-    
-    // Load users from text file
-    fp = fopen("users.txt", "r");
-    if(fp != NULL) {
-        if(fgets(line, sizeof(line), fp)) {
-            sscanf(line, "TOTAL_USERS=%d", &userCount);
-        }
-        
-        int idx = 0;
-        while(fgets(line, sizeof(line), fp) && idx < userCount) {
-            if(strstr(line, "USER_") && strstr(line, "_START")) {
-                // Read user data
-                if(fgets(line, sizeof(line), fp)) {
-                    sscanf(line, "FullName=%[^\n]", users[idx].fullName);
-                }
-                if(fgets(line, sizeof(line), fp)) {
-                    sscanf(line, "NID=%s", users[idx].nidNumber);
-                }
-                if(fgets(line, sizeof(line), fp)) {
-                    sscanf(line, "Password=%s", users[idx].password);
-                }
-                if(fgets(line, sizeof(line), fp)) {
-                    sscanf(line, "HasVoted=%d", &users[idx].hasVoted);
-                }
-                if(fgets(line, sizeof(line), fp)) {
-                    long voteTime;
-                    sscanf(line, "VoteTime=%ld", &voteTime);
-                    users[idx].voteTime = (time_t)voteTime;
-                }
-                idx++;
-            }
-        }
-        fclose(fp);
+typedef struct {
+    int events;
+} LogBenchWorker;
+
+static void* logBenchThread(void* arg) {
+    LogBenchWorker *worker = arg;
+    for(int i = 0; i < worker->events; i++) {
+        logActivity("Vote cast");
     }
-    
-    // Load candidates from text file
-    fp = fopen("candidates.txt", "r");
-    if(fp != NULL) {
-        if(fgets(line, sizeof(line), fp)) {
-            sscanf(line, "TOTAL_CANDIDATES=%d", &candidateCount);
-        }
-        
-        int idx = 0;
-        while(fgets(line, sizeof(line), fp) && idx < candidateCount) {
-            if(strstr(line, "CANDIDATE_") && strstr(line, "_START")) {
-                // Read candidate data
-                if(fgets(line, sizeof(line), fp)) {
-                    sscanf(line, "ID=%d", &candidates[idx].id);
-                }
-                if(fgets(line, sizeof(line), fp)) {
-                    sscanf(line, "Name=%[^\n]", candidates[idx].name);
-                }
-                if(fgets(line, sizeof(line), fp)) {
-                    sscanf(line, "Party=%[^\n]", candidates[idx].party);
-                }
-                if(fgets(line, sizeof(line), fp)) {
-                    sscanf(line, "Education=%[^\n]", candidates[idx].education);
-                }
-                if(fgets(line, sizeof(line), fp)) {
-                    sscanf(line, "Age=%d", &candidates[idx].age);
-                }
-                if(fgets(line, sizeof(line), fp)) {
-                    sscanf(line, "Manifesto=%[^\n]", candidates[idx].manifesto);
-                }
-                if(fgets(line, sizeof(line), fp)) {
-                    sscanf(line, "Votes=%d", &candidates[idx].votes);
-                }
-                idx++;
-            }
+    return NULL;
+}
+
+// Runs one burst of events split across threads; returns the seconds the
+// producers took
+static double logBurst(int threads, int events) {
+    LogBenchWorker workers[64];
+    pthread_t ids[64];
+    double start = currentSeconds();
+    for(int t = 0; t < threads; t++) {
+        workers[t].events = events / threads;
+        pthread_create(&ids[t], NULL, logBenchThread, &workers[t]);
+    }
+    for(int t = 0; t < threads; t++) {
+        pthread_join(ids[t], NULL);
+    }
+    return currentSeconds() - start;
+}
+
+// Counts the entries in a log file and the entries it reports as dropped
+static long countLogLines(char* path, long* dropped) {
+    FILE *fp = fopen(path, "r");
+    long lines = 0;
+    char line[256];
+    *dropped = 0;
+    while(fp != NULL && fgets(line, sizeof(line), fp)) {
+        long count;
+        if(sscanf(line, "[%*[^]]] %ld log entries dropped", &count) == 1) {
+            *dropped += count;
+        } else {
+            lines++;
         }
-        fclose(fp);
     }
-    
-    // Load election configuration from text file
-    fp = fopen("election_config.txt", "r");
     if(fp != NULL) {
-        long startTime, endTime;
-        if(fgets(line, sizeof(line), fp)) {
-            sscanf(line, "ElectionStartTime=%ld", &startTime);
-            electionStartTime = (time_t)startTime;
-        }
-        if(fgets(line, sizeof(line), fp)) {
-            sscanf(line, "ElectionEndTime=%ld", &endTime);
-            electionEndTime = (time_t)endTime;
-        }
         fclose(fp);
     }
+    return lines;
 }
 
-void logActivity(char* activity) {
-    FILE *fp = fopen("activity_log.txt", "a");
-    if(fp != NULL) {
-        time_t now;
-        time(&now);
-        char timeStr[100];
-        struct tm *timeInfo = localtime(&now);
-        strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", timeInfo);
-        
-        fprintf(fp, "[%s] %s", timeStr, activity);
-        if(currentUserIndex != -1) {
-            fprintf(fp, " - User: %s (NID: %s)", 
-                    users[currentUserIndex].fullName,
-                    users[currentUserIndex].nidNumber);
+// Measures what logActivity() costs the calling thread with 1, 2, 4...
+// producers, against the old open-append-close per event. Bursts are half
+// the ring so nothing is dropped; a final oversized burst shows the
+// overflow policy.
+void benchmarkLogging() {
+    char *path = "log_bench.tmp";
+    int burst = LOG_RING_SIZE / 2;
+    int rounds = 50;
+    int maxThreads = cpuCount() * 2;
+    long dropped;
+    
+    printHeader("ACTIVITY LOG BENCHMARK");
+    remove(path);
+    activityLog.path = path;
+    int syncEvents = 20000;
+    double start = currentSeconds();
+    for(int i = 0; i < syncEvents; i++) {
+        logActivity("Vote cast");
+    }
+    printf("Synchronous fopen/fclose per event: %.0f ns/event\n\n",
+           (currentSeconds() - start) * 1e9 / syncEvents);
+    
+    printf("%-10s %-16s %-12s %-10s\n", "Threads", "Producer ns/op", "Written", "Complete");
+    for(int threads = 1; threads <= maxThreads && threads <= 64; threads *= 2) {
+        remove(path);
+        if(!startLogger(path)) {
+            printError("Could not start the logger!");
+            return;
         }
-        fprintf(fp, "\n");
-        fclose(fp);
+        double producing = 0;
+        int total = 0;
+        for(int r = 0; r < rounds; r++) {
+            producing += logBurst(threads, burst);
+            total += (burst / threads) * threads;
+            flushLog();
+        }
+        stopLogger();
+        long lines = countLogLines(path, &dropped);
+        printf("%-10d %-16.0f %-12ld %-10s\n", threads, producing * 1e9 * threads / total,
+               lines, lines == total && dropped == 0 ? "yes" : "NO");
     }
+    
+    remove(path);
+    startLogger(path);
+    int flood = LOG_RING_SIZE * 8;
+    logBurst(1, flood);
+    stopLogger();
+    long lines = countLogLines(path, &dropped);
+    printf("\nOverflow: %d events in one burst, %ld written, %ld dropped and reported (%s)\n",
+           flood, lines, dropped, lines + dropped == flood ? "OK" : "LOST");
+    remove(path);
+    activityLog.path = LOG_FILE;
 }
 
 void printHeader(char* title) {